@@ -0,0 +1,782 @@
+/**
+ * @file bench.cpp
+ * @brief Throughput benchmarks for RouteTracker
+ *
+ * Usage: bench [routes] [lookups]
+ */
+
+#include "route_tracker.h"
+#include "dir24_fib.h"
+#include "compact_trie.h"
+#include "lc_trie_fib.h"
+#include "poptrie_fib.h"
+#include "patricia.h"
+#include "tracked_table.h"
+#include <algorithm>
+#include <map>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <atomic>
+#include <thread>
+using namespace  std;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double secondsSince(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static std::string ipv4ToString(uint32_t address) {
+    char buf[INET_ADDRSTRLEN];
+    uint32_t net = htonl(address);
+    inet_ntop(AF_INET, &net, buf, sizeof(buf));
+    return buf;
+}
+
+static void report(const std::string& name, size_t operations, double seconds) {
+    std::cout << "  " << std::setw(28) << std::left << name
+              << std::setw(10) << std::right << std::fixed << std::setprecision(2)
+              << operations / seconds / 1e6 << " M/s\n";
+}
+
+// Prefix lengths roughly follow a BGP table: mostly /24, a tail of /16-/23,
+// very few shorter than /16 or longer than /24.
+static int bgpLikeLength(std::mt19937& rng) {
+    unsigned roll = rng() % 100;
+    if (roll < 55) return 24;
+    if (roll < 90) return 16 + rng() % 8;
+    if (roll < 97) return 8 + rng() % 8;
+    return 25 + rng() % 8;
+}
+
+static void populate(RouteTracker& tracker, size_t routes, std::mt19937& rng) {
+    for (size_t i = 0; i < routes; ++i) {
+        int length = bgpLikeLength(rng);
+        uint32_t prefix = rng() & (0xFFFFFFFFu << (32 - length));
+        tracker.addRoute(ipv4ToString(prefix) + "/" + std::to_string(length),
+                         "nh" + std::to_string(rng() % 512));
+    }
+}
+
+void benchLookups(RouteTracker& tracker, size_t lookups, std::mt19937& rng) {
+    std::cout << "Lookup throughput over " << lookups << " random addresses:\n";
+
+    std::vector<uint32_t> addresses(lookups);
+    std::vector<std::string> texts(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        addresses[i] = rng();
+        texts[i] = ipv4ToString(addresses[i]);
+    }
+
+    size_t found = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        Route* route = tracker.longestPrefixMatch(texts[i]);
+        found += route != nullptr;
+        delete route;
+    }
+    report("longestPrefixMatch (single)", lookups, secondsSince(start));
+
+    size_t text_found = 0;
+    start = bench_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        text_found += tracker.lookup(texts[i]).found();
+    }
+    report("lookup (text, single)", lookups, secondsSince(start));
+    if (text_found != found) {
+        std::cerr << "lookup and longestPrefixMatch disagree\n";
+    }
+
+    const size_t bursts[] = {1, 32, 64, 128, 256};
+    std::vector<RouteMatch> results(256);
+    for (size_t b = 0; b < sizeof(bursts) / sizeof(bursts[0]); ++b) {
+        size_t burst = bursts[b];
+        size_t batch_found = 0;
+        start = bench_clock::now();
+        for (size_t i = 0; i + burst <= lookups; i += burst) {
+            tracker.lookupBatch(&addresses[i], burst, results.data());
+            for (size_t j = 0; j < burst; ++j) {
+                batch_found += results[j].found();
+            }
+        }
+        report("lookupBatch x" + std::to_string(burst), lookups - lookups % burst, secondsSince(start));
+        if (burst == 1 && batch_found != found) {
+            std::cerr << "batch and single-key paths disagree\n";
+        }
+    }
+}
+
+// IPv6 lookups on a table of BGP-like lengths (mostly /32 to /48) under
+// 2000::/3, which lives in its own 128-bit trie.
+void benchIPv6(size_t routes, size_t lookups, std::mt19937& rng) {
+    std::cout << "IPv6 lookup throughput, " << routes << " routes:\n";
+
+    RouteTracker tracker;
+    std::mt19937_64 rng64(rng());
+    static const int lengths[] = {32, 36, 40, 44, 48, 48, 48, 56, 64};
+    for (size_t i = 0; i < routes; ++i) {
+        IPv6Address prefix;
+        prefix.hi = 0x2000000000000000ULL | (rng64() >> 3);
+        prefix.lo = 0;
+        tracker.addRoute(prefix, lengths[rng() % 9], "nh" + std::to_string(i % 256));
+    }
+
+    std::vector<IPv6Address> addresses(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        addresses[i].hi = 0x2000000000000000ULL | (rng64() >> 3);
+        addresses[i].lo = rng64();
+    }
+    std::vector<RouteMatch6> results(256);
+    size_t found = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i + 256 <= lookups; i += 256) {
+        tracker.lookupBatch(&addresses[i], 256, results.data());
+        found += results[0].found();
+    }
+    report("lookupBatch x256", lookups - lookups % 256, secondsSince(start));
+}
+
+// Raw DIR-24-8 kernels on a table of the same shape, without the nexthop
+// resolution that RouteTracker::lookupBatch adds on top.
+void benchFibKernels(size_t routes, size_t lookups, std::mt19937& rng) {
+    std::cout << "DIR-24-8 kernel throughput (bursts of 256):\n";
+
+    Dir24Fib fib;
+    for (size_t i = 0; i < routes; ++i) {
+        int length = bgpLikeLength(rng);
+        fib.insert(rng() & (0xFFFFFFFFu << (32 - length)), length, static_cast<uint32_t>(i & Dir24Fib::kMaxValue));
+    }
+
+    std::vector<uint32_t> addresses(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        addresses[i] = rng();
+    }
+    std::vector<uint32_t> values(256);
+    std::vector<int> lengths(256);
+
+    const Dir24Fib::Kernel kernels[] = {Dir24Fib::kScalar, Dir24Fib::kAvx2, Dir24Fib::kAvx512};
+    for (size_t k = 0; k < 3; ++k) {
+        if (!fib.setKernel(kernels[k])) {
+            std::cout << "  " << Dir24Fib::kernelName(kernels[k]) << ": not supported\n";
+            continue;
+        }
+        size_t found = 0;
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i + 256 <= lookups; i += 256) {
+            fib.lookupBatch(&addresses[i], 256, values.data(), lengths.data());
+            found += lengths[0] >= 0;
+        }
+        report(Dir24Fib::kernelName(kernels[k]), lookups - lookups % 256, secondsSince(start));
+    }
+}
+
+// DIR-24-8 against the LC-trie and the poptrie on the same table: batch
+// throughput, trie shape and memory.
+void benchLookupEngines(size_t routes, size_t lookups, std::mt19937& rng) {
+    std::cout << "Lookup engines (bursts of 256):\n";
+
+    Dir24Fib dir24;
+    LcTrieFib lc_trie;
+    PoptrieFib poptrie;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < routes; ++i) {
+        int length = bgpLikeLength(rng);
+        uint32_t prefix = rng() & (0xFFFFFFFFu << (32 - length));
+        uint32_t value = static_cast<uint32_t>(i & Dir24Fib::kMaxValue);
+        dir24.insert(prefix, length, value);
+        lc_trie.insert(prefix, length, value);
+        poptrie.insert(prefix, length, value);
+    }
+    std::cout << "  built all three in " << secondsSince(start) << " s\n";
+
+    std::vector<uint32_t> addresses(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        addresses[i] = rng();
+    }
+    std::vector<uint32_t> values(256);
+    std::vector<int> lengths(256);
+
+    start = bench_clock::now();
+    for (size_t i = 0; i + 256 <= lookups; i += 256) {
+        dir24.lookupBatch(&addresses[i], 256, values.data(), lengths.data());
+    }
+    report("DIR-24-8", lookups - lookups % 256, secondsSince(start));
+
+    start = bench_clock::now();
+    for (size_t i = 0; i + 256 <= lookups; i += 256) {
+        lc_trie.lookupBatch(&addresses[i], 256, values.data(), lengths.data());
+    }
+    report("LC-trie", lookups - lookups % 256, secondsSince(start));
+
+    start = bench_clock::now();
+    for (size_t i = 0; i + 256 <= lookups; i += 256) {
+        poptrie.lookupBatch(&addresses[i], 256, values.data(), lengths.data());
+    }
+    report("Poptrie", lookups - lookups % 256, secondsSince(start));
+
+    double average;
+    int maximum;
+    lc_trie.depthStats(&average, &maximum);
+    std::cout << "  LC-trie: " << lc_trie.chunks() << " chunks, average depth " << average << ", max " << maximum
+              << ", " << lc_trie.memoryBytes() / 1024 << " KB\n";
+    std::cout << "  Poptrie: " << poptrie.chunks() << " chunks, " << poptrie.nodes() << " nodes, "
+              << poptrie.memoryBytes() / 1024 << " KB\n";
+}
+
+static size_t changes_seen = 0;
+
+static void countingCallback(const std::string&, const std::string&, const std::string&) { ++changes_seen; }
+
+// Initial convergence: the same table loaded with one addRoute() per route
+// and with a single addRoutes(), while addresses are being tracked.
+void benchBulkLoad(size_t routes, size_t tracked, std::mt19937& rng) {
+    std::cout << "Table load with " << tracked << " tracked addresses:\n";
+
+    std::vector<std::pair<std::string, std::string> > table(routes);
+    for (size_t i = 0; i < routes; ++i) {
+        int length = bgpLikeLength(rng);
+        uint32_t prefix = rng() & (0xFFFFFFFFu << (32 - length));
+        table[i] = std::make_pair(ipv4ToString(prefix) + "/" + std::to_string(length),
+                                  "nh" + std::to_string(rng() % 512));
+    }
+    std::vector<uint32_t> addresses(tracked);
+    for (size_t i = 0; i < tracked; ++i) {
+        addresses[i] = rng();
+    }
+
+    {
+        RouteTracker one_by_one;
+        for (size_t i = 0; i < tracked; ++i) {
+            one_by_one.registerAddress(addresses[i], &countingCallback);
+        }
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < routes; ++i) {
+            one_by_one.addRoute(table[i].first, table[i].second);
+        }
+        report("addRoute per route", routes, secondsSince(start));
+    }
+    {
+        RouteTracker bulk;
+        for (size_t i = 0; i < tracked; ++i) {
+            bulk.registerAddress(addresses[i], &countingCallback);
+        }
+        bench_clock::time_point start = bench_clock::now();
+        bulk.addRoutes(table);
+        report("addRoutes", routes, secondsSince(start));
+    }
+}
+
+// Startup registration of many addresses against a loaded table: one
+// registerAddress() each against one registerAddresses(), then withdrawal by
+// address against by handle.
+void benchBulkRegistration(size_t routes, size_t tracked, std::mt19937& rng) {
+    std::cout << "Registering " << tracked << " addresses against " << routes << " routes:\n";
+    std::vector<uint32_t> addresses(tracked);
+    for (size_t i = 0; i < tracked; ++i) {
+        addresses[i] = rng();
+    }
+    {
+        RouteTracker tracker;
+        populate(tracker, routes, rng);
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < tracked; ++i) {
+            tracker.registerAddress(addresses[i], &countingCallback);
+        }
+        report("registerAddress", tracked, secondsSince(start));
+        start = bench_clock::now();
+        for (size_t i = 0; i < tracked; ++i) {
+            tracker.unregisterAddress(addresses[i]);
+        }
+        report("unregisterAddress", tracked, secondsSince(start));
+    }
+    {
+        RouteTracker tracker;
+        populate(tracker, routes, rng);
+        std::vector<AddressHandle> handles(tracked);
+        bench_clock::time_point start = bench_clock::now();
+        tracker.registerAddresses(addresses.data(), tracked, &countingCallback, handles.data());
+        report("registerAddresses", tracked, secondsSince(start));
+        start = bench_clock::now();
+        for (size_t i = 0; i < tracked; ++i) {
+            tracker.unregister(handles[i]);
+        }
+        report("unregister(handle)", tracked, secondsSince(start));
+    }
+}
+
+// The tracked-address table against the ordered map it replaced: memory per
+// address, point lookups, and collecting the addresses inside a /8 and a
+// /24 through the sorted index.
+void benchTrackedTable(size_t tracked, std::mt19937& rng) {
+    std::cout << "Tracked-address table with " << tracked << " addresses:\n";
+    std::vector<uint32_t> addresses(tracked);
+    for (size_t i = 0; i < tracked; ++i) {
+        addresses[i] = (rng() & 0x0FFFFFFF) | (10u << 24);
+    }
+    TrackedTable table;
+    std::map<uint32_t, TrackedTable::Entry> ordered;
+    for (size_t i = 0; i < tracked; ++i) {
+        table.insert(addresses[i], 1);
+        ordered[addresses[i]].listener = 1;
+    }
+    std::cout << "  flat table " << table.memoryBytes() / table.size() << " bytes/address, map about "
+              << (sizeof(std::map<uint32_t, TrackedTable::Entry>::value_type) + 32) << " + allocator overhead\n";
+
+    std::vector<uint32_t> probes(4 * tracked);
+    for (size_t i = 0; i < probes.size(); ++i) {
+        probes[i] = addresses[rng() % tracked];
+    }
+    size_t hits = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < probes.size(); ++i) {
+        hits += table.find(probes[i]) != nullptr;
+    }
+    report("find, flat table", probes.size(), secondsSince(start));
+    start = bench_clock::now();
+    for (size_t i = 0; i < probes.size(); ++i) {
+        hits += ordered.find(probes[i]) != ordered.end();
+    }
+    report("find, map", probes.size(), secondsSince(start));
+
+    std::vector<TrackedTable::Entry*> inside;
+    start = bench_clock::now();
+    for (int i = 0; i < 20; ++i) {
+        inside.clear();
+        table.collect(10u << 24, (11u << 24) - 1, inside);
+    }
+    report("/8 collect, flat table", 20 * inside.size(), secondsSince(start));
+    start = bench_clock::now();
+    for (int i = 0; i < 20; ++i) {
+        inside.clear();
+        for (std::map<uint32_t, TrackedTable::Entry>::iterator it = ordered.begin(); it != ordered.end(); ++it) {
+            inside.push_back(&it->second);
+        }
+    }
+    report("/8 walk, map", 20 * inside.size(), secondsSince(start));
+    start = bench_clock::now();
+    size_t found = 0;
+    for (size_t i = 0; i < 2000; ++i) {
+        inside.clear();
+        uint32_t first = addresses[i] & 0xFFFFFF00;
+        table.collect(first, first | 0xFF, inside);
+        found += inside.size();
+    }
+    report("/24 collect, flat table", 2000, secondsSince(start));
+    start = bench_clock::now();
+    for (size_t i = 0; i < 2000; ++i) {
+        inside.clear();
+        uint32_t first = addresses[i] & 0xFFFFFF00;
+        for (std::map<uint32_t, TrackedTable::Entry>::iterator it = ordered.lower_bound(first);
+             it != ordered.end() && it->first <= (first | 0xFF); ++it) {
+            inside.push_back(&it->second);
+        }
+        found += inside.size();
+    }
+    report("/24 walk, map", 2000, secondsSince(start));
+    // both structures count, so each total is twice what one of them found
+    std::cout << "  " << hits / 2 << " of " << probes.size() << " probes found, " << found / 2
+              << " addresses in the /24s\n";
+}
+
+// Initial load of a table: the route table alone (patricia_lookup and
+// CompactTrie::insert per prefix against one bottom-up assign), then whole
+// compact-layout trackers (addRoute per route against addRoutes).
+void benchBottomUpBuild(size_t routes, std::mt19937& rng) {
+    std::cout << "Initial load of " << routes << " prefixes:\n";
+
+    std::vector<CompactTrie::Entry> entries(routes);
+    for (size_t i = 0; i < routes; ++i) {
+        entries[i].length = bgpLikeLength(rng);
+        entries[i].prefix = rng() & (0xFFFFFFFFu << (32 - entries[i].length));
+        entries[i].value = 1 + i % 512;
+    }
+
+    bench_clock::time_point start = bench_clock::now();
+    patricia_tree_t* tree = New_Patricia(32);
+    for (size_t i = 0; i < routes; ++i) {
+        in_addr sin;
+        sin.s_addr = htonl(entries[i].prefix);
+        prefix_t* p = New_Prefix(AF_INET, &sin, entries[i].length);
+        patricia_lookup(tree, p)->user1 = reinterpret_cast<void*>(static_cast<uintptr_t>(entries[i].value));
+        Deref_Prefix(p);
+    }
+    report("patricia_lookup per prefix", routes, secondsSince(start));
+    Destroy_Patricia(tree, nullptr);
+
+    start = bench_clock::now();
+    {
+        CompactTrie trie;
+        for (size_t i = 0; i < routes; ++i) {
+            trie.insert(entries[i].prefix, entries[i].length, entries[i].value);
+        }
+        report("CompactTrie::insert per prefix", routes, secondsSince(start));
+    }
+
+    std::vector<CompactTrie::Entry> sorted(entries);
+    std::sort(sorted.begin(), sorted.end(), [](const CompactTrie::Entry& a, const CompactTrie::Entry& b) {
+        return a.prefix != b.prefix ? a.prefix < b.prefix : a.length < b.length;
+    });
+    size_t kept = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (kept > 0 && sorted[kept - 1].prefix == sorted[i].prefix && sorted[kept - 1].length == sorted[i].length) {
+            sorted[kept - 1] = sorted[i];
+        } else {
+            sorted[kept++] = sorted[i];
+        }
+    }
+    sorted.resize(kept);
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads = 1; threads <= cores; threads *= 2) {
+        CompactTrie trie;
+        start = bench_clock::now();
+        trie.assign(sorted, threads);
+        report("CompactTrie::assign sorted, " + std::to_string(threads) + " thread(s)", routes, secondsSince(start));
+    }
+
+    std::vector<std::pair<std::string, std::string> > table(routes);
+    for (size_t i = 0; i < routes; ++i) {
+        table[i] = std::make_pair(ipv4ToString(entries[i].prefix) + "/" + std::to_string(entries[i].length),
+                                  "nh" + std::to_string(entries[i].value));
+    }
+    {
+        RouteTracker one_by_one(RouteTracker::kCompactRib);
+        start = bench_clock::now();
+        for (size_t i = 0; i < routes; ++i) {
+            one_by_one.addRoute(table[i].first, table[i].second);
+        }
+        report("compact tracker addRoute per route", routes, secondsSince(start));
+    }
+    {
+        RouteTracker bulk(RouteTracker::kCompactRib);
+        start = bench_clock::now();
+        bulk.addRoutes(table);
+        report("compact tracker addRoutes (bottom-up)", routes, secondsSince(start));
+    }
+}
+
+static void putBigEndian(std::string& out, uint32_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+// Bootstrapping a compact tracker from a dump file: reading lines into
+// strings for addRoutes() against loadRoutes() on the same text, and
+// loadRoutes() on an MRT TABLE_DUMP_V2 dump of the same routes.
+void benchRouteLoader(size_t routes, std::mt19937& rng) {
+    std::cout << "Loading a " << routes << " route dump:\n";
+    std::string text_path = "/tmp/route_tracker_bench.txt";
+    std::string mrt_path = "/tmp/route_tracker_bench.mrt";
+    {
+        std::ofstream text(text_path.c_str());
+        std::ofstream mrt(mrt_path.c_str(), std::ios::binary);
+        std::string record;
+        for (size_t i = 0; i < routes; ++i) {
+            int length = bgpLikeLength(rng);
+            uint32_t prefix = rng() & (0xFFFFFFFFu << (32 - length));
+            uint32_t nexthop = 0xC0000200u | (rng() % 200);
+            text << ipv4ToString(prefix) << "/" << length << " " << ipv4ToString(nexthop) << "\n";
+
+            std::string body;
+            putBigEndian(body, i, 4);
+            body.push_back(static_cast<char>(length));
+            putBigEndian(body, prefix >> (32 - (length + 7) / 8 * 8), (length + 7) / 8);
+            putBigEndian(body, 1, 2);       // one path: peer 0, originated 0
+            putBigEndian(body, 0, 6);
+            putBigEndian(body, 11, 2);
+            body += std::string("\x40\x01\x01\x00\x40\x03\x04", 7);      // ORIGIN, NEXT_HOP
+            putBigEndian(body, nexthop, 4);
+            record.clear();
+            putBigEndian(record, 0, 4);
+            putBigEndian(record, 13, 2);    // TABLE_DUMP_V2 RIB_IPV4_UNICAST
+            putBigEndian(record, 2, 2);
+            putBigEndian(record, body.size(), 4);
+            mrt << record << body;
+        }
+    }
+
+    {
+        RouteTracker tracker(RouteTracker::kCompactRib);
+        bench_clock::time_point start = bench_clock::now();
+        std::ifstream in(text_path.c_str());
+        std::vector<std::pair<std::string, std::string> > table;
+        std::string prefix, nexthop;
+        while (in >> prefix >> nexthop) {
+            table.push_back(std::make_pair(prefix, nexthop));
+        }
+        tracker.addRoutes(table);
+        report("text via std::string + addRoutes", routes, secondsSince(start));
+    }
+    for (int mrt = 0; mrt < 2; ++mrt) {
+        RouteTracker tracker(RouteTracker::kCompactRib);
+        RouteLoadStats stats;
+        tracker.loadRoutes(mrt ? mrt_path : text_path, mrt ? RouteFileFormat::kMrt : RouteFileFormat::kText, &stats);
+        report(mrt ? "loadRoutes MRT" : "loadRoutes text", stats.routes_parsed,
+               stats.parse_seconds + stats.apply_seconds);
+        std::cout << "    parse " << stats.parse_seconds << " s, apply " << stats.apply_seconds << " s\n";
+    }
+    std::remove(text_path.c_str());
+    std::remove(mrt_path.c_str());
+}
+
+// Warm restart: how long after loadSnapshot() starts the first lookup is
+// answered (from the mapped file) and how long until the tables are rebuilt.
+void benchWarmRestart(RouteTracker& tracker, size_t lookups, std::mt19937& rng) {
+    std::string path = "/tmp/route_tracker_bench.snap";
+    size_t routes = tracker.snapshot().size();
+    std::cout << "Warm restart of " << routes << " routes:\n";
+
+    bench_clock::time_point start = bench_clock::now();
+    tracker.saveSnapshot(path);
+    std::cout << "  saveSnapshot                " << std::setw(10) << secondsSince(start) * 1e3 << " ms\n";
+
+    std::vector<uint32_t> addresses(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        addresses[i] = rng();
+    }
+    RouteTracker restored(RouteTracker::kCompactRib);
+    start = bench_clock::now();
+    restored.loadSnapshot(path);
+    RouteMatch first = restored.lookup(addresses[0]);
+    std::cout << "  first lookup after          " << std::setw(10) << secondsSince(start) * 1e3 << " ms"
+              << (first.found() ? "" : " (no route)") << "\n";
+    bench_clock::time_point lookup_start = bench_clock::now();
+    size_t found = 0;
+    for (size_t i = 0; i < lookups / 8; ++i) {
+        found += restored.lookup(addresses[i]).found();
+    }
+    report("lookups during the rebuild", lookups / 8, secondsSince(lookup_start));
+    restored.waitForRestore();
+    std::cout << "  tables rebuilt after        " << std::setw(10) << secondsSince(start) * 1e3 << " ms\n";
+    std::remove(path.c_str());
+}
+
+// Journaling cost on the update path, and crash recovery by replay against
+// rebuilding the table with one addRoute() per update.
+void benchJournal(size_t updates, std::mt19937& rng) {
+    std::string path = "/tmp/route_tracker_bench.journal";
+    std::remove(path.c_str());
+    std::cout << "Update journal, " << updates << " route updates:\n";
+    std::vector<std::pair<uint32_t, int> > prefixes(updates);
+    for (size_t i = 0; i < updates; ++i) {
+        int length = bgpLikeLength(rng);
+        prefixes[i] = std::make_pair(rng() & (0xFFFFFFFFu << (32 - length)), length);
+    }
+
+    RouteTracker plain;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < updates; ++i) {
+        plain.addRoute(prefixes[i].first, prefixes[i].second, "nh" + std::to_string(i % 64));
+    }
+    report("addRoute, no journal", updates, secondsSince(start));
+
+    RouteTracker journaled;
+    journaled.openJournal(path, 10);
+    start = bench_clock::now();
+    for (size_t i = 0; i < updates; ++i) {
+        journaled.addRoute(prefixes[i].first, prefixes[i].second, "nh" + std::to_string(i % 64));
+    }
+    journaled.syncJournal();
+    report("addRoute, journaled + sync", updates, secondsSince(start));
+    journaled.closeJournal();
+
+    RouteTracker recovered;
+    JournalReplayStats stats;
+    recovered.replayJournal(path, nullptr, &stats);
+    report("replayJournal", stats.records, stats.seconds);
+    std::remove(path.c_str());
+}
+
+// A subscriber that takes ~20us per callback: writer throughput with the
+// callbacks inline, then on notifier threads.
+static void slowCallback(const std::string&, const std::string&, const std::string&) {
+    bench_clock::time_point start = bench_clock::now();
+    while (secondsSince(start) < 20e-6) {
+    }
+}
+
+void benchAsyncNotifications(size_t updates) {
+    std::cout << "Route updates with 64 tracked addresses and a 20us subscriber:\n";
+    for (unsigned threads = 0; threads <= 4; threads += 2) {
+        RouteTracker tracker;
+        if (threads) {
+            tracker.startNotifiers(threads, 1 << 16);
+        }
+        for (uint32_t i = 0; i < 64; ++i) {
+            tracker.registerAddress((10u << 24) + i * 4096 + 1, &slowCallback);
+        }
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < updates; ++i) {
+            tracker.addRoute((10u << 24) + (i % 64) * 4096, 20, "nh" + std::to_string(i % 7));
+        }
+        double writer_seconds = secondsSince(start);
+        tracker.flushNotifications();
+        std::string name = threads ? "addRoute, " + std::to_string(threads) + " notifiers" : "addRoute, inline";
+        report(name, updates, writer_seconds);
+        if (threads) {
+            NotifierStats stats = tracker.notifierStats();
+            std::cout << "    delivered " << stats.delivered << " in " << std::setprecision(3) << secondsSince(start)
+                      << " s, max queued " << stats.max_queued << "\n";
+        }
+    }
+}
+
+// One update moving many tracked addresses: a callback per address, which
+// formats the address and copies both nexthops, against one batch of binary
+// records per update.
+static void countingBatch(const RouteChange*, size_t count, void*) { changes_seen += count; }
+
+void benchBatchCallbacks(size_t tracked, size_t updates) {
+    std::cout << "Route updates moving " << tracked << " tracked addresses:\n";
+    for (int batched = 0; batched <= 1; ++batched) {
+        RouteTracker tracker;
+        tracker.addRoute(10u << 24, 8, "nh-start");
+        uint32_t subscriber = tracker.subscribe(&countingBatch, nullptr);
+        for (size_t i = 0; i < tracked; ++i) {
+            uint32_t address = (10u << 24) + static_cast<uint32_t>(i) * 97;
+            if (batched) {
+                tracker.subscribeAddress(address, subscriber);
+            } else {
+                tracker.registerAddress(address, &countingCallback);
+            }
+        }
+        changes_seen = 0;
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < updates; ++i) {
+            tracker.addRoute(10u << 24, 8, "nh" + std::to_string(i % 2));
+        }
+        report(batched ? "notifications, batched" : "notifications, per address", changes_seen, secondsSince(start));
+    }
+}
+
+// Aggregate lock-free lookup rate for 1..N reader threads while one writer
+// keeps adding and deleting routes.
+void benchConcurrentReaders(RouteTracker& tracker, std::mt19937& rng) {
+    unsigned max_readers = std::max(4u, std::thread::hardware_concurrency());
+    std::cout << "Concurrent lookupBatch x64 with a writer churning routes (1s each):\n";
+
+    std::vector<uint32_t> addresses(1 << 16);
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        addresses[i] = rng();
+    }
+
+    for (unsigned readers = 1; readers <= max_readers; readers *= 2) {
+        std::atomic<bool> stop(false);
+        std::atomic<size_t> total(0);
+        std::atomic<size_t> updates(0);
+
+        std::thread writer([&]() {
+            for (size_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+                std::string prefix = "100." + std::to_string(i % 64) + "." + std::to_string((i / 64) % 256) + ".0/24";
+                tracker.addRoute(prefix, "churn");
+                tracker.deleteRoute(prefix);
+                updates += 2;
+            }
+        });
+        std::vector<std::thread> threads;
+        for (unsigned r = 0; r < readers; ++r) {
+            threads.push_back(std::thread([&, r]() {
+                RouteMatch results[64];
+                size_t done = 0;
+                for (size_t i = r * 4096; !stop.load(std::memory_order_relaxed); i += 64) {
+                    tracker.lookupBatch(&addresses[i % (addresses.size() - 64)], 64, results);
+                    done += 64;
+                }
+                total += done;
+            }));
+        }
+
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        stop = true;
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+        writer.join();
+        report(std::to_string(readers) + " reader(s), " + std::to_string(updates.load()) + " updates", total.load(), 1.0);
+    }
+}
+
+// Host lookups straight on the two route table layouts, without the
+// DIR-24-8 table in front of them.
+void benchRouteTables(size_t routes, size_t lookups, std::mt19937& rng) {
+    std::cout << "Route table search_best over /32s:\n";
+
+    patricia_tree_t* tree = New_Patricia(32);
+    CompactTrie trie;
+    for (size_t i = 0; i < routes; ++i) {
+        int length = bgpLikeLength(rng);
+        uint32_t prefix = rng() & (0xFFFFFFFFu << (32 - length));
+        in_addr sin;
+        sin.s_addr = htonl(prefix);
+        prefix_t* p = New_Prefix(AF_INET, &sin, length);
+        patricia_lookup(tree, p)->user1 = reinterpret_cast<void*>(static_cast<uintptr_t>(1 + i % 512));
+        Deref_Prefix(p);
+        trie.insert(prefix, length, 1 + i % 512);
+    }
+
+    std::vector<uint32_t> addresses(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        addresses[i] = rng();
+    }
+
+    size_t found = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        prefix_t p;
+        p.family = AF_INET;
+        p.bitlen = 32;
+        p.ref_count = 0;
+        p.add.sin.s_addr = htonl(addresses[i]);
+        found += patricia_search_best(tree, &p) != nullptr;
+    }
+    report("patricia (pointer nodes)", lookups, secondsSince(start));
+
+    size_t compact_found = 0;
+    start = bench_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        uint32_t value;
+        int length;
+        compact_found += trie.searchBest(addresses[i], 32, &value, &length);
+    }
+    report("compact (16-byte nodes)", lookups, secondsSince(start));
+    if (compact_found != found) {
+        std::cerr << "route table layouts disagree\n";
+    }
+    std::cout << "  node memory: patricia " << tree->pool.num_slabs * 64 << " KB, compact "
+              << trie.memoryBytes() / 1024 << " KB\n";
+    Destroy_Patricia(tree, nullptr);
+}
+
+int main(int argc, char** argv) {
+    size_t routes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 500000;
+    size_t lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4000000;
+
+    std::mt19937 rng(7);
+    RouteTracker tracker;
+
+    bench_clock::time_point start = bench_clock::now();
+    populate(tracker, routes, rng);
+    std::cout << "Loaded " << routes << " routes in " << secondsSince(start) << " s\n";
+
+    benchLookups(tracker, lookups, rng);
+    benchFibKernels(routes, lookups, rng);
+    benchLookupEngines(routes, lookups, rng);
+    benchRouteTables(routes, lookups, rng);
+    benchIPv6(routes / 4, lookups, rng);
+    benchBulkLoad(routes, 100000, rng);
+    benchBulkRegistration(routes, 200000, rng);
+    benchTrackedTable(200000, rng);
+    benchBottomUpBuild(2 * routes, rng);
+    benchRouteLoader(2 * routes, rng);
+    benchWarmRestart(tracker, lookups, rng);
+    benchJournal(routes, rng);
+    benchAsyncNotifications(20000);
+    benchBatchCallbacks(100000, 20);
+    benchConcurrentReaders(tracker, rng);
+    return 0;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file chunked_fib.h
+ * @brief The /16 direct table and per-/16 chunks shared by the compact FIBs
+ *
+ * LcTrieFib and PoptrieFib split the address space the same way: the top 16
+ * address bits index a 2^16 entry direct table holding the best route of
+ * length 16 or less, and every /16 that also has longer routes gets an
+ * immutable chunk over them. ChunkedFib is that common part: the direct
+ * table and its updates, the chunk slots, and the update of a route longer
+ * than /16, which hands the chunk's routes plus the change to the engine's
+ * builder, publishes the new chunk with a release store and retires the old
+ * one through the EpochReclaimer. The engines only define the chunk and how
+ * to build and walk it.
+ *
+ * Direct entries use the Dir24Fib format (valid | length | 24-bit value).
+ * Same threading model as Dir24Fib: one writer, any number of readers inside
+ * an EpochGuard.
+ *
+ * Chunk provides:
+ *   typedef ... Route;       // uint32_t key, uint32_t value, int length
+ *   void copyRoutes(std::vector<Route>& routes) const;   // by (key, length)
+ *   static void destroy(Chunk* chunk);
+ */
+
+#ifndef _CHUNKED_FIB_H
+#define _CHUNKED_FIB_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "epoch.h"
+
+template <typename Chunk>
+class ChunkedFib {
+public:
+    static const uint32_t kValid = 0x80000000u;
+    static const uint32_t kDepthShift = 24;
+    static const uint32_t kValueMask = 0x00FFFFFF;
+    static const size_t kTopBits = 16;
+
+    static uint32_t makeEntry(uint32_t value, int length) {
+        return kValid | (static_cast<uint32_t>(length) << kDepthShift) | value;
+    }
+    static int entryDepth(uint32_t entry) { return (entry >> kDepthShift) & 0x3F; }
+    // the direct table slot and chunk of address
+    static size_t slot(uint32_t address) { return address >> (32 - kTopBits); }
+
+    explicit ChunkedFib(EpochReclaimer* reclaimer) : reclaimer_(reclaimer), chunk_count_(0) {
+        memset(top_, 0, sizeof(top_));
+        memset(chunks_, 0, sizeof(chunks_));
+    }
+    ~ChunkedFib() {
+        for (size_t i = 0; i < kSlots; ++i) {
+            if (chunks_[i]) {
+                Chunk::destroy(chunks_[i]);
+            }
+        }
+    }
+
+    ChunkedFib(const ChunkedFib&) = delete;
+    ChunkedFib& operator=(const ChunkedFib&) = delete;
+
+    // Same contract as Dir24Fib::insert()/remove(). build(routes) returns a
+    // new chunk for the routes of one /16, sorted and never empty; it may
+    // take them out of the vector.
+    template <typename Build>
+    void insert(uint32_t prefix, int length, uint32_t value, Build build) {
+        if (length > static_cast<int>(kTopBits)) {
+            updateChunk(prefix, length, value, true, build);
+            return;
+        }
+        uint32_t entry = makeEntry(value, length);
+        uint32_t first = prefix >> (32 - kTopBits);
+        uint32_t count = 1u << (kTopBits - length);
+        for (uint32_t i = first; i < first + count; ++i) {
+            if (!(top_[i] & kValid) || entryDepth(top_[i]) <= length) {
+                __atomic_store_n(&top_[i], entry, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    template <typename Build>
+    void remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length, Build build) {
+        if (length > static_cast<int>(kTopBits)) {
+            updateChunk(prefix, length, 0, false, build);
+            return;
+        }
+        // a covering route longer than /16 cannot cover a /16 or shorter prefix
+        uint32_t replacement = replacement_length < 0 ? 0 : makeEntry(replacement_value, replacement_length);
+        uint32_t first = prefix >> (32 - kTopBits);
+        uint32_t count = 1u << (kTopBits - length);
+        for (uint32_t i = first; i < first + count; ++i) {
+            if ((top_[i] & kValid) && entryDepth(top_[i]) == length) {
+                __atomic_store_n(&top_[i], replacement, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    // Readers: acquire loads, valid inside an EpochGuard.
+    const Chunk* chunk(size_t index) const { return __atomic_load_n(&chunks_[index], __ATOMIC_ACQUIRE); }
+    uint32_t top(size_t index) const { return __atomic_load_n(&top_[index], __ATOMIC_ACQUIRE); }
+    void prefetchChunk(size_t index) const { __builtin_prefetch(&chunks_[index]); }
+    void prefetchTop(size_t index) const { __builtin_prefetch(&top_[index]); }
+
+    // Writer side: every chunk, for statistics.
+    template <typename Visit>
+    void forEachChunk(Visit visit) const {
+        for (size_t i = 0; i < kSlots; ++i) {
+            if (chunks_[i]) {
+                visit(*chunks_[i]);
+            }
+        }
+    }
+    size_t chunks() const { return chunk_count_; }
+
+private:
+    static const size_t kSlots = size_t(1) << kTopBits;
+
+    // Rebuilds the chunk of prefix from the old chunk's routes plus the change.
+    template <typename Build>
+    void updateChunk(uint32_t prefix, int length, uint32_t value, bool add, Build build) {
+        typedef typename Chunk::Route Route;
+        size_t index = slot(prefix);
+        Route route = Route();
+        route.key = prefix & (0xFFFFFFFFu << (32 - length));
+        route.value = value;
+        route.length = length;
+
+        std::vector<Route> routes;
+        if (chunks_[index]) {
+            chunks_[index]->copyRoutes(routes);
+        }
+        typename std::vector<Route>::iterator it =
+            std::lower_bound(routes.begin(), routes.end(), route, [](const Route& a, const Route& b) {
+                return a.key != b.key ? a.key < b.key : a.length < b.length;
+            });
+        bool present = it != routes.end() && it->key == route.key && it->length == length;
+        if (add) {
+            if (present) {
+                it->value = value;
+            } else {
+                routes.insert(it, route);
+            }
+        } else {
+            if (!present) {
+                return;
+            }
+            routes.erase(it);
+        }
+        publishChunk(index, routes.empty() ? nullptr : build(routes));
+    }
+
+    void publishChunk(size_t index, Chunk* chunk) {
+        Chunk* old = chunks_[index];
+        __atomic_store_n(&chunks_[index], chunk, __ATOMIC_RELEASE);
+        chunk_count_ += (chunk != nullptr) - (old != nullptr);
+        if (!old) {
+            return;
+        }
+        if (reclaimer_) {
+            reclaimer_->retire([old]() { Chunk::destroy(old); });
+        } else {
+            Chunk::destroy(old);
+        }
+    }
+
+    EpochReclaimer* reclaimer_;
+    uint32_t top_[kSlots];
+    Chunk* chunks_[kSlots];
+    size_t chunk_count_;
+};
+
+#endif /* _CHUNKED_FIB_H */
@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <thread>
+
+#include "compact_trie.h"
+
+static uint32_t trieMask(int length) {
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+static int trieBit(uint32_t key, int position) {
+    return (key >> (31 - position)) & 1;
+}
+
+static int trieCommonLength(uint32_t a, int a_length, uint32_t b, int b_length) {
+    uint32_t differ = a ^ b;
+    int same = differ ? __builtin_clz(differ) : 32;
+    return std::min(same, std::min(a_length, b_length));
+}
+
+CompactTrie::CompactTrie() : root_(kNil), routes_(0) {
+    nodes_.resize(1);
+}
+
+uint32_t CompactTrie::allocNode(uint32_t key, int length, uint32_t value, bool routed) {
+    uint32_t index;
+    if (!free_nodes_.empty()) {
+        index = free_nodes_.back();
+        free_nodes_.pop_back();
+    } else {
+        index = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(Node());
+    }
+    Node& node = nodes_[index];
+    node.key = key;
+    node.child[0] = node.child[1] = kNil;
+    node.info = makeInfo(length, value, routed);
+    return index;
+}
+
+void CompactTrie::freeNode(uint32_t index) {
+    free_nodes_.push_back(index);
+}
+
+uint32_t CompactTrie::insert(uint32_t prefix, int length, uint32_t value) {
+    uint32_t key = prefix & trieMask(length);
+    // an insert adds at most two nodes; with room for them up front, the
+    // link pointer below stays valid
+    if (nodes_.capacity() < nodes_.size() + 2) {
+        nodes_.reserve(std::max<size_t>(64, nodes_.capacity() * 2));
+    }
+
+    uint32_t* link = &root_;
+    while (true) {
+        uint32_t index = *link;
+        if (index == kNil) {
+            *link = allocNode(key, length, value, true);
+            ++routes_;
+            return 0;
+        }
+        Node& node = nodes_[index];
+        int node_length = node.length();
+        int common = trieCommonLength(node.key, node_length, key, length);
+
+        if (common == node_length && common == length) {
+            uint32_t old = node.routed() ? node.value() : 0;
+            if (!old) {
+                ++routes_;
+            }
+            node.info = makeInfo(length, value, true);
+            return old;
+        }
+        if (common == node_length) {
+            link = &node.child[trieBit(key, node_length)];
+            continue;
+        }
+
+        uint32_t fresh = allocNode(key, length, value, true);
+        ++routes_;
+        if (common == length) {
+            // the new prefix covers the node
+            nodes_[fresh].child[trieBit(nodes_[index].key, length)] = index;
+            *link = fresh;
+            return 0;
+        }
+        uint32_t glue = allocNode(key & trieMask(common), common, 0, false);
+        nodes_[glue].child[trieBit(key, common)] = fresh;
+        nodes_[glue].child[!trieBit(key, common)] = index;
+        *link = glue;
+        return 0;
+    }
+}
+
+uint32_t CompactTrie::remove(uint32_t prefix, int length) {
+    uint32_t key = prefix & trieMask(length);
+    uint32_t* parent_link = nullptr;
+    uint32_t* link = &root_;
+    while (*link != kNil) {
+        Node& node = nodes_[*link];
+        if (node.length() > length || (key & trieMask(node.length())) != node.key) {
+            return 0;
+        }
+        if (node.length() == length) {
+            break;
+        }
+        parent_link = link;
+        link = &node.child[trieBit(key, node.length())];
+    }
+    if (*link == kNil || !nodes_[*link].routed()) {
+        return 0;
+    }
+
+    uint32_t index = *link;
+    Node& node = nodes_[index];
+    uint32_t old = node.value();
+    --routes_;
+    if (node.child[0] != kNil && node.child[1] != kNil) {
+        node.info = makeInfo(length, 0, false);   // stays as glue
+        return old;
+    }
+
+    uint32_t child = node.child[0] != kNil ? node.child[0] : node.child[1];
+    *link = child;
+    freeNode(index);
+
+    // a glue parent left with one child is no longer needed
+    if (child == kNil && parent_link) {
+        uint32_t parent = *parent_link;
+        Node& glue = nodes_[parent];
+        if (!glue.routed()) {
+            *parent_link = glue.child[0] != kNil ? glue.child[0] : glue.child[1];
+            freeNode(parent);
+        }
+    }
+    return old;
+}
+
+bool CompactTrie::searchBest(uint32_t prefix, int length, uint32_t* value, int* matched_length) const {
+    const Node* best = nullptr;
+    for (uint32_t index = root_; index != kNil;) {
+        const Node& node = nodes_[index];
+        int node_length = node.length();
+        if (node_length > length || (prefix & trieMask(node_length)) != node.key) {
+            break;
+        }
+        if (node.routed()) {
+            best = &node;
+        }
+        if (node_length == length) {
+            break;
+        }
+        index = node.child[trieBit(prefix, node_length)];
+    }
+    if (!best) {
+        return false;
+    }
+    *value = best->value();
+    *matched_length = best->length();
+    return true;
+}
+
+bool CompactTrie::searchImage(const void* image, size_t nodes, uint32_t root, uint32_t address, uint32_t* value,
+                              int* matched_length) {
+    const Node* table = static_cast<const Node*>(image);
+    const Node* best = nullptr;
+    int parent_length = -1;
+    for (uint32_t index = root; index != kNil && index < nodes;) {
+        const Node& node = table[index];
+        int node_length = node.length();
+        // lengths grow on the way down, which also bounds the walk
+        if (node_length <= parent_length || (address & trieMask(node_length)) != node.key) {
+            break;
+        }
+        parent_length = node_length;
+        if (node.routed()) {
+            best = &node;
+        }
+        if (node_length == 32) {
+            break;
+        }
+        index = node.child[trieBit(address, node_length)];
+    }
+    if (!best) {
+        return false;
+    }
+    *value = best->value();
+    *matched_length = best->length();
+    return true;
+}
+
+uint32_t CompactTrie::searchExact(uint32_t prefix, int length) const {
+    uint32_t value;
+    int matched_length;
+    if (searchBest(prefix, length, &value, &matched_length) && matched_length == length) {
+        return value;
+    }
+    return 0;
+}
+
+static CompactTrie::Entry entryKey(uint32_t key, int length) {
+    CompactTrie::Entry entry;
+    entry.prefix = key;
+    entry.length = length;
+    entry.value = 0;
+    return entry;
+}
+
+static bool entryBefore(const CompactTrie::Entry& a, const CompactTrie::Entry& b) {
+    return a.prefix != b.prefix ? a.prefix < b.prefix : a.length < b.length;
+}
+
+// One pass over the items keeping the rightmost path of the trie built so
+// far: each item hangs under the deepest path node that is a prefix of it,
+// next to (or, through a new glue node, above) the last subtree popped off
+// the path. Every item is pushed and popped once, so this is linear.
+uint32_t CompactTrie::linkSorted(std::vector<Node>& nodes, const uint32_t* items, size_t count) {
+    std::vector<uint32_t> path;
+    uint32_t root = kNil;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t item = items[i];
+        uint32_t key = nodes[item].key;
+        int length = nodes[item].length();
+
+        uint32_t below = kNil;
+        while (!path.empty()) {
+            const Node& top = nodes[path.back()];
+            if (top.length() < length && (key & trieMask(top.length())) == top.key) {
+                break;
+            }
+            below = path.back();
+            path.pop_back();
+        }
+        uint32_t parent = path.empty() ? kNil : path.back();
+
+        uint32_t attach = item;
+        if (below != kNil) {
+            int common = trieCommonLength(nodes[below].key, nodes[below].length(), key, length);
+            if (parent == kNil || common > nodes[parent].length()) {
+                // below and the item part ways under parent
+                Node glue;
+                glue.key = key & trieMask(common);
+                glue.info = makeInfo(common, 0, false);
+                glue.child[trieBit(key, common)] = item;
+                glue.child[!trieBit(key, common)] = below;
+                attach = static_cast<uint32_t>(nodes.size());
+                nodes.push_back(glue);
+                path.push_back(attach);
+            }
+        }
+        if (parent == kNil) {
+            root = attach;
+        } else {
+            nodes[parent].child[trieBit(key, nodes[parent].length())] = attach;
+        }
+        path.push_back(item);
+    }
+    return root;
+}
+
+void CompactTrie::buildBuckets(const Entry* entries, const size_t* bucket_start, int first, int last,
+                               std::vector<Node>& nodes, uint32_t* roots) {
+    nodes.assign(1, Node());
+    std::vector<uint32_t> items;
+    for (int bucket = first; bucket < last; ++bucket) {
+        items.clear();
+        for (size_t i = bucket_start[bucket]; i < bucket_start[bucket + 1]; ++i) {
+            Node node;
+            node.key = entries[i].prefix;
+            node.child[0] = node.child[1] = kNil;
+            node.info = makeInfo(entries[i].length, entries[i].value, true);
+            items.push_back(static_cast<uint32_t>(nodes.size()));
+            nodes.push_back(node);
+        }
+        roots[bucket] = linkSorted(nodes, items.data(), items.size());
+    }
+}
+
+bool CompactTrie::assign(const std::vector<Entry>& entries, unsigned threads) {
+    for (size_t i = 1; i < entries.size(); ++i) {
+        if (!entryBefore(entries[i - 1], entries[i])) {
+            return false;
+        }
+    }
+
+    // entries shorter than /8 first in each bucket's key range; they are
+    // linked above the buckets at the end
+    const int kBuckets = 1 << kBucketBits;
+    std::vector<Entry> bucketed;
+    std::vector<Entry> top;
+    bucketed.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        (entries[i].length < kBucketBits ? top : bucketed).push_back(entries[i]);
+    }
+    size_t bucket_start[kBuckets + 1];
+    for (int bucket = 0; bucket <= kBuckets; ++bucket) {
+        uint32_t bound = bucket == kBuckets ? 0 : static_cast<uint32_t>(bucket) << (32 - kBucketBits);
+        bucket_start[bucket] = bucket == kBuckets ? bucketed.size()
+                                                  : std::lower_bound(bucketed.begin(), bucketed.end(),
+                                                                     entryKey(bound, 0), entryBefore) -
+                                                        bucketed.begin();
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<unsigned>(threads, kBuckets);
+
+    // contiguous bucket ranges of roughly equal entry counts
+    std::vector<int> split(1, 0);
+    for (unsigned t = 1; t < threads; ++t) {
+        size_t target = bucketed.size() * t / threads;
+        int bucket = split.back();
+        while (bucket < kBuckets && bucket_start[bucket] < target) {
+            ++bucket;
+        }
+        split.push_back(bucket);
+    }
+    split.push_back(kBuckets);
+
+    std::vector<std::vector<Node> > parts(threads);
+    uint32_t roots[kBuckets];
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.push_back(std::thread(buildBuckets, bucketed.data(), bucket_start, split[t], split[t + 1],
+                                      std::ref(parts[t]), roots));
+    }
+    buildBuckets(bucketed.data(), bucket_start, split[0], split[1], parts[0], roots);
+    for (size_t w = 0; w < workers.size(); ++w) {
+        workers[w].join();
+    }
+
+    // stitch: append every part behind the sentinel, shifting its indices
+    std::vector<Node> nodes(1);
+    size_t total = 1;
+    for (unsigned t = 0; t < threads; ++t) {
+        total += parts[t].size() - 1;
+    }
+    nodes.reserve(total + 2 * top.size());
+    for (unsigned t = 0; t < threads; ++t) {
+        uint32_t shift = static_cast<uint32_t>(nodes.size()) - 1;
+        for (size_t i = 1; i < parts[t].size(); ++i) {
+            Node node = parts[t][i];
+            for (int c = 0; c < 2; ++c) {
+                if (node.child[c] != kNil) {
+                    node.child[c] += shift;
+                }
+            }
+            nodes.push_back(node);
+        }
+        for (int bucket = split[t]; bucket < split[t + 1]; ++bucket) {
+            if (roots[bucket] != kNil) {
+                roots[bucket] += shift;
+            }
+        }
+        std::vector<Node>().swap(parts[t]);
+    }
+
+    // the short routes and bucket roots, merged in (key, length) order
+    std::vector<uint32_t> items;
+    size_t next_top = 0;
+    for (int bucket = 0; bucket <= kBuckets; ++bucket) {
+        uint32_t bound = bucket == kBuckets ? 0xFFFFFFFFu : static_cast<uint32_t>(bucket) << (32 - kBucketBits);
+        while (next_top < top.size() && (bucket == kBuckets || top[next_top].prefix <= bound)) {
+            Node node;
+            node.key = top[next_top].prefix;
+            node.child[0] = node.child[1] = kNil;
+            node.info = makeInfo(top[next_top].length, top[next_top].value, true);
+            items.push_back(static_cast<uint32_t>(nodes.size()));
+            nodes.push_back(node);
+            ++next_top;
+        }
+        if (bucket < kBuckets && roots[bucket] != kNil) {
+            items.push_back(roots[bucket]);
+        }
+    }
+
+    nodes_.swap(nodes);
+    free_nodes_.clear();
+    root_ = linkSorted(nodes_, items.data(), items.size());
+    routes_ = entries.size();
+    return true;
+}
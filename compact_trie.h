@@ -0,0 +1,103 @@
+/**
+ * @file compact_trie.h
+ * @brief IPv4 patricia trie with 16-byte, index-linked nodes
+ *
+ * Alternative to the pointer-based patricia.cxx tree for the route table.
+ * Nodes live in one contiguous array and refer to their children by 32-bit
+ * index; each node carries its key bits, prefix length and value inline, so
+ * a search step touches a single quarter cache line and the top levels of a
+ * full Internet table fit in L2. There is no parent link: removal keeps the
+ * two links it needs while walking down.
+ *
+ * Prefixes are IPv4 in host byte order. Values are 24-bit and non-zero (0
+ * means "no route"), which matches NexthopTable ids. Not thread safe.
+ */
+
+#ifndef _COMPACT_TRIE_H
+#define _COMPACT_TRIE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+class CompactTrie {
+public:
+    static const uint32_t kMaxValue = 0x00FFFFFF;
+
+    struct Entry {
+        uint32_t prefix;    // host byte order, bits past length zero
+        int length;
+        uint32_t value;     // non-zero
+    };
+
+    CompactTrie();
+
+    // Replaces the contents with entries, which must be sorted by (prefix,
+    // length) without duplicates; returns false, leaving the trie as it was,
+    // when they are not. Builds bottom-up in one pass instead of inserting:
+    // the subtrees of each /8 are built on up to threads worker threads (0
+    // means one per core), then stitched under the routes shorter than /8.
+    bool assign(const std::vector<Entry>& entries, unsigned threads = 1);
+
+    // Sets prefix/length to value and returns the value it replaces, 0 when
+    // the prefix was not routed.
+    uint32_t insert(uint32_t prefix, int length, uint32_t value);
+    // Returns the value prefix/length had, 0 when it was not routed.
+    uint32_t remove(uint32_t prefix, int length);
+    // Longest routed prefix covering prefix/length, itself included.
+    bool searchBest(uint32_t prefix, int length, uint32_t* value, int* matched_length) const;
+    uint32_t searchExact(uint32_t prefix, int length) const;
+
+    // Flat image of the trie for files: imageNodes() nodes of kImageNodeBytes
+    // each, starting at imageData(). Nodes link by index, so an image can be
+    // searched wherever it is mapped, with searchImage().
+    static const size_t kImageNodeBytes = 16;
+    const void* imageData() const { return nodes_.data(); }
+    size_t imageNodes() const { return nodes_.size(); }
+    uint32_t imageRoot() const { return root_; }
+    // Longest routed prefix covering address in an image. Links outside the
+    // image or back up the trie end the search, so a damaged image is never
+    // read out of bounds or walked forever.
+    static bool searchImage(const void* image, size_t nodes, uint32_t root, uint32_t address, uint32_t* value,
+                            int* matched_length);
+
+    size_t routes() const { return routes_; }
+    // nodes in use, routed and glue
+    size_t nodes() const { return nodes_.size() - 1 - free_nodes_.size(); }
+    size_t memoryBytes() const { return nodes_.capacity() * sizeof(Node); }
+
+private:
+    static const uint32_t kNil = 0;   // nodes_[0] is never used
+
+    struct Node {
+        uint32_t key;           // the first length() bits, rest zero
+        uint32_t child[2];
+        uint32_t info;          // value:24 | length:6 | routed:1
+
+        int length() const { return (info >> 24) & 0x3F; }
+        bool routed() const { return info >> 31; }
+        uint32_t value() const { return info & kMaxValue; }
+    };
+    static_assert(sizeof(Node) == 16 && sizeof(Node) == kImageNodeBytes, "four nodes per cache line");
+
+    static uint32_t makeInfo(int length, uint32_t value, bool routed) {
+        return (routed ? 0x80000000u : 0) | (static_cast<uint32_t>(length) << 24) | (value & kMaxValue);
+    }
+    uint32_t allocNode(uint32_t key, int length, uint32_t value, bool routed);
+    void freeNode(uint32_t index);
+
+    static const int kBucketBits = 8;
+    // Links the nodes named by items, in (key, length) order, into one trie
+    // and returns its root; items may be finished subtrees.
+    static uint32_t linkSorted(std::vector<Node>& nodes, const uint32_t* items, size_t count);
+    // builds the subtree of every /8 bucket in [first, last) into nodes
+    static void buildBuckets(const Entry* entries, const size_t* bucket_start, int first, int last,
+                             std::vector<Node>& nodes, uint32_t* roots);
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> free_nodes_;
+    uint32_t root_;
+    size_t routes_;
+};
+
+#endif /* _COMPACT_TRIE_H */
@@ -0,0 +1,52 @@
+#include <cstring>
+
+#include "crc32c.h"
+
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+    static const struct Table {
+        uint32_t entry[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    value = value & 1 ? (value >> 1) ^ 0x82F63B78u : value >> 1;
+                }
+                entry[i] = value;
+            }
+        }
+    } table;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table.entry[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// the SSE4.2 crc32 instruction computes CRC-32C, 8 bytes at a time
+__attribute__((target("sse4.2"))) static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data,
+                                                                  size_t size) {
+    uint64_t wide = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = __builtin_ia32_crc32di(wide, word);
+    }
+    crc = static_cast<uint32_t>(wide);
+    for (; size > 0; ++data, --size) {
+        crc = __builtin_ia32_crc32qi(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32cHardware(crc, bytes, size);
+    }
+#endif
+    return ~crc32cSoftware(crc, bytes, size);
+}
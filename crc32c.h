@@ -0,0 +1,19 @@
+/**
+ * @file crc32c.h
+ * @brief CRC-32C (Castagnoli) checksum for the on-disk formats
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it (checked once at run
+ * time, no -m flags needed) and a table otherwise; both give the same result.
+ */
+
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Continues a CRC-32C: start from 0 and pass the previous result to extend
+// it over more data.
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+#endif /* _CRC32C_H */
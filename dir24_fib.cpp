@@ -0,0 +1,342 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "dir24_fib.h"
+#include "epoch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR24_FIB_X86 1
+#endif
+
+static const size_t kTbl24Entries = 1u << 24;
+static const size_t kTbl8GroupEntries = 256;
+static const size_t kInitialTbl8Groups = 256;
+// gather indices are signed 32-bit, which bounds tbl8 at 2^23 groups
+static const size_t kMaxTbl8Groups = 1u << 23;
+
+Dir24Fib::Dir24Fib(EpochReclaimer* reclaimer)
+    : reclaimer_(reclaimer), tbl8_capacity_(kInitialTbl8Groups), kernel_(kScalar) {
+    // calloc keeps the untouched parts of the 64MB first level unbacked
+    tbl24_ = static_cast<uint32_t*>(calloc(kTbl24Entries, sizeof(uint32_t)));
+    tbl8_ = static_cast<uint32_t*>(calloc(tbl8_capacity_ * kTbl8GroupEntries, sizeof(uint32_t)));
+    if (!tbl24_ || !tbl8_) {
+        free(tbl24_);
+        free(tbl8_);
+        throw std::bad_alloc();
+    }
+    free_tbl8_.reserve(tbl8_capacity_);
+    for (size_t g = tbl8_capacity_; g > 0; --g) {
+        free_tbl8_.push_back(static_cast<uint32_t>(g - 1));
+    }
+    if (!setKernel(kAvx512)) {
+        setKernel(kAvx2);
+    }
+}
+
+Dir24Fib::~Dir24Fib() {
+    free(tbl24_);
+    free(tbl8_);
+}
+
+// Takes a free tbl8 group, doubling the pool when it runs dry, and fills it
+// with the entry it is about to replace in tbl24. The pool is grown by copy
+// so that readers still holding the old array can finish with it.
+uint32_t Dir24Fib::allocGroup(uint32_t fill) {
+    if (free_tbl8_.empty()) {
+        size_t capacity = tbl8_capacity_ * 2;
+        if (capacity > kMaxTbl8Groups) {
+            throw std::bad_alloc();
+        }
+        uint32_t* grown = static_cast<uint32_t*>(calloc(capacity * kTbl8GroupEntries, sizeof(uint32_t)));
+        if (!grown) {
+            throw std::bad_alloc();
+        }
+        memcpy(grown, tbl8_, tbl8_capacity_ * kTbl8GroupEntries * sizeof(uint32_t));
+        uint32_t* old = tbl8_;
+        __atomic_store_n(&tbl8_, grown, __ATOMIC_RELEASE);
+        if (reclaimer_) {
+            reclaimer_->retire([old]() { free(old); });
+        } else {
+            free(old);
+        }
+        for (size_t g = capacity; g > tbl8_capacity_; --g) {
+            free_tbl8_.push_back(static_cast<uint32_t>(g - 1));
+        }
+        tbl8_capacity_ = capacity;
+    }
+    uint32_t group = free_tbl8_.back();
+    free_tbl8_.pop_back();
+
+    uint32_t* entries = tbl8_ + static_cast<size_t>(group) * kTbl8GroupEntries;
+    for (size_t i = 0; i < kTbl8GroupEntries; ++i) {
+        entries[i] = fill;
+    }
+    return group;
+}
+
+// A collapsed group may still be read through a stale tbl24 entry, so it only
+// goes back on the free list once those readers are gone.
+void Dir24Fib::releaseGroup(uint32_t group) {
+    if (reclaimer_) {
+        reclaimer_->retire([this, group]() { free_tbl8_.push_back(group); });
+    } else {
+        free_tbl8_.push_back(group);
+    }
+}
+
+// Folds a tbl8 group back into its tbl24 slot once every entry in it comes
+// from the same /24-or-shorter route (or from no route at all).
+void Dir24Fib::tryCollapseGroup(uint32_t tbl24_index) {
+    uint32_t group = tbl24_[tbl24_index] & kValueMask;
+    uint32_t* entries = tbl8_ + static_cast<size_t>(group) * kTbl8GroupEntries;
+
+    uint32_t first = entries[0];
+    if ((first & kValid) && entryDepth(first) > 24) {
+        return;
+    }
+    for (size_t i = 1; i < kTbl8GroupEntries; ++i) {
+        if (entries[i] != first) {
+            return;
+        }
+    }
+    storeEntry(&tbl24_[tbl24_index], first);
+    releaseGroup(group);
+}
+
+void Dir24Fib::insert(uint32_t prefix, int length, uint32_t value) {
+    uint32_t entry = makeEntry(value, length);
+
+    if (length <= 24) {
+        uint32_t first = prefix >> 8;
+        uint32_t count = 1u << (24 - length);
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t current = tbl24_[i];
+            if (!(current & kExtended)) {
+                if (!(current & kValid) || entryDepth(current) <= length) {
+                    storeEntry(&tbl24_[i], entry);
+                }
+                continue;
+            }
+            uint32_t* entries = tbl8_ + static_cast<size_t>(current & kValueMask) * kTbl8GroupEntries;
+            for (size_t j = 0; j < kTbl8GroupEntries; ++j) {
+                if (!(entries[j] & kValid) || entryDepth(entries[j]) <= length) {
+                    storeEntry(&entries[j], entry);
+                }
+            }
+            tryCollapseGroup(i);
+        }
+        return;
+    }
+
+    uint32_t index = prefix >> 8;
+    if (!(tbl24_[index] & kExtended)) {
+        uint32_t group = allocGroup(tbl24_[index]);
+        storeEntry(&tbl24_[index], kValid | kExtended | group);
+    }
+    uint32_t* entries = tbl8_ + static_cast<size_t>(tbl24_[index] & kValueMask) * kTbl8GroupEntries;
+    uint32_t first = prefix & 0xFF;
+    uint32_t count = 1u << (32 - length);
+    for (uint32_t j = first; j < first + count; ++j) {
+        if (!(entries[j] & kValid) || entryDepth(entries[j]) <= length) {
+            storeEntry(&entries[j], entry);
+        }
+    }
+}
+
+void Dir24Fib::remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length) {
+    uint32_t replacement = replacement_length < 0 ? 0 : makeEntry(replacement_value, replacement_length);
+
+    if (length <= 24) {
+        uint32_t first = prefix >> 8;
+        uint32_t count = 1u << (24 - length);
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t current = tbl24_[i];
+            if (!(current & kExtended)) {
+                if ((current & kValid) && entryDepth(current) == length) {
+                    storeEntry(&tbl24_[i], replacement);
+                }
+                continue;
+            }
+            uint32_t* entries = tbl8_ + static_cast<size_t>(current & kValueMask) * kTbl8GroupEntries;
+            for (size_t j = 0; j < kTbl8GroupEntries; ++j) {
+                if ((entries[j] & kValid) && entryDepth(entries[j]) == length) {
+                    storeEntry(&entries[j], replacement);
+                }
+            }
+            tryCollapseGroup(i);
+        }
+        return;
+    }
+
+    uint32_t index = prefix >> 8;
+    if (!(tbl24_[index] & kExtended)) {
+        return;
+    }
+    uint32_t* entries = tbl8_ + static_cast<size_t>(tbl24_[index] & kValueMask) * kTbl8GroupEntries;
+    uint32_t first = prefix & 0xFF;
+    uint32_t count = 1u << (32 - length);
+    for (uint32_t j = first; j < first + count; ++j) {
+        if ((entries[j] & kValid) && entryDepth(entries[j]) == length) {
+            storeEntry(&entries[j], replacement);
+        }
+    }
+    tryCollapseGroup(index);
+}
+
+bool Dir24Fib::kernelSupported(Kernel kernel) {
+    switch (kernel) {
+    case kScalar:
+        return true;
+#ifdef DIR24_FIB_X86
+    case kAvx2:
+        return __builtin_cpu_supports("avx2");
+    case kAvx512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char* Dir24Fib::kernelName(Kernel kernel) {
+    switch (kernel) {
+    case kAvx2:
+        return "avx2";
+    case kAvx512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+bool Dir24Fib::setKernel(Kernel kernel) {
+    if (!kernelSupported(kernel)) {
+        return false;
+    }
+    kernel_ = kernel;
+    return true;
+}
+
+void Dir24Fib::lookupBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    switch (kernel_) {
+    case kAvx512:
+        lookupAvx512(addresses, count, values, lengths);
+        break;
+    case kAvx2:
+        lookupAvx2(addresses, count, values, lengths);
+        break;
+    default:
+        lookupScalar(addresses, count, values, lengths);
+        break;
+    }
+}
+
+void Dir24Fib::lookupScalar(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    for (size_t i = 0; i < count; ++i) {
+        __builtin_prefetch(&tbl24_[addresses[i] >> 8]);
+    }
+    // tbl8 is only read after the tbl24 entries that point into it
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = __atomic_load_n(&tbl24_[addresses[i] >> 8], __ATOMIC_ACQUIRE);
+    }
+    const uint32_t* tbl8 = __atomic_load_n(&tbl8_, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; ++i) {
+        if (values[i] & kExtended) {
+            __builtin_prefetch(&tbl8[((values[i] & kValueMask) << 8) | (addresses[i] & 0xFF)]);
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t entry = values[i];
+        if (entry & kExtended) {
+            entry = tbl8[((entry & kValueMask) << 8) | (addresses[i] & 0xFF)];
+        }
+        values[i] = entry & kValueMask;
+        lengths[i] = (entry & kValid) ? entryDepth(entry) : -1;
+    }
+}
+
+#ifdef DIR24_FIB_X86
+
+// Both SIMD kernels follow the scalar lookup() step for step on a whole vector
+// of addresses: gather tbl24, then re-gather only the extended lanes from tbl8
+// and decode value/length. The tail that does not fill a vector goes scalar.
+
+__attribute__((target("avx2")))
+void Dir24Fib::lookupAvx2(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    const __m256i extended = _mm256_set1_epi32(static_cast<int>(kExtended));
+    const __m256i value_mask = _mm256_set1_epi32(static_cast<int>(kValueMask));
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i depth_mask = _mm256_set1_epi32(0x3F);
+    const __m256i no_route = _mm256_set1_epi32(-1);
+    const int* tbl24 = reinterpret_cast<const int*>(tbl24_);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i address = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(addresses + i));
+        __m256i entry = _mm256_i32gather_epi32(tbl24, _mm256_srli_epi32(address, 8), 4);
+        const int* tbl8 = reinterpret_cast<const int*>(__atomic_load_n(&tbl8_, __ATOMIC_ACQUIRE));
+
+        __m256i in_tbl8 = _mm256_cmpeq_epi32(_mm256_and_si256(entry, extended), extended);
+        if (!_mm256_testz_si256(in_tbl8, in_tbl8)) {
+            __m256i index = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(entry, value_mask), 8),
+                                            _mm256_and_si256(address, low_byte));
+            entry = _mm256_mask_i32gather_epi32(entry, tbl8, index, in_tbl8, 4);
+        }
+
+        // kValid is the sign bit
+        __m256i valid = _mm256_srai_epi32(entry, 31);
+        __m256i depth = _mm256_and_si256(_mm256_srli_epi32(entry, kDepthShift), depth_mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i), _mm256_and_si256(entry, value_mask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lengths + i), _mm256_blendv_epi8(no_route, depth, valid));
+    }
+    lookupScalar(addresses + i, count - i, values + i, lengths + i);
+}
+
+__attribute__((target("avx512f")))
+void Dir24Fib::lookupAvx512(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    const __m512i extended = _mm512_set1_epi32(static_cast<int>(kExtended));
+    const __m512i valid_bit = _mm512_set1_epi32(static_cast<int>(kValid));
+    const __m512i value_mask = _mm512_set1_epi32(static_cast<int>(kValueMask));
+    const __m512i low_byte = _mm512_set1_epi32(0xFF);
+    const __m512i depth_mask = _mm512_set1_epi32(0x3F);
+    const __m512i no_route = _mm512_set1_epi32(-1);
+    // GCC's unmasked gathers and shifts pass an undefined source vector, which
+    // -Wmaybe-uninitialized reports; the all-lanes masked forms with a zero
+    // source compile to the same instructions
+    const __m512i zero = _mm512_setzero_si512();
+    const __mmask16 all = 0xFFFF;
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i address = _mm512_loadu_si512(addresses + i);
+        __m512i entry = _mm512_mask_i32gather_epi32(zero, all, _mm512_maskz_srli_epi32(all, address, 8), tbl24_, 4);
+        const uint32_t* tbl8 = __atomic_load_n(&tbl8_, __ATOMIC_ACQUIRE);
+
+        __mmask16 in_tbl8 = _mm512_test_epi32_mask(entry, extended);
+        if (in_tbl8) {
+            __m512i index = _mm512_or_si512(_mm512_maskz_slli_epi32(all, _mm512_and_si512(entry, value_mask), 8),
+                                            _mm512_and_si512(address, low_byte));
+            entry = _mm512_mask_i32gather_epi32(entry, in_tbl8, index, tbl8, 4);
+        }
+
+        __mmask16 valid = _mm512_test_epi32_mask(entry, valid_bit);
+        __m512i depth = _mm512_and_si512(_mm512_maskz_srli_epi32(all, entry, kDepthShift), depth_mask);
+        _mm512_storeu_si512(values + i, _mm512_and_si512(entry, value_mask));
+        _mm512_storeu_si512(lengths + i, _mm512_mask_blend_epi32(valid, no_route, depth));
+    }
+    lookupScalar(addresses + i, count - i, values + i, lengths + i);
+}
+
+#else
+
+void Dir24Fib::lookupAvx2(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    lookupScalar(addresses, count, values, lengths);
+}
+
+void Dir24Fib::lookupAvx512(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    lookupScalar(addresses, count, values, lengths);
+}
+
+#endif /* DIR24_FIB_X86 */
@@ -0,0 +1,114 @@
+/**
+ * @file dir24_fib.h
+ * @brief DIR-24-8 compiled IPv4 forwarding table
+ *
+ * A 2^24 entry first level indexed by the top 24 address bits plus 256 entry
+ * overflow groups for prefixes longer than /24. Every entry records the value
+ * and the length of the prefix that produced it, which lets routes be added
+ * and removed incrementally without consulting the rest of the table.
+ * Addresses and prefixes are IPv4 in host byte order.
+ *
+ * One writer at a time; lookups may run concurrently with it from any number
+ * of threads inside an EpochGuard. Entries are published with release
+ * stores, and overflow groups and outgrown group pools are handed to the
+ * owner's EpochReclaimer instead of being reused or freed in place.
+ */
+
+#ifndef _DIR24_FIB_H
+#define _DIR24_FIB_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+class EpochReclaimer;
+
+class Dir24Fib {
+public:
+    // values must fit in 24 bits
+    static const uint32_t kMaxValue = 0x00FFFFFF;
+
+    // lookupBatch() implementations; the best one the CPU supports is picked
+    // at construction time
+    enum Kernel {
+        kScalar,    // prefetching scalar loop
+        kAvx2,      // 8 addresses per gather
+        kAvx512     // 16 addresses per gather
+    };
+    static bool kernelSupported(Kernel kernel);
+    static const char* kernelName(Kernel kernel);
+
+    // without a reclaimer, retired memory is reused at once (single threaded use)
+    explicit Dir24Fib(EpochReclaimer* reclaimer = nullptr);
+    ~Dir24Fib();
+
+    Dir24Fib(const Dir24Fib&) = delete;
+    Dir24Fib& operator=(const Dir24Fib&) = delete;
+
+    // Installs prefix/length -> value, overriding only the parts of its range
+    // that are covered by an equal or shorter prefix.
+    void insert(uint32_t prefix, int length, uint32_t value);
+
+    // Withdraws prefix/length, handing its range back to the covering route
+    // (replacement_length < 0 when nothing covers it).
+    void remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length);
+
+    // One tbl24 access, plus one tbl8 access for addresses under a >/24 prefix.
+    bool lookup(uint32_t address, uint32_t* value, int* length) const {
+        uint32_t entry = __atomic_load_n(&tbl24_[address >> 8], __ATOMIC_ACQUIRE);
+        if (entry & kExtended) {
+            const uint32_t* tbl8 = __atomic_load_n(&tbl8_, __ATOMIC_ACQUIRE);
+            entry = __atomic_load_n(&tbl8[((entry & kValueMask) << 8) | (address & 0xFF)], __ATOMIC_RELAXED);
+        }
+        if (!(entry & kValid)) {
+            return false;
+        }
+        *value = entry & kValueMask;
+        *length = (entry >> kDepthShift) & 0x3F;
+        return true;
+    }
+
+    // Batched form of lookup(), run by the selected kernel. The scalar kernel
+    // issues (prefetches) all first-level loads of the batch before consuming
+    // any, then the same for the overflow groups, so the cache misses of
+    // different addresses overlap; the SIMD kernels gather both levels for a
+    // whole vector of addresses at once. lengths[i] is -1 when addresses[i]
+    // has no route.
+    void lookupBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+
+    Kernel kernel() const { return kernel_; }
+    // returns false (and keeps the current kernel) if the CPU lacks support
+    bool setKernel(Kernel kernel);
+
+    size_t tbl8GroupsInUse() const { return tbl8_capacity_ - free_tbl8_.size(); }
+
+private:
+    static const uint32_t kValid = 0x80000000u;
+    static const uint32_t kExtended = 0x40000000u;
+    static const uint32_t kDepthShift = 24;
+    static const uint32_t kValueMask = 0x00FFFFFF;
+
+    static uint32_t makeEntry(uint32_t value, int length) {
+        return kValid | (static_cast<uint32_t>(length) << kDepthShift) | value;
+    }
+    static int entryDepth(uint32_t entry) { return (entry >> kDepthShift) & 0x3F; }
+
+    void lookupScalar(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+    void lookupAvx2(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+    void lookupAvx512(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+
+    static void storeEntry(uint32_t* slot, uint32_t entry) { __atomic_store_n(slot, entry, __ATOMIC_RELEASE); }
+
+    uint32_t allocGroup(uint32_t fill);
+    void releaseGroup(uint32_t group);
+    void tryCollapseGroup(uint32_t tbl24_index);
+
+    EpochReclaimer* reclaimer_;
+    uint32_t* tbl24_;
+    uint32_t* tbl8_;
+    size_t tbl8_capacity_;          // in 256 entry groups
+    std::vector<uint32_t> free_tbl8_;
+    Kernel kernel_;
+};
+
+#endif /* _DIR24_FIB_H */
@@ -0,0 +1,111 @@
+#include <atomic>
+
+#include "epoch.h"
+
+namespace {
+
+// One record per thread that has ever entered a critical section. Records
+// are never freed; a record whose thread exited is handed to the next thread.
+struct alignas(64) ThreadRecord {
+    std::atomic<uint64_t> epoch;    // 0 while quiescent
+    std::atomic<bool> in_use;
+    ThreadRecord* next;
+    unsigned depth;                 // guard nesting, owner thread only
+
+    ThreadRecord() : epoch(0), in_use(true), next(nullptr), depth(0) {}
+};
+
+// starts above 0 so that 0 can mean "not reading"
+std::atomic<uint64_t> global_epoch(2);
+std::atomic<ThreadRecord*> records(nullptr);
+
+ThreadRecord* acquireRecord() {
+    for (ThreadRecord* r = records.load(std::memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed) &&
+            r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return r;
+        }
+    }
+    ThreadRecord* r = new ThreadRecord();
+    ThreadRecord* head = records.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (!records.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+    return r;
+}
+
+struct ThreadSlot {
+    ThreadRecord* record;
+
+    ThreadSlot() : record(acquireRecord()) {}
+    ~ThreadSlot() {
+        record->epoch.store(0, std::memory_order_release);
+        record->in_use.store(false, std::memory_order_release);
+    }
+};
+
+ThreadRecord* currentRecord() {
+    static thread_local ThreadSlot slot;
+    return slot.record;
+}
+
+// The epoch may only advance once every active reader has observed it.
+uint64_t tryAdvance() {
+    uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+    for (ThreadRecord* r = records.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t seen = r->epoch.load(std::memory_order_seq_cst);
+        if (seen != 0 && seen != epoch) {
+            return epoch;
+        }
+    }
+    global_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    return global_epoch.load(std::memory_order_seq_cst);
+}
+
+} // namespace
+
+EpochGuard::EpochGuard() {
+    ThreadRecord* r = currentRecord();
+    if (r->depth++ == 0) {
+        r->epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+EpochGuard::~EpochGuard() {
+    ThreadRecord* r = currentRecord();
+    if (--r->depth == 0) {
+        r->epoch.store(0, std::memory_order_release);
+    }
+}
+
+EpochReclaimer::~EpochReclaimer() {
+    for (size_t i = 0; i < retired_.size(); ++i) {
+        retired_[i].reclaim();
+    }
+}
+
+void EpochReclaimer::retire(std::function<void()> reclaim) {
+    Retired item;
+    item.epoch = global_epoch.load(std::memory_order_seq_cst);
+    item.reclaim = std::move(reclaim);
+    retired_.push_back(std::move(item));
+}
+
+void EpochReclaimer::reclaim() {
+    if (retired_.empty()) {
+        return;
+    }
+    // a second step lets a quiet system free everything in one call
+    tryAdvance();
+    uint64_t epoch = tryAdvance();
+
+    // retired entries are in epoch order
+    size_t done = 0;
+    while (done < retired_.size() && retired_[done].epoch + 2 <= epoch) {
+        retired_[done].reclaim();
+        ++done;
+    }
+    retired_.erase(retired_.begin(), retired_.begin() + done);
+}
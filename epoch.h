@@ -0,0 +1,58 @@
+/**
+ * @file epoch.h
+ * @brief Epoch-based reclamation for lock-free readers
+ *
+ * Readers wrap every access to shared structures in an EpochGuard. Writers
+ * unlink an object first and then retire() it; the reclamation runs only once
+ * the global epoch has moved on twice, i.e. once every reader that could
+ * still be holding the object has left its critical section. Readers never
+ * block and never write shared cache lines other than their own record.
+ */
+
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Read-side critical section for the calling thread. Nests freely; only the
+// outermost guard publishes and clears the thread's epoch.
+class EpochGuard {
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// Writer-side list of retired objects for one data structure. Not thread
+// safe: callers serialize on the lock that already protects their writes.
+class EpochReclaimer {
+public:
+    EpochReclaimer() {}
+    // runs every pending reclamation; no reader may still be inside the
+    // structure at this point
+    ~EpochReclaimer();
+
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    // Schedules reclaim to run once no reader can still observe what the
+    // caller has just unlinked.
+    void retire(std::function<void()> reclaim);
+    // Tries to advance the global epoch and runs what has become safe.
+    void reclaim();
+    size_t pending() const { return retired_.size(); }
+
+private:
+    struct Retired {
+        uint64_t epoch;
+        std::function<void()> reclaim;
+    };
+    std::vector<Retired> retired_;
+};
+
+#endif /* _EPOCH_H */
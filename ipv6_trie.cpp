@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "ipv6_trie.h"
+#include "epoch.h"
+
+static uint64_t wordMask(int length) {
+    return length <= 0 ? 0 : length >= 64 ? ~0ULL : ~0ULL << (64 - length);
+}
+
+static uint64_t loadWord(const unsigned char* bytes) {
+    uint64_t word = 0;
+    for (int i = 0; i < 8; ++i) {
+        word = (word << 8) | bytes[i];
+    }
+    return word;
+}
+
+static void storeWord(uint64_t word, unsigned char* bytes) {
+    for (int i = 7; i >= 0; --i) {
+        bytes[i] = static_cast<unsigned char>(word);
+        word >>= 8;
+    }
+}
+
+// whether the first length bits of address and key agree
+static bool prefixMatches(const IPv6Address& address, const IPv6Address& key, int length) {
+    if (length <= 64) {
+        return ((address.hi ^ key.hi) & wordMask(length)) == 0;
+    }
+    return address.hi == key.hi && ((address.lo ^ key.lo) & wordMask(length - 64)) == 0;
+}
+
+static int commonLength(const IPv6Address& a, int a_length, const IPv6Address& b, int b_length) {
+    int same;
+    if (a.hi != b.hi) {
+        same = __builtin_clzll(a.hi ^ b.hi);
+    } else if (a.lo != b.lo) {
+        same = 64 + __builtin_clzll(a.lo ^ b.lo);
+    } else {
+        same = 128;
+    }
+    return std::min(same, std::min(a_length, b_length));
+}
+
+IPv6Address IPv6Address::fromIn6(const in6_addr& address) {
+    IPv6Address result;
+    result.hi = loadWord(address.s6_addr);
+    result.lo = loadWord(address.s6_addr + 8);
+    return result;
+}
+
+in6_addr IPv6Address::toIn6() const {
+    in6_addr result;
+    storeWord(hi, result.s6_addr);
+    storeWord(lo, result.s6_addr + 8);
+    return result;
+}
+
+IPv6Address IPv6Address::masked(int length) const {
+    IPv6Address result;
+    result.hi = hi & wordMask(length);
+    result.lo = lo & wordMask(length - 64);
+    return result;
+}
+
+IPv6Address IPv6Address::lastInPrefix(int length) const {
+    IPv6Address result;
+    result.hi = hi | ~wordMask(length);
+    result.lo = lo | ~wordMask(length - 64);
+    return result;
+}
+
+// key and length never change once a node is linked; value (0 for glue) and
+// the child links are read by lock-free readers
+struct Ipv6Trie::Node {
+    IPv6Address key;
+    int length;
+    uint32_t value;
+    Node* child[2];
+};
+
+Ipv6Trie::Ipv6Trie(EpochReclaimer* reclaimer) : reclaimer_(reclaimer), root_(nullptr), routes_(0) {}
+
+Ipv6Trie::~Ipv6Trie() {
+    std::vector<Node*> pending;
+    if (root_) {
+        pending.push_back(root_);
+    }
+    while (!pending.empty()) {
+        Node* node = pending.back();
+        pending.pop_back();
+        for (int i = 0; i < 2; ++i) {
+            if (node->child[i]) {
+                pending.push_back(node->child[i]);
+            }
+        }
+        delete node;
+    }
+}
+
+Ipv6Trie::Node* Ipv6Trie::newNode(const IPv6Address& key, int length, uint32_t value) {
+    Node* node = new Node();
+    node->key = key;
+    node->length = length;
+    node->value = value;
+    node->child[0] = node->child[1] = nullptr;
+    return node;
+}
+
+void Ipv6Trie::retireNode(Node* node) {
+    if (reclaimer_) {
+        reclaimer_->retire([node]() { delete node; });
+    } else {
+        delete node;
+    }
+}
+
+uint32_t Ipv6Trie::insert(const IPv6Address& prefix, int length, uint32_t value) {
+    IPv6Address key = prefix.masked(length);
+    Node** link = &root_;
+    while (true) {
+        Node* node = *link;
+        if (!node) {
+            __atomic_store_n(link, newNode(key, length, value), __ATOMIC_RELEASE);
+            ++routes_;
+            return 0;
+        }
+        int common = commonLength(node->key, node->length, key, length);
+
+        if (common == node->length && common == length) {
+            uint32_t old = node->value;
+            if (!old) {
+                ++routes_;
+            }
+            __atomic_store_n(&node->value, value, __ATOMIC_RELEASE);
+            return old;
+        }
+        if (common == node->length) {
+            link = &node->child[key.bit(node->length)];
+            continue;
+        }
+
+        // the replacement subtree is complete before it is linked
+        Node* fresh = newNode(key, length, value);
+        ++routes_;
+        if (common == length) {
+            // the new prefix covers the node
+            fresh->child[node->key.bit(length)] = node;
+            __atomic_store_n(link, fresh, __ATOMIC_RELEASE);
+            return 0;
+        }
+        Node* glue = newNode(key.masked(common), common, 0);
+        glue->child[key.bit(common)] = fresh;
+        glue->child[!key.bit(common)] = node;
+        __atomic_store_n(link, glue, __ATOMIC_RELEASE);
+        return 0;
+    }
+}
+
+uint32_t Ipv6Trie::remove(const IPv6Address& prefix, int length) {
+    IPv6Address key = prefix.masked(length);
+    Node** parent_link = nullptr;
+    Node** link = &root_;
+    while (*link) {
+        Node* node = *link;
+        if (node->length > length || !prefixMatches(key, node->key, node->length)) {
+            return 0;
+        }
+        if (node->length == length) {
+            break;
+        }
+        parent_link = link;
+        link = &node->child[key.bit(node->length)];
+    }
+    if (!*link || !(*link)->value) {
+        return 0;
+    }
+
+    Node* node = *link;
+    uint32_t old = node->value;
+    --routes_;
+    if (node->child[0] && node->child[1]) {
+        __atomic_store_n(&node->value, 0u, __ATOMIC_RELEASE);   // stays as glue
+        return old;
+    }
+
+    Node* child = node->child[0] ? node->child[0] : node->child[1];
+    __atomic_store_n(link, child, __ATOMIC_RELEASE);
+    retireNode(node);
+
+    // a glue parent left with one child is no longer needed
+    if (!child && parent_link) {
+        Node* glue = *parent_link;
+        if (!glue->value) {
+            __atomic_store_n(parent_link, glue->child[0] ? glue->child[0] : glue->child[1], __ATOMIC_RELEASE);
+            retireNode(glue);
+        }
+    }
+    return old;
+}
+
+bool Ipv6Trie::searchBest(const IPv6Address& prefix, int length, uint32_t* value, int* matched_length) const {
+    uint32_t best = 0;
+    int best_length = -1;
+    for (const Node* node = __atomic_load_n(&root_, __ATOMIC_ACQUIRE); node;) {
+        if (node->length > length || !prefixMatches(prefix, node->key, node->length)) {
+            break;
+        }
+        if (uint32_t routed = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE)) {
+            best = routed;
+            best_length = node->length;
+        }
+        if (node->length == length) {
+            break;
+        }
+        node = __atomic_load_n(&node->child[prefix.bit(node->length)], __ATOMIC_ACQUIRE);
+    }
+    if (!best) {
+        return false;
+    }
+    *value = best;
+    *matched_length = best_length;
+    return true;
+}
+
+// Each pass moves every lane one node down and prefetches the node it will
+// read on the next pass, so a group pays roughly one miss per level instead
+// of one per level and address.
+void Ipv6Trie::lookupBatch(const IPv6Address* addresses, size_t count, uint32_t* values, int* lengths) const {
+    static const size_t kLanes = 16;
+    const Node* root = __atomic_load_n(&root_, __ATOMIC_ACQUIRE);
+    for (size_t base = 0; base < count; base += kLanes) {
+        size_t lanes = std::min(kLanes, count - base);
+        const Node* node[kLanes];
+        for (size_t l = 0; l < lanes; ++l) {
+            node[l] = root;
+            values[base + l] = 0;
+            lengths[base + l] = -1;
+        }
+        for (bool active = root != nullptr; active;) {
+            active = false;
+            for (size_t l = 0; l < lanes; ++l) {
+                const Node* current = node[l];
+                if (!current) {
+                    continue;
+                }
+                const IPv6Address& address = addresses[base + l];
+                node[l] = nullptr;
+                if (!prefixMatches(address, current->key, current->length)) {
+                    continue;
+                }
+                if (uint32_t routed = __atomic_load_n(&current->value, __ATOMIC_ACQUIRE)) {
+                    values[base + l] = routed;
+                    lengths[base + l] = current->length;
+                }
+                if (current->length == 128) {
+                    continue;
+                }
+                node[l] = __atomic_load_n(&current->child[address.bit(current->length)], __ATOMIC_ACQUIRE);
+                if (node[l]) {
+                    __builtin_prefetch(node[l]);
+                    active = true;
+                }
+            }
+        }
+    }
+}
+
+void Ipv6Trie::forEach(const std::function<void(const IPv6Address& prefix, int length, uint32_t value)>& visit) const {
+    std::vector<const Node*> pending;
+    if (const Node* root = __atomic_load_n(&root_, __ATOMIC_ACQUIRE)) {
+        pending.push_back(root);
+    }
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        if (uint32_t value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE)) {
+            visit(node->key, node->length, value);
+        }
+        for (int i = 1; i >= 0; --i) {
+            if (const Node* child = __atomic_load_n(&node->child[i], __ATOMIC_ACQUIRE)) {
+                pending.push_back(child);
+            }
+        }
+    }
+}
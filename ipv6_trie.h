@@ -0,0 +1,89 @@
+/**
+ * @file ipv6_trie.h
+ * @brief 128-bit patricia trie holding the IPv6 routes
+ *
+ * Keys are IPv6Address values: the address as two 64-bit words in host byte
+ * order, so prefix matches and branch bits are word operations instead of
+ * patricia.cxx's byte-at-a-time BIT_TEST. Values are 24-bit and non-zero (0
+ * means "no route"), which matches NexthopTable ids.
+ *
+ * Same threading model as Dir24Fib: one writer, any number of readers inside
+ * an EpochGuard. Nodes never move; the writer links a fully built node with a
+ * release store, and unlinked nodes are freed through the EpochReclaimer.
+ */
+
+#ifndef _IPV6_TRIE_H
+#define _IPV6_TRIE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <netinet/in.h>
+
+class EpochReclaimer;
+
+// IPv6 address or prefix, high word first, each word in host byte order.
+struct IPv6Address {
+    uint64_t hi;
+    uint64_t lo;
+
+    static IPv6Address fromIn6(const in6_addr& address);
+    in6_addr toIn6() const;
+    // the first length bits, rest zero
+    IPv6Address masked(int length) const;
+    // the first length bits, rest one: the last address inside the prefix
+    IPv6Address lastInPrefix(int length) const;
+    int bit(int position) const {
+        return position < 64 ? (hi >> (63 - position)) & 1 : (lo >> (127 - position)) & 1;
+    }
+
+    bool operator==(const IPv6Address& other) const { return hi == other.hi && lo == other.lo; }
+    bool operator!=(const IPv6Address& other) const { return !(*this == other); }
+    bool operator<(const IPv6Address& other) const {
+        return hi != other.hi ? hi < other.hi : lo < other.lo;
+    }
+    bool operator<=(const IPv6Address& other) const { return !(other < *this); }
+};
+
+class Ipv6Trie {
+public:
+    static const uint32_t kMaxValue = 0x00FFFFFF;
+
+    explicit Ipv6Trie(EpochReclaimer* reclaimer = nullptr);
+    ~Ipv6Trie();
+
+    Ipv6Trie(const Ipv6Trie&) = delete;
+    Ipv6Trie& operator=(const Ipv6Trie&) = delete;
+
+    // Writer side. insert() returns the value it replaces and remove() the
+    // value prefix/length had, 0 when the prefix was not routed.
+    uint32_t insert(const IPv6Address& prefix, int length, uint32_t value);
+    uint32_t remove(const IPv6Address& prefix, int length);
+
+    // Reader side, lock-free. Longest routed prefix covering prefix/length,
+    // itself included; lookup() is searchBest() of a full address.
+    bool searchBest(const IPv6Address& prefix, int length, uint32_t* value, int* matched_length) const;
+    bool lookup(const IPv6Address& address, uint32_t* value, int* length) const {
+        return searchBest(address, 128, value, length);
+    }
+    // Lock-free lookup of count addresses; lengths[i] is -1 when addresses[i]
+    // has no route. Walks groups of addresses a level at a time so their
+    // cache misses overlap.
+    void lookupBatch(const IPv6Address* addresses, size_t count, uint32_t* values, int* lengths) const;
+    // visits routes in address order (shorter prefix first on ties)
+    void forEach(const std::function<void(const IPv6Address& prefix, int length, uint32_t value)>& visit) const;
+
+    size_t routes() const { return routes_; }
+
+private:
+    struct Node;
+
+    Node* newNode(const IPv6Address& key, int length, uint32_t value);
+    void retireNode(Node* node);
+
+    EpochReclaimer* reclaimer_;
+    Node* root_;
+    size_t routes_;
+};
+
+#endif /* _IPV6_TRIE_H */
@@ -0,0 +1,349 @@
+#include <algorithm>
+#include <new>
+
+#include "lc_trie_fib.h"
+
+namespace {
+
+// trie node word: branch:5 | skip:5 | adr:22. A leaf (branch 0) holds the
+// index of its route in adr, an internal node the index of its first child.
+const uint32_t kAdrBits = 22;
+const uint32_t kAdrMask = (1u << kAdrBits) - 1;
+const uint32_t kNoRoute = kAdrMask;
+
+inline uint32_t makeNode(int branch, int skip, uint32_t adr) {
+    return (static_cast<uint32_t>(branch) << 27) | (static_cast<uint32_t>(skip) << kAdrBits) | adr;
+}
+inline int nodeBranch(uint32_t node) { return node >> 27; }
+inline int nodeSkip(uint32_t node) { return (node >> kAdrBits) & 0x1F; }
+inline uint32_t nodeAdr(uint32_t node) { return node & kAdrMask; }
+
+inline uint32_t lcMask(int length) {
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+// bits [position, position + count) of key, count > 0
+inline uint32_t extractBits(uint32_t key, int position, int count) {
+    return (key << position) >> (32 - count);
+}
+
+struct LcRoute {
+    uint32_t key;
+    uint32_t pre;       // longest other route that is a prefix of this one
+    uint32_t value;
+    int length;
+
+    bool covers(uint32_t address) const { return ((address ^ key) & lcMask(length)) == 0; }
+};
+
+} // namespace
+
+struct LcTrieFib::Chunk {
+    typedef LcRoute Route;
+
+    std::vector<uint32_t> nodes;
+    std::vector<LcRoute> routes;      // sorted by (key, length)
+    uint64_t depth_sum;
+    uint32_t leaves;
+    int max_depth;
+
+    // takes the routes
+    static Chunk* build(std::vector<LcRoute>& routes, double fill_factor, int max_branch);
+    void copyRoutes(std::vector<LcRoute>& out) const { out = routes; }
+    static void destroy(Chunk* chunk) { delete chunk; }
+
+    uint32_t lookup(uint32_t address) const {
+        uint32_t node = nodes[0];
+        int position = Table::kTopBits;
+        while (int branch = nodeBranch(node)) {
+            position += nodeSkip(node);
+            node = nodes[nodeAdr(node) + extractBits(address, position, branch)];
+            position += branch;
+        }
+        return nodeAdr(node);
+    }
+};
+
+namespace {
+
+class ChunkBuilder {
+public:
+    ChunkBuilder(std::vector<LcRoute>& routes, std::vector<uint32_t>& nodes, double fill_factor, int max_branch)
+        : routes_(routes), nodes_(nodes), fill_factor_(fill_factor), max_branch_(max_branch),
+          depth_sum_(0), leaves_(0), max_depth_(0) {}
+
+    void build() {
+        // pre chains: routes arrive sorted, so the open prefixes form a stack
+        std::vector<uint32_t> open;
+        std::vector<bool> is_prefix(routes_.size(), false);
+        for (size_t i = 0; i < routes_.size(); ++i) {
+            while (!open.empty() && !(routes_[open.back()].length < routes_[i].length &&
+                                      routes_[open.back()].covers(routes_[i].key))) {
+                open.pop_back();
+            }
+            routes_[i].pre = open.empty() ? kNoRoute : open.back();
+            if (!open.empty()) {
+                is_prefix[open.back()] = true;
+            }
+            open.push_back(static_cast<uint32_t>(i));
+        }
+        for (size_t i = 0; i < routes_.size(); ++i) {
+            if (!is_prefix[i]) {
+                base_.push_back(static_cast<uint32_t>(i));
+            }
+        }
+        nodes_.assign(1, 0);
+        buildNode(0, 0, base_.size(), kTopBitsPosition, 1);
+    }
+
+    uint64_t depthSum() const { return depth_sum_; }
+    uint32_t leaves() const { return leaves_; }
+    int maxDepth() const { return max_depth_; }
+
+private:
+    static const int kTopBitsPosition = 16;
+
+    uint32_t baseKey(size_t i) const { return routes_[base_[i]].key; }
+
+    void leaf(uint32_t node, uint32_t route, int depth) {
+        nodes_[node] = makeNode(0, 0, route);
+        depth_sum_ += depth;
+        ++leaves_;
+        max_depth_ = std::max(max_depth_, depth);
+    }
+
+    size_t occupiedBuckets(size_t first, size_t count, int position, int branch) const {
+        size_t occupied = 0;
+        uint32_t last = 0;
+        for (size_t i = first; i < first + count; ++i) {
+            uint32_t bucket = extractBits(baseKey(i), position, branch);
+            if (i == first || bucket != last) {
+                ++occupied;
+                last = bucket;
+            }
+        }
+        return occupied;
+    }
+
+    // Longest route covering the (empty) bucket region. Any such route is a
+    // prefix of the nearest base route on at least one side of the bucket.
+    uint32_t coveringRoute(size_t before, size_t after, size_t first, size_t count,
+                           uint32_t region, int region_length) const {
+        uint32_t best = kNoRoute;
+        int best_length = -1;
+        size_t sides[2] = {before, after};
+        for (int s = 0; s < 2; ++s) {
+            if (sides[s] < first || sides[s] >= first + count) {
+                continue;
+            }
+            for (uint32_t r = base_[sides[s]]; r != kNoRoute; r = routes_[r].pre) {
+                if (routes_[r].length <= region_length && routes_[r].covers(region)) {
+                    if (routes_[r].length > best_length) {
+                        best = r;
+                        best_length = routes_[r].length;
+                    }
+                    break;
+                }
+            }
+        }
+        return best;
+    }
+
+    void buildNode(uint32_t node, size_t first, size_t count, int position, int depth) {
+        if (count == 1) {
+            leaf(node, base_[first], depth);
+            return;
+        }
+        // base keys are distinct, so the first and last differ somewhere
+        int skip = __builtin_clz(baseKey(first) ^ baseKey(first + count - 1)) - position;
+        position += skip;
+
+        int branch = 1;
+        while (branch < max_branch_ && position + branch < 32 &&
+               occupiedBuckets(first, count, position, branch + 1) >= fill_factor_ * (1u << (branch + 1))) {
+            ++branch;
+        }
+
+        size_t children = nodes_.size();
+        if (children + (size_t(1) << branch) > kNoRoute) {
+            throw std::bad_alloc();
+        }
+        nodes_.resize(children + (size_t(1) << branch));
+        nodes_[node] = makeNode(branch, skip, static_cast<uint32_t>(children));
+
+        uint32_t region_base = baseKey(first) & lcMask(position);
+        size_t i = first;
+        for (uint32_t bucket = 0; bucket < (1u << branch); ++bucket) {
+            size_t start = i;
+            while (i < first + count && extractBits(baseKey(i), position, branch) == bucket) {
+                ++i;
+            }
+            uint32_t child = static_cast<uint32_t>(children + bucket);
+            if (i > start) {
+                buildNode(child, start, i - start, position + branch, depth + 1);
+            } else {
+                uint32_t region = region_base | (bucket << (32 - position - branch));
+                leaf(child, coveringRoute(start - 1, start, first, count, region, position + branch), depth + 1);
+            }
+        }
+    }
+
+    std::vector<LcRoute>& routes_;
+    std::vector<uint32_t>& nodes_;
+    std::vector<uint32_t> base_;
+    double fill_factor_;
+    int max_branch_;
+    uint64_t depth_sum_;
+    uint32_t leaves_;
+    int max_depth_;
+};
+
+} // namespace
+
+LcTrieFib::Chunk* LcTrieFib::Chunk::build(std::vector<LcRoute>& routes, double fill_factor, int max_branch) {
+    Chunk* chunk = new Chunk();
+    chunk->routes.swap(routes);
+    ChunkBuilder builder(chunk->routes, chunk->nodes, fill_factor, max_branch);
+    builder.build();
+    chunk->depth_sum = builder.depthSum();
+    chunk->leaves = builder.leaves();
+    chunk->max_depth = builder.maxDepth();
+    return chunk;
+}
+
+LcTrieFib::LcTrieFib(EpochReclaimer* reclaimer, double fill_factor, int max_branch)
+    : fill_factor_(fill_factor), max_branch_(std::min(std::max(max_branch, 1), 16)), table_(reclaimer) {}
+
+LcTrieFib::~LcTrieFib() {}
+
+void LcTrieFib::insert(uint32_t prefix, int length, uint32_t value) {
+    table_.insert(prefix, length, value, [this](std::vector<LcRoute>& routes) {
+        return Chunk::build(routes, fill_factor_, max_branch_);
+    });
+}
+
+void LcTrieFib::remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length) {
+    table_.remove(prefix, length, replacement_value, replacement_length, [this](std::vector<LcRoute>& routes) {
+        return Chunk::build(routes, fill_factor_, max_branch_);
+    });
+}
+
+bool LcTrieFib::lookup(uint32_t address, uint32_t* value, int* length) const {
+    const Chunk* chunk = table_.chunk(Table::slot(address));
+    if (chunk) {
+        for (uint32_t r = chunk->lookup(address); r != kNoRoute; r = chunk->routes[r].pre) {
+            const LcRoute& route = chunk->routes[r];
+            if (route.covers(address)) {
+                *value = route.value;
+                *length = route.length;
+                return true;
+            }
+        }
+    }
+    uint32_t entry = table_.top(Table::slot(address));
+    if (!(entry & Table::kValid)) {
+        return false;
+    }
+    *value = entry & Table::kValueMask;
+    *length = Table::entryDepth(entry);
+    return true;
+}
+
+// The burst is walked in groups of kLanes addresses, one trie level per pass
+// over the group: every lane prefetches its next node before any lane reads
+// it, so the cache misses of a group overlap instead of adding up.
+void LcTrieFib::lookupBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    static const size_t kLanes = 16;
+    for (size_t i = 0; i < count; ++i) {
+        table_.prefetchChunk(Table::slot(addresses[i]));
+    }
+
+    for (size_t base = 0; base < count; base += kLanes) {
+        size_t lanes = std::min(kLanes, count - base);
+        const Chunk* chunk[kLanes];
+        uint32_t node[kLanes];
+        int position[kLanes];
+        for (size_t l = 0; l < lanes; ++l) {
+            chunk[l] = table_.chunk(Table::slot(addresses[base + l]));
+            table_.prefetchTop(Table::slot(addresses[base + l]));
+            if (chunk[l]) {
+                __builtin_prefetch(chunk[l]);
+            }
+        }
+        for (size_t l = 0; l < lanes; ++l) {
+            if (chunk[l]) {
+                __builtin_prefetch(chunk[l]->nodes.data());
+            }
+        }
+        // pending[l] is the node lane l reads on the next pass, prefetched on
+        // this one
+        const uint32_t* pending[kLanes];
+        for (size_t l = 0; l < lanes; ++l) {
+            node[l] = makeNode(0, 0, kNoRoute);   // no chunk: a finished walk with no route
+            pending[l] = chunk[l] ? chunk[l]->nodes.data() : nullptr;
+            position[l] = Table::kTopBits;
+        }
+        for (bool active = true; active;) {
+            active = false;
+            for (size_t l = 0; l < lanes; ++l) {
+                if (!pending[l]) {
+                    continue;
+                }
+                node[l] = *pending[l];
+                pending[l] = nullptr;
+                if (int branch = nodeBranch(node[l])) {
+                    position[l] += nodeSkip(node[l]);
+                    pending[l] =
+                        &chunk[l]->nodes[nodeAdr(node[l]) + extractBits(addresses[base + l], position[l], branch)];
+                    __builtin_prefetch(pending[l]);
+                    position[l] += branch;
+                    active = true;
+                }
+            }
+        }
+
+        for (size_t l = 0; l < lanes; ++l) {
+            if (nodeAdr(node[l]) != kNoRoute) {
+                __builtin_prefetch(&chunk[l]->routes[nodeAdr(node[l])]);
+            }
+        }
+        for (size_t l = 0; l < lanes; ++l) {
+            uint32_t address = addresses[base + l];
+            bool found = false;
+            for (uint32_t r = nodeAdr(node[l]); r != kNoRoute && !found; r = chunk[l]->routes[r].pre) {
+                const LcRoute& route = chunk[l]->routes[r];
+                if (route.covers(address)) {
+                    values[base + l] = route.value;
+                    lengths[base + l] = route.length;
+                    found = true;
+                }
+            }
+            if (found) {
+                continue;
+            }
+            uint32_t entry = table_.top(Table::slot(address));
+            values[base + l] = (entry & Table::kValid) ? entry & Table::kValueMask : 0;
+            lengths[base + l] = (entry & Table::kValid) ? Table::entryDepth(entry) : -1;
+        }
+    }
+}
+
+void LcTrieFib::depthStats(double* average, int* maximum) const {
+    uint64_t sum = 0;
+    uint64_t leaves = 0;
+    *maximum = 0;
+    table_.forEachChunk([&](const Chunk& chunk) {
+        sum += chunk.depth_sum;
+        leaves += chunk.leaves;
+        *maximum = std::max(*maximum, chunk.max_depth);
+    });
+    *average = leaves ? static_cast<double>(sum) / leaves : 0;
+}
+
+size_t LcTrieFib::memoryBytes() const {
+    size_t bytes = sizeof(*this);
+    table_.forEachChunk([&bytes](const Chunk& chunk) {
+        bytes += sizeof(Chunk) + chunk.nodes.capacity() * sizeof(uint32_t) + chunk.routes.capacity() * sizeof(LcRoute);
+    });
+    return bytes;
+}
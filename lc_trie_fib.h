@@ -0,0 +1,69 @@
+/**
+ * @file lc_trie_fib.h
+ * @brief Level- and path-compressed trie (LC-trie) IPv4 forwarding table
+ *
+ * Alternative to Dir24Fib with a much smaller footprint. The top 16 address
+ * bits index a 2^16 entry direct table holding the best route of length 16
+ * or less; every /16 that also has longer routes gets its own LC-trie
+ * (Nilsson & Karlsson) over those routes. Inside a chunk, path compression
+ * skips bits that all routes below a node agree on, and level compression
+ * lets a node branch on as many bits at once as the fill factor allows, so
+ * a lookup is the direct table plus a handful of trie steps.
+ *
+ * Routes that are prefixes of other routes are kept out of the trie and
+ * reached through a "pre" chain from the leaves; empty branches point at the
+ * longest route covering them. A lookup ends with at most a few prefix
+ * compares along that chain.
+ *
+ * The direct table and the immutable chunks, rebuilt and republished on
+ * every update of a route longer than /16, are ChunkedFib's (chunked_fib.h).
+ * Same threading model as Dir24Fib: one writer, any number of readers inside
+ * an EpochGuard.
+ */
+
+#ifndef _LC_TRIE_FIB_H
+#define _LC_TRIE_FIB_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "chunked_fib.h"
+
+class LcTrieFib {
+public:
+    // values must fit in 24 bits
+    static const uint32_t kMaxValue = 0x00FFFFFF;
+
+    // fill_factor is the fraction of a node's 2^branch children that must be
+    // non-empty for it to branch on that many bits; max_branch caps the
+    // stride of any trie node. Defaults follow the LC-trie paper.
+    explicit LcTrieFib(EpochReclaimer* reclaimer = nullptr, double fill_factor = 0.5, int max_branch = 16);
+    ~LcTrieFib();
+
+    LcTrieFib(const LcTrieFib&) = delete;
+    LcTrieFib& operator=(const LcTrieFib&) = delete;
+
+    // Same contract as Dir24Fib::insert()/remove().
+    void insert(uint32_t prefix, int length, uint32_t value);
+    void remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length);
+
+    bool lookup(uint32_t address, uint32_t* value, int* length) const;
+    // lengths[i] is -1 when addresses[i] has no route
+    void lookupBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+
+    // Trie nodes visited below the direct table, averaged over the leaves of
+    // every chunk and at the deepest leaf.
+    void depthStats(double* average, int* maximum) const;
+    size_t chunks() const { return table_.chunks(); }
+    size_t memoryBytes() const;
+
+private:
+    struct Chunk;
+    typedef ChunkedFib<Chunk> Table;
+
+    double fill_factor_;
+    int max_branch_;
+    Table table_;
+};
+
+#endif /* _LC_TRIE_FIB_H */
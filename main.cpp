@@ -4,10 +4,36 @@
  */
 
 #include "route_tracker.h"
+#include "dir24_fib.h"
+#include "nexthop_table.h"
+#include "patricia.h"
+#include "compact_trie.h"
+#include "lc_trie_fib.h"
+#include "poptrie_fib.h"
+#include "snapshot_file.h"
+#include "tracked_table.h"
 #include <iostream>
+#include <fstream>
 #include <iomanip>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <random>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <tuple>
 using namespace  std;
 
+static void check(bool condition, const std::string& what) {
+    if (!condition) {
+        throw std::runtime_error("check failed: " + what);
+    }
+}
+
 // Test Cases
 void testAllRoutes() {
     std::cout << std::string(70, '=') << "\n";
@@ -168,6 +194,204 @@ void testEdgeCases() {
     tracker.deleteRoute("10.0.0.0/8");
 }
 
+// last nexthop reported per address, for tests that inspect notifications
+static std::map<std::string, std::string> last_nexthop;
+static int scoped_callback_count = 0;
+void recordCallback(const std::string& ip_address,
+                    const std::string& new_nexthop,
+                    const std::string& old_nexthop) {
+    scoped_callback_count++;
+    last_nexthop[ip_address] = new_nexthop;
+}
+
+void testScopedNotifications() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 5: Notifications only reach addresses inside the changed prefix" << endl;
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    tracker.addRoute("10.1.0.0/16", "nh-b");
+
+    tracker.registerAddress("10.1.2.3", &recordCallback);
+    tracker.registerAddress("10.2.0.1", &recordCallback);
+    tracker.registerAddress("192.168.1.1", &recordCallback);
+    check(last_nexthop["10.1.2.3"] == "nh-b", "10.1.2.3 resolves via 10.1.0.0/16");
+    check(last_nexthop["192.168.1.1"] == "", "192.168.1.1 starts unrouted");
+
+    // a less specific route than 10.1.0.0/16 must not touch 10.1.2.3
+    scoped_callback_count = 0;
+    tracker.addRoute("10.0.0.0/9", "nh-c");
+    check(scoped_callback_count == 1, "one address moves to 10.0.0.0/9");
+    check(last_nexthop["10.2.0.1"] == "nh-c", "10.2.0.1 resolves via 10.0.0.0/9");
+
+    scoped_callback_count = 0;
+    tracker.addRoute("10.1.2.0/24", "nh-d");
+    check(scoped_callback_count == 1 && last_nexthop["10.1.2.3"] == "nh-d", "10.1.2.3 moves to /24");
+
+    scoped_callback_count = 0;
+    tracker.deleteRoute("10.1.0.0/16");
+    check(scoped_callback_count == 0, "deleting an unused /16 notifies nobody");
+
+    tracker.deleteRoute("10.1.2.0/24");
+    check(last_nexthop["10.1.2.3"] == "nh-c", "10.1.2.3 falls back to 10.0.0.0/9");
+
+    tracker.addRoute("0.0.0.0/0", "default");
+    check(last_nexthop["192.168.1.1"] == "default", "default route reaches unrouted address");
+
+    tracker.unregisterAddress("10.1.2.3");
+    scoped_callback_count = 0;
+    tracker.addRoute("10.1.2.3/32", "host");
+    check(scoped_callback_count == 0, "unregistered address is no longer notified");
+    std::cout << "Scoped notification checks passed\n";
+}
+
+static std::string ipv4ToString(uint32_t address) {
+    char buf[INET_ADDRSTRLEN];
+    uint32_t net = htonl(address);
+    inet_ntop(AF_INET, &net, buf, sizeof(buf));
+    return buf;
+}
+
+// brute force longest prefix match over (prefix, length) -> nexthop
+static uint32_t prefixMaskForTest(int length) {
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+static std::string referenceMatch(const std::map<std::pair<uint32_t, int>, std::string>& routes,
+                                  uint32_t address) {
+    int best = -1;
+    std::string nexthop;
+    for (std::map<std::pair<uint32_t, int>, std::string>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+        int length = it->first.second;
+        uint32_t mask = length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+        if ((address & mask) == it->first.first && length > best) {
+            best = length;
+            nexthop = it->second;
+        }
+    }
+    return nexthop;
+}
+
+void testCompiledFib(RouteTracker::RibLayout layout, RouteTracker::LookupEngine engine) {
+    std::cout << std::string(70, '=') << "\n";
+    const char* engine_name = engine == RouteTracker::kLcTrieLookup    ? "LC-trie"
+                              : engine == RouteTracker::kPoptrieLookup ? "Poptrie"
+                                                                       : "DIR-24-8";
+    cout << "Test 6: Compiled " << engine_name << " table against a reference matcher ("
+         << (layout == RouteTracker::kCompactRib ? "compact" : "patricia") << " route table)" << endl;
+
+    RouteTracker tracker(layout, engine);
+    std::map<std::pair<uint32_t, int>, std::string> routes;
+    std::mt19937 rng(2024);
+
+    // keep everything under a few /8s so overflow groups and covering
+    // routes interact, with a sprinkling of short and host routes
+    const uint32_t bases[] = {0x0A000000u, 0xC0A80000u, 0xAC100000u};
+    for (int round = 0; round < 3000; ++round) {
+        int length = 8 + rng() % 25;
+        uint32_t address = bases[rng() % 3] | (rng() & 0x00FFFFFFu);
+        if (bases[0] == (address & 0xFF000000u) && rng() % 50 == 0) {
+            length = 1 + rng() % 7;
+        }
+        uint32_t mask = 0xFFFFFFFFu << (32 - length);
+        std::pair<uint32_t, int> key(address & mask, length);
+        std::string prefix = ipv4ToString(key.first) + "/" + std::to_string(length);
+
+        if (rng() % 3 == 0 && !routes.empty()) {
+            std::map<std::pair<uint32_t, int>, std::string>::iterator victim = routes.lower_bound(key);
+            if (victim == routes.end()) {
+                victim = routes.begin();
+            }
+            std::string victim_prefix = ipv4ToString(victim->first.first) + "/" + std::to_string(victim->first.second);
+            check(tracker.deleteRoute(victim_prefix), "delete " + victim_prefix);
+            routes.erase(victim);
+        } else {
+            std::string nexthop = "nh" + std::to_string(rng() % 64);
+            tracker.addRoute(prefix, nexthop);
+            routes[key] = nexthop;
+        }
+
+        if (round % 100 == 0 || round > 2900) {
+            for (int probe = 0; probe < 40; ++probe) {
+                uint32_t address = bases[rng() % 3] | (rng() & 0x00FFFFFFu);
+                if (probe % 2 == 0 && !routes.empty()) {
+                    // aim at the edges of a known prefix
+                    std::map<std::pair<uint32_t, int>, std::string>::iterator it = routes.lower_bound(std::make_pair(address, 0));
+                    if (it == routes.end()) {
+                        --it;
+                    }
+                    uint32_t span = it->first.second == 0 ? 0xFFFFFFFFu : ~(0xFFFFFFFFu << (32 - it->first.second));
+                    address = it->first.first + ((probe % 4 == 0) ? 0 : span);
+                    address += (rng() % 3) - 1;
+                }
+                Route* result = tracker.longestPrefixMatch(ipv4ToString(address));
+                std::string expected = referenceMatch(routes, address);
+                check((result ? result->nexthop : std::string()) == expected,
+                      "lookup " + ipv4ToString(address));
+                delete result;
+            }
+        }
+    }
+    std::cout << "Compiled table agreed with reference for " << routes.size() << " routes\n";
+
+    // a burst through lookupBatch must agree with the single-key path
+    std::vector<uint32_t> burst(300);
+    for (size_t i = 0; i < burst.size(); ++i) {
+        burst[i] = bases[rng() % 3] | (rng() & 0x00FFFFFFu);
+    }
+    std::vector<RouteMatch> results(burst.size());
+    tracker.lookupBatch(burst.data(), burst.size(), results.data());
+    for (size_t i = 0; i < burst.size(); ++i) {
+        Route* single = tracker.longestPrefixMatch(ipv4ToString(burst[i]));
+        check(results[i].found() == (single != nullptr), "batch found " + ipv4ToString(burst[i]));
+        if (single) {
+            check(results[i].nexthop == single->nexthop && ipv4ToString(results[i].prefix) == single->prefix,
+                  "batch match " + ipv4ToString(burst[i]));
+        }
+        delete single;
+    }
+    std::cout << "lookupBatch agreed with longestPrefixMatch for " << burst.size() << " addresses\n";
+}
+
+void testFibKernels() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 7: Vectorized DIR-24-8 lookup kernels" << endl;
+
+    Dir24Fib fib;
+    std::mt19937 rng(99);
+    for (uint32_t value = 0; value < 4000; ++value) {
+        int length = 12 + rng() % 21;
+        uint32_t prefix = (0x0A000000u | (rng() & 0x00FFFFFFu)) & (0xFFFFFFFFu << (32 - length));
+        fib.insert(prefix, length, value);
+    }
+
+    // odd sized burst so every kernel also runs its scalar tail
+    std::vector<uint32_t> addresses(1000 + 13);
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        addresses[i] = (i % 5 == 0) ? rng() : (0x0A000000u | (rng() & 0x00FFFFFFu));
+    }
+
+    const Dir24Fib::Kernel kernels[] = {Dir24Fib::kScalar, Dir24Fib::kAvx2, Dir24Fib::kAvx512};
+    for (size_t k = 0; k < 3; ++k) {
+        if (!fib.setKernel(kernels[k])) {
+            std::cout << "  " << Dir24Fib::kernelName(kernels[k]) << ": not supported on this CPU\n";
+            continue;
+        }
+        std::vector<uint32_t> values(addresses.size());
+        std::vector<int> lengths(addresses.size());
+        fib.lookupBatch(addresses.data(), addresses.size(), values.data(), lengths.data());
+        for (size_t i = 0; i < addresses.size(); ++i) {
+            uint32_t value = 0;
+            int length = -1;
+            bool found = fib.lookup(addresses[i], &value, &length);
+            check(found == (lengths[i] >= 0), std::string(Dir24Fib::kernelName(kernels[k])) + " found");
+            check(!found || (value == values[i] && length == lengths[i]),
+                  std::string(Dir24Fib::kernelName(kernels[k])) + " result for " + ipv4ToString(addresses[i]));
+        }
+        std::cout << "  " << Dir24Fib::kernelName(kernels[k]) << ": matches scalar lookup\n";
+    }
+}
+
 struct ThreadArgs {
     long id;
     RouteTracker* tracker;
@@ -259,9 +483,1465 @@ void* UnregisterThread(void* arg) {
     return nullptr;
 }
 
+struct ReaderArgs {
+    RouteTracker* tracker;
+    std::atomic<bool>* stop;
+    long lookups;
+    long bad;
+};
+
+// looks up addresses inside the churned 10.20.0.0/16 while routes change
+void* LockFreeReaderThread(void* arg) {
+    ReaderArgs* args = static_cast<ReaderArgs*>(arg);
+    uint32_t burst[32];
+    RouteMatch results[32];
+    uint32_t next = 1;
+
+    while (!args->stop->load()) {
+        for (int i = 0; i < 32; ++i) {
+            next = next * 1103515245u + 12345u;
+            burst[i] = 0x0A140000u | (next >> 16);
+        }
+        EpochGuard guard;
+        args->tracker->lookupBatch(burst, 32, results);
+        for (int i = 0; i < 32; ++i) {
+            const RouteMatch& match = results[i];
+            if (match.found() &&
+                (match.nexthop.substr(0, 3) != "NH-" || (match.prefix_length != 16 && match.prefix_length != 24 && match.prefix_length != 25))) {
+                args->bad++;
+            }
+        }
+        RouteMatch single = args->tracker->lookup(burst[0]);
+        if (single.found() && single.nexthop.substr(0, 3) != "NH-") {
+            args->bad++;
+        }
+        args->lookups += 33;
+    }
+    return nullptr;
+}
+
+void testLockFreeReaders() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 8: Lock-free readers during route churn" << endl;
+
+    RouteTracker tracker;
+    std::atomic<bool> stop(false);
+    const int kReaders = 3;
+    pthread_t readers[kReaders];
+    ReaderArgs args[kReaders];
+    for (int i = 0; i < kReaders; ++i) {
+        args[i] = ReaderArgs{&tracker, &stop, 0, 0};
+        pthread_create(&readers[i], nullptr, LockFreeReaderThread, &args[i]);
+    }
+
+    // keep replacing nexthops, deleting and re-adding so strings, slots and
+    // overflow groups all get retired while the readers run
+    for (int i = 0; i < 3000; ++i) {
+        std::string subnet = "10.20." + std::to_string(i % 256) + ".0/24";
+        tracker.addRoute(subnet, "NH-" + std::to_string(i));
+        tracker.addRoute("10.20." + std::to_string(i % 256) + ".128/25", "NH-x" + std::to_string(i));
+        if (i % 3 == 0) {
+            tracker.deleteRoute("10.20." + std::to_string(i % 256) + ".128/25");
+        }
+        if (i % 5 == 0) {
+            tracker.deleteRoute(subnet);
+        }
+        if (i % 500 == 0) {
+            tracker.addRoute("10.20.0.0/16", "NH-agg" + std::to_string(i));
+        }
+    }
+    stop = true;
+
+    long lookups = 0, bad = 0;
+    for (int i = 0; i < kReaders; ++i) {
+        pthread_join(readers[i], nullptr);
+        lookups += args[i].lookups;
+        bad += args[i].bad;
+    }
+    check(bad == 0, "readers saw only well-formed routes");
+    std::cout << "Readers completed " << lookups << " lookups during churn\n";
+}
+
+void testSnapshots() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 9: Point-in-time snapshots" << endl;
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh1");
+    tracker.addRoute("10.1.0.0/16", "nh2");
+    tracker.addRoute("192.168.1.0/24", "nh3");
+
+    RouteSnapshot before = tracker.snapshot();
+    tracker.addRoute("10.1.2.0/24", "nh4");
+    tracker.addRoute("10.0.0.0/8", "nh1b");
+    tracker.deleteRoute("192.168.1.0/24");
+    RouteSnapshot after = tracker.snapshot();
+
+    check(before.size() == 3 && after.size() == 3, "snapshot sizes");
+    check(before.lookup(0x0A010203).nexthop == "nh2", "old snapshot keeps the /16");
+    check(after.lookup(0x0A010203).nexthop == "nh4", "new snapshot sees the /24");
+    check(before.lookup(0xC0A80101).nexthop == "nh3", "old snapshot keeps the deleted route");
+    check(!after.lookup(0xC0A80101).found(), "new snapshot lost the deleted route");
+
+    std::vector<RouteDelta> changes;
+    RouteSnapshot::diff(before, after, changes);
+    check(changes.size() == 3, "diff reports three changes");
+    check(changes[0].prefix == 0x0A000000 && changes[0].old_nexthop == "nh1" && changes[0].new_nexthop == "nh1b",
+          "diff reports the replaced /8");
+    check(changes[1].prefix == 0x0A010200 && changes[1].prefix_length == 24 && changes[1].old_nexthop.empty(),
+          "diff reports the added /24");
+    check(changes[2].prefix == 0xC0A80100 && changes[2].new_nexthop.empty(), "diff reports the deleted route");
+
+    // what-if edits produce new snapshots and leave the tracker alone
+    RouteSnapshot what_if = after.withRoute(0x0A010200, 23, "nh5").withoutRoute(0x0A000000, 8);
+    check(what_if.size() == 3 && what_if.lookup(0x0A010302).nexthop == "nh5", "what-if snapshot");
+    check(!what_if.lookup(0x0A050505).found(), "what-if snapshot dropped the /8");
+    check(after.lookup(0x0A050505).nexthop == "nh1b", "source snapshot is untouched");
+    check(tracker.getAllRoutes().size() == 3, "tracker is untouched");
+
+    // lookups through a snapshot agree with the tracker
+    std::mt19937 rng(11);
+    for (int i = 0; i < 200; ++i) {
+        int length = 8 + rng() % 25;
+        uint32_t prefix = rng() & (0xFFFFFFFFu << (32 - length));
+        tracker.addRoute(ipv4ToString(prefix) + "/" + std::to_string(length), "r" + std::to_string(i));
+    }
+    RouteSnapshot current = tracker.snapshot();
+    check(current.size() == tracker.getAllRoutes().size(), "snapshot size matches getAllRoutes");
+    for (int i = 0; i < 2000; ++i) {
+        uint32_t address = rng();
+        RouteMatch expected = tracker.lookup(address);
+        RouteMatch actual = current.lookup(address);
+        check(expected.prefix_length == actual.prefix_length && expected.nexthop == actual.nexthop,
+              "snapshot lookup agrees with the tracker for " + ipv4ToString(address));
+    }
+    std::cout << "Snapshot checks passed\n";
+}
+
+void testBinaryApi() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 10: Binary and string_view entry points" << endl;
+
+    RouteTracker tracker;
+    check(tracker.addRoute(0x0A000000, 8, "nh-bin"), "addRoute with a host order address");
+    in_addr net;
+    inet_pton(AF_INET, "10.1.0.0", &net);
+    check(tracker.addRoute(net, 16, "nh-net"), "addRoute with an in_addr");
+    std::string text = "192.168.0.0/16 trailing text";
+    check(tracker.addRoute(std::string_view(text).substr(0, 14), "nh-view"), "addRoute with a string_view slice");
+
+    check(tracker.lookup(0x0A020304).nexthop == "nh-bin", "binary route is installed");
+    check(tracker.lookup(0x0A010203).nexthop == "nh-net", "in_addr route is installed");
+    check(tracker.lookup(0xC0A80101).nexthop == "nh-view", "string_view route is installed");
+
+    RouteMatch match = tracker.lookup("10.1.2.3");
+    check(match.prefix == 0x0A010000 && match.prefix_length == 16 && match.nexthop == "nh-net",
+          "text lookup returns prefix, length and nexthop");
+    inet_pton(AF_INET, "10.200.0.1", &net);
+    check(tracker.lookup(net).prefix_length == 8, "in_addr lookup");
+    check(!tracker.lookup("10.1.2.300").found(), "unparsable lookup finds nothing");
+    inet_pton(AF_INET, "10.1.0.0", &net);
+
+    // the parser is as strict as inet_pton and rejects trailing garbage
+    const char* bad_prefixes[] = {"10.0.0.0", "10.0.0.0/", "/8", "10.0.0/8", "10.0.0.0/33", "10.0.0.0/8x",
+                                  "10.0.0.0/-1", "256.0.0.0/8", "010.0.0.0/8", "10..0.0/8", "10.0.0.0.0/8",
+                                  "10.0.0.0/008", " 10.0.0.0/8"};
+    for (size_t i = 0; i < sizeof(bad_prefixes) / sizeof(bad_prefixes[0]); ++i) {
+        check(!tracker.addRoute(bad_prefixes[i], "bad"), std::string("rejects ") + bad_prefixes[i]);
+    }
+    check(!tracker.addRoute(0x0A000000, 33, "bad") && !tracker.deleteRoute(0x0A000000, -1), "rejects bad lengths");
+    check(tracker.addRoute("0.0.0.0/0", "default") && tracker.addRoute("255.255.255.255/32", "bcast"),
+          "accepts the extreme prefixes");
+
+    scoped_callback_count = 0;
+    check(tracker.registerAddress(0x0A010203, &recordCallback), "registerAddress with a binary address");
+    check(last_nexthop["10.1.2.3"] == "nh-net", "binary registration reports the formatted address");
+    check(!tracker.registerAddress("10.1.2", &recordCallback), "registerAddress rejects a short address");
+    check(tracker.deleteRoute(net, 16), "deleteRoute with an in_addr");
+    check(last_nexthop["10.1.2.3"] == "nh-bin", "registered address follows the delete");
+    check(tracker.unregisterAddress("10.1.2.3"), "text unregister finds the binary registration");
+    check(!tracker.unregisterAddress(0x0A010203), "address is gone");
+    check(tracker.deleteRoute(0x0A000000, 8), "deleteRoute with a host order address");
+    check(!tracker.lookup(0x0A020304).found() || tracker.lookup(0x0A020304).prefix_length == 0, "binary route removed");
+    std::cout << "Binary entry point checks passed\n";
+}
+
+void testNexthopInterning() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 11: Interned nexthops" << endl;
+
+    NexthopTable table;
+    uint32_t a = table.acquire("nh-a");
+    uint32_t b = table.acquire("nh-b");
+    check(a != 0 && b != 0 && a != b, "distinct nexthops get distinct ids");
+    check(table.acquire(std::string("nh-a")) == a, "equal nexthops share an id");
+    check(*table.get(a) == "nh-a" && table.size() == 2, "ids resolve to their string");
+    table.release(a);
+    check(table.get(a) && table.size() == 2, "id survives while referenced");
+    table.release(a);
+    check(table.size() == 1, "last release drops the nexthop");
+    uint32_t c = table.acquire("nh-c");
+    check(c == a && *table.get(c) == "nh-c", "released ids are reused");
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "shared-nh");
+    tracker.addRoute("172.16.0.0/12", std::string("shared-") + "nh");
+    tracker.addRoute("192.168.0.0/16", "other-nh");
+    EpochGuard guard;
+    RouteMatch first = tracker.lookup(0x0A000001);
+    RouteMatch second = tracker.lookup(0xAC100001);
+    check(first.nexthop.data() == second.nexthop.data(), "routes with equal nexthops share one string");
+    check(tracker.lookup(0xC0A80001).nexthop.data() != first.nexthop.data(), "different nexthops do not");
+
+    // re-pointing a route to its current nexthop notifies nobody
+    tracker.registerAddress("10.1.2.3", &recordCallback);
+    scoped_callback_count = 0;
+    tracker.addRoute("10.0.0.0/8", "shared-nh");
+    check(scoped_callback_count == 0, "unchanged nexthop is not reported");
+    tracker.addRoute("10.0.0.0/8", "other-nh");
+    check(scoped_callback_count == 1 && last_nexthop["10.1.2.3"] == "other-nh", "changed nexthop is reported");
+    check(tracker.lookup(0xAC100001).nexthop == "shared-nh", "other users of the old nexthop keep it");
+    tracker.unregisterAddress("10.1.2.3");
+    std::cout << "Nexthop interning checks passed\n";
+}
+
+void testPatriciaPool() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 12: Patricia node pool" << endl;
+
+    patricia_tree_t* tree = New_Patricia(32);
+    std::mt19937 rng(5);
+    std::vector<prefix_t*> prefixes;
+    for (int i = 0; i < 20000; ++i) {
+        int length = 8 + rng() % 25;
+        in_addr sin;
+        sin.s_addr = htonl(rng() & (0xFFFFFFFFu << (32 - length)));
+        prefixes.push_back(New_Prefix(AF_INET, &sin, length));
+        patricia_node_t* node = patricia_lookup(tree, prefixes.back());
+        check(node && node->prefix != prefixes.back() && node->prefix->bitlen == length, "node holds its own prefix");
+    }
+    u_int slabs = tree->pool.num_slabs;
+    int nodes = tree->num_active_node;
+    check(slabs > 0 && slabs * 65536.0 / nodes < 2 * tree->pool.object_size, "nodes are packed into slabs");
+
+    // churn: removed nodes are recycled instead of growing the pool
+    for (int round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            patricia_node_t* node = patricia_search_exact(tree, prefixes[i]);
+            if (node) {
+                patricia_remove(tree, node);
+            }
+        }
+        check(tree->head == nullptr && tree->num_active_node == 0, "tree is empty");
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            patricia_lookup(tree, prefixes[i]);
+        }
+        check(tree->num_active_node == nodes, "same shape after re-adding");
+    }
+    check(tree->pool.num_slabs == slabs, "churn reuses freed nodes");
+
+    prefix_t* probe = prefixes[123];
+    patricia_node_t* best = patricia_search_best(tree, probe);
+    check(best && best->prefix->bitlen <= probe->bitlen, "search still works on pooled nodes");
+
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        Deref_Prefix(prefixes[i]);
+    }
+    Destroy_Patricia(tree, nullptr);
+    std::cout << "Pool held " << nodes << " nodes in " << slabs << " slabs\n";
+}
+
+void testCompactTrie() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 13: Compact index-linked route table" << endl;
+
+    CompactTrie trie;
+    patricia_tree_t* tree = New_Patricia(32);
+    std::mt19937 rng(17);
+    std::vector<std::pair<uint32_t, int> > prefixes;
+    for (int i = 0; i < 5000; ++i) {
+        int length = rng() % 33;
+        uint32_t prefix = length == 0 ? 0 : rng() & (0xFFFFFFFFu << (32 - length));
+        prefixes.push_back(std::make_pair(prefix, length));
+        trie.insert(prefix, length, 1 + i);
+        in_addr sin;
+        sin.s_addr = htonl(prefix);
+        prefix_t* p = New_Prefix(AF_INET, &sin, length);
+        patricia_lookup(tree, p)->user1 = reinterpret_cast<void*>(static_cast<uintptr_t>(1 + i));
+        Deref_Prefix(p);
+    }
+    check(trie.nodes() <= 2 * trie.routes(), "at most one glue node per route");
+
+    // searchBest must agree with the patricia tree for hosts and prefixes
+    for (int i = 0; i < 20000; ++i) {
+        int length = i % 2 ? 32 : rng() % 33;
+        uint32_t prefix = length == 0 ? 0 : rng() & (0xFFFFFFFFu << (32 - length));
+        if (i % 3 == 0) {
+            prefix = prefixes[rng() % prefixes.size()].first | (rng() & 0xFF);
+        }
+        in_addr sin;
+        sin.s_addr = htonl(prefix);
+        prefix_t* p = New_Prefix(AF_INET, &sin, length);
+        patricia_node_t* expected = patricia_search_best(tree, p);
+        Deref_Prefix(p);
+        uint32_t value = 0;
+        int matched = -1;
+        bool found = trie.searchBest(prefix, length, &value, &matched);
+        check(found == (expected != nullptr), "compact trie finds the same routes");
+        if (found) {
+            check(value == reinterpret_cast<uintptr_t>(expected->user1) && matched == expected->prefix->bitlen,
+                  "compact trie picks the same route");
+        }
+    }
+
+    // bottom-up builds from the sorted routes, serial and split across
+    // threads, must give the same answers as the inserted trie
+    std::vector<CompactTrie::Entry> entries;
+    std::vector<std::pair<uint32_t, int> > sorted(prefixes);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        CompactTrie::Entry entry;
+        entry.prefix = sorted[i].first;
+        entry.length = sorted[i].second;
+        entry.value = trie.searchExact(entry.prefix, entry.length);
+        entries.push_back(entry);
+    }
+    for (unsigned threads = 1; threads <= 4; threads += 3) {
+        CompactTrie built;
+        check(built.assign(entries, threads), "assign accepts sorted routes");
+        check(built.routes() == trie.routes() && built.nodes() == trie.nodes(),
+              "bottom-up build has the inserted trie's shape");
+        for (int i = 0; i < 20000; ++i) {
+            int length = i % 2 ? 32 : rng() % 33;
+            uint32_t prefix = length == 0 ? 0 : rng() & (0xFFFFFFFFu << (32 - length));
+            if (i % 3 == 0) {
+                prefix = prefixes[rng() % prefixes.size()].first | (rng() & 0xFF);
+            }
+            uint32_t expected = 0, value = 0;
+            int expected_length = -1, matched = -1;
+            trie.searchBest(prefix, length, &expected, &expected_length);
+            built.searchBest(prefix, length, &value, &matched);
+            check(value == expected && matched == expected_length, "bottom-up build picks the same route");
+        }
+        built.insert(0x0A000000u, 8, 7);
+        check(built.searchExact(0x0A000000u, 8) == 7, "a built trie takes further inserts");
+    }
+    std::swap(entries[0], entries[1]);
+    check(!trie.assign(entries) && trie.routes() == sorted.size(), "assign rejects unsorted routes");
+
+    std::shuffle(prefixes.begin(), prefixes.end(), rng);
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        trie.remove(prefixes[i].first, prefixes[i].second);
+    }
+    check(trie.routes() == 0 && trie.nodes() == 0, "removing every route frees every node");
+    Destroy_Patricia(tree, nullptr);
+    std::cout << "Compact trie agreed with patricia; " << trie.memoryBytes() << " bytes reserved at peak\n";
+}
+
+static patricia_node_t* patriciaBest(patricia_tree_t* tree, uint32_t prefix, int length) {
+    in_addr sin;
+    sin.s_addr = htonl(prefix);
+    prefix_t* p = New_Prefix(AF_INET, &sin, length);
+    patricia_node_t* node = patricia_search_best(tree, p);
+    Deref_Prefix(p);
+    return node;
+}
+
+// Random inserts and deletes applied to fib and a patricia tree alike, then
+// lookups (single and batched) checked against patricia_search_best.
+template <typename Fib>
+static void compareWithPatricia(Fib& fib, std::mt19937& rng, const std::string& name) {
+    patricia_tree_t* tree = New_Patricia(32);
+    std::vector<std::pair<uint32_t, int> > installed;
+
+    // BGP-like lengths, crowded into a few /12s so that chunks fill up
+    // and nest prefixes
+    for (int round = 0; round < 20000; ++round) {
+        if (round % 4 == 3 && !installed.empty()) {
+            size_t victim = rng() % installed.size();
+            std::pair<uint32_t, int> route = installed[victim];
+            installed[victim] = installed.back();
+            installed.pop_back();
+            in_addr sin;
+            sin.s_addr = htonl(route.first);
+            prefix_t* p = New_Prefix(AF_INET, &sin, route.second);
+            patricia_node_t* node = patricia_search_exact(tree, p);
+            Deref_Prefix(p);
+            if (!node) {
+                continue;   // was a duplicate that is already gone
+            }
+            patricia_remove(tree, node);
+            patricia_node_t* covering = patriciaBest(tree, route.first, route.second);
+            if (covering) {
+                fib.remove(route.first, route.second,
+                           static_cast<uint32_t>(reinterpret_cast<uintptr_t>(covering->user1)),
+                           covering->prefix->bitlen);
+            } else {
+                fib.remove(route.first, route.second, 0, -1);
+            }
+            continue;
+        }
+        unsigned roll = rng() % 100;
+        int length = roll < 50 ? 24 : roll < 80 ? 16 + rng() % 8 : roll < 90 ? 25 + rng() % 8 : rng() % 16;
+        uint32_t prefix = (0x0A000000u | ((rng() % 4) << 20) | (rng() & 0x000FFFFFu)) & prefixMaskForTest(length);
+        uint32_t value = 1 + rng() % 1000;
+        fib.insert(prefix, length, value);
+        in_addr sin;
+        sin.s_addr = htonl(prefix);
+        prefix_t* p = New_Prefix(AF_INET, &sin, length);
+        patricia_lookup(tree, p)->user1 = reinterpret_cast<void*>(static_cast<uintptr_t>(value));
+        Deref_Prefix(p);
+        installed.push_back(std::make_pair(prefix, length));
+    }
+
+    for (int probe = 0; probe < 200000; ++probe) {
+        uint32_t address = 0x0A000000u | ((rng() % 5) << 20) | (rng() & 0x000FFFFFu);
+        if (probe % 2 && !installed.empty()) {
+            // edges of installed prefixes, where off-by-one bugs live
+            std::pair<uint32_t, int> route = installed[rng() % installed.size()];
+            address = route.first + ((probe % 4 == 1) ? 0 : ~prefixMaskForTest(route.second)) + (rng() % 3) - 1;
+        }
+        patricia_node_t* expected = patriciaBest(tree, address, 32);
+        uint32_t value = 0;
+        int length = -1;
+        bool found = fib.lookup(address, &value, &length);
+        check(found == (expected != nullptr), name + " finds a route for " + ipv4ToString(address));
+        if (found) {
+            check(length == expected->prefix->bitlen &&
+                  value == static_cast<uint32_t>(reinterpret_cast<uintptr_t>(expected->user1)),
+                  name + " picks the patricia route for " + ipv4ToString(address));
+        }
+    }
+
+    std::vector<uint32_t> burst(1000);
+    for (size_t i = 0; i < burst.size(); ++i) {
+        burst[i] = 0x0A000000u | ((rng() % 5) << 20) | (rng() & 0x000FFFFFu);
+    }
+    std::vector<uint32_t> values(burst.size());
+    std::vector<int> lengths(burst.size());
+    fib.lookupBatch(burst.data(), burst.size(), values.data(), lengths.data());
+    for (size_t i = 0; i < burst.size(); ++i) {
+        uint32_t value = 0;
+        int length = -1;
+        fib.lookup(burst[i], &value, &length);
+        check(lengths[i] == length && (length < 0 || values[i] == value),
+              name + " lookupBatch agrees with lookup for " + ipv4ToString(burst[i]));
+    }
+
+    Destroy_Patricia(tree, nullptr);
+}
+
+void testLcTrie() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 14: LC-trie lookups against the patricia tree on random tables" << endl;
+
+    const double fill_factors[] = {0.5, 0.25, 1.0};
+    for (int variant = 0; variant < 3; ++variant) {
+        LcTrieFib fib(nullptr, fill_factors[variant], variant == 1 ? 4 : 16);
+        std::mt19937 rng(31 + variant);
+        compareWithPatricia(fib, rng, "LC-trie");
+
+        double average;
+        int maximum;
+        fib.depthStats(&average, &maximum);
+        std::cout << "fill factor " << fill_factors[variant] << ": " << fib.chunks() << " chunks, average depth "
+                  << average << ", max " << maximum << "\n";
+    }
+}
+
+void testPoptrie() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 15: Poptrie lookups against the patricia tree on random tables" << endl;
+
+    {
+        PoptrieFib fib;
+        std::mt19937 rng(41);
+        compareWithPatricia(fib, rng, "Poptrie");
+        std::cout << fib.chunks() << " chunks, " << fib.nodes() << " nodes, " << fib.memoryBytes() / 1024
+                  << " KB, popcnt " << (fib.hardwarePopcount() ? "yes" : "no") << "\n";
+    }
+
+    // every child of one node internal, and /32s in the last level, which
+    // only uses every fourth child
+    PoptrieFib fib;
+    for (uint32_t c = 0; c < 64; ++c) {
+        fib.insert(0xC0A80000u | (c << 10) | (1u << 8), 24, 100 + c);
+        fib.insert(0xC0A80000u | (c << 10) | (1u << 8) | 0x7F, 32, 200 + c);
+    }
+    fib.insert(0xC0A80000u, 16, 1);
+    uint32_t value;
+    int length;
+    check(fib.lookup(0xC0A8FD7Fu, &value, &length) && length == 32 && value == 263, "Poptrie finds the last /32");
+    check(fib.lookup(0xC0A8FD7Eu, &value, &length) && length == 24 && value == 163, "Poptrie falls back to the /24");
+    check(fib.lookup(0xC0A8FC00u, &value, &length) && length == 16 && value == 1, "Poptrie falls back to the /16");
+    fib.remove(0xC0A80000u, 16, 0, -1);
+    check(!fib.lookup(0xC0A8FC00u, &value, &length) && length == -1, "Poptrie misses once the /16 is gone");
+    for (uint32_t c = 0; c < 64; ++c) {
+        fib.remove(0xC0A80000u | (c << 10) | (1u << 8) | 0x7F, 32, 100 + c, 24);
+        fib.remove(0xC0A80000u | (c << 10) | (1u << 8), 24, 0, -1);
+    }
+    check(fib.chunks() == 0, "Poptrie frees an emptied chunk");
+}
+
+static IPv6Address ipv6FromText(const char* text) {
+    in6_addr net;
+    inet_pton(AF_INET6, text, &net);
+    return IPv6Address::fromIn6(net);
+}
+
+void testIPv6() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 16: IPv6 routes, lookups and tracked addresses" << endl;
+
+    RouteTracker tracker;
+    check(tracker.addRoute("2001:db8::/32", "nh6-a"), "addRoute with an IPv6 prefix");
+    check(tracker.addRoute("2001:db8:1::/48", "nh6-b"), "addRoute with a longer IPv6 prefix");
+    check(tracker.addRoute(ipv6FromText("2001:db8:1:2::"), 64, "nh6-c"), "addRoute with a binary IPv6 prefix");
+    check(tracker.addRoute("10.0.0.0/8", "nh4"), "IPv4 routes sit next to IPv6 ones");
+    check(!tracker.addRoute("2001:db8::/129", "x"), "addRoute rejects an IPv6 length over 128");
+    check(!tracker.addRoute("10.0.0.0/33", "x") && !tracker.addRoute("10.0.0.0/100", "x"),
+          "addRoute keeps rejecting IPv4 lengths over 32");
+    check(!tracker.addRoute("2001:db8:::/32", "x") && !tracker.addRoute("2001:zz8::/32", "x"),
+          "addRoute rejects malformed IPv6 text");
+
+    check(tracker.lookup6("2001:db8:1:2::1").nexthop == "nh6-c", "/64 is the longest match");
+    check(tracker.lookup6("2001:db8:1:3::1").nexthop == "nh6-b", "/48 covers the rest of its range");
+    RouteMatch6 match = tracker.lookup(ipv6FromText("2001:db8:ffff::1"));
+    check(match.found() && match.prefix_length == 32 && match.prefix == ipv6FromText("2001:db8::"),
+          "binary lookup reports the matched prefix");
+    check(!tracker.lookup6("2001:db9::1").found(), "addresses outside every prefix are unrouted");
+    check(!tracker.lookup6("10.1.1.1").found() && tracker.lookup("10.1.1.1").nexthop == "nh4",
+          "the families do not mix");
+
+    Route* route = tracker.longestPrefixMatch("2001:db8:1::5");
+    check(route && route->prefix == "2001:db8:1::" && route->nexthop == "nh6-b",
+          "longestPrefixMatch accepts IPv6 text");
+    delete route;
+
+    scoped_callback_count = 0;
+    check(tracker.registerAddress("2001:db8:1:2::9", &recordCallback), "registerAddress with an IPv6 address");
+    check(last_nexthop["2001:db8:1:2::9"] == "nh6-c", "registration reports the IPv6 nexthop");
+    tracker.registerAddress("2001:db8:2::9", &recordCallback);
+    scoped_callback_count = 0;
+    tracker.addRoute("2001:db8:2::/47", "nh6-d");
+    check(scoped_callback_count == 1 && last_nexthop["2001:db8:2::9"] == "nh6-d",
+          "adding an IPv6 route notifies only addresses inside it");
+    scoped_callback_count = 0;
+    check(tracker.deleteRoute("2001:db8:1:2::/64"), "deleteRoute with an IPv6 prefix");
+    check(scoped_callback_count == 1 && last_nexthop["2001:db8:1:2::9"] == "nh6-b",
+          "tracked IPv6 address falls back to the /48");
+    check(!tracker.deleteRoute(ipv6FromText("2001:db8:1:2::"), 64), "deleting twice fails");
+    check(tracker.unregisterAddress("2001:db8:1:2::9"), "unregisterAddress with an IPv6 address");
+
+    std::vector<Route> all = tracker.getAllRoutes();
+    check(all.size() == 4 && all[0].prefix == "10.0.0.0" && all[1].prefix == "2001:db8::" &&
+          all.back().prefix == "2001:db8:2::",
+          "getAllRoutes lists IPv4 then IPv6 routes in address order");
+
+    // a default route and host routes at both ends of the address space
+    tracker.addRoute("::/0", "nh6-default");
+    tracker.addRoute("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff/128", "nh6-top");
+    check(tracker.lookup6("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff").nexthop == "nh6-top", "/128 matches");
+    check(tracker.lookup6("ffff:ffff:ffff:ffff:ffff:ffff:ffff:fffe").nexthop == "nh6-default",
+          "its neighbour takes the default route");
+
+    // random prefixes against a linear scan; lengths straddle the 64-bit word
+    // boundary
+    std::mt19937_64 rng(6);
+    std::map<std::pair<IPv6Address, int>, std::string> reference;
+    for (int round = 0; round < 3000; ++round) {
+        static const int lengths[] = {16, 32, 48, 56, 63, 64, 65, 80, 96, 127, 128};
+        int length = lengths[rng() % 11];
+        IPv6Address prefix;
+        prefix.hi = 0x20010DB800000000ULL | (rng() & 0x00000000FF0FF0FFULL);
+        prefix.lo = rng() & 0xFF000000000000FFULL;
+        prefix = prefix.masked(length);
+        if (round % 3 == 2 && !reference.empty()) {
+            std::map<std::pair<IPv6Address, int>, std::string>::iterator victim = reference.begin();
+            std::advance(victim, rng() % reference.size());
+            check(tracker.deleteRoute(victim->first.first, victim->first.second), "random IPv6 delete");
+            reference.erase(victim);
+            continue;
+        }
+        std::string nexthop = "nh" + std::to_string(rng() % 50);
+        tracker.addRoute(prefix, length, nexthop);
+        reference[std::make_pair(prefix, length)] = nexthop;
+    }
+    std::vector<IPv6Address> probes;
+    for (std::map<std::pair<IPv6Address, int>, std::string>::iterator it = reference.begin();
+         it != reference.end() && probes.size() < 2000; ++it) {
+        probes.push_back(it->first.first);
+        probes.push_back(it->first.first.lastInPrefix(it->first.second));
+    }
+    std::vector<RouteMatch6> results(probes.size());
+    EpochGuard guard;
+    tracker.lookupBatch(probes.data(), probes.size(), results.data());
+    size_t agreed = 0;
+    for (size_t i = 0; i < probes.size(); ++i) {
+        int best_length = -1;
+        std::string best = "nh6-default";
+        for (std::map<std::pair<IPv6Address, int>, std::string>::iterator it = reference.begin();
+             it != reference.end(); ++it) {
+            if (it->first.second > best_length && probes[i].masked(it->first.second) == it->first.first) {
+                best_length = it->first.second;
+                best = it->second;
+            }
+        }
+        if (probes[i] == ipv6FromText("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff")) {
+            best = "nh6-top";
+        }
+        agreed += results[i].nexthop == best;
+    }
+    check(agreed == probes.size(), "IPv6 lookupBatch agrees with a linear scan");
+    std::cout << "IPv6 table agreed with reference for " << agreed << " addresses\n";
+}
+
+void testBulkUpdates() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 17: Bulk addRoutes/deleteRoutes with one notification pass" << endl;
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-old");
+    tracker.registerAddress("10.1.2.3", &recordCallback);
+    tracker.registerAddress("10.9.9.9", &recordCallback);
+    tracker.registerAddress("192.168.0.1", &recordCallback);
+    tracker.registerAddress("2001:db8::1", &recordCallback);
+
+    std::vector<std::pair<std::string, std::string> > routes;
+    routes.push_back(std::make_pair("10.0.0.0/8", "nh-a"));
+    routes.push_back(std::make_pair("10.1.0.0/16", "nh-b"));
+    routes.push_back(std::make_pair("10.1.2.0/24", "nh-c"));
+    routes.push_back(std::make_pair("2001:db8::/32", "nh6"));
+    routes.push_back(std::make_pair("10.1.2.0/99", "bad"));
+    routes.push_back(std::make_pair("172.16.0.0/12", ""));
+    scoped_callback_count = 0;
+    check(tracker.addRoutes(routes) == 4, "addRoutes applies the valid entries and skips the rest");
+    // 10.1.2.3 moves three times inside the batch but hears about it once
+    check(scoped_callback_count == 3, "one callback per affected address");
+    check(last_nexthop["10.1.2.3"] == "nh-c" && last_nexthop["10.9.9.9"] == "nh-a" &&
+          last_nexthop["2001:db8::1"] == "nh6",
+          "callbacks report the final state");
+    check(tracker.getAllRoutes().size() == 4 && tracker.snapshot().size() == 3,
+          "the batch is visible in getAllRoutes() and the snapshot");
+
+    std::vector<std::string> prefixes;
+    prefixes.push_back("10.1.2.0/24");
+    prefixes.push_back("10.1.0.0/16");
+    prefixes.push_back("10.5.0.0/16");
+    prefixes.push_back("2001:db8::/32");
+    scoped_callback_count = 0;
+    check(tracker.deleteRoutes(prefixes) == 3, "deleteRoutes counts only routes that existed");
+    check(scoped_callback_count == 2 && last_nexthop["10.1.2.3"] == "nh-a" && last_nexthop["2001:db8::1"] == "",
+          "deleteRoutes notifies each affected address once");
+    // duplicates in one batch: the last entry wins, however the prefix is
+    // written
+    routes.clear();
+    routes.push_back(std::make_pair("10.1.0.0/8", "nh-first"));
+    routes.push_back(std::make_pair("10.0.0.0/8", "nh-last"));
+    tracker.addRoutes(routes);
+    check(tracker.lookup("10.1.2.3").nexthop == "nh-last", "the last duplicate in a batch wins");
+
+    scoped_callback_count = 0;
+    check(tracker.addRoutes(std::vector<std::pair<std::string, std::string> >()) == 0 && scoped_callback_count == 0,
+          "an empty batch is a no-op");
+
+    // a large batch ends in the same state as the same routes added one by one
+    RouteTracker one_by_one;
+    RouteTracker bulk;
+    std::mt19937 rng(15);
+    routes.clear();
+    for (int i = 0; i < 5000; ++i) {
+        int length = 8 + rng() % 25;
+        uint32_t prefix = (0x0A000000u | (rng() & 0x00FFFFFFu)) & prefixMaskForTest(length);
+        routes.push_back(std::make_pair(ipv4ToString(prefix) + "/" + std::to_string(length),
+                                        "nh" + std::to_string(rng() % 20)));
+        one_by_one.addRoute(routes.back().first, routes.back().second);
+    }
+    bulk.addRoutes(routes);
+    // the compact layout builds its empty table bottom-up instead
+    RouteTracker built(RouteTracker::kCompactRib);
+    built.registerAddress("10.1.2.3", &recordCallback);
+    scoped_callback_count = 0;
+    check(built.addRoutes(routes) == routes.size() && scoped_callback_count == 1,
+          "a bottom-up load counts and notifies like inserts");
+    std::vector<RouteDelta> changes;
+    RouteSnapshot::diff(one_by_one.snapshot(), bulk.snapshot(), changes);
+    check(changes.empty(), "bulk load matches one-by-one adds");
+    RouteSnapshot::diff(one_by_one.snapshot(), built.snapshot(), changes);
+    check(changes.empty(), "bottom-up load matches one-by-one adds");
+    for (int i = 0; i < 2000; ++i) {
+        uint32_t address = 0x0A000000u | (rng() & 0x00FFFFFFu);
+        check(one_by_one.lookup(address).nexthop == bulk.lookup(address).nexthop &&
+                  one_by_one.lookup(address).nexthop == built.lookup(address).nexthop,
+              "bulk load resolves like one-by-one adds");
+    }
+    check(built.deleteRoute(routes[0].first) && built.addRoute("10.0.0.0/8", "nh-x") &&
+              built.lookup("10.255.255.255").nexthop != "",
+          "a bottom-up table takes further updates");
+}
+
+static std::string bigEndian(uint32_t value, int bytes) {
+    std::string out;
+    for (int i = bytes - 1; i >= 0; --i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+    return out;
+}
+
+// one MRT TABLE_DUMP_V2 record
+static std::string mrtRecord(uint16_t subtype, const std::string& body) {
+    return bigEndian(0, 4) + bigEndian(13, 2) + bigEndian(subtype, 2) + bigEndian(body.size(), 4) + body;
+}
+
+// RIB record body with a single path carrying attributes
+static std::string mrtRib(const std::string& prefix_bytes, int length, const std::string& attributes) {
+    return bigEndian(0, 4) + std::string(1, static_cast<char>(length)) + prefix_bytes + bigEndian(1, 2) +
+           bigEndian(0, 2) + bigEndian(0, 4) + bigEndian(attributes.size(), 2) + attributes;
+}
+
+void testRouteLoader() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 18: Memory-mapped text and MRT route loader" << endl;
+
+    std::string path = "/tmp/route_tracker_load_" + std::to_string(getpid());
+    {
+        std::ofstream out(path.c_str());
+        out << "# prefix nexthop\n"
+            << "10.0.0.0/8 nh-a\n"
+            << "  10.1.0.0/16\tnh-b  \r\n"
+            << "\n"
+            << "not-a-prefix nh-x\n"
+            << "2001:db8::/32 nh6\n"
+            << "10.0.0.0/8 nh-last\n"
+            << "192.168.0.0/16 nh-c";        // no final newline
+    }
+    RouteTracker tracker;
+    RouteLoadStats stats;
+    check(tracker.loadRoutes(path, RouteFileFormat::kText, &stats, 1), "loadRoutes maps a text file");
+    check(stats.routes_parsed == 5 && stats.routes_skipped == 1 && stats.routes_added == 5,
+          "text loader counts parsed, skipped and added routes");
+    check(tracker.lookup("10.9.9.9").nexthop == "nh-last" && tracker.lookup("10.1.2.3").nexthop == "nh-b" &&
+              tracker.lookup("192.168.1.1").nexthop == "nh-c" && tracker.lookup6("2001:db8::1").nexthop == "nh6",
+          "text loader installs the routes, last duplicate winning");
+
+    // peer index table (ignored), IPv4 with NEXT_HOP, IPv4 with an extended
+    // length attribute, IPv6 with an abbreviated MP_REACH_NLRI, a record
+    // without paths and a truncated tail
+    std::string origin = "\x40\x01\x01" + std::string(1, '\0');
+    std::string mrt = mrtRecord(1, std::string(10, '\0'));
+    mrt += mrtRecord(2, mrtRib("\x0a\x02", 16, origin + "\x40\x03\x04" + std::string("\xc0\x00\x02\x01", 4)));
+    mrt += mrtRecord(2, mrtRib("\xac\x10\x05", 24, "\x50\x03" + bigEndian(4, 2) + std::string("\xc0\x00\x02\x02", 4)));
+    std::string next_hop6 = std::string("\x20\x01\x0d\xb8", 4) + std::string(11, '\0') + "\xff";
+    mrt += mrtRecord(4, mrtRib(std::string("\x20\x01\x0d\xb8\x00\x01", 6), 48,
+                               origin + "\x80\x0e\x11\x10" + next_hop6));
+    mrt += mrtRecord(2, bigEndian(0, 4) + "\x08\x0b" + bigEndian(0, 2));
+    mrt += mrtRecord(2, mrtRib("\x0c", 8, origin)).substr(0, 15);
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        out << mrt;
+    }
+    RouteTracker from_mrt(RouteTracker::kCompactRib);
+    check(from_mrt.loadRoutes(path, RouteFileFormat::kMrt, &stats), "loadRoutes maps an MRT file");
+    check(stats.routes_parsed == 3 && stats.routes_skipped == 2 && stats.routes_added == 3,
+          "MRT loader reads the RIB records and skips the broken ones");
+    check(from_mrt.lookup("10.2.3.4").nexthop == "192.0.2.1" && from_mrt.lookup("172.16.5.9").nexthop == "192.0.2.2" &&
+              from_mrt.lookup6("2001:db8:1::5").nexthop == "2001:db8::ff",
+          "MRT loader takes the nexthop of the first path");
+
+    // large enough to be parsed in several parts
+    std::mt19937 rng(18);
+    std::vector<std::pair<std::string, std::string> > routes;
+    {
+        std::ofstream out(path.c_str());
+        for (int i = 0; i < 120000; ++i) {
+            int length = 8 + rng() % 25;
+            uint32_t prefix = rng() & prefixMaskForTest(length);
+            routes.push_back(std::make_pair(ipv4ToString(prefix) + "/" + std::to_string(length),
+                                            "nh" + std::to_string(rng() % 50)));
+            out << routes.back().first << " " << routes.back().second << "\n";
+        }
+    }
+    RouteTracker bulk;
+    RouteTracker parallel(RouteTracker::kCompactRib);
+    bulk.addRoutes(routes);
+    check(parallel.loadRoutes(path, RouteFileFormat::kText, &stats, 4) && stats.routes_parsed == routes.size(),
+          "parallel parse reads every line");
+    std::vector<RouteDelta> changes;
+    RouteSnapshot::diff(bulk.snapshot(), parallel.snapshot(), changes);
+    check(changes.empty(), "parallel file load matches addRoutes");
+    std::remove(path.c_str());
+
+    check(!tracker.loadRoutes(path, RouteFileFormat::kText), "a missing file is reported");
+    std::cout << "Loaded " << stats.routes_parsed << " routes at " << static_cast<size_t>(stats.routesPerSecond())
+              << " routes/s\n";
+}
+
+// updates the tracker from the first routed callback, which for a tracker
+// restored from a snapshot is one the rebuild runs
+static RouteTracker* restore_tracker = nullptr;
+static bool restore_reentered = false;
+void restoreCallback(const std::string& ip_address,
+                     const std::string& new_nexthop,
+                     const std::string& old_nexthop) {
+    if (!restore_reentered && !new_nexthop.empty()) {
+        restore_reentered = true;
+        restore_tracker->addRoute("203.0.113.0/24", "from-restore");
+    }
+}
+
+void testSnapshotFiles() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 19: Binary snapshot files and warm restart" << endl;
+
+    RouteTracker tracker;
+    std::mt19937 rng(19);
+    for (int i = 0; i < 20000; ++i) {
+        int length = 8 + rng() % 25;
+        uint32_t prefix = rng() & prefixMaskForTest(length);
+        tracker.addRoute(prefix, length, "nh" + std::to_string(rng() % 40));
+    }
+    tracker.addRoute("0.0.0.0/0", "default");
+    tracker.addRoute("2001:db8::/32", "nh6");
+    tracker.addRoute("2001:db8:1::/48", "nh6-more");
+
+    std::string path = "/tmp/route_tracker_snapshot_" + std::to_string(getpid());
+    check(tracker.saveSnapshot(path), "saveSnapshot writes the file");
+
+    // the mapped file answers like the tracker it was saved from
+    SnapshotFile file;
+    check(file.open(path) && file.routes() == tracker.snapshot().size() && file.routes6() == 2,
+          "the snapshot file holds every route");
+    for (int i = 0; i < 20000; ++i) {
+        uint32_t address = rng();
+        std::string_view nexthop;
+        int length = -1;
+        RouteMatch expected = tracker.lookup(address);
+        check(file.lookup(address, &nexthop, &length) && nexthop == expected.nexthop &&
+                  length == expected.prefix_length,
+              "lookups in the mapped file match the tracker");
+    }
+
+    RouteTracker restored(RouteTracker::kCompactRib, RouteTracker::kPoptrieLookup);
+    restored.registerAddress("2001:db8:1::9", &recordCallback);
+    check(restored.loadSnapshot(path), "loadSnapshot maps the file");
+    // answered from the file or the rebuilt tables, whichever is current
+    for (int i = 0; i < 2000; ++i) {
+        uint32_t address = rng();
+        check(restored.lookup(address).nexthop == tracker.lookup(address).nexthop,
+              "lookups during the restore match");
+    }
+    check(restored.addRoute("198.51.100.0/24", "after-restore"), "updates wait for the restore");
+    std::vector<RouteDelta> changes;
+    RouteSnapshot::diff(tracker.snapshot(), restored.snapshot(), changes);
+    check(changes.size() == 1 && changes[0].new_nexthop == "after-restore", "the restore rebuilds every route");
+    check(restored.lookup6("2001:db8:1::9").nexthop == "nh6-more" && last_nexthop["2001:db8:1::9"] == "nh6-more",
+          "IPv6 routes are restored and tracked addresses notified");
+    check(!restored.loadSnapshot(path), "loadSnapshot refuses a tracker with routes");
+
+    // a callback from the rebuild updates the tracker while this thread is
+    // waiting for the rebuild
+    RouteTracker reentered;
+    restore_tracker = &reentered;
+    reentered.registerAddress("192.0.2.77", &restoreCallback);
+    check(reentered.loadSnapshot(path), "loadSnapshot maps the file again");
+    check(reentered.addRoute("198.51.100.0/24", "after-restore"), "an update waits beside a re-entrant callback");
+    check(restore_reentered && reentered.lookup("203.0.113.1").nexthop == "from-restore",
+          "callbacks run by the rebuild can update the tracker");
+    restore_tracker = nullptr;
+
+    // a registration during the rebuild waits for it and hears its route once
+    RouteTracker late;
+    check(late.loadSnapshot(path), "loadSnapshot maps the file for a late registration");
+    scoped_callback_count = 0;
+    late.registerAddress("192.0.2.78", &recordCallback);
+    late.waitForRestore();
+    check(scoped_callback_count == 1 && last_nexthop["192.0.2.78"] == tracker.lookup("192.0.2.78").nexthop,
+          "registrations resolve against the restored routes");
+
+    // damage: a flipped byte, a truncated file, a missing file
+    std::string bytes;
+    {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::string damaged = bytes;
+    damaged[damaged.size() / 2] ^= 0x40;
+    std::ofstream(path.c_str(), std::ios::binary) << damaged;
+    RouteTracker empty;
+    check(!empty.loadSnapshot(path), "a corrupt snapshot is rejected");
+    std::ofstream(path.c_str(), std::ios::binary) << bytes.substr(0, bytes.size() - 8);
+    check(!empty.loadSnapshot(path), "a truncated snapshot is rejected");
+    std::remove(path.c_str());
+    check(!empty.loadSnapshot(path) && empty.getAllRoutes().empty(), "a missing snapshot is rejected");
+}
+
+void testUpdateJournal() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 20: Write-ahead update journal and replay" << endl;
+
+    std::string journal = "/tmp/route_tracker_journal_" + std::to_string(getpid());
+    std::string checkpoint = journal + ".snapshot";
+    std::remove(journal.c_str());
+    std::remove((journal + ".old").c_str());
+
+    RouteTracker tracker;
+    check(tracker.openJournal(journal, 0), "openJournal creates the journal");
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    tracker.addRoute("10.1.0.0/16", "nh-b");
+    tracker.addRoute("10.1.0.0/16", "nh-c");
+    tracker.addRoute("2001:db8::/32", "nh6");
+    tracker.registerAddress("10.1.2.3", &recordCallback);
+    tracker.registerAddress("10.200.0.1", &recordCallback);
+    tracker.registerAddress("2001:db8::1", &recordCallback);
+    tracker.unregisterAddress("10.200.0.1");
+    std::vector<std::pair<std::string, std::string> > routes;
+    routes.push_back(std::make_pair("192.168.0.0/16", "nh-d"));
+    routes.push_back(std::make_pair("172.16.0.0/12", "nh-e"));
+    tracker.addRoutes(routes);
+    tracker.deleteRoute("10.0.0.0/8");
+    std::vector<std::string> prefixes(1, "172.16.0.0/12");
+    tracker.deleteRoutes(prefixes);
+    check(tracker.syncJournal(), "syncJournal reports a healthy journal");
+
+    RouteTracker replayed;
+    JournalReplayStats stats;
+    scoped_callback_count = 0;
+    check(replayed.replayJournal(journal, &recordCallback, &stats), "replayJournal reads the journal");
+    std::vector<RouteDelta> changes;
+    RouteSnapshot::diff(tracker.snapshot(), replayed.snapshot(), changes);
+    check(changes.empty() && replayed.getAllRoutes().size() == tracker.getAllRoutes().size(),
+          "replay rebuilds the same routes");
+    check(stats.records == 12 && !stats.torn && stats.routes_added == 3 && stats.routes_deleted == 2,
+          "replay reduces the records to the net change per prefix");
+    check(stats.registrations == 2 && scoped_callback_count == 2 && last_nexthop["10.1.2.3"] == "nh-c" &&
+              last_nexthop["2001:db8::1"] == "nh6",
+          "registrations are replayed with the given callback");
+    check(!tracker.replayJournal(journal), "replay refuses a tracker with an open journal");
+
+    // a crash mid-write leaves a torn record; replay stops before it and
+    // reopening cuts it off so that appends stay readable
+    tracker.closeJournal();
+    std::string bytes;
+    {
+        std::ifstream in(journal.c_str(), std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::ofstream(journal.c_str(), std::ios::binary | std::ios::app) << bytes.substr(16, 20);
+    RouteTracker torn;
+    check(torn.replayJournal(journal, nullptr, &stats) && stats.torn && stats.records == 12,
+          "a torn tail is detected and skipped");
+    std::string damaged = bytes;
+    damaged[damaged.size() - 3] ^= 0x40;
+    std::ofstream(journal.c_str(), std::ios::binary) << damaged;
+    check(torn.replayJournal(journal, nullptr, &stats) && stats.torn && stats.records == 11,
+          "a record failing its checksum ends the replay");
+    std::ofstream(journal.c_str(), std::ios::binary) << bytes << bytes.substr(16, 20);
+    check(tracker.openJournal(journal, 5), "openJournal appends to an existing journal");
+    tracker.addRoute("198.51.100.0/24", "nh-f");
+    check(tracker.syncJournal(), "the background flusher's journal syncs");
+    RouteTracker appended;
+    check(appended.replayJournal(journal, nullptr, &stats) && !stats.torn && stats.records == 13 &&
+              appended.lookup("198.51.100.1").nexthop == "nh-f",
+          "records appended after a torn tail are replayed");
+
+    // checkpoint: the snapshot plus the journal since it give the same state
+    check(tracker.saveSnapshot(checkpoint), "saveSnapshot checkpoints the journal");
+    check(access((journal + ".old").c_str(), F_OK) != 0, "the checkpointed segment is removed");
+    tracker.addRoute("203.0.113.0/24", "nh-g");
+    tracker.deleteRoute("192.168.0.0/16");
+    tracker.syncJournal();
+    RouteTracker recovered(RouteTracker::kCompactRib, RouteTracker::kPoptrieLookup);
+    scoped_callback_count = 0;
+    check(recovered.loadSnapshot(checkpoint) && recovered.replayJournal(journal, &recordCallback, &stats),
+          "recovery loads the checkpoint and replays the journal");
+    changes.clear();
+    RouteSnapshot::diff(tracker.snapshot(), recovered.snapshot(), changes);
+    check(changes.empty() && recovered.lookup6("2001:db8::5").nexthop == "nh6",
+          "recovery rebuilds the same routes");
+    check(stats.records == 4 && stats.registrations == 2 && scoped_callback_count == 2,
+          "the new segment starts with the registrations");
+    check(!recovered.replayJournal(journal + ".missing"), "a missing journal is an error");
+
+    tracker.closeJournal();
+    std::remove(journal.c_str());
+    std::remove(checkpoint.c_str());
+}
+
+void testTransactions() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 21: Transactional update batches" << endl;
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    tracker.addRoute("10.1.0.0/16", "nh-b");
+    tracker.registerAddress("10.1.1.1", &recordCallback);
+    tracker.registerAddress("10.1.2.1", &recordCallback);
+    tracker.registerAddress("10.1.3.1", &recordCallback);
+    tracker.registerAddress("10.2.0.1", &recordCallback);
+
+    // withdraw and re-announce with the same nexthop: nothing to report
+    scoped_callback_count = 0;
+    check(tracker.beginTransaction(), "beginTransaction opens a transaction");
+    check(!tracker.beginTransaction(), "only one transaction at a time");
+    check(tracker.deleteRoute("10.1.0.0/16") && tracker.addRoute("10.1.0.0/16", "nh-b"),
+          "updates inside a transaction are queued");
+    check(tracker.lookup("10.1.1.1").nexthop == "nh-b", "queued updates are not applied yet");
+    tracker.commit();
+    check(scoped_callback_count == 0 && tracker.lookup("10.1.1.1").nexthop == "nh-b",
+          "a flap inside a transaction sends no callback");
+
+    // replace the /16 with /24s: one net callback per address that moved
+    // to another nexthop, none for the one that kept its nexthop
+    check(tracker.beginTransaction(), "a new transaction after commit");
+    tracker.deleteRoute("10.1.0.0/16");
+    tracker.addRoute("10.1.1.0/24", "nh-c");
+    tracker.addRoute("10.1.2.0/24", "nh-b");
+    std::vector<std::pair<std::string, std::string> > routes;
+    routes.push_back(std::make_pair("10.1.3.0/24", "nh-x"));
+    routes.push_back(std::make_pair("10.1.3.0/24", "nh-d"));
+    check(tracker.addRoutes(routes) == 2, "bulk updates are queued too");
+    RouteSnapshot before = tracker.snapshot();
+    check(tracker.commit() == 4, "commit applies the net change");
+    check(scoped_callback_count == 2 && last_nexthop["10.1.1.1"] == "nh-c" && last_nexthop["10.1.3.1"] == "nh-d",
+          "one old -> new callback per address whose nexthop changed");
+    std::vector<RouteDelta> changes;
+    RouteSnapshot::diff(before, tracker.snapshot(), changes);
+    check(changes.size() == 4 && tracker.lookup("10.1.2.1").prefix_length == 24,
+          "the whole transaction lands in one snapshot");
+
+    scoped_callback_count = 0;
+    check(tracker.beginTransaction(), "beginTransaction again");
+    tracker.deleteRoute("10.0.0.0/8");
+    tracker.rollback();
+    check(tracker.commit() == 0 && scoped_callback_count == 0 && tracker.lookup("10.2.0.1").nexthop == "nh-a",
+          "rollback discards the queued updates");
+    check(tracker.addRoute("10.3.0.0/16", "nh-e") && tracker.lookup("10.3.0.1").nexthop == "nh-e",
+          "updates apply directly outside a transaction");
+}
+
+// every asynchronous delivery per address, in delivery order
+static std::mutex async_mutex;
+static std::map<std::string, std::vector<std::pair<std::string, std::string> > > async_history;
+static std::thread::id async_writer;
+static bool async_inline = false;
+static RouteTracker* async_tracker = nullptr;
+void asyncCallback(const std::string& ip_address,
+                   const std::string& new_nexthop,
+                   const std::string& old_nexthop) {
+    // a slow subscriber
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    if (new_nexthop == "nh-reenter" && ip_address == "10.0.0.1") {
+        // updates from a callback must not wait for their own queue
+        async_tracker->addRoute("192.0.2.0/24", "from-callback");
+    }
+    if (new_nexthop == "nh-close") {
+        // closing windows from a window's own delivery
+        async_tracker->setDebounceWindow(0);
+    }
+    std::lock_guard<std::mutex> lock(async_mutex);
+    async_inline = async_inline || std::this_thread::get_id() == async_writer;
+    async_history[ip_address].push_back(std::make_pair(old_nexthop, new_nexthop));
+}
+
+void testAsyncNotifications() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 22: Asynchronous callbacks on notifier threads" << endl;
+
+    RouteTracker tracker;
+    async_tracker = &tracker;
+    async_writer = std::this_thread::get_id();
+    check(tracker.notifierStats().threads == 0, "callbacks run inline by default");
+    check(tracker.startNotifiers(3, 8), "startNotifiers starts the pool");
+    check(!tracker.startNotifiers(2), "the pool starts once");
+
+    const int kAddresses = 16;
+    const int kUpdates = 200;
+    for (int i = 1; i <= kAddresses; ++i) {
+        tracker.registerAddress("10.0.0." + std::to_string(i), &asyncCallback);
+    }
+    for (int i = 0; i < kUpdates; ++i) {
+        tracker.addRoute("10.0.0.0/24", "nh" + std::to_string(i));
+    }
+    tracker.addRoute("10.0.0.0/24", "nh-reenter");
+    tracker.deleteRoute("10.0.0.0/24");
+    tracker.flushNotifications();
+
+    bool ordered = async_history.size() == static_cast<size_t>(kAddresses);
+    for (std::map<std::string, std::vector<std::pair<std::string, std::string> > >::iterator it =
+             async_history.begin();
+         it != async_history.end(); ++it) {
+        const std::vector<std::pair<std::string, std::string> >& history = it->second;
+        // registration, every update, the delete
+        ordered = ordered && history.size() == static_cast<size_t>(kUpdates + 3) && history.back().second == "";
+        for (size_t i = 1; i < history.size(); ++i) {
+            ordered = ordered && history[i].first == history[i - 1].second;
+        }
+    }
+    check(ordered, "each address hears about every update, in order");
+    check(!async_inline, "no callback runs on the updating thread");
+    check(tracker.lookup("192.0.2.1").nexthop == "from-callback", "callbacks can update the tracker");
+    NotifierStats stats = tracker.notifierStats();
+    check(stats.threads == 3 && stats.queued == 0 && stats.delivered == static_cast<uint64_t>(kAddresses * (kUpdates + 3)),
+          "every notification is delivered");
+    check(stats.max_queued >= 8 && stats.stalls > 0, "updates wait while the queue is full");
+    async_tracker = nullptr;
+}
+
+typedef std::vector<std::pair<std::string, std::string> > AsyncHistory;
+
+// a copy of what asyncCallback recorded for address, taken under the lock
+static AsyncHistory asyncHistory(const std::string& address) {
+    std::lock_guard<std::mutex> lock(async_mutex);
+    std::map<std::string, AsyncHistory>::const_iterator it = async_history.find(address);
+    return it == async_history.end() ? AsyncHistory() : it->second;
+}
+
+// polls until address has heard size callbacks, for at most ten seconds
+static AsyncHistory waitForHistory(const std::string& address, size_t size) {
+    std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    AsyncHistory history = asyncHistory(address);
+    while (history.size() < size && std::chrono::steady_clock::now() < give_up) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        history = asyncHistory(address);
+    }
+    return history;
+}
+
+void testDebounce() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 23: Debounced notifications" << endl;
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    {
+        std::lock_guard<std::mutex> lock(async_mutex);
+        async_history.clear();
+    }
+    tracker.registerAddress("10.1.1.1", &asyncCallback);
+    tracker.registerAddress("10.2.2.2", &asyncCallback);
+    check(asyncHistory("10.1.1.1").size() == 1, "registration callbacks are immediate");
+
+    // a more specific route with the same nexthop is no change
+    tracker.addRoute("10.1.0.0/16", "nh-a");
+    check(asyncHistory("10.1.1.1").size() == 1, "a move to a prefix with the same nexthop is suppressed");
+    tracker.deleteRoute("10.1.0.0/16");
+
+    // long enough that no window closes on its own before the checks
+    tracker.setDebounceWindow(60000);
+    // a flap inside the window: back where it started, no callback
+    tracker.addRoute("10.1.0.0/16", "nh-b");
+    tracker.deleteRoute("10.1.0.0/16");
+    // a change made of several steps: one callback with the net change
+    tracker.addRoute("10.2.0.0/16", "nh-b");
+    tracker.addRoute("10.2.0.0/16", "nh-c");
+    check(asyncHistory("10.2.2.2").size() == 1 && tracker.notifierStats().debouncing == 2,
+          "changes wait for their window to close");
+    // flushNotifications() closes the windows early
+    tracker.flushNotifications();
+    AsyncHistory flapped = asyncHistory("10.1.1.1");
+    AsyncHistory changed = asyncHistory("10.2.2.2");
+    check(flapped.size() == 1, "a flap inside the window sends nothing");
+    check(changed.size() == 2 && changed[1].first == "nh-a" && changed[1].second == "nh-c",
+          "the window closes with one old -> new callback");
+    NotifierStats stats = tracker.notifierStats();
+    check(stats.debouncing == 0 && stats.suppressed == 3, "folded and undone changes are counted");
+
+    // a short window closes by itself
+    tracker.setDebounceWindow(20);
+    tracker.addRoute("10.2.0.0/16", "nh-d");
+    changed = waitForHistory("10.2.2.2", 3);
+    check(changed.size() == 3 && changed[2].second == "nh-d", "the window closes at its deadline");
+
+    // a window opened after the length was cut is not held behind the
+    // longer ones opened before
+    tracker.setDebounceWindow(60000);
+    tracker.addRoute("10.1.0.0/16", "nh-g");
+    tracker.setDebounceWindow(20);
+    tracker.addRoute("10.2.0.0/16", "nh-h");
+    changed = waitForHistory("10.2.2.2", 4);
+    check(changed.size() == 4 && changed[3].second == "nh-h" && asyncHistory("10.1.1.1").size() == 1,
+          "a shorter window closes first");
+    // its callback, on the debounce thread, closes the long window
+    async_tracker = &tracker;
+    tracker.addRoute("10.2.0.0/16", "nh-close");
+    flapped = waitForHistory("10.1.1.1", 2);
+    check(flapped.size() == 2 && flapped[1].second == "nh-g" && asyncHistory("10.2.2.2").size() == 5,
+          "a callback can set window 0");
+    async_tracker = nullptr;
+
+    // unregistering drops the pending change
+    tracker.setDebounceWindow(60000);
+    tracker.addRoute("10.2.0.0/16", "nh-e");
+    tracker.unregisterAddress("10.2.2.2");
+    tracker.setDebounceWindow(0);
+    changed = asyncHistory("10.2.2.2");
+    check(changed.size() == 6 && changed[5].second == "", "an unregistered address hears nothing more");
+    tracker.addRoute("10.1.0.0/16", "nh-f");
+    check(asyncHistory("10.1.1.1").size() == 3, "window 0 delivers at once");
+}
+
+// what a batch subscriber has seen: one entry per callback, each a list of
+// address, old nexthop, new nexthop
+struct BatchLog {
+    RouteTracker* tracker;
+    std::vector<std::vector<std::tuple<std::string, std::string, std::string> > > batches;
+};
+
+void batchCallback(const RouteChange* changes, size_t count, void* context) {
+    BatchLog* log = static_cast<BatchLog*>(context);
+    std::vector<std::tuple<std::string, std::string, std::string> > batch;
+    for (size_t i = 0; i < count; ++i) {
+        char text[INET6_ADDRSTRLEN];
+        if (changes[i].version == IPVersion::IPv4) {
+            in_addr address;
+            address.s_addr = htonl(changes[i].address);
+            inet_ntop(AF_INET, &address, text, sizeof(text));
+        } else {
+            in6_addr address = changes[i].address6.toIn6();
+            inet_ntop(AF_INET6, &address, text, sizeof(text));
+        }
+        batch.push_back(std::make_tuple(std::string(text), std::string(log->tracker->nexthopName(changes[i].old_nexthop)),
+                                        std::string(log->tracker->nexthopName(changes[i].new_nexthop))));
+    }
+    log->batches.push_back(batch);
+}
+
+void testBatchCallbacks() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 24: Batched subscriber callbacks" << endl;
+
+    RouteTracker tracker;
+    BatchLog log;
+    log.tracker = &tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    uint32_t subscriber = tracker.subscribe(&batchCallback, &log);
+    check(subscriber != 0, "subscribe returns an id");
+    check(!tracker.subscribeAddress(0x0A000001, subscriber + 1), "an unknown subscriber is refused");
+
+    tracker.subscribeAddress(0x0A010101, subscriber);
+    tracker.subscribeAddress(0x0A020202, subscriber);
+    tracker.subscribeAddress(0x14000001, subscriber);
+    IPv6Address v6 = {0x20010DB800000000ull, 1};
+    tracker.subscribeAddress(v6, subscriber);
+    check(log.batches.size() == 4 && std::get<2>(log.batches[0][0]) == "nh-a" && std::get<2>(log.batches[2][0]) == "",
+          "subscribing reports the current nexthop");
+
+    // one update moving several addresses is one callback
+    tracker.addRoute("0.0.0.0/0", "nh-default");
+    tracker.addRoute("10.0.0.0/8", "nh-b");
+    check(log.batches.size() == 6 && log.batches[4].size() == 1 && log.batches[5].size() == 2,
+          "one callback per update with every change");
+    check(std::get<0>(log.batches[5][0]) == "10.1.1.1" && std::get<1>(log.batches[5][0]) == "nh-a" &&
+              std::get<2>(log.batches[5][0]) == "nh-b",
+          "records carry address and old and new nexthop");
+
+    // a bulk call and a transaction are one callback each
+    std::vector<std::pair<std::string, std::string> > routes;
+    routes.push_back(std::make_pair("10.1.0.0/16", "nh-c"));
+    routes.push_back(std::make_pair("10.2.0.0/16", "nh-c"));
+    routes.push_back(std::make_pair("2001:db8::/32", "nh-c"));
+    tracker.addRoutes(routes);
+    check(log.batches.size() == 7 && log.batches[6].size() == 3, "a bulk call is one callback");
+    tracker.beginTransaction();
+    tracker.deleteRoute("10.1.0.0/16");
+    tracker.deleteRoute("10.2.0.0/16");
+    tracker.addRoute("20.0.0.0/8", "nh-d");
+    tracker.commit();
+    check(log.batches.size() == 8 && log.batches[7].size() == 3, "a transaction is one callback");
+
+    // per-address callbacks go on as before next to subscribers
+    {
+        std::lock_guard<std::mutex> lock(async_mutex);
+        async_history.clear();
+    }
+    tracker.registerAddress("10.3.3.3", &asyncCallback);
+    tracker.addRoute("10.0.0.0/8", "nh-e");
+    check(asyncHistory("10.3.3.3").size() == 2 && log.batches.size() == 9 && log.batches[8].size() == 2,
+          "callbacks and batches side by side");
+
+    // debounce windows close into one batch
+    tracker.setDebounceWindow(1000);
+    tracker.addRoute("10.0.0.0/8", "nh-f");
+    tracker.addRoute("20.0.0.0/8", "nh-f");
+    tracker.addRoute("20.0.0.0/8", "nh-d");
+    tracker.flushNotifications();
+    check(log.batches.size() == 10 && log.batches[9].size() == 2, "closed windows are batched");
+    tracker.setDebounceWindow(0);
+
+    // unregistering says nothing; unsubscribing ends the callbacks
+    check(tracker.unregisterAddress(0x0A010101) && log.batches.size() == 10, "unregistering is silent");
+    check(tracker.unsubscribe(subscriber) && !tracker.unsubscribe(subscriber), "unsubscribe once");
+    tracker.addRoute("10.0.0.0/8", "nh-g");
+    tracker.addRoute("20.0.0.0/8", "nh-g");
+    check(log.batches.size() == 10 && asyncHistory("10.3.3.3").size() == 4, "an unsubscribed callback hears nothing");
+    check(!tracker.subscribeAddress(0x0A010101, subscriber), "ids are not reused");
+
+    // through the notifier threads
+    BatchLog async_log;
+    async_log.tracker = &tracker;
+    uint32_t async_subscriber = tracker.subscribe(&batchCallback, &async_log);
+    tracker.startNotifiers(2);
+    for (uint32_t i = 0; i < 100; ++i) {
+        tracker.subscribeAddress(0x0A000000 + i, async_subscriber);
+    }
+    tracker.addRoute("10.0.0.0/8", "nh-h");
+    tracker.flushNotifications();
+    check(async_log.batches.size() == 101 && async_log.batches[100].size() == 100 &&
+              std::get<2>(async_log.batches[100][99]) == "nh-h",
+          "batches are delivered by the notifier threads");
+}
+
+void testBulkRegistration() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 25: Bulk registration and handles" << endl;
+
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    tracker.addRoute("10.1.0.0/16", "nh-b");
+    tracker.addRoute("2001:db8::/32", "nh-c");
+    {
+        std::lock_guard<std::mutex> lock(async_mutex);
+        async_history.clear();
+    }
+
+    // unsorted, with a duplicate and an unrouted address
+    const uint32_t addresses[] = {0x0A010101, 0x0A000001, 0x14000001, 0x0A010101};
+    AddressHandle handles[4];
+    check(tracker.registerAddresses(addresses, 4, &asyncCallback, handles) == 4, "every address is registered");
+    check(async_history.size() == 3 && asyncHistory("10.1.1.1").size() == 1 &&
+              asyncHistory("10.1.1.1")[0].second == "nh-b" && asyncHistory("10.0.0.1")[0].second == "nh-a" &&
+              asyncHistory("20.0.0.1")[0].second == "",
+          "one registration callback per address with its current nexthop");
+    check(handles[0] == handles[3] && handles[0] != handles[1] && handles[1] != handles[2] && handles[2] != 0,
+          "duplicates share a handle");
+    check(tracker.registerAddresses(addresses, 4, nullptr) == 0, "a callback is required");
+
+    // tracked like any registration
+    tracker.addRoute("10.1.0.0/16", "nh-d");
+    check(asyncHistory("10.1.1.1").size() == 2 && asyncHistory("10.1.1.1")[1].second == "nh-d",
+          "bulk-registered addresses hear about changes");
+
+    // unregister by handle
+    check(tracker.unregister(handles[0]) && asyncHistory("10.1.1.1").size() == 3, "unregister by handle");
+    check(!tracker.unregister(handles[3]) && !tracker.unregister(0) && !tracker.unregister(12345),
+          "dead and unknown handles are refused");
+    check(tracker.unregisterAddress(0x0A000001) && !tracker.unregister(handles[1]),
+          "a handle dies with its registration");
+
+    // a reused slot gets a new generation
+    AddressHandle again;
+    tracker.registerAddresses(addresses, 1, &asyncCallback, &again);
+    check(again != handles[0] && !tracker.unregister(handles[0]) && tracker.unregister(again),
+          "old handles do not name new registrations");
+
+    // IPv6, and subscribers
+    IPv6Address addresses6[2] = {{0x20010DB800000000ull, 1}, {0x20010DB900000000ull, 1}};
+    AddressHandle handles6[2];
+    tracker.registerAddresses(addresses6, 2, &asyncCallback, handles6);
+    check(asyncHistory("2001:db8::1").size() == 1 && asyncHistory("2001:db8::1")[0].second == "nh-c" &&
+              asyncHistory("2001:db9::1")[0].second == "",
+          "IPv6 bulk registration");
+    check(tracker.unregister(handles6[1]) && tracker.unregister(handles[2]), "IPv6 and IPv4 handles side by side");
+
+    BatchLog log;
+    log.tracker = &tracker;
+    uint32_t subscriber = tracker.subscribe(&batchCallback, &log);
+    const uint32_t subscribed[] = {0x0A020202, 0x0A010102, 0x0A030303};
+    AddressHandle subscribed_handles[3];
+    tracker.subscribeAddresses(subscribed, 3, subscriber, subscribed_handles);
+    check(log.batches.size() == 1 && log.batches[0].size() == 3 && std::get<0>(log.batches[0][0]) == "10.1.1.2",
+          "a subscriber gets one batch, in address order");
+    tracker.unsubscribe(subscriber);
+    check(!tracker.unregister(subscribed_handles[0]), "unsubscribing ends the handles");
+}
+
+int counting_callbacks = 0;
+
+void countingCallback(const std::string&, const std::string&, const std::string&) { ++counting_callbacks; }
+
+void testTrackedTable() {
+    std::cout << std::string(70, '=') << "\n";
+    cout << "Test 26: Flat tracked-address table" << endl;
+
+    // random inserts and erases, clustered so probe runs collide and wrap,
+    // checked against a map
+    TrackedTable table;
+    std::map<uint32_t, uint32_t> reference;
+    std::mt19937 rng(11);
+    bool same = true;
+    for (int i = 0; i < 200000; ++i) {
+        uint32_t address = (rng() % 4096) * ((i % 3) ? 1u : 0x10001u);
+        if (rng() % 3) {
+            bool inserted;
+            TrackedTable::Entry* entry = table.insert(address, 1 + address % 7, &inserted);
+            same = same && inserted == (reference.count(address) == 0) && entry->address == address;
+            entry->nexthop_id = address ^ 0x5A5A;
+            reference[address] = 1 + address % 7;
+        } else {
+            TrackedTable::Entry* entry = table.find(address);
+            same = same && (entry != nullptr) == (reference.count(address) != 0);
+            if (entry) {
+                table.erase(entry);
+                reference.erase(address);
+            }
+        }
+    }
+    size_t found = 0;
+    for (std::map<uint32_t, uint32_t>::iterator it = reference.begin(); it != reference.end(); ++it) {
+        TrackedTable::Entry* entry = table.find(it->first);
+        found += entry && entry->listener == it->second && entry->nexthop_id == (it->first ^ 0x5A5A);
+    }
+    check(same && found == reference.size() && table.size() == reference.size(), "the table matches a map");
+
+    // range queries, one range and several: each finds its first chunk by
+    // binary search and walks the sorted chunks from there, in address order
+    std::vector<std::pair<uint32_t, uint32_t> > ranges;
+    ranges.push_back(std::make_pair(100u, 199u));
+    ranges.push_back(std::make_pair(1000u, 3999u));
+    ranges.push_back(std::make_pair(0x10000u, 0xFFFFFFFFu));
+    for (size_t narrow = 0; narrow < 2; ++narrow) {
+        std::vector<TrackedTable::Entry*> inside;
+        if (narrow) {
+            table.collect(100, 199, inside);
+        } else {
+            table.collect(ranges, inside);
+        }
+        std::vector<uint32_t> expected;
+        for (std::map<uint32_t, uint32_t>::iterator it = reference.begin(); it != reference.end(); ++it) {
+            bool in = it->first >= 100 && it->first <= 199;
+            if (!narrow) {
+                in = in || (it->first >= 1000 && it->first <= 3999) || it->first >= 0x10000;
+            }
+            if (in) {
+                expected.push_back(it->first);
+            }
+        }
+        bool match = inside.size() == expected.size();
+        for (size_t i = 0; match && i < inside.size(); ++i) {
+            match = inside[i]->address == expected[i];
+        }
+        check(match, narrow ? "a narrow range is probed" : "wide ranges are scanned");
+    }
+    check(table.memoryBytes() / table.size() <= 64, "entries are inline");
+
+    // 100k tracked addresses in a tracker
+    RouteTracker tracker;
+    tracker.addRoute("10.0.0.0/8", "nh-a");
+    std::vector<uint32_t> addresses(100000);
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        addresses[i] = (10u << 24) + static_cast<uint32_t>(i) * 131;
+    }
+    tracker.registerAddresses(addresses.data(), addresses.size(), &countingCallback);
+    counting_callbacks = 0;
+    tracker.addRoute("10.0.0.0/8", "nh-b");
+    tracker.addRoute("10.0.1.0/24", "nh-c");
+    check(counting_callbacks == 100000 + 2, "a covering change reaches every address, a /24 only its own");
+}
+
 void testMutexLocks() {
     std::cout << std::string(70, '=') << "\n";
-    cout << "Test 5: Mutex testing running parallel threads" << endl;
+    cout << "Test 27: Mutex testing running parallel threads" << endl;
 // create two threads
     pthread_t t1, t2;
 
@@ -302,7 +1982,7 @@ void testMutexLocks() {
 
 void testDeadLocks() {
     std::cout << std::string(70, '=') << "\n";
-    cout << "Test 5: DEADLOCK testing running parallel threads" << endl;
+    cout << "Test 28: DEADLOCK testing running parallel threads" << endl;
     RouteTracker tracker;
     ThreadArgs args1{1, &tracker};
 
@@ -329,6 +2009,38 @@ int main() {
         testBasics();
         testAddressTracker();
         testEdgeCases();
+        testScopedNotifications();
+        testCompiledFib(RouteTracker::kPatriciaRib, RouteTracker::kDir24Lookup);
+        testCompiledFib(RouteTracker::kCompactRib, RouteTracker::kDir24Lookup);
+        testCompiledFib(RouteTracker::kPatriciaRib, RouteTracker::kLcTrieLookup);
+        testCompiledFib(RouteTracker::kCompactRib, RouteTracker::kPoptrieLookup);
+        testFibKernels();
+        testLockFreeReaders();
+        testSnapshots();
+        testBinaryApi();
+        testNexthopInterning();
+        testPatriciaPool();
+        testCompactTrie();
+        testLcTrie();
+        testPoptrie();
+        testIPv6();
+        testBulkUpdates();
+        testRouteLoader();
+        testSnapshotFiles();
+
+        testUpdateJournal();
+
+        testTransactions();
+
+        testAsyncNotifications();
+
+        testDebounce();
+
+        testBatchCallbacks();
+
+        testBulkRegistration();
+
+        testTrackedTable();
         
         testMutexLocks();
 
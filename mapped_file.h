@@ -0,0 +1,74 @@
+/**
+ * @file mapped_file.h
+ * @brief Read-only memory mapping of a whole file
+ *
+ * Used by the readers of route dumps and snapshot files, which parse the
+ * mapping in place instead of reading it into buffers. Also holds the
+ * directory sync their writers need to make a new name durable.
+ */
+
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class MappedFile {
+public:
+    MappedFile() : data_(nullptr), size_(0) {}
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // An empty file maps to size() 0 and a null data().
+    bool open(const std::string& path, int advice = MADV_NORMAL) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = data != MAP_FAILED;
+            if (ok) {
+                data_ = data;
+                size_ = st.st_size;
+                madvise(data_, size_, advice);
+            }
+        }
+        close(fd);
+        return ok;
+    }
+
+    const char* data() const { return static_cast<const char*>(data_); }
+    size_t size() const { return size_; }
+
+private:
+    void* data_;
+    size_t size_;
+};
+
+// fsync()s the directory holding path, so that a file created in it or
+// renamed into it survives a crash, not just the file's data.
+inline bool syncDirectoryOf(const std::string& path) {
+    std::string::size_type slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+#endif /* _MAPPED_FILE_H */
@@ -0,0 +1,82 @@
+#include <cstring>
+#include <new>
+
+#include "nexthop_table.h"
+#include "epoch.h"
+
+NexthopTable::NexthopTable(EpochReclaimer* reclaimer) : reclaimer_(reclaimer) {
+    memset(chunks_, 0, sizeof(chunks_));
+    // id 0 is never handed out
+    owners_.resize(1);
+    refs_.resize(1);
+}
+
+NexthopTable::~NexthopTable() {
+    for (size_t i = 0; i < kChunks; ++i) {
+        delete[] chunks_[i];
+    }
+}
+
+uint32_t NexthopTable::allocId() {
+    if (!free_ids_.empty()) {
+        uint32_t id = free_ids_.back();
+        free_ids_.pop_back();
+        return id;
+    }
+    if (owners_.size() > kMaxId) {
+        return 0;
+    }
+    uint32_t id = static_cast<uint32_t>(owners_.size());
+    owners_.resize(id + 1);
+    refs_.resize(id + 1);
+    size_t chunk = id >> kChunkBits;
+    if (!chunks_[chunk]) {
+        const std::string** entries = new const std::string*[size_t(1) << kChunkBits]();
+        __atomic_store_n(&chunks_[chunk], entries, __ATOMIC_RELEASE);
+    }
+    return id;
+}
+
+uint32_t NexthopTable::acquire(std::string_view nexthop) {
+    std::unordered_map<std::string_view, uint32_t>::iterator it = ids_.find(nexthop);
+    if (it != ids_.end()) {
+        ++refs_[it->second];
+        return it->second;
+    }
+
+    uint32_t id = allocId();
+    if (id == 0) {
+        return 0;
+    }
+    owners_[id] = std::make_shared<const std::string>(nexthop);
+    refs_[id] = 1;
+    ids_.insert(std::make_pair(std::string_view(*owners_[id]), id));
+    __atomic_store_n(&chunks_[id >> kChunkBits][id & kChunkMask], owners_[id].get(), __ATOMIC_RELEASE);
+    return id;
+}
+
+void NexthopTable::retain(uint32_t id) {
+    ++refs_[id];
+}
+
+// The id disappears from the intern map at once, so a new acquire() of the
+// same string gets a fresh id; the old one is only recycled after the grace
+// period, since readers may still be resolving it.
+void NexthopTable::release(uint32_t id) {
+    if (--refs_[id] != 0) {
+        return;
+    }
+    ids_.erase(std::string_view(*owners_[id]));
+
+    std::function<void()> recycle = [this, id]() {
+        __atomic_store_n(&chunks_[id >> kChunkBits][id & kChunkMask], static_cast<const std::string*>(nullptr),
+                         __ATOMIC_RELAXED);
+        owners_[id].reset();
+        free_ids_.push_back(id);
+    };
+    if (reclaimer_) {
+        reclaimer_->retire(recycle);
+    } else {
+        recycle();
+    }
+}
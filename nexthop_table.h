@@ -0,0 +1,74 @@
+/**
+ * @file nexthop_table.h
+ * @brief Reference counted intern table for nexthop strings
+ *
+ * Every distinct nexthop is stored once and named by a 32-bit id, so routes
+ * and tracked addresses hold integers and compare them instead of strings.
+ * Ids start at 1 (0 means "no nexthop") and fit in a Dir24Fib value.
+ *
+ * acquire()/retain()/release() are writer-side and must be serialized by the
+ * caller. get() is lock-free: strings live in fixed chunks that never move,
+ * and a released id keeps resolving to its string until the owner's
+ * EpochReclaimer has seen every reader leave, only then is the id reused.
+ */
+
+#ifndef _NEXTHOP_TABLE_H
+#define _NEXTHOP_TABLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class EpochReclaimer;
+
+class NexthopTable {
+public:
+    static const uint32_t kMaxId = 0x00FFFFFF;
+
+    // without a reclaimer, released ids are reused at once (single threaded use)
+    explicit NexthopTable(EpochReclaimer* reclaimer = nullptr);
+    ~NexthopTable();
+
+    NexthopTable(const NexthopTable&) = delete;
+    NexthopTable& operator=(const NexthopTable&) = delete;
+
+    // Returns the id of nexthop with one more reference, interning it first
+    // if needed; 0 when the table already holds kMaxId nexthops.
+    uint32_t acquire(std::string_view nexthop);
+    void retain(uint32_t id);
+    void release(uint32_t id);
+
+    // the interned string, for sharing with snapshots (writer side)
+    const std::shared_ptr<const std::string>& shared(uint32_t id) const { return owners_[id]; }
+    // distinct nexthops currently referenced
+    size_t size() const { return ids_.size(); }
+
+    // Lock-free; the string stays valid while the calling thread holds an
+    // EpochGuard, even if the id is released meanwhile.
+    const std::string* get(uint32_t id) const {
+        const std::string* const* chunk = __atomic_load_n(&chunks_[id >> kChunkBits], __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&chunk[id & kChunkMask], __ATOMIC_ACQUIRE);
+    }
+
+private:
+    static const size_t kChunkBits = 12;
+    static const uint32_t kChunkMask = (1u << kChunkBits) - 1;
+    static const size_t kChunks = (size_t(kMaxId) + 1) >> kChunkBits;
+
+    uint32_t allocId();
+
+    EpochReclaimer* reclaimer_;
+    const std::string** chunks_[kChunks];
+    // writer-side state, indexed by id
+    std::vector<std::shared_ptr<const std::string>> owners_;
+    std::vector<uint32_t> refs_;
+    std::vector<uint32_t> free_ids_;
+    // keys view the interned strings themselves
+    std::unordered_map<std::string_view, uint32_t> ids_;
+};
+
+#endif /* _NEXTHOP_TABLE_H */
@@ -0,0 +1,223 @@
+/**
+ * @file notifier_pool.h
+ * @brief Lock-free MPSC queues drained by a pool of notifier threads
+ *
+ * Each notifier thread owns one queue (a shard). Items are sharded by a key,
+ * so items pushed with the same key are delivered by the same thread in push
+ * order; items of different keys are delivered concurrently. Producers never
+ * block in push(): the queue is Vyukov's intrusive MPSC list, one atomic
+ * exchange per push. Backpressure is separate, in waitForRoom(), so that
+ * producers can wait for room before taking their own locks and push under
+ * them.
+ */
+
+#ifndef _NOTIFIER_POOL_H
+#define _NOTIFIER_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+// Unbounded multi-producer single-consumer queue. push() is wait-free and
+// may run on any thread; pop() and empty() only on the consumer's.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head_(&stub_), tail_(&stub_) { stub_.next.store(nullptr, std::memory_order_relaxed); }
+    ~MpscQueue() {
+        T value;
+        while (pop(value)) {
+        }
+        if (tail_ != &stub_) {
+            delete tail_;
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T&& value) {
+        Node* node = new Node(std::move(value));
+        Node* previous = head_.exchange(node, std::memory_order_acq_rel);
+        // until this store the consumer sees the queue end at previous
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T& value) {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        // next becomes the new stub; its value is moved out
+        value = std::move(next->value);
+        tail_ = next;
+        if (tail != &stub_) {
+            delete tail;
+        }
+        return true;
+    }
+
+    bool empty() const { return tail_->next.load(std::memory_order_acquire) == nullptr; }
+
+private:
+    struct Node {
+        Node() : next(nullptr) {}
+        explicit Node(T&& v) : next(nullptr), value(std::move(v)) {}
+        std::atomic<Node*> next;
+        T value;
+    };
+
+    Node stub_;
+    std::atomic<Node*> head_;   // last pushed, producers' end
+    Node* tail_;                // consumer's end, already popped
+};
+
+template <typename Item>
+class NotifierPool {
+public:
+    typedef std::function<void(Item&)> Deliver;
+
+    // threads notifier threads calling deliver; waitForRoom() holds producers
+    // back while max_queued items are waiting
+    NotifierPool(unsigned threads, size_t max_queued, Deliver deliver)
+        : max_queued_(max_queued), deliver_(deliver), queued_(0), max_seen_(0), delivered_(0), stalls_(0),
+          waiting_(0), stop_(false) {
+        for (unsigned i = 0; i < threads; ++i) {
+            shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            shards_[i]->thread = std::thread(&NotifierPool::run, this, shards_[i].get());
+        }
+    }
+    // delivers everything queued, then stops the threads
+    ~NotifierPool() {
+        stop_.store(true);
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            wake(*shards_[i]);
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->thread.join();
+        }
+    }
+
+    NotifierPool(const NotifierPool&) = delete;
+    NotifierPool& operator=(const NotifierPool&) = delete;
+
+    // Never blocks. Items with equal keys are delivered in push order, which
+    // is only meaningful if the caller serializes those pushes.
+    void push(uint64_t key, Item&& item) {
+        size_t queued = queued_.fetch_add(1) + 1;
+        size_t seen = max_seen_.load(std::memory_order_relaxed);
+        while (queued > seen && !max_seen_.compare_exchange_weak(seen, queued, std::memory_order_relaxed)) {
+        }
+        Shard& shard = *shards_[key % shards_.size()];
+        shard.queue.push(std::move(item));
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (shard.sleeping.load()) {
+            wake(shard);
+        }
+    }
+
+    // Backpressure: blocks while max_queued items are waiting. Returns at
+    // once on a notifier thread, whose callbacks may produce items too.
+    void waitForRoom() {
+        if (queued_.load() < max_queued_ || current_ == this) {
+            return;
+        }
+        stalls_.fetch_add(1, std::memory_order_relaxed);
+        waitUntil([this]() { return queued_.load() < max_queued_; });
+    }
+
+    // waits until every item pushed so far has been delivered
+    void drain() {
+        if (current_ == this) {
+            return;
+        }
+        waitUntil([this]() { return queued_.load() == 0; });
+    }
+
+    size_t queued() const { return queued_.load(std::memory_order_relaxed); }
+    size_t maxQueued() const { return max_seen_.load(std::memory_order_relaxed); }
+    uint64_t delivered() const { return delivered_.load(std::memory_order_relaxed); }
+    uint64_t stalls() const { return stalls_.load(std::memory_order_relaxed); }
+    unsigned threads() const { return static_cast<unsigned>(shards_.size()); }
+
+private:
+    struct Shard {
+        Shard() : sleeping(false) {}
+        MpscQueue<Item> queue;
+        std::atomic<bool> sleeping;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::thread thread;
+    };
+
+    static void wake(Shard& shard) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.wake.notify_one();
+    }
+
+    template <typename Predicate>
+    void waitUntil(Predicate done) {
+        std::unique_lock<std::mutex> lock(room_mutex_);
+        waiting_.fetch_add(1);
+        room_.wait(lock, done);
+        waiting_.fetch_sub(1);
+    }
+
+    void run(Shard* shard) {
+        current_ = this;
+        Item item;
+        for (;;) {
+            if (shard->queue.pop(item)) {
+                deliver_(item);
+                item = Item();
+                delivered_.fetch_add(1, std::memory_order_relaxed);
+                queued_.fetch_sub(1);
+                if (waiting_.load() > 0) {
+                    std::lock_guard<std::mutex> lock(room_mutex_);
+                    room_.notify_all();
+                }
+                continue;
+            }
+            // sleeping is set before the last look at the queue and push()
+            // reads it after pushing, so one of the two sees the other
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            shard->sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (shard->queue.empty()) {
+                if (stop_.load()) {
+                    break;
+                }
+                shard->wake.wait(lock);
+            }
+            shard->sleeping.store(false);
+        }
+    }
+
+    std::vector<std::unique_ptr<Shard> > shards_;
+    const size_t max_queued_;
+    Deliver deliver_;
+    std::atomic<size_t> queued_;        // pushed, not yet delivered
+    std::atomic<size_t> max_seen_;
+    std::atomic<uint64_t> delivered_;
+    std::atomic<uint64_t> stalls_;
+    std::atomic<int> waiting_;          // threads in waitUntil()
+    std::atomic<bool> stop_;
+    std::mutex room_mutex_;
+    std::condition_variable room_;
+    // the pool whose notifier thread this is, if any
+    static thread_local const NotifierPool* current_;
+};
+
+template <typename Item>
+thread_local const NotifierPool<Item>* NotifierPool<Item>::current_ = nullptr;
+
+#endif /* _NOTIFIER_POOL_H */
@@ -339,6 +339,104 @@ Deref_Prefix (prefix_t * prefix)
 
 /* } */
 
+/* { node pool */
+
+#define PATRICIA_SLAB_BYTES	(64 * 1024)
+
+/* the inline prefix lives right behind the node */
+#define node_inline_prefix(node) ((prefix_t *)((char *)(node) + sizeof (patricia_node_t)))
+
+static void
+patricia_pool_init (patricia_pool_t *pool, u_int maxbits)
+{
+    size_t prefix_size = (maxbits <= sizeof(struct in_addr) * 8)?
+				sizeof (prefix4_t): sizeof (prefix_t);
+    size_t align = sizeof (void *);
+
+    pool->object_size = (sizeof (patricia_node_t) + prefix_size + align - 1) & ~(align - 1);
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->bump = pool->bump_end = NULL;
+    pool->num_slabs = 0;
+}
+
+static patricia_node_t *
+patricia_node_alloc (patricia_tree_t *patricia)
+{
+    patricia_pool_t *pool = &patricia->pool;
+    void *object;
+
+    if (pool->free_list) {
+	object = pool->free_list;
+	pool->free_list = *(void **)object;
+    }
+    else {
+	if (pool->bump == NULL || pool->bump + pool->object_size > pool->bump_end) {
+	    patricia_slab_t *slab = (patricia_slab_t *)malloc (PATRICIA_SLAB_BYTES);
+	    if (slab == NULL)
+		return (NULL);
+	    slab->next = pool->slabs;
+	    pool->slabs = slab;
+	    pool->num_slabs++;
+	    /* objects start pointer-aligned after the header */
+	    pool->bump = (char *)slab + sizeof (void *) *
+				((sizeof (patricia_slab_t) + sizeof (void *) - 1) / sizeof (void *));
+	    pool->bump_end = (char *)slab + PATRICIA_SLAB_BYTES;
+	}
+	object = pool->bump;
+	pool->bump += pool->object_size;
+    }
+    memset (object, 0, pool->object_size);
+    return ((patricia_node_t *)object);
+}
+
+static void
+patricia_node_free (patricia_tree_t *patricia, patricia_node_t *node)
+{
+    *(void **)node = patricia->pool.free_list;
+    patricia->pool.free_list = node;
+}
+
+/* gives every node of the tree back at once, one free() per slab */
+static void
+patricia_pool_clear (patricia_pool_t *pool)
+{
+    patricia_slab_t *slab = pool->slabs;
+
+    while (slab) {
+	patricia_slab_t *next = slab->next;
+	free (slab);
+	slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->bump = pool->bump_end = NULL;
+    pool->num_slabs = 0;
+}
+
+/* copies prefix into the node's inline storage. The copy has ref_count 0,
+ * i.e. it is static: Ref_Prefix() on it hands out a private copy, and it must
+ * never be passed to Deref_Prefix(). */
+static prefix_t *
+patricia_node_set_prefix (patricia_node_t *node, prefix_t *prefix)
+{
+    prefix_t *inline_prefix = node_inline_prefix (node);
+
+    inline_prefix->family = prefix->family;
+    inline_prefix->bitlen = prefix->bitlen;
+    inline_prefix->ref_count = 0;
+#ifdef HAVE_IPV6
+    if (prefix->family == AF_INET6)
+	memcpy (&inline_prefix->add.sin6, &prefix->add.sin6, sizeof(struct in6_addr));
+    else
+#endif /* HAVE_IPV6 */
+	memcpy (&inline_prefix->add.sin, &prefix->add.sin, sizeof(struct in_addr));
+    node->prefix = inline_prefix;
+    return (inline_prefix);
+}
+
+/* } */
+
 /* #define PATRICIA_DEBUG 1 */
 
 static int num_active_patricia = 0;
@@ -354,6 +452,7 @@ New_Patricia (int maxbits)
     patricia->head = NULL;
     patricia->num_active_node = 0;
     assert (maxbits <= PATRICIA_MAXBITS); /* XXX */
+    patricia_pool_init (&patricia->pool, maxbits);
     num_active_patricia++;
     return (patricia);
 }
@@ -368,7 +467,7 @@ void
 Clear_Patricia (patricia_tree_t *patricia, void_fn_t func)
 {
     assert (patricia);
-    if (patricia->head) {
+    if (patricia->head && func) {
 
         patricia_node_t *Xstack[PATRICIA_MAXBITS+1];
         patricia_node_t **Xsp = Xstack;
@@ -379,15 +478,12 @@ Clear_Patricia (patricia_tree_t *patricia, void_fn_t func)
             patricia_node_t *r = Xrn->r;
 
     	    if (Xrn->prefix) {
-		Deref_Prefix (Xrn->prefix);
-		if (Xrn->data && func)
+		if (Xrn->data)
 	    	    func (Xrn->data);
     	    }
     	    else {
 		assert (Xrn->data == NULL);
     	    }
-    	    Delete (Xrn);
-	    patricia->num_active_node--;
 
             if (l) {
                 if (r) {
@@ -403,7 +499,10 @@ Clear_Patricia (patricia_tree_t *patricia, void_fn_t func)
             }
         }
     }
-    assert (patricia->num_active_node == 0);
+    /* prefixes are inline, so the nodes need no visit of their own */
+    patricia_pool_clear (&patricia->pool);
+    patricia->head = NULL;
+    patricia->num_active_node = 0;
     /* Delete (patricia); */
 }
 
@@ -639,9 +738,11 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
     assert (prefix->bitlen <= patricia->maxbits);
 
     if (patricia->head == NULL) {
-	node = (patricia_node_t*)calloc(1, sizeof *node);
+	node = patricia_node_alloc (patricia);
+	if (node == NULL)
+	    return (NULL);
 	node->bit = prefix->bitlen;
-	node->prefix = Ref_Prefix (prefix);
+	patricia_node_set_prefix (node, prefix);
 	node->parent = NULL;
 	node->l = node->r = NULL;
 	node->data = NULL;
@@ -741,7 +842,7 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 #endif /* PATRICIA_DEBUG */
 	    return (node);
 	}
-	node->prefix = Ref_Prefix (prefix);
+	patricia_node_set_prefix (node, prefix);
 #ifdef PATRICIA_DEBUG
 	fprintf (stderr, "patricia_lookup: new node #1 %s/%d (glue mod)\n",
 		 prefix_toa (prefix), prefix->bitlen);
@@ -750,9 +851,11 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	return (node);
     }
 
-    new_node = (patricia_node_t*)calloc(1, sizeof *new_node);
+    new_node = patricia_node_alloc (patricia);
+    if (new_node == NULL)
+	return (NULL);
     new_node->bit = prefix->bitlen;
-    new_node->prefix = Ref_Prefix (prefix);
+    patricia_node_set_prefix (new_node, prefix);
     new_node->parent = NULL;
     new_node->l = new_node->r = NULL;
     new_node->data = NULL;
@@ -802,7 +905,12 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 #endif /* PATRICIA_DEBUG */
     }
     else {
-        glue = (patricia_node_t*)calloc(1, sizeof *glue);
+        glue = patricia_node_alloc (patricia);
+        if (glue == NULL) {
+	    patricia_node_free (patricia, new_node);
+	    patricia->num_active_node--;
+	    return (NULL);
+        }
         glue->bit = differ_bit;
         glue->prefix = NULL;
         glue->parent = node->parent;
@@ -855,8 +963,6 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
 	
 	/* this might be a placeholder node -- have to check and make sure
 	 * there is a prefix aossciated with it ! */
-	if (node->prefix != NULL) 
-	  Deref_Prefix (node->prefix);
 	node->prefix = NULL;
 	/* Also I needed to clear data pointer -- masaki */
 	node->data = NULL;
@@ -869,8 +975,7 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
 		 prefix_toa (node->prefix), node->prefix->bitlen);
 #endif /* PATRICIA_DEBUG */
 	parent = node->parent;
-	Deref_Prefix (node->prefix);
-	Delete (node);
+	patricia_node_free (patricia, node);
         patricia->num_active_node--;
 
 	if (parent == NULL) {
@@ -906,7 +1011,7 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
 	    parent->parent->l = child;
 	}
 	child->parent = parent->parent;
-	Delete (parent);
+	patricia_node_free (patricia, parent);
         patricia->num_active_node--;
 	return;
     }
@@ -925,8 +1030,7 @@ patricia_remove (patricia_tree_t *patricia, patricia_node_t *node)
     parent = node->parent;
     child->parent = parent;
 
-    Deref_Prefix (node->prefix);
-    Delete (node);
+    patricia_node_free (patricia, node);
     patricia->num_active_node--;
 
     if (parent == NULL) {
@@ -73,10 +73,28 @@ typedef struct _patricia_node_t {
    void	*user1;			/* pointer to usr data (ex. route flap info) */
 } patricia_node_t;
 
+/* Node pool owned by a tree. Nodes are carved out of large slabs, one size
+ * class per tree: the node itself followed by room for an inline prefix of
+ * the tree's family, so a node and its prefix share a cache line and there is
+ * no separate prefix allocation. Freed nodes go on a free list and are reused
+ * first; slabs are only returned to the system when the tree is cleared. */
+typedef struct _patricia_slab_t {
+   struct _patricia_slab_t *next;
+} patricia_slab_t;
+
+typedef struct _patricia_pool_t {
+   size_t object_size;		/* node + inline prefix, rounded up */
+   patricia_slab_t *slabs;
+   void *free_list;		/* freed nodes, linked through their first word */
+   char *bump, *bump_end;	/* never used part of the newest slab */
+   u_int num_slabs;
+} patricia_pool_t;
+
 typedef struct _patricia_tree_t {
    patricia_node_t 	*head;
    u_int		maxbits;	/* for IP, 32 bit addresses */
    int num_active_node;		/* for debug purpose */
+   patricia_pool_t	pool;
 } patricia_tree_t;
 
 
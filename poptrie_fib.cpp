@@ -0,0 +1,275 @@
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "poptrie_fib.h"
+
+namespace {
+
+const int kStride = 6;
+
+struct PopNode {
+    uint64_t vector;    // bit i: child i is a node
+    uint64_t leafvec;   // bit i: a run of equal leaves starts at child i
+    uint32_t base0;     // first leaf
+    uint32_t base1;     // first child node
+};
+
+struct PopRoute {
+    uint32_t key;
+    uint32_t value;
+    int length;
+};
+
+inline uint32_t popMask(int length) {
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+// the 6 bits at position; past bit 31 they read as zero, so the last level
+// (position 28) only uses every fourth child
+inline uint32_t strideBits(uint32_t key, int position) {
+    return (key << position) >> (32 - kStride);
+}
+
+} // namespace
+
+// One allocation: the header, then node_count nodes (the root first),
+// leaf_count leaves and route_count routes sorted by (key, length). Only the
+// nodes and leaves are read by lookups; the routes are kept for rebuilds.
+struct PoptrieFib::Chunk {
+    typedef PopRoute Route;
+
+    uint32_t node_count;
+    uint32_t leaf_count;
+    uint32_t route_count;
+    uint32_t bytes;
+
+    const PopNode* nodes() const { return reinterpret_cast<const PopNode*>(this + 1); }
+    const uint32_t* leaves() const { return reinterpret_cast<const uint32_t*>(nodes() + node_count); }
+    const PopRoute* routes() const { return reinterpret_cast<const PopRoute*>(leaves() + leaf_count); }
+
+    static Chunk* create(const std::vector<PopNode>& nodes, const std::vector<uint32_t>& leaves,
+                         const std::vector<PopRoute>& routes) {
+        size_t bytes = sizeof(Chunk) + nodes.size() * sizeof(PopNode) + leaves.size() * sizeof(uint32_t) +
+                       routes.size() * sizeof(PopRoute);
+        Chunk* chunk = static_cast<Chunk*>(::operator new(bytes));
+        chunk->node_count = static_cast<uint32_t>(nodes.size());
+        chunk->leaf_count = static_cast<uint32_t>(leaves.size());
+        chunk->route_count = static_cast<uint32_t>(routes.size());
+        chunk->bytes = static_cast<uint32_t>(bytes);
+        memcpy(const_cast<PopNode*>(chunk->nodes()), nodes.data(), nodes.size() * sizeof(PopNode));
+        memcpy(const_cast<uint32_t*>(chunk->leaves()), leaves.data(), leaves.size() * sizeof(uint32_t));
+        memcpy(const_cast<PopRoute*>(chunk->routes()), routes.data(), routes.size() * sizeof(PopRoute));
+        return chunk;
+    }
+    static void destroy(Chunk* chunk) { ::operator delete(chunk); }
+    static Chunk* build(const std::vector<PopRoute>& routes);
+    void copyRoutes(std::vector<PopRoute>& out) const { out.assign(routes(), routes() + route_count); }
+
+    // leaf entry for address, 0 when no route longer than /16 covers it
+    __attribute__((always_inline)) uint32_t lookup(uint32_t address) const {
+        const PopNode* all = nodes();
+        const PopNode* node = all;
+        for (int position = Table::kTopBits;; position += kStride) {
+            uint32_t child = strideBits(address, position);
+            uint64_t upto = (2ULL << child) - 1;   // bits 0..child
+            if (!((node->vector >> child) & 1)) {
+                return leaves()[node->base0 + __builtin_popcountll(node->leafvec & upto) - 1];
+            }
+            node = &all[node->base1 + __builtin_popcountll(node->vector & upto) - 1];
+        }
+    }
+};
+
+namespace {
+
+// Builds the nodes and leaves of one chunk from its routes, all longer than
+// /16 and inside the same /16.
+class PoptrieBuilder {
+public:
+    PoptrieBuilder(const std::vector<PopRoute>& routes, uint32_t (*make_entry)(uint32_t, int))
+        : routes_(routes), make_entry_(make_entry) {}
+
+    void build(int top_bits) {
+        nodes_.assign(1, PopNode());
+        buildNode(0, 0, routes_.size(), routes_[0].key & popMask(top_bits), top_bits, 0);
+    }
+
+    const std::vector<PopNode>& nodes() const { return nodes_; }
+    const std::vector<uint32_t>& leaves() const { return leaves_; }
+
+private:
+    static const int kChildren = 1 << kStride;
+
+    // Routes [first, last) lie inside the node's region; those no longer
+    // than position were folded into inherited by the parent.
+    void buildNode(size_t node, size_t first, size_t last, uint32_t region, int position, uint32_t inherited) {
+        uint32_t leaf[kChildren];
+        int leaf_length[kChildren];
+        bool internal[kChildren] = {};
+        for (int c = 0; c < kChildren; ++c) {
+            leaf[c] = inherited;
+            leaf_length[c] = -1;
+        }
+        for (size_t i = first; i < last; ++i) {
+            const PopRoute& route = routes_[i];
+            if (route.length <= position) {
+                continue;
+            }
+            uint32_t child = strideBits(route.key, position);
+            if (route.length > position + kStride) {
+                internal[child] = true;
+                continue;
+            }
+            // a shorter route spans a run of children; the longest one wins
+            uint32_t span = 1u << (position + kStride - route.length);
+            for (uint32_t c = child; c < child + span; ++c) {
+                if (route.length > leaf_length[c]) {
+                    leaf[c] = make_entry_(route.value, route.length);
+                    leaf_length[c] = route.length;
+                }
+            }
+        }
+
+        PopNode built = PopNode();
+        built.base1 = static_cast<uint32_t>(nodes_.size());
+        built.base0 = static_cast<uint32_t>(leaves_.size());
+        for (int c = 0; c < kChildren; ++c) {
+            if (internal[c]) {
+                built.vector |= 1ULL << c;
+            } else if (built.leafvec == 0 || leaf[c] != leaves_.back()) {
+                built.leafvec |= 1ULL << c;
+                leaves_.push_back(leaf[c]);
+            }
+        }
+        nodes_.resize(nodes_.size() + __builtin_popcountll(built.vector));
+        nodes_[node] = built;
+
+        // routes are sorted by key, so each child's routes are a contiguous run
+        size_t i = first;
+        uint32_t next = built.base1;
+        for (int c = 0; c < kChildren; ++c) {
+            size_t start = i;
+            while (i < last && strideBits(routes_[i].key, position) == static_cast<uint32_t>(c)) {
+                ++i;
+            }
+            if (internal[c]) {
+                uint32_t child_region = region | (static_cast<uint32_t>(c) << (32 - position - kStride));
+                buildNode(next++, start, i, child_region, position + kStride, leaf[c]);
+            }
+        }
+    }
+
+    const std::vector<PopRoute>& routes_;
+    uint32_t (*make_entry_)(uint32_t, int);
+    std::vector<PopNode> nodes_;
+    std::vector<uint32_t> leaves_;
+};
+
+} // namespace
+
+PoptrieFib::Chunk* PoptrieFib::Chunk::build(const std::vector<PopRoute>& routes) {
+    PoptrieBuilder builder(routes, Table::makeEntry);
+    builder.build(Table::kTopBits);
+    return create(builder.nodes(), builder.leaves(), routes);
+}
+
+PoptrieFib::PoptrieFib(EpochReclaimer* reclaimer) : popcnt_(false), table_(reclaimer) {
+#if defined(__x86_64__) || defined(__i386__)
+    popcnt_ = __builtin_cpu_supports("popcnt");
+#endif
+}
+
+PoptrieFib::~PoptrieFib() {}
+
+void PoptrieFib::insert(uint32_t prefix, int length, uint32_t value) {
+    table_.insert(prefix, length, value, Chunk::build);
+}
+
+void PoptrieFib::remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length) {
+    table_.remove(prefix, length, replacement_value, replacement_length, Chunk::build);
+}
+
+__attribute__((always_inline)) inline bool PoptrieFib::resolve(uint32_t address, uint32_t* value,
+                                                               int* length) const {
+    uint32_t entry = 0;
+    if (const Chunk* chunk = table_.chunk(Table::slot(address))) {
+        entry = chunk->lookup(address);
+    }
+    if (!(entry & Table::kValid)) {
+        entry = table_.top(Table::slot(address));
+    }
+    if (!(entry & Table::kValid)) {
+        *value = 0;
+        *length = -1;
+        return false;
+    }
+    *value = entry & Table::kValueMask;
+    *length = Table::entryDepth(entry);
+    return true;
+}
+
+// Each stage is prefetched for the whole burst before it is read: the chunk
+// slot and direct entry, then the chunk header with its root node.
+__attribute__((always_inline)) inline void PoptrieFib::resolveBatch(const uint32_t* addresses, size_t count,
+                                                                    uint32_t* values, int* lengths) const {
+    for (size_t i = 0; i < count; ++i) {
+        table_.prefetchChunk(Table::slot(addresses[i]));
+        table_.prefetchTop(Table::slot(addresses[i]));
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (const Chunk* chunk = table_.chunk(Table::slot(addresses[i]))) {
+            __builtin_prefetch(chunk);
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        resolve(addresses[i], &values[i], &lengths[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt"))) bool PoptrieFib::lookupPopcnt(uint32_t address, uint32_t* value,
+                                                                int* length) const {
+    return resolve(address, value, length);
+}
+
+__attribute__((target("popcnt"))) void PoptrieFib::lookupBatchPopcnt(const uint32_t* addresses, size_t count,
+                                                                     uint32_t* values, int* lengths) const {
+    resolveBatch(addresses, count, values, lengths);
+}
+#else
+bool PoptrieFib::lookupPopcnt(uint32_t address, uint32_t* value, int* length) const {
+    return resolve(address, value, length);
+}
+
+void PoptrieFib::lookupBatchPopcnt(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    resolveBatch(addresses, count, values, lengths);
+}
+#endif
+
+bool PoptrieFib::lookup(uint32_t address, uint32_t* value, int* length) const {
+    if (popcnt_) {
+        return lookupPopcnt(address, value, length);
+    }
+    return resolve(address, value, length);
+}
+
+void PoptrieFib::lookupBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const {
+    if (popcnt_) {
+        lookupBatchPopcnt(addresses, count, values, lengths);
+    } else {
+        resolveBatch(addresses, count, values, lengths);
+    }
+}
+
+size_t PoptrieFib::nodes() const {
+    size_t total = 0;
+    table_.forEachChunk([&total](const Chunk& chunk) { total += chunk.node_count; });
+    return total;
+}
+
+size_t PoptrieFib::memoryBytes() const {
+    size_t bytes = sizeof(*this);
+    table_.forEachChunk([&bytes](const Chunk& chunk) { bytes += chunk.bytes; });
+    return bytes;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file poptrie_fib.h
+ * @brief Poptrie IPv4 forwarding table
+ *
+ * Alternative to Dir24Fib for deployments that cannot spare 64MB. The top 16
+ * address bits index a 2^16 entry direct table holding the best route of
+ * length 16 or less; every /16 that also has longer routes gets a poptrie
+ * (Asai & Ohara) over them. A poptrie node branches on 6 bits: a 64-bit
+ * vector marks which of the 64 children are nodes, a second 64-bit leafvec
+ * marks where runs of identical leaves start, and the child or leaf index is
+ * a base plus a popcount of the bits below. Runs of equal leaves are stored
+ * once, so a node with few distinct routes costs 24 bytes and a few leaves,
+ * and a lookup is the direct table plus at most three nodes.
+ *
+ * Leaves use the Dir24Fib entry format (valid | length | 24-bit value).
+ * Chunks are one allocation each; they and the direct table, with the
+ * rebuild and republishing of a chunk on every update of a route longer
+ * than /16, are ChunkedFib's (chunked_fib.h). Same threading model as
+ * Dir24Fib: one writer, any number of readers inside an EpochGuard.
+ */
+
+#ifndef _POPTRIE_FIB_H
+#define _POPTRIE_FIB_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "chunked_fib.h"
+
+class PoptrieFib {
+public:
+    // values must fit in 24 bits
+    static const uint32_t kMaxValue = 0x00FFFFFF;
+
+    explicit PoptrieFib(EpochReclaimer* reclaimer = nullptr);
+    ~PoptrieFib();
+
+    PoptrieFib(const PoptrieFib&) = delete;
+    PoptrieFib& operator=(const PoptrieFib&) = delete;
+
+    // Same contract as Dir24Fib::insert()/remove().
+    void insert(uint32_t prefix, int length, uint32_t value);
+    void remove(uint32_t prefix, int length, uint32_t replacement_value, int replacement_length);
+
+    bool lookup(uint32_t address, uint32_t* value, int* length) const;
+    // lengths[i] is -1 when addresses[i] has no route
+    void lookupBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+
+    // true when lookups use the popcnt instruction
+    bool hardwarePopcount() const { return popcnt_; }
+    size_t chunks() const { return table_.chunks(); }
+    // poptrie nodes in all chunks
+    size_t nodes() const;
+    size_t memoryBytes() const;
+
+private:
+    struct Chunk;
+    typedef ChunkedFib<Chunk> Table;
+
+    // lookup bodies, compiled once per popcount flavour
+    bool resolve(uint32_t address, uint32_t* value, int* length) const;
+    void resolveBatch(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+    bool lookupPopcnt(uint32_t address, uint32_t* value, int* length) const;
+    void lookupBatchPopcnt(const uint32_t* addresses, size_t count, uint32_t* values, int* lengths) const;
+
+    bool popcnt_;
+    Table table_;
+};
+
+#endif /* _POPTRIE_FIB_H */
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <arpa/inet.h>
+
+#include "route_tracker.h"
+#include "mapped_file.h"
+
+namespace {
+
+typedef std::vector<std::pair<IPAddress, std::string_view> > ParsedRoutes;
+
+// parse chunks smaller than this are not worth a thread
+const size_t kMinChunk = 1 << 20;
+
+// ---- MRT TABLE_DUMP_V2 (RFC 6396) ----
+
+const size_t kMrtHeader = 12;           // timestamp:4 type:2 subtype:2 length:4
+const uint16_t kTableDumpV2 = 13;
+const uint16_t kRibIpv4Unicast = 2;
+const uint16_t kRibIpv6Unicast = 4;
+const uint16_t kRibIpv4UnicastAddPath = 8;
+const uint16_t kRibIpv6UnicastAddPath = 10;
+const uint8_t kAttrExtendedLength = 0x10;
+const uint8_t kAttrNextHop = 3;
+const uint8_t kAttrMpReachNlri = 14;
+
+inline uint16_t load16(const unsigned char* p) { return static_cast<uint16_t>(p[0] << 8 | p[1]); }
+inline uint32_t load32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+           static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+// MRT nexthops are binary; each worker formats every distinct one once and
+// hands out views of its copy.
+class NexthopNames {
+public:
+    std::string_view name(int family, const unsigned char* address) {
+        std::pair<int, IPv6Address> key(family, IPv6Address());
+        in6_addr raw;
+        memset(&raw, 0, sizeof(raw));
+        memcpy(raw.s6_addr, address, family == AF_INET ? 4 : 16);
+        key.second = IPv6Address::fromIn6(raw);
+        std::map<std::pair<int, IPv6Address>, std::string>::iterator it = names_.find(key);
+        if (it == names_.end()) {
+            char text[INET6_ADDRSTRLEN];
+            inet_ntop(family, address, text, sizeof(text));
+            it = names_.insert(std::make_pair(key, std::string(text))).first;
+        }
+        return it->second;
+    }
+
+private:
+    std::map<std::pair<int, IPv6Address>, std::string> names_;
+};
+
+struct ParseResult {
+    ParsedRoutes routes;
+    size_t skipped;
+    NexthopNames names;     // what the routes' MRT nexthops view
+
+    ParseResult() : skipped(0) {}
+};
+
+// Runs parse(bounds[i], bounds[i + 1], result) for every part on its own
+// thread, the caller's included, and returns the per-part results.
+template <typename Parse>
+std::vector<ParseResult> parseInParts(const std::vector<size_t>& bounds, Parse parse) {
+    size_t parts = bounds.size() - 1;
+    std::vector<ParseResult> results(parts);
+    std::vector<std::thread> workers;
+    for (size_t part = 1; part < parts; ++part) {
+        workers.push_back(std::thread([&, part]() { parse(bounds[part], bounds[part + 1], results[part]); }));
+    }
+    parse(bounds[0], bounds[1], results[0]);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    return results;
+}
+
+// Prefix and nexthop of the first path of a RIB_IPV4/IPV6_UNICAST record
+// body; false when the record is malformed or the path has no nexthop.
+bool parseRibRecord(const unsigned char* body, size_t length, bool ipv6, bool add_path, NexthopNames& names,
+                    IPAddress& prefix, std::string_view& nexthop) {
+    const unsigned char* end = body + length;
+    const unsigned char* p = body + 4;      // sequence number
+    if (p >= end) {
+        return false;
+    }
+    int prefix_length = *p++;
+    size_t prefix_bytes = (prefix_length + 7) / 8;
+    if (prefix_length > (ipv6 ? 128 : 32) || end - p < static_cast<ptrdiff_t>(prefix_bytes + 2)) {
+        return false;
+    }
+    prefix.version = ipv6 ? IPVersion::IPv6 : IPVersion::IPv4;
+    memset(prefix.bytes, 0, sizeof(prefix.bytes));
+    memcpy(prefix.bytes, p, prefix_bytes);
+    prefix.prefix_length = prefix_length;
+    p += prefix_bytes;
+    uint16_t entries = load16(p);
+    p += 2;
+
+    // peer index:2 originated:4 [path id:4] attribute length:2
+    size_t entry_header = add_path ? 12 : 8;
+    if (entries == 0 || end - p < static_cast<ptrdiff_t>(entry_header)) {
+        return false;
+    }
+    p += entry_header;
+    uint16_t attributes_length = load16(p - 2);
+    if (end - p < attributes_length) {
+        return false;
+    }
+    const unsigned char* attributes_end = p + attributes_length;
+
+    const unsigned char* next_hop = nullptr;        // NEXT_HOP, IPv4
+    const unsigned char* mp_next_hop = nullptr;     // MP_REACH_NLRI nexthop
+    int mp_next_hop_length = 0;
+    while (attributes_end - p >= 3) {
+        uint8_t flags = p[0];
+        uint8_t type = p[1];
+        size_t value_length;
+        if (flags & kAttrExtendedLength) {
+            if (attributes_end - p < 4) {
+                return false;
+            }
+            value_length = load16(p + 2);
+            p += 4;
+        } else {
+            value_length = p[2];
+            p += 3;
+        }
+        if (attributes_end - p < static_cast<ptrdiff_t>(value_length)) {
+            return false;
+        }
+        if (type == kAttrNextHop && value_length == 4) {
+            next_hop = p;
+        } else if (type == kAttrMpReachNlri && value_length > 0) {
+            // TABLE_DUMP_V2 abbreviates the attribute to nexthop length and
+            // nexthop; some writers keep the AFI/SAFI in front
+            size_t offset = p[0] + 1u == value_length ? 0 : 3;
+            if (offset < value_length && offset + 1 + p[offset] <= value_length) {
+                mp_next_hop_length = p[offset];
+                mp_next_hop = p + offset + 1;
+            }
+        }
+        p += value_length;
+    }
+
+    if (next_hop && (!ipv6 || !mp_next_hop)) {
+        nexthop = names.name(AF_INET, next_hop);
+    } else if (mp_next_hop && mp_next_hop_length >= 16) {
+        // a link-local address may follow the global one; keep the global
+        nexthop = names.name(AF_INET6, mp_next_hop);
+    } else if (mp_next_hop && mp_next_hop_length == 4) {
+        nexthop = names.name(AF_INET, mp_next_hop);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void parseMrtRecords(const unsigned char* data, const std::vector<size_t>& records, size_t first, size_t last,
+                     ParseResult& result) {
+    result.routes.reserve(last - first);
+    for (size_t i = first; i < last; ++i) {
+        const unsigned char* header = data + records[i];
+        if (load16(header + 4) != kTableDumpV2) {
+            continue;
+        }
+        uint16_t subtype = load16(header + 6);
+        bool ipv6 = subtype == kRibIpv6Unicast || subtype == kRibIpv6UnicastAddPath;
+        bool add_path = subtype == kRibIpv4UnicastAddPath || subtype == kRibIpv6UnicastAddPath;
+        if (!ipv6 && !add_path && subtype != kRibIpv4Unicast) {
+            continue;       // peer index table, multicast, generic RIBs
+        }
+        IPAddress prefix;
+        std::string_view nexthop;
+        if (parseRibRecord(header + kMrtHeader, load32(header + 8), ipv6, add_path, result.names, prefix, nexthop)) {
+            result.routes.push_back(std::make_pair(prefix, nexthop));
+        } else {
+            ++result.skipped;
+        }
+    }
+}
+
+// ---- text ----
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+std::string_view nextField(const char*& cursor, const char* end) {
+    while (cursor < end && isBlank(*cursor)) {
+        ++cursor;
+    }
+    const char* start = cursor;
+    while (cursor < end && !isBlank(*cursor)) {
+        ++cursor;
+    }
+    return std::string_view(start, cursor - start);
+}
+
+// start of the line holding offset, or size
+size_t lineStart(const char* data, size_t size, size_t offset) {
+    if (offset == 0 || offset >= size) {
+        return std::min(offset, size);
+    }
+    const void* newline = memchr(data + offset - 1, '\n', size - offset + 1);
+    return newline ? static_cast<const char*>(newline) - data + 1 : size;
+}
+
+}  // namespace
+
+bool RouteTracker::loadRoutes(const std::string& path, RouteFileFormat format, RouteLoadStats* stats,
+                              unsigned threads) {
+    typedef std::chrono::steady_clock clock;
+    waitForRestore();
+    clock::time_point start = clock::now();
+
+    MappedFile file;
+    // every worker reads its own range front to back
+    if (!file.open(path, MADV_SEQUENTIAL)) {
+        return false;
+    }
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, file.size() / kMinChunk + 1));
+
+    std::vector<ParseResult> results;
+    size_t skipped = 0;
+    if (format == RouteFileFormat::kMrt) {
+        // records can only be found by walking their headers, which is cheap;
+        // the parsing is what gets split
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(file.data());
+        std::vector<size_t> records;
+        size_t offset = 0;
+        while (file.size() - offset >= kMrtHeader) {
+            size_t length = load32(data + offset + 8);
+            if (file.size() - offset - kMrtHeader < length) {
+                break;
+            }
+            records.push_back(offset);
+            offset += kMrtHeader + length;
+        }
+        if (offset != file.size()) {
+            ++skipped;      // truncated last record
+        }
+        std::vector<size_t> bounds;
+        for (unsigned part = 0; part <= threads; ++part) {
+            bounds.push_back(records.size() * part / threads);
+        }
+        results = parseInParts(bounds, [&](size_t first, size_t last, ParseResult& result) {
+            parseMrtRecords(data, records, first, last, result);
+        });
+    } else {
+        const char* data = file.data();
+        std::vector<size_t> bounds;
+        for (unsigned part = 0; part <= threads; ++part) {
+            bounds.push_back(lineStart(data, file.size(), file.size() * part / threads));
+        }
+        results = parseInParts(bounds, [&](size_t first, size_t last, ParseResult& result) {
+            const char* line = data + first;
+            const char* end = data + last;
+            while (line < end) {
+                const char* newline = static_cast<const char*>(memchr(line, '\n', end - line));
+                const char* line_end = newline ? newline : end;
+                const char* cursor = line;
+                std::string_view prefix = nextField(cursor, line_end);
+                if (!prefix.empty() && prefix[0] != '#') {
+                    std::string_view nexthop = nextField(cursor, line_end);
+                    IPAddress addr;
+                    if (!nexthop.empty() && parseIP(prefix, addr)) {
+                        result.routes.push_back(std::make_pair(addr, nexthop));
+                    } else {
+                        ++result.skipped;
+                    }
+                }
+                if (!newline) {
+                    break;
+                }
+                line = newline + 1;
+            }
+        });
+    }
+
+    ParsedRoutes parsed;
+    size_t total = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        total += results[i].routes.size();
+    }
+    parsed.reserve(total);
+    for (size_t i = 0; i < results.size(); ++i) {
+        parsed.insert(parsed.end(), results[i].routes.begin(), results[i].routes.end());
+        skipped += results[i].skipped;
+        ParsedRoutes().swap(results[i].routes);
+    }
+    double parse_seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    // the nexthop views point into file and results[i].names, which are
+    // still alive while applyRoutes() interns them
+    start = clock::now();
+    size_t added = applyRoutes(parsed);
+    if (stats) {
+        stats->routes_parsed = total;
+        stats->routes_skipped = skipped;
+        stats->routes_added = added;
+        stats->parse_seconds = parse_seconds;
+        stats->apply_seconds = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    return true;
+}
@@ -0,0 +1,386 @@
+#include <atomic>
+#include <algorithm>
+#include <arpa/inet.h>
+
+#include "route_tracker.h"
+
+// Immutable once built; shared between every snapshot (and every node) that
+// references it. A node is a patricia node over IPv4 prefixes: key holds the
+// first bit bits, and nexthop is null for glue nodes.
+struct SnapshotNode {
+    mutable std::atomic<uint32_t> refs;
+    uint32_t key;
+    int bit;
+    size_t routes;                                // routes in this subtree
+    std::shared_ptr<const std::string> nexthop;
+    const SnapshotNode* child[2];
+};
+
+static uint32_t snapshotMask(int length) {
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+static int bitAt(uint32_t key, int position) {
+    return (key >> (31 - position)) & 1;
+}
+
+// length of the common prefix of two prefixes
+static int commonLength(uint32_t a, int a_length, uint32_t b, int b_length) {
+    int limit = std::min(a_length, b_length);
+    uint32_t differ = a ^ b;
+    int same = differ ? __builtin_clz(differ) : 32;
+    return std::min(limit, same);
+}
+
+static const SnapshotNode* retainNode(const SnapshotNode* node) {
+    if (node) {
+        node->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return node;
+}
+
+static void releaseNode(const SnapshotNode* node) {
+    if (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        releaseNode(node->child[0]);
+        releaseNode(node->child[1]);
+        delete node;
+    }
+}
+
+const SnapshotNode* RouteSnapshot::retain(const SnapshotNode* root) {
+    return retainNode(root);
+}
+
+void RouteSnapshot::release(const SnapshotNode* root) {
+    releaseNode(root);
+}
+
+// Takes over the references held by child0 and child1.
+static const SnapshotNode* makeNode(uint32_t key, int bit, const std::shared_ptr<const std::string>& nexthop,
+                                    const SnapshotNode* child0, const SnapshotNode* child1) {
+    SnapshotNode* node = new SnapshotNode();
+    node->refs.store(1, std::memory_order_relaxed);
+    node->key = key;
+    node->bit = bit;
+    node->nexthop = nexthop;
+    node->child[0] = child0;
+    node->child[1] = child1;
+    node->routes = (nexthop ? 1 : 0) + (child0 ? child0->routes : 0) + (child1 ? child1->routes : 0);
+    return node;
+}
+
+// Like makeNode, but a glue node left with fewer than two children is dropped.
+static const SnapshotNode* makeOrCollapse(uint32_t key, int bit, const std::shared_ptr<const std::string>& nexthop,
+                                          const SnapshotNode* child0, const SnapshotNode* child1) {
+    if (nexthop || (child0 && child1)) {
+        return makeNode(key, bit, nexthop, child0, child1);
+    }
+    return child0 ? child0 : child1;
+}
+
+// Returns a new reference to the root of n with key/length set to nexthop.
+// Only the nodes on the path to the prefix are copied.
+static const SnapshotNode* insertNode(const SnapshotNode* n, uint32_t key, int length,
+                                      const std::shared_ptr<const std::string>& nexthop) {
+    if (!n) {
+        return makeNode(key, length, nexthop, nullptr, nullptr);
+    }
+    int common = commonLength(n->key, n->bit, key, length);
+
+    if (common == n->bit && common == length) {
+        return makeNode(n->key, n->bit, nexthop, retainNode(n->child[0]), retainNode(n->child[1]));
+    }
+    if (common == n->bit) {
+        int side = bitAt(key, n->bit);
+        const SnapshotNode* child[2];
+        child[side] = insertNode(n->child[side], key, length, nexthop);
+        child[!side] = retainNode(n->child[!side]);
+        return makeNode(n->key, n->bit, n->nexthop, child[0], child[1]);
+    }
+
+    const SnapshotNode* child[2];
+    if (common == length) {
+        // the new prefix covers n
+        int side = bitAt(n->key, length);
+        child[side] = retainNode(n);
+        child[!side] = nullptr;
+        return makeNode(key, length, nexthop, child[0], child[1]);
+    }
+    int side = bitAt(key, common);
+    child[side] = makeNode(key, length, nexthop, nullptr, nullptr);
+    child[!side] = retainNode(n);
+    return makeNode(key & snapshotMask(common), common, std::shared_ptr<const std::string>(), child[0], child[1]);
+}
+
+// Returns a new reference to the root of n without key/length; n itself
+// (with an extra reference) when the prefix is not present.
+static const SnapshotNode* removeNode(const SnapshotNode* n, uint32_t key, int length) {
+    if (!n || n->bit > length || (key & snapshotMask(n->bit)) != n->key) {
+        return retainNode(n);
+    }
+    if (n->bit == length) {
+        if (!n->nexthop) {
+            return retainNode(n);
+        }
+        return makeOrCollapse(n->key, n->bit, std::shared_ptr<const std::string>(),
+                              retainNode(n->child[0]), retainNode(n->child[1]));
+    }
+
+    int side = bitAt(key, n->bit);
+    const SnapshotNode* replaced = removeNode(n->child[side], key, length);
+    if (replaced == n->child[side]) {
+        releaseNode(replaced);
+        return retainNode(n);
+    }
+    const SnapshotNode* child[2];
+    child[side] = replaced;
+    child[!side] = retainNode(n->child[!side]);
+    return makeOrCollapse(n->key, n->bit, n->nexthop, child[0], child[1]);
+}
+
+// A node is private to the caller when its reference count is 1 and every
+// node above it on the path is private too: no other snapshot, and so no
+// reader, can reach it. The owned variants below consume the caller's
+// reference to n, edit private nodes in place and fall back to path copying
+// at the first shared one.
+static bool privateNode(const SnapshotNode* n) {
+    return n->refs.load(std::memory_order_acquire) == 1;
+}
+
+static void recount(SnapshotNode* n) {
+    n->routes = (n->nexthop ? 1 : 0) + (n->child[0] ? n->child[0]->routes : 0) +
+                (n->child[1] ? n->child[1]->routes : 0);
+}
+
+static const SnapshotNode* insertOwned(const SnapshotNode* n, uint32_t key, int length,
+                                       const std::shared_ptr<const std::string>& nexthop) {
+    if (!n) {
+        return makeNode(key, length, nexthop, nullptr, nullptr);
+    }
+    if (!privateNode(n)) {
+        const SnapshotNode* copy = insertNode(n, key, length, nexthop);
+        releaseNode(n);
+        return copy;
+    }
+    SnapshotNode* m = const_cast<SnapshotNode*>(n);
+    int common = commonLength(m->key, m->bit, key, length);
+
+    if (common == m->bit && common == length) {
+        m->nexthop = nexthop;
+        recount(m);
+        return m;
+    }
+    if (common == m->bit) {
+        int side = bitAt(key, m->bit);
+        m->child[side] = insertOwned(m->child[side], key, length, nexthop);
+        recount(m);
+        return m;
+    }
+
+    const SnapshotNode* child[2];
+    if (common == length) {
+        int side = bitAt(m->key, length);
+        child[side] = m;
+        child[!side] = nullptr;
+        return makeNode(key, length, nexthop, child[0], child[1]);
+    }
+    int side = bitAt(key, common);
+    child[side] = makeNode(key, length, nexthop, nullptr, nullptr);
+    child[!side] = m;
+    return makeNode(key & snapshotMask(common), common, std::shared_ptr<const std::string>(), child[0], child[1]);
+}
+
+static const SnapshotNode* removeOwned(const SnapshotNode* n, uint32_t key, int length) {
+    if (!n || n->bit > length || (key & snapshotMask(n->bit)) != n->key) {
+        return n;
+    }
+    if (!privateNode(n)) {
+        const SnapshotNode* copy = removeNode(n, key, length);
+        releaseNode(n);
+        return copy;
+    }
+    SnapshotNode* m = const_cast<SnapshotNode*>(n);
+    if (m->bit == length) {
+        if (!m->nexthop) {
+            return m;
+        }
+        m->nexthop.reset();
+    } else {
+        int side = bitAt(key, m->bit);
+        m->child[side] = removeOwned(m->child[side], key, length);
+    }
+    if (m->nexthop || (m->child[0] && m->child[1])) {
+        recount(m);
+        return m;
+    }
+    // glue left with fewer than two children: hand the child up
+    const SnapshotNode* child = m->child[0] ? m->child[0] : m->child[1];
+    m->child[0] = m->child[1] = nullptr;
+    delete m;
+    return child;
+}
+
+void RouteSnapshot::setRoute(uint32_t prefix, int prefix_length, const std::shared_ptr<const std::string>& nexthop) {
+    root_ = insertOwned(root_, prefix & snapshotMask(prefix_length), prefix_length, nexthop);
+}
+
+void RouteSnapshot::clearRoute(uint32_t prefix, int prefix_length) {
+    root_ = removeOwned(root_, prefix & snapshotMask(prefix_length), prefix_length);
+}
+
+static std::string formatPrefix(uint32_t key) {
+    char buf[INET_ADDRSTRLEN];
+    uint32_t net = htonl(key);
+    inet_ntop(AF_INET, &net, buf, sizeof(buf));
+    return buf;
+}
+
+RouteSnapshot::RouteSnapshot(const RouteSnapshot& other) : root_(retainNode(other.root_)) {
+}
+
+RouteSnapshot& RouteSnapshot::operator=(const RouteSnapshot& other) {
+    const SnapshotNode* old = root_;
+    root_ = retainNode(other.root_);
+    releaseNode(old);
+    return *this;
+}
+
+RouteSnapshot::~RouteSnapshot() {
+    releaseNode(root_);
+}
+
+size_t RouteSnapshot::size() const {
+    return root_ ? root_->routes : 0;
+}
+
+RouteMatch RouteSnapshot::lookup(uint32_t address) const {
+    const SnapshotNode* best = nullptr;
+    for (const SnapshotNode* n = root_; n && (address & snapshotMask(n->bit)) == n->key;) {
+        if (n->nexthop) {
+            best = n;
+        }
+        if (n->bit == 32) {
+            break;
+        }
+        n = n->child[bitAt(address, n->bit)];
+    }
+
+    RouteMatch match;
+    if (best) {
+        match.prefix = best->key;
+        match.prefix_length = best->bit;
+        match.nexthop = *best->nexthop;
+    } else {
+        match.prefix = 0;
+        match.prefix_length = -1;
+    }
+    return match;
+}
+
+// pre-order is address order, shorter prefix first
+static void walk(const SnapshotNode* n,
+                 const std::function<void(uint32_t, int, std::string_view)>& visit) {
+    if (!n) {
+        return;
+    }
+    if (n->nexthop) {
+        visit(n->key, n->bit, *n->nexthop);
+    }
+    walk(n->child[0], visit);
+    walk(n->child[1], visit);
+}
+
+void RouteSnapshot::forEach(const std::function<void(uint32_t prefix, int prefix_length, std::string_view nexthop)>& visit) const {
+    walk(root_, visit);
+}
+
+std::vector<Route> RouteSnapshot::routes() const {
+    std::vector<Route> result;
+    result.reserve(size());
+    forEach([&result](uint32_t prefix, int, std::string_view nexthop) {
+        result.push_back(Route(formatPrefix(prefix), std::string(nexthop)));
+    });
+    return result;
+}
+
+RouteSnapshot RouteSnapshot::withRoute(uint32_t prefix, int prefix_length, std::string_view nexthop) const {
+    return withRoute(prefix, prefix_length, std::make_shared<const std::string>(nexthop));
+}
+
+RouteSnapshot RouteSnapshot::withRoute(uint32_t prefix, int prefix_length,
+                                       const std::shared_ptr<const std::string>& nexthop) const {
+    return RouteSnapshot(insertNode(root_, prefix & snapshotMask(prefix_length), prefix_length, nexthop));
+}
+
+RouteSnapshot RouteSnapshot::withoutRoute(uint32_t prefix, int prefix_length) const {
+    return RouteSnapshot(removeNode(root_, prefix & snapshotMask(prefix_length), prefix_length));
+}
+
+struct SnapshotEntry {
+    uint32_t key;
+    int bit;
+    const std::string* nexthop;
+};
+
+static void collect(const SnapshotNode* n, std::vector<SnapshotEntry>& entries) {
+    if (!n) {
+        return;
+    }
+    if (n->nexthop) {
+        entries.push_back(SnapshotEntry{n->key, n->bit, n->nexthop.get()});
+    }
+    collect(n->child[0], entries);
+    collect(n->child[1], entries);
+}
+
+static void pushDelta(uint32_t key, int bit, const std::string* from, const std::string* to,
+                      std::vector<RouteDelta>& changes) {
+    if (from == to || (from && to && *from == *to)) {
+        return;
+    }
+    RouteDelta delta;
+    delta.prefix = key;
+    delta.prefix_length = bit;
+    delta.old_nexthop = from ? std::string_view(*from) : std::string_view();
+    delta.new_nexthop = to ? std::string_view(*to) : std::string_view();
+    changes.push_back(delta);
+}
+
+static void diffNodes(const SnapshotNode* a, const SnapshotNode* b, std::vector<RouteDelta>& changes) {
+    if (a == b) {
+        return;
+    }
+    if (a && b && a->key == b->key && a->bit == b->bit) {
+        pushDelta(a->key, a->bit, a->nexthop.get(), b->nexthop.get(), changes);
+        diffNodes(a->child[0], b->child[0], changes);
+        diffNodes(a->child[1], b->child[1], changes);
+        return;
+    }
+
+    // the shapes diverge here: merge both subtrees' routes in address order
+    std::vector<SnapshotEntry> from, to;
+    collect(a, from);
+    collect(b, to);
+    size_t i = 0, j = 0;
+    while (i < from.size() || j < to.size()) {
+        bool take_from = j == to.size() ||
+            (i < from.size() && (from[i].key < to[j].key || (from[i].key == to[j].key && from[i].bit < to[j].bit)));
+        bool take_to = i == from.size() ||
+            (j < to.size() && (to[j].key < from[i].key || (to[j].key == from[i].key && to[j].bit < from[i].bit)));
+        if (take_from) {
+            pushDelta(from[i].key, from[i].bit, from[i].nexthop, nullptr, changes);
+            ++i;
+        } else if (take_to) {
+            pushDelta(to[j].key, to[j].bit, nullptr, to[j].nexthop, changes);
+            ++j;
+        } else {
+            pushDelta(from[i].key, from[i].bit, from[i].nexthop, to[j].nexthop, changes);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+void RouteSnapshot::diff(const RouteSnapshot& from, const RouteSnapshot& to, std::vector<RouteDelta>& changes) {
+    diffNodes(from.root_, to.root_, changes);
+}
@@ -1,419 +1,2167 @@
 
 #include <sstream>
 #include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <arpa/inet.h>
+#include <unistd.h>
 
 
 #include "route_tracker.h"
+#include "dir24_fib.h"
+#include "nexthop_table.h"
+#include "compact_trie.h"
+#include "lc_trie_fib.h"
+#include "poptrie_fib.h"
+#include "snapshot_file.h"
+#include "update_journal.h"
+#include "notifier_pool.h"
 
 extern "C" {
 #include "patricia.h"
 }
 
-void freePatriciaNode(patricia_node_t* node) {
+static uint32_t ipv4Key(const IPAddress& addr) {
+    uint32_t key;
+    memcpy(&key, addr.bytes, sizeof(key));
+    return ntohl(key);
+}
+
+static uint32_t prefixMask(int length) {
+    return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
+
+static std::string formatIPv4(uint32_t key) {
+    char buf[INET_ADDRSTRLEN];
+    uint32_t net = htonl(key);
+    inet_ntop(AF_INET, &net, buf, sizeof(buf));
+    return buf;
+}
+
+static void ipv4FromKey(uint32_t key, IPAddress& addr) {
+    uint32_t net = htonl(key);
+    addr.version = IPVersion::IPv4;
+    memcpy(addr.bytes, &net, sizeof(net));
+    addr.prefix_length = 32;
+}
+
+// debounce key of a tracked IPv4 address
+static std::pair<int, IPv6Address> notificationKey(uint32_t key) {
+    IPv6Address address;
+    address.hi = 0;
+    address.lo = key;
+    return std::make_pair(AF_INET, address);
+}
+
+static IPv6Address ipv6Key(const IPAddress& addr) {
+    in6_addr net;
+    memcpy(&net, addr.bytes, sizeof(net));
+    return IPv6Address::fromIn6(net);
+}
+
+static std::string formatIPv6(const IPv6Address& key) {
+    char buf[INET6_ADDRSTRLEN];
+    in6_addr net = key.toIn6();
+    inet_ntop(AF_INET6, &net, buf, sizeof(buf));
+    return buf;
+}
+
+static void ipv6FromKey(const IPv6Address& key, IPAddress& addr) {
+    in6_addr net = key.toIn6();
+    addr.version = IPVersion::IPv6;
+    memcpy(addr.bytes, &net, sizeof(net));
+    addr.prefix_length = 128;
+}
+
+// inet_pton(AF_INET6) needs a NUL-terminated string; the copy stays on the
+// stack
+static bool parseIPv6Text(std::string_view text, IPv6Address* key) {
+    char buf[INET6_ADDRSTRLEN];
+    if (text.empty() || text.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, text.data(), text.size());
+    buf[text.size()] = '\0';
+    in6_addr net;
+    if (inet_pton(AF_INET6, buf, &net) != 1) {
+        return false;
+    }
+    *key = IPv6Address::fromIn6(net);
+    return true;
+}
+
+// Strict dotted quad, as inet_pton(AF_INET) accepts it: four decimal parts of
+// at most 255 and no leading zeros. Works on the caller's characters, so no
+// copy into a NUL-terminated buffer is needed.
+static bool parseDottedQuad(std::string_view text, uint32_t* key) {
+    uint32_t value = 0;
+    size_t pos = 0;
+    for (int part = 0; part < 4; ++part) {
+        if (part > 0) {
+            if (pos >= text.size() || text[pos] != '.') {
+                return false;
+            }
+            ++pos;
+        }
+        size_t start = pos;
+        unsigned octet = 0;
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9' && pos - start < 3) {
+            octet = octet * 10 + (text[pos] - '0');
+            ++pos;
+        }
+        if (pos == start || octet > 255 || (text[start] == '0' && pos - start > 1)) {
+            return false;
+        }
+        value = (value << 8) | octet;
+    }
+    if (pos != text.size()) {
+        return false;
+    }
+    *key = value;
+    return true;
+}
+
+// zeroes the bits past prefix_length, so equal prefixes compare equal
+static void maskAddress(IPAddress& addr) {
+    int bits = addr.prefix_length;
+    for (size_t i = 0; i < sizeof(addr.bytes); ++i, bits -= 8) {
+        if (bits <= 0) {
+            addr.bytes[i] = 0;
+        } else if (bits < 8) {
+            addr.bytes[i] &= static_cast<unsigned char>(0xFF << (8 - bits));
+        }
+    }
+}
+
+// IPv4 before IPv6, then by address bytes and prefix length
+static bool addressBefore(const IPAddress& a, const IPAddress& b) {
+    if (a.version != b.version) {
+        return a.version == IPVersion::IPv4;
+    }
+    int order = memcmp(a.bytes, b.bytes, sizeof(a.bytes));
+    return order != 0 ? order < 0 : a.prefix_length < b.prefix_length;
+}
+
+// Reduces updates (host bits cleared, in the order they were made; an empty
+// nexthop is a delete) to the last one of each prefix. A stable sort brings
+// a prefix's updates together in order, so the table sees one sorted batch
+// however often the prefix flapped.
+static void netUpdates(std::vector<std::pair<IPAddress, std::string_view> >& updates,
+                       std::vector<std::pair<IPAddress, std::string_view> >& adds, std::vector<IPAddress>& deletes) {
+    std::stable_sort(updates.begin(), updates.end(),
+                     [](const std::pair<IPAddress, std::string_view>& a,
+                        const std::pair<IPAddress, std::string_view>& b) { return addressBefore(a.first, b.first); });
+    for (size_t i = 0; i < updates.size(); ++i) {
+        if (i + 1 < updates.size() && !addressBefore(updates[i].first, updates[i + 1].first)) {
+            continue;
+        }
+        if (updates[i].second.empty()) {
+            deletes.push_back(updates[i].first);
+        } else {
+            adds.push_back(updates[i]);
+        }
+    }
+}
+
+// Sorts inclusive [first, last] ranges and merges the overlapping ones.
+template <typename Key>
+static void mergeRanges(std::vector<std::pair<Key, Key> >& ranges) {
+    std::sort(ranges.begin(), ranges.end());
+    size_t kept = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (kept > 0 && ranges[i].first <= ranges[kept - 1].second) {
+            if (ranges[kept - 1].second < ranges[i].second) {
+                ranges[kept - 1].second = ranges[i].second;
+            }
+        } else {
+            ranges[kept++] = ranges[i];
+        }
+    }
+    ranges.resize(kept);
+}
+
+RouteTracker::RouteTracker(RibLayout layout, LookupEngine engine)
+    : ip_tree_(nullptr), nexthops_(new NexthopTable(&reclaimer_)), ipv6_rib_(new Ipv6Trie(&reclaimer_)),
+      published_snapshot_(nullptr), restore_image_(nullptr), restoring_(false), debounce_ms_(0), suppressed_(0), debounce_stop_(false),
+      delivering_closed_(false), closings_(0), delivered_closings_(0), notifier_(nullptr) {
+    if (engine == kLcTrieLookup) {
+        lc_fib_.reset(new LcTrieFib(&reclaimer_));
+    } else if (engine == kPoptrieLookup) {
+        poptrie_fib_.reset(new PoptrieFib(&reclaimer_));
+    } else {
+        fib_.reset(new Dir24Fib(&reclaimer_));
+    }
+    if (layout == kCompactRib) {
+        compact_rib_.reset(new CompactTrie());
+    } else {
+        ip_tree_ = New_Patricia(32);
+    }
+  //  ip_tree_->free_user_data = free_route_data;
+}
+
+RouteTracker::~RouteTracker() {
+    waitForRestore();
+    if (restore_thread_.joinable()) {
+        restore_thread_.join();
+    }
+    {
+        std::lock_guard<std::mutex> _lock(rt_mutex_);
+        debounce_stop_ = true;
+    }
+    debounce_wake_.notify_all();
+    if (debounce_thread_.joinable()) {
+        debounce_thread_.join();
+    }
+    // delivers what is still waiting
+    closeWindows(true);
+    delete notifier_;
+    {
+        std::lock_guard<std::mutex> _lock(rt_mutex_);
+        tracked_addresses_.forEach([this](TrackedTable::Entry& tracked) {
+            if (tracked.nexthop_id) {
+                nexthops_->release(tracked.nexthop_id);
+            }
+        });
+        tracked_addresses_.clear();
+        for (TrackedMap6::iterator it = tracked_addresses6_.begin(); it != tracked_addresses6_.end(); ++it) {
+            if (it->second.nexthop_id) {
+                nexthops_->release(it->second.nexthop_id);
+            }
+        }
+        tracked_addresses6_.clear();
+    }
+
+    // nodes live in the tree's slabs, so this frees slabs, not nodes
+    if (ip_tree_) {
+        Destroy_Patricia(ip_tree_, nullptr);
+        ip_tree_ = nullptr;
+    }
+    RouteSnapshot::release(published_snapshot_);
+}
+
+bool RouteTracker::addRoute(std::string_view prefix, std::string_view nexthop) {
+    IPAddress addr;
+    if (!parseIP(prefix, addr)) {
+        return false;
+    }
+    return addRoute(addr, nexthop);
+}
+
+bool RouteTracker::addRoute(uint32_t prefix, int prefix_length, std::string_view nexthop) {
+    if (prefix_length < 0 || prefix_length > 32) {
+        return false;
+    }
+    IPAddress addr;
+    ipv4FromKey(prefix, addr);
+    addr.prefix_length = prefix_length;
+    return addRoute(addr, nexthop);
+}
+
+bool RouteTracker::addRoute(const in_addr& prefix, int prefix_length, std::string_view nexthop) {
+    return addRoute(ntohl(prefix.s_addr), prefix_length, nexthop);
+}
+
+bool RouteTracker::addRoute(const IPv6Address& prefix, int prefix_length, std::string_view nexthop) {
+    if (prefix_length < 0 || prefix_length > 128) {
+        return false;
+    }
+    IPAddress addr;
+    ipv6FromKey(prefix, addr);
+    addr.prefix_length = prefix_length;
+    return addRoute(addr, nexthop);
+}
+
+bool RouteTracker::addRoute(const in6_addr& prefix, int prefix_length, std::string_view nexthop) {
+    return addRoute(IPv6Address::fromIn6(prefix), prefix_length, nexthop);
+}
+
+bool RouteTracker::addRoute(const IPAddress& addr, std::string_view nexthop) {
+    waitForRestore();
+    if (nexthop.empty()) {
+        return false;
+    }
+    waitForNotifiers();
+    //std::cout << " addRoute: " << "pfx:" << prefix << "nh:" << nexthop << "\n";    
+    std::vector<NotificationData> notifications;
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (queueInTransaction(addr, nexthop)) {
+            return true;
+        }
+        if (!insertRoute(addr, nexthop)) {
+            return false;
+        }
+        journalRoute(addr, nexthop);
+        notifyAffectedAddresses(addr, true, notifications);
+        debounceNotifications(notifications);
+        queueNotifications(notifications);
+    }
+    deliverNotifications(notifications);
+
+    return true;
+}
+
+bool RouteTracker::deleteRoute(std::string_view prefix) {
+    IPAddress addr;
+    if (!parseIP(prefix, addr)) {
+        return false;
+    }
+    return deleteRoute(addr);
+}
+
+bool RouteTracker::deleteRoute(uint32_t prefix, int prefix_length) {
+    if (prefix_length < 0 || prefix_length > 32) {
+        return false;
+    }
+    IPAddress addr;
+    ipv4FromKey(prefix, addr);
+    addr.prefix_length = prefix_length;
+    return deleteRoute(addr);
+}
+
+bool RouteTracker::deleteRoute(const in_addr& prefix, int prefix_length) {
+    return deleteRoute(ntohl(prefix.s_addr), prefix_length);
+}
+
+bool RouteTracker::deleteRoute(const IPv6Address& prefix, int prefix_length) {
+    if (prefix_length < 0 || prefix_length > 128) {
+        return false;
+    }
+    IPAddress addr;
+    ipv6FromKey(prefix, addr);
+    addr.prefix_length = prefix_length;
+    return deleteRoute(addr);
+}
+
+bool RouteTracker::deleteRoute(const in6_addr& prefix, int prefix_length) {
+    return deleteRoute(IPv6Address::fromIn6(prefix), prefix_length);
+}
+
+bool RouteTracker::deleteRoute(const IPAddress& addr) {
+    waitForRestore();
+    waitForNotifiers();
+    //std::cout << " deleteRoute: " << "pfx:" << prefix << "\n";    
+    std::vector<NotificationData> notifications;
+    bool deleted;
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (queueInTransaction(addr, std::string_view())) {
+            return true;
+        }
+        deleted = removeRoute(addr);
+        if (deleted) {
+            journalRoute(addr, std::string_view());
+            notifyAffectedAddresses(addr, false, notifications);
+            debounceNotifications(notifications);
+            queueNotifications(notifications);
+        }
+    }
+    deliverNotifications(notifications);
+    
+    return deleted;
+}
+
+size_t RouteTracker::addRoutes(const std::vector<std::pair<std::string, std::string> >& routes) {
+    waitForRestore();
+    // parse before taking the lock
+    std::vector<std::pair<IPAddress, std::string_view> > parsed;
+    parsed.reserve(routes.size());
+    for (size_t i = 0; i < routes.size(); ++i) {
+        IPAddress addr;
+        if (!routes[i].second.empty() && parseIP(routes[i].first, addr)) {
+            parsed.push_back(std::make_pair(addr, std::string_view(routes[i].second)));
+        }
+    }
+    return applyRoutes(parsed);
+}
+
+// The locked half of addRoutes() and loadRoutes(); parsed holds the routes
+// in input order, host bits not yet cleared.
+size_t RouteTracker::applyRoutes(std::vector<std::pair<IPAddress, std::string_view> >& parsed, bool journal) {
+    std::vector<IPAddress> deletes;
+    return applyUpdates(parsed, deletes, journal);
+}
+
+size_t RouteTracker::deleteRoutes(const std::vector<std::string>& prefixes) {
+    waitForRestore();
+    std::vector<IPAddress> parsed;
+    parsed.reserve(prefixes.size());
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        IPAddress addr;
+        if (parseIP(prefixes[i], addr)) {
+            parsed.push_back(addr);
+        }
+    }
+    std::vector<std::pair<IPAddress, std::string_view> > adds;
+    return applyUpdates(adds, parsed, true);
+}
+
+// One bulk update: the deletes, then the adds (the last of duplicate
+// prefixes winning), under one lock hold with one snapshot publication and
+// one notification pass. Host bits need not be cleared yet. journal false
+// is for updates that are already durable: a snapshot or journal replay.
+size_t RouteTracker::applyUpdates(std::vector<std::pair<IPAddress, std::string_view> >& adds,
+                                  std::vector<IPAddress>& deletes, bool journal) {
+    for (size_t i = 0; i < adds.size(); ++i) {
+        maskAddress(adds[i].first);
+    }
+    for (size_t i = 0; i < deletes.size(); ++i) {
+        maskAddress(deletes[i]);
+    }
+
+    // in address order consecutive updates walk the same trie paths and
+    // table ranges; stable, so the last of duplicate prefixes still wins
+    std::stable_sort(adds.begin(), adds.end(),
+                     [](const std::pair<IPAddress, std::string_view>& a,
+                        const std::pair<IPAddress, std::string_view>& b) { return addressBefore(a.first, b.first); });
+    std::sort(deletes.begin(), deletes.end(), addressBefore);
+
+    std::vector<IPAddress> changed;
+    changed.reserve(adds.size() + deletes.size());
+    std::vector<NotificationData> notifications;
+    waitForNotifiers();
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (transaction_owner_ == std::this_thread::get_id()) {
+            for (size_t i = 0; i < deletes.size(); ++i) {
+                queueInTransaction(deletes[i], std::string_view());
+            }
+            for (size_t i = 0; i < adds.size(); ++i) {
+                queueInTransaction(adds[i].first, adds[i].second);
+            }
+            return adds.size() + deletes.size();
+        }
+        for (size_t i = 0; i < deletes.size(); ++i) {
+            if (removeRoute(deletes[i], false)) {
+                changed.push_back(deletes[i]);
+                if (journal) {
+                    journalRoute(deletes[i], std::string_view());
+                }
+            }
+        }
+        // like deletes, only the adds that took effect are journaled
+        size_t loaded = 0;
+        if (compact_rib_ && compact_rib_->routes() == 0) {
+            std::vector<size_t> accepted;
+            loaded = loadCompactRib(adds, changed, accepted);
+            for (size_t i = 0; journal && i < accepted.size(); ++i) {
+                journalRoute(adds[accepted[i]].first, adds[accepted[i]].second);
+            }
+        }
+        for (size_t i = loaded; i < adds.size(); ++i) {
+            if (insertRoute(adds[i].first, adds[i].second, false)) {
+                changed.push_back(adds[i].first);
+                if (journal) {
+                    journalRoute(adds[i].first, adds[i].second);
+                }
+            }
+        }
+        publishSnapshot();
+        reclaimer_.reclaim();
+        notifyChangedNetworks(changed, notifications);
+        debounceNotifications(notifications);
+        queueNotifications(notifications);
+    }
+    deliverNotifications(notifications);
+
+    return changed.size();
+}
+
+bool RouteTracker::beginTransaction() {
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    if (transaction_owner_ != std::thread::id()) {
+        return false;
+    }
+    transaction_owner_ = std::this_thread::get_id();
+    return true;
+}
+
+size_t RouteTracker::commit() {
+    waitForRestore();
+    std::vector<std::pair<IPAddress, std::string> > queued;
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (transaction_owner_ != std::this_thread::get_id()) {
+            return 0;
+        }
+        transaction_owner_ = std::thread::id();
+        queued.swap(transaction_);
+    }
+    std::vector<std::pair<IPAddress, std::string_view> > updates;
+    updates.reserve(queued.size());
+    for (size_t i = 0; i < queued.size(); ++i) {
+        updates.push_back(std::make_pair(queued[i].first, std::string_view(queued[i].second)));
+    }
+    std::vector<std::pair<IPAddress, std::string_view> > adds;
+    std::vector<IPAddress> deletes;
+    netUpdates(updates, adds, deletes);
+    return applyUpdates(adds, deletes);
+}
+
+void RouteTracker::rollback() {
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    if (transaction_owner_ == std::this_thread::get_id()) {
+        transaction_owner_ = std::thread::id();
+        transaction_.clear();
+    }
+}
+
+bool RouteTracker::queueInTransaction(const IPAddress& addr, std::string_view nexthop) {
+    if (transaction_owner_ != std::this_thread::get_id()) {
+        return false;
+    }
+    transaction_.push_back(std::make_pair(addr, std::string(nexthop)));
+    maskAddress(transaction_.back().first);
+    return true;
+}
+
+// lock free, but allocates the Route; lookup() is the allocation-free form
+Route* RouteTracker::longestPrefixMatch(std::string_view ip_address) const {
+    uint32_t key;
+    if (parseDottedQuad(ip_address, &key)) {
+        EpochGuard guard;
+        RouteMatch match = lookup(key);
+        if (!match.found()) {
+            return nullptr;
+        }
+        return new Route(formatIPv4(match.prefix), std::string(match.nexthop));
+    }
+
+    IPv6Address key6;
+    if (!parseIPv6Text(ip_address, &key6)) {
+        return nullptr;
+    }
+    EpochGuard guard;
+    RouteMatch6 match = lookup(key6);
+    if (!match.found()) {
+        return nullptr;
+    }
+    return new Route(formatIPv6(match.prefix), std::string(match.nexthop));
+}
+
+RouteMatch RouteTracker::lookup(std::string_view ip_address) const {
+    uint32_t key;
+    if (!parseDottedQuad(ip_address, &key)) {
+        RouteMatch none;
+        none.prefix = 0;
+        none.prefix_length = -1;
+        return none;
+    }
+    return lookup(key);
+}
+
+RouteMatch RouteTracker::lookup(const in_addr& address) const {
+    return lookup(ntohl(address.s_addr));
+}
+
+RouteMatch RouteTracker::lookup(uint32_t address) const {
+    EpochGuard guard;
+    RouteMatch match;
+    uint32_t id;
+    if (const SnapshotFile* image = __atomic_load_n(&restore_image_, __ATOMIC_ACQUIRE)) {
+        if (!image->lookup(address, &match.nexthop, &match.prefix_length)) {
+            match.prefix_length = -1;
+        }
+        match.prefix = match.prefix_length >= 0 ? address & prefixMask(match.prefix_length) : 0;
+        return match;
+    }
+    if (fibLookup(address, &id, &match.prefix_length)) {
+        match.prefix = address & prefixMask(match.prefix_length);
+        match.nexthop = *nexthops_->get(id);
+    } else {
+        match.prefix = 0;
+        match.prefix_length = -1;
+    }
+    return match;
+}
+
+void RouteTracker::lookupBatch(const uint32_t* addresses, size_t count, RouteMatch* results) const {
+    static const size_t kWindow = 64;
+    uint32_t ids[kWindow];
+    int lengths[kWindow];
+    const std::string* nexthops[kWindow];
+
+    EpochGuard guard;
+    if (__atomic_load_n(&restore_image_, __ATOMIC_ACQUIRE)) {
+        for (size_t i = 0; i < count; ++i) {
+            results[i] = lookup(addresses[i]);
+        }
+        return;
+    }
+
+    for (size_t base = 0; base < count; base += kWindow) {
+        size_t n = std::min(kWindow, count - base);
+        const uint32_t* window = addresses + base;
+
+        fibLookupBatch(window, n, ids, lengths);
+
+        // id -> nexthop string, one prefetched hop at a time
+        for (size_t i = 0; i < n; ++i) {
+            nexthops[i] = nullptr;
+            if (lengths[i] >= 0) {
+                nexthops[i] = nexthops_->get(ids[i]);
+                __builtin_prefetch(nexthops[i]);
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            RouteMatch& result = results[base + i];
+            result.prefix_length = lengths[i];
+            if (lengths[i] >= 0) {
+                result.prefix = window[i] & prefixMask(lengths[i]);
+                result.nexthop = *nexthops[i];
+            } else {
+                result.prefix = 0;
+                result.nexthop = std::string_view();
+            }
+        }
+    }
+}
+
+RouteMatch6 RouteTracker::lookup6(std::string_view ip_address) const {
+    IPv6Address key;
+    if (!parseIPv6Text(ip_address, &key)) {
+        RouteMatch6 none;
+        none.prefix = IPv6Address();
+        none.prefix_length = -1;
+        return none;
+    }
+    return lookup(key);
+}
+
+RouteMatch6 RouteTracker::lookup(const in6_addr& address) const {
+    return lookup(IPv6Address::fromIn6(address));
+}
+
+RouteMatch6 RouteTracker::lookup(const IPv6Address& address) const {
+    EpochGuard guard;
+    RouteMatch6 match;
+    uint32_t id;
+    if (ipv6_rib_->lookup(address, &id, &match.prefix_length)) {
+        match.prefix = address.masked(match.prefix_length);
+        match.nexthop = *nexthops_->get(id);
+    } else {
+        match.prefix = IPv6Address();
+        match.prefix_length = -1;
+    }
+    return match;
+}
+
+void RouteTracker::lookupBatch(const IPv6Address* addresses, size_t count, RouteMatch6* results) const {
+    static const size_t kWindow = 64;
+    uint32_t ids[kWindow];
+    int lengths[kWindow];
+
+    EpochGuard guard;
+
+    for (size_t base = 0; base < count; base += kWindow) {
+        size_t n = std::min(kWindow, count - base);
+        ipv6_rib_->lookupBatch(addresses + base, n, ids, lengths);
+        for (size_t i = 0; i < n; ++i) {
+            RouteMatch6& result = results[base + i];
+            result.prefix_length = lengths[i];
+            if (lengths[i] >= 0) {
+                result.prefix = addresses[base + i].masked(lengths[i]);
+                result.nexthop = *nexthops_->get(ids[i]);
+            } else {
+                result.prefix = IPv6Address();
+                result.nexthop = std::string_view();
+            }
+        }
+    }
+}
+
+bool RouteTracker::registerAddress(std::string_view ip_address, RouteChangeCallback callback) {
+    uint32_t key;
+    if (parseDottedQuad(ip_address, &key)) {
+        return registerAddress(key, callback);
+    }
+    IPv6Address key6;
+    if (parseIPv6Text(ip_address, &key6)) {
+        return registerAddress(key6, callback);
+    }
+    return false;
+}
+
+bool RouteTracker::registerAddress(const in6_addr& ip_address, RouteChangeCallback callback) {
+    return registerAddress(IPv6Address::fromIn6(ip_address), callback);
+}
+
+bool RouteTracker::registerAddress(const IPv6Address& ip_address, RouteChangeCallback callback) {
+    return callback && trackAddress6(ip_address, callback, 0);
+}
+
+bool RouteTracker::registerAddress(const in_addr& ip_address, RouteChangeCallback callback) {
+    return registerAddress(ntohl(ip_address.s_addr), callback);
+}
+
+bool RouteTracker::registerAddress(uint32_t ip_address, RouteChangeCallback callback) {
+    return callback && trackAddress(ip_address, callback, 0);
+}
+
+bool RouteTracker::subscribeAddress(uint32_t ip_address, uint32_t subscriber) {
+    return subscriber && trackAddress(ip_address, nullptr, subscriber);
+}
+
+bool RouteTracker::subscribeAddress(const IPv6Address& ip_address, uint32_t subscriber) {
+    return subscriber && trackAddress6(ip_address, nullptr, subscriber);
+}
+
+bool RouteTracker::trackAddress6(const IPv6Address& ip_address, RouteChangeCallback callback, uint32_t subscriber) {
+    // resolved against the complete tables, not the mapped file
+    waitForRestore();
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    if (!validSubscriber(subscriber)) {
+        return false;
+    }
+    uint32_t id = 0;
+    int length = -1;
+    ipv6_rib_->lookup(ip_address, &id, &length);
+    std::vector<NotificationData> notifications;
+    trackResolved6(tracked_addresses6_.insert(std::make_pair(ip_address, TrackedAddress6())).first, id, length, callback,
+                   subscriber, notifications);
+    queueNotifications(notifications);
+    
+    // invoke callback so remove locks before that
+    tlock.unlock();
+    deliverNotifications(notifications);
+    return true;
+}
+
+bool RouteTracker::trackAddress(uint32_t ip_address, RouteChangeCallback callback, uint32_t subscriber) {
+    // resolved against the complete tables, not the mapped file
+    waitForRestore();
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    if (!validSubscriber(subscriber)) {
+        return false;
+    }
+    uint32_t id = 0;
+    int length = -1;
+    fibLookup(ip_address, &id, &length);
+    std::vector<NotificationData> notifications;
+    trackResolved(*tracked_addresses_.insert(ip_address, listener(callback, subscriber)), id, length, notifications);
+    queueNotifications(notifications);
+    
+    // invoke callback so remove locks before that
+    tlock.unlock();
+    deliverNotifications(notifications);
+    return true;
+}
+
+// Points a new or existing entry at its route and queues the registration
+// notification. Caller holds rt_mutex_.
+void RouteTracker::trackResolved(TrackedTable::Entry& tracked, uint32_t id, int length,
+                                 std::vector<NotificationData>& notifications) {
+    if (tracked.nexthop_id) {
+        nexthops_->release(tracked.nexthop_id);
+    }
+    if (id) {
+        nexthops_->retain(id);
+    }
+    tracked.route_length = id ? length : -1;
+    tracked.nexthop_id = id;
+    // a window from before is about the old registration
+    dropDebounced(notificationKey(tracked.address));
+    if (journal_) {
+        IPAddress addr;
+        ipv4FromKey(tracked.address, addr);
+        journalRegistration(addr, true);
+    }
+
+    NotificationData data;
+    data.version = IPVersion::IPv4;
+    data.ip_address = tracked.address;
+    fillNotification(data, listenerCallback(tracked.listener), listenerSubscriber(tracked.listener), 0, id);
+    notifications.push_back(std::move(data));
+}
+
+void RouteTracker::trackResolved6(TrackedMap6::iterator it, uint32_t id, int length, RouteChangeCallback callback,
+                                  uint32_t subscriber, std::vector<NotificationData>& notifications) {
+    TrackedAddress6& tracked = it->second;
+    if (tracked.nexthop_id) {
+        nexthops_->release(tracked.nexthop_id);
+    }
+    if (id) {
+        nexthops_->retain(id);
+    }
+    tracked.callback = callback;
+    tracked.route_prefix = id ? it->first.masked(length) : IPv6Address();
+    tracked.route_length = length;
+    tracked.nexthop_id = id;
+    tracked.subscriber = subscriber;
+    dropDebounced(NotificationKey(AF_INET6, it->first));
+    if (journal_) {
+        IPAddress addr;
+        ipv6FromKey(it->first, addr);
+        journalRegistration(addr, true);
+    }
+
+    NotificationData data;
+    data.version = IPVersion::IPv6;
+    data.ip6_address = it->first;
+    fillNotification(data, callback, subscriber, 0, id);
+    notifications.push_back(std::move(data));
+}
+
+size_t RouteTracker::registerAddresses(const uint32_t* addresses, size_t count, RouteChangeCallback callback,
+                                       AddressHandle* handles) {
+    return callback ? trackAddresses(addresses, count, callback, 0, handles) : 0;
+}
+
+size_t RouteTracker::registerAddresses(const IPv6Address* addresses, size_t count, RouteChangeCallback callback,
+                                       AddressHandle* handles) {
+    return callback ? trackAddresses6(addresses, count, callback, 0, handles) : 0;
+}
+
+size_t RouteTracker::subscribeAddresses(const uint32_t* addresses, size_t count, uint32_t subscriber,
+                                        AddressHandle* handles) {
+    return subscriber ? trackAddresses(addresses, count, nullptr, subscriber, handles) : 0;
+}
+
+size_t RouteTracker::subscribeAddresses(const IPv6Address* addresses, size_t count, uint32_t subscriber,
+                                        AddressHandle* handles) {
+    return subscriber ? trackAddresses6(addresses, count, nullptr, subscriber, handles) : 0;
+}
+
+// The addresses are sorted first, so that the lookups walk the route table
+// in address order (and IPv6 map inserts land after the previous one).
+size_t RouteTracker::trackAddresses(const uint32_t* addresses, size_t count, RouteChangeCallback callback,
+                                    uint32_t subscriber, AddressHandle* handles) {
+    std::vector<std::pair<uint32_t, size_t> > order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = std::make_pair(addresses[i], i);
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<uint32_t> sorted(count);
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = order[i].first;
+    }
+    std::vector<uint32_t> ids(count);
+    std::vector<int> lengths(count);
+
+    waitForRestore();
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    if (!validSubscriber(subscriber)) {
+        return 0;
+    }
+    fibLookupBatch(sorted.data(), count, ids.data(), lengths.data());
+    std::vector<NotificationData> notifications;
+    notifications.reserve(count);
+    uint32_t entry_listener = listener(callback, subscriber);
+    AddressHandle handle = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i == 0 || sorted[i] != sorted[i - 1]) {
+            TrackedTable::Entry& tracked = *tracked_addresses_.insert(sorted[i], entry_listener);
+            trackResolved(tracked, lengths[i] >= 0 ? ids[i] : 0, lengths[i], notifications);
+            if (handles) {
+                handle = addressHandle(tracked);
+            }
+        }
+        // duplicates share the entry and its handle
+        if (handles) {
+            handles[order[i].second] = handle;
+        }
+    }
+    queueNotifications(notifications);
+
+    tlock.unlock();
+    deliverNotifications(notifications);
+    return count;
+}
+
+size_t RouteTracker::trackAddresses6(const IPv6Address* addresses, size_t count, RouteChangeCallback callback,
+                                     uint32_t subscriber, AddressHandle* handles) {
+    std::vector<std::pair<IPv6Address, size_t> > order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = std::make_pair(addresses[i], i);
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<IPv6Address> sorted(count);
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = order[i].first;
+    }
+    std::vector<uint32_t> ids(count);
+    std::vector<int> lengths(count);
+
+    waitForRestore();
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    if (!validSubscriber(subscriber)) {
+        return 0;
+    }
+    ipv6_rib_->lookupBatch(sorted.data(), count, ids.data(), lengths.data());
+    std::vector<NotificationData> notifications;
+    notifications.reserve(count);
+    TrackedMap6::iterator hint = tracked_addresses6_.begin();
+    AddressHandle handle = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i == 0 || sorted[i] != sorted[i - 1]) {
+            TrackedMap6::iterator it = tracked_addresses6_.emplace_hint(hint, sorted[i], TrackedAddress6());
+            trackResolved6(it, lengths[i] >= 0 ? ids[i] : 0, lengths[i], callback, subscriber, notifications);
+            if (handles) {
+                handle = addressHandle6(it);
+            }
+            hint = std::next(it);
+        }
+        if (handles) {
+            handles[order[i].second] = handle;
+        }
+    }
+    queueNotifications(notifications);
+
+    tlock.unlock();
+    deliverNotifications(notifications);
+    return count;
+}
+
+uint32_t RouteTracker::listener(RouteChangeCallback callback, uint32_t subscriber) {
+    if (subscriber) {
+        return kSubscriberListener | subscriber;
+    }
+    std::map<RouteChangeCallback, uint32_t>::iterator it = callback_listeners_.find(callback);
+    if (it == callback_listeners_.end()) {
+        callbacks_.push_back(callback);
+        it = callback_listeners_.insert(std::make_pair(callback, static_cast<uint32_t>(callbacks_.size()))).first;
+    }
+    return it->second;
+}
+
+bool RouteTracker::validSubscriber(uint32_t subscriber) const {
+    return subscriber == 0 || (subscriber <= subscribers_.size() && subscribers_[subscriber - 1].callback);
+}
+
+// A handle is the slot number in its low 32 bits and the slot's generation
+// in its high 32 bits; freeing a slot bumps its generation, so handles of
+// earlier registrations no longer match.
+AddressHandle RouteTracker::addressHandle(TrackedTable::Entry& tracked) {
+    if (!tracked.handle) {
+        tracked.handle = newHandleSlot();
+        HandleSlot& slot = handle_slots_[tracked.handle - 1];
+        slot.address = tracked.address;
+        slot.ipv6 = false;
+    }
+    return static_cast<AddressHandle>(handle_slots_[tracked.handle - 1].generation) << 32 | tracked.handle;
+}
+
+AddressHandle RouteTracker::addressHandle6(TrackedMap6::iterator it) {
+    if (!it->second.handle) {
+        it->second.handle = newHandleSlot();
+        HandleSlot& slot = handle_slots_[it->second.handle - 1];
+        slot.address6 = it;
+        slot.ipv6 = true;
+    }
+    return static_cast<AddressHandle>(handle_slots_[it->second.handle - 1].generation) << 32 | it->second.handle;
+}
+
+uint32_t RouteTracker::newHandleSlot() {
+    if (!free_handle_slots_.empty()) {
+        uint32_t slot = free_handle_slots_.back();
+        free_handle_slots_.pop_back();
+        return slot;
+    }
+    HandleSlot slot;
+    slot.generation = 1;
+    slot.ipv6 = false;
+    handle_slots_.push_back(slot);
+    return static_cast<uint32_t>(handle_slots_.size());
+}
+
+void RouteTracker::freeHandleSlot(uint32_t slot) {
+    if (slot) {
+        ++handle_slots_[slot - 1].generation;
+        free_handle_slots_.push_back(slot);
+    }
+}
+
+bool RouteTracker::unregister(AddressHandle handle) {
+    uint32_t slot = static_cast<uint32_t>(handle);
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    if (slot == 0 || slot > handle_slots_.size() || handle_slots_[slot - 1].generation != handle >> 32) {
+        return false;
+    }
+    if (handle_slots_[slot - 1].ipv6) {
+        return untrackAddress6(handle_slots_[slot - 1].address6, tlock);
+    }
+    return untrackAddress(tracked_addresses_.find(handle_slots_[slot - 1].address), tlock);
+}
+
+bool RouteTracker::unregisterAddress(std::string_view ip_address) {
+    uint32_t key;
+    if (parseDottedQuad(ip_address, &key)) {
+        return unregisterAddress(key);
+    }
+    IPv6Address key6;
+    if (parseIPv6Text(ip_address, &key6)) {
+        return unregisterAddress(key6);
+    }
+    return false;
+}
+
+bool RouteTracker::unregisterAddress(const in6_addr& ip_address) {
+    return unregisterAddress(IPv6Address::fromIn6(ip_address));
+}
+
+bool RouteTracker::unregisterAddress(const IPv6Address& ip_address) {
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    TrackedMap6::iterator it = tracked_addresses6_.find(ip_address);
+    if (it == tracked_addresses6_.end()) {
+        return false;
+    }
+    return untrackAddress6(it, tlock);
+}
+
+bool RouteTracker::unregisterAddress(const in_addr& ip_address) {
+    return unregisterAddress(ntohl(ip_address.s_addr));
+}
+
+bool RouteTracker::unregisterAddress(uint32_t ip_address) {
+    waitForNotifiers();
+    std::unique_lock<std::mutex> tlock(rt_mutex_);
+    TrackedTable::Entry* tracked = tracked_addresses_.find(ip_address);
+    if (!tracked) {
+        return false;
+    }
+    return untrackAddress(tracked, tlock);
+}
+
+// Removes the entry and, outside tlock, tells its callback; subscribers are
+// not told.
+bool RouteTracker::untrackAddress(TrackedTable::Entry* tracked, std::unique_lock<std::mutex>& tlock) {
+    uint32_t ip_address = tracked->address;
+    RouteChangeCallback local_callback = listenerCallback(tracked->listener);
+    if (tracked->nexthop_id) {
+        nexthops_->release(tracked->nexthop_id);
+    }
+    freeHandleSlot(tracked->handle);
+    tracked_addresses_.erase(tracked);
+    dropDebounced(notificationKey(ip_address));
+    if (journal_) {
+        IPAddress addr;
+        ipv4FromKey(ip_address, addr);
+        journalRegistration(addr, false);
+    }
+    if (!local_callback) {
+        return true;
+    }
+
+    std::vector<NotificationData> notifications(1);
+    NotificationData& data = notifications[0];
+    data.version = IPVersion::IPv4;
+    data.ip_address = ip_address;
+    data.callback = local_callback;
+    queueNotifications(notifications);
+
+    // invoke callback so remove locks before that
+    tlock.unlock();
+    deliverNotifications(notifications);
+    return true;
+}
+
+bool RouteTracker::untrackAddress6(TrackedMap6::iterator it, std::unique_lock<std::mutex>& tlock) {
+    IPv6Address ip_address = it->first;
+    RouteChangeCallback local_callback = it->second.callback;
+    if (it->second.nexthop_id) {
+        nexthops_->release(it->second.nexthop_id);
+    }
+    freeHandleSlot(it->second.handle);
+    tracked_addresses6_.erase(it);
+    dropDebounced(NotificationKey(AF_INET6, ip_address));
+    if (journal_) {
+        IPAddress addr;
+        ipv6FromKey(ip_address, addr);
+        journalRegistration(addr, false);
+    }
+    if (!local_callback) {
+        return true;
+    }
+
+    std::vector<NotificationData> notifications(1);
+    NotificationData& data = notifications[0];
+    data.version = IPVersion::IPv6;
+    data.ip6_address = ip_address;
+    data.callback = local_callback;
+    queueNotifications(notifications);
+
+    // invoke callback so remove locks before that
+    tlock.unlock();
+    deliverNotifications(notifications);
+    return true;
+}
+
+uint32_t RouteTracker::subscribe(RouteChangeBatchCallback callback, void* context) {
+    if (!callback) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    Subscriber subscriber;
+    subscriber.callback = callback;
+    subscriber.context = context;
+    subscribers_.push_back(subscriber);
+    return static_cast<uint32_t>(subscribers_.size());
+}
+
+bool RouteTracker::unsubscribe(uint32_t subscriber) {
+    waitForNotifiers();
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    if (subscriber == 0 || !validSubscriber(subscriber)) {
+        return false;
+    }
+    // ids are not reused, so batches still queued for it can keep theirs
+    subscribers_[subscriber - 1].callback = nullptr;
+    // erasing moves entries, so find them first
+    std::vector<uint32_t> addresses;
+    tracked_addresses_.forEach([&](const TrackedTable::Entry& tracked) {
+        if (tracked.listener == (kSubscriberListener | subscriber)) {
+            addresses.push_back(tracked.address);
+        }
+    });
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        TrackedTable::Entry* tracked = tracked_addresses_.find(addresses[i]);
+        if (tracked->nexthop_id) {
+            nexthops_->release(tracked->nexthop_id);
+        }
+        freeHandleSlot(tracked->handle);
+        tracked_addresses_.erase(tracked);
+        dropDebounced(notificationKey(addresses[i]));
+        if (journal_) {
+            IPAddress addr;
+            ipv4FromKey(addresses[i], addr);
+            journalRegistration(addr, false);
+        }
+    }
+    for (TrackedMap6::iterator it = tracked_addresses6_.begin(); it != tracked_addresses6_.end();) {
+        if (it->second.subscriber != subscriber) {
+            ++it;
+            continue;
+        }
+        if (it->second.nexthop_id) {
+            nexthops_->release(it->second.nexthop_id);
+        }
+        freeHandleSlot(it->second.handle);
+        dropDebounced(NotificationKey(AF_INET6, it->first));
+        if (journal_) {
+            IPAddress addr;
+            ipv6FromKey(it->first, addr);
+            journalRegistration(addr, false);
+        }
+        it = tracked_addresses6_.erase(it);
+    }
+    return true;
+}
+
+std::string_view RouteTracker::nexthopName(uint32_t id) const {
+    const std::string* nexthop = id ? nexthops_->get(id) : nullptr;
+    return nexthop ? std::string_view(*nexthop) : std::string_view();
+}
+
+std::vector<Route> RouteTracker::getAllRoutes() const {
+    std::vector<Route> routes = snapshot().routes();
+    EpochGuard guard;
+    ipv6_rib_->forEach([this, &routes](const IPv6Address& prefix, int, uint32_t id) {
+        routes.push_back(Route(formatIPv6(prefix), *nexthops_->get(id)));
+    });
+    return routes;
+}
+
+bool RouteTracker::saveSnapshot(const std::string& path) const {
+    waitForRestore();
+
+    // IPv6 nexthops are copied under the lock: the views from nexthops_ only
+    // last while their routes do
+    RouteSnapshot routes;
+    std::vector<SnapshotFile::Route6> routes6;
+    std::vector<std::string_view> nexthops;
+    std::unordered_map<std::string_view, uint32_t> nexthop_index;
+    std::deque<std::string> names6;
+    std::string checkpoint;     // the journal segment the snapshot replaces
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        routes = snapshot();
+        if (journal_) {
+            // An earlier checkpoint that failed to write its snapshot left
+            // its segment behind; the journal then keeps growing until one
+            // succeeds. Replaying older updates over a newer snapshot is
+            // harmless, as only the last update of each prefix counts.
+            checkpoint = journal_->path() + ".old";
+            if (access(checkpoint.c_str(), F_OK) != 0) {
+                if (journal_->rotate(checkpoint)) {
+                    // registrations are not in the snapshot
+                    tracked_addresses_.forEach([this](const TrackedTable::Entry& tracked) {
+                        IPAddress addr;
+                        ipv4FromKey(tracked.address, addr);
+                        journalRegistration(addr, true);
+                    });
+                    for (TrackedMap6::const_iterator it = tracked_addresses6_.begin();
+                         it != tracked_addresses6_.end(); ++it) {
+                        IPAddress addr;
+                        ipv6FromKey(it->first, addr);
+                        journalRegistration(addr, true);
+                    }
+                } else {
+                    // no segment to retire: the journal stays whole
+                    checkpoint.clear();
+                }
+            }
+        }
+        ipv6_rib_->forEach([&](const IPv6Address& prefix, int length, uint32_t id) {
+            std::string_view name = *nexthops_->get(id);
+            std::unordered_map<std::string_view, uint32_t>::iterator it = nexthop_index.find(name);
+            if (it == nexthop_index.end()) {
+                names6.push_back(std::string(name));
+                it = nexthop_index.insert(std::make_pair(std::string_view(names6.back()), nexthops.size())).first;
+                nexthops.push_back(names6.back());
+            }
+            SnapshotFile::Route6 route;
+            route.hi = prefix.hi;
+            route.lo = prefix.lo;
+            route.length = length;
+            route.nexthop = it->second;
+            routes6.push_back(route);
+        });
+    }
+
+    std::vector<SnapshotFile::Route> routes4;
+    routes4.reserve(routes.size());
+    routes.forEach([&](uint32_t prefix, int length, std::string_view nexthop) {
+        std::unordered_map<std::string_view, uint32_t>::iterator it = nexthop_index.find(nexthop);
+        if (it == nexthop_index.end()) {
+            it = nexthop_index.insert(std::make_pair(nexthop, nexthops.size())).first;
+            nexthops.push_back(nexthop);
+        }
+        SnapshotFile::Route route;
+        route.prefix = prefix;
+        route.length = length;
+        route.nexthop = it->second;
+        routes4.push_back(route);
+    });
+    if (!SnapshotFile::write(path, nexthops, routes4, routes6)) {
+        return false;
+    }
+    // write() returned once the snapshot and its directory entry are durable;
+    // the segment may go when the registrations journaled since are too
+    if (!checkpoint.empty()) {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (journal_ && journal_->sync()) {
+            remove(checkpoint.c_str());
+        }
+    }
+    return true;
+}
+
+bool RouteTracker::loadSnapshot(const std::string& path) {
+    waitForRestore();
+    std::unique_ptr<SnapshotFile> image(new SnapshotFile());
+    if (!image->open(path)) {
+        return false;
+    }
 
-    if (!node) return;
+    // held until the thread exists, so that updates racing this call wait
+    // for the rebuild too
+    std::lock_guard<std::mutex> restore_lock(restore_mutex_);
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (routes_snapshot_.size() != 0 || ipv6_rib_->routes() != 0) {
+            return false;
+        }
+        __atomic_store_n(&restore_image_, image.get(), __ATOMIC_RELEASE);
+    }
+    // the previous rebuild has finished, or waitForRestore() would not have
+    // returned
+    if (restore_thread_.joinable()) {
+        restore_thread_.join();
+    }
+    restoring_ = true;
+    restore_thread_ = std::thread(&RouteTracker::restoreRoutes, this, image.release());
+    return true;
+}
+
+// The rebuild behind loadSnapshot(): one bulk add of every route in the
+// file, after which lookups go back to the compiled table and the file is
+// unmapped once no reader can be using it.
+void RouteTracker::restoreRoutes(const SnapshotFile* image) {
+    std::vector<std::pair<IPAddress, std::string_view> > parsed;
+    parsed.reserve(image->routes() + image->routes6());
+    for (size_t i = 0; i < image->routes(); ++i) {
+        const SnapshotFile::Route& route = image->routeData()[i];
+        IPAddress addr;
+        ipv4FromKey(route.prefix, addr);
+        addr.prefix_length = route.length;
+        parsed.push_back(std::make_pair(addr, image->nexthop(route.nexthop)));
+    }
+    for (size_t i = 0; i < image->routes6(); ++i) {
+        const SnapshotFile::Route6& route = image->route6Data()[i];
+        IPv6Address key;
+        key.hi = route.hi;
+        key.lo = route.lo;
+        IPAddress addr;
+        ipv6FromKey(key, addr);
+        addr.prefix_length = route.length;
+        parsed.push_back(std::make_pair(addr, image->nexthop(route.nexthop)));
+    }
+    applyRoutes(parsed, false);
+
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        __atomic_store_n(&restore_image_, static_cast<const SnapshotFile*>(nullptr), __ATOMIC_RELEASE);
+        reclaimer_.retire([image]() { delete image; });
+        reclaimer_.reclaim();
+    }
+    std::lock_guard<std::mutex> restore_lock(restore_mutex_);
+    restoring_ = false;
+    restore_done_.notify_all();
+}
+
+void RouteTracker::waitForRestore() const {
+    std::unique_lock<std::mutex> restore_lock(restore_mutex_);
+    // a route change callback run by the rebuild itself must not wait for it
+    if (restore_thread_.get_id() == std::this_thread::get_id()) {
+        return;
+    }
+    restore_done_.wait(restore_lock, [this]() { return !restoring_; });
+}
+
+bool RouteTracker::openJournal(const std::string& path, unsigned sync_interval_ms) {
+    std::unique_ptr<UpdateJournal> journal(new UpdateJournal());
+    if (!journal->open(path, sync_interval_ms)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    journal_ = std::move(journal);
+    return true;
+}
+
+bool RouteTracker::syncJournal() {
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    return journal_ && journal_->sync();
+}
+
+void RouteTracker::closeJournal() {
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    journal_.reset();
+}
+
+void RouteTracker::journalRoute(const IPAddress& addr, std::string_view nexthop) const {
+    if (!journal_) {
+        return;
+    }
+    JournalEntry entry;
+    entry.type = nexthop.empty() ? JournalEntry::kDeleteRoute : JournalEntry::kAddRoute;
+    entry.family = addr.version == IPVersion::IPv6 ? AF_INET6 : AF_INET;
+    entry.length = addr.prefix_length;
+    memcpy(entry.address, addr.bytes, sizeof(entry.address));
+    entry.nexthop = nexthop;
+    journal_->append(entry);
+}
+
+void RouteTracker::journalRegistration(const IPAddress& addr, bool registered) const {
+    if (!journal_) {
+        return;
+    }
+    JournalEntry entry;
+    entry.type = registered ? JournalEntry::kRegister : JournalEntry::kUnregister;
+    entry.family = addr.version == IPVersion::IPv6 ? AF_INET6 : AF_INET;
+    entry.length = 0;
+    memcpy(entry.address, addr.bytes, sizeof(entry.address));
+    journal_->append(entry);
+}
+
+bool RouteTracker::replayJournal(const std::string& path, RouteChangeCallback callback, JournalReplayStats* stats) {
+    typedef std::chrono::steady_clock clock;
+    waitForRestore();
+    clock::time_point start = clock::now();
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        if (journal_) {
+            return false;
+        }
+    }
+
+    // the older segment first; the readers stay open while the nexthops
+    // viewing them are applied
+    JournalReader readers[2];
+    bool opened[2] = {readers[0].open(path + ".old"), readers[1].open(path)};
+    if (!opened[0] && !opened[1]) {
+        return false;
+    }
+    std::vector<std::pair<IPAddress, std::string_view> > updates;     // empty nexthop: delete
+    std::vector<std::pair<IPAddress, bool> > registrations;
+    size_t records = 0;
+    bool torn = false;
+    for (int i = 0; i < 2; ++i) {
+        JournalEntry entry;
+        while (opened[i] && readers[i].next(entry)) {
+            IPAddress addr;
+            addr.version = entry.family == AF_INET6 ? IPVersion::IPv6 : IPVersion::IPv4;
+            memcpy(addr.bytes, entry.address, sizeof(addr.bytes));
+            addr.prefix_length = entry.length;
+            if (entry.type == JournalEntry::kAddRoute || entry.type == JournalEntry::kDeleteRoute) {
+                maskAddress(addr);
+                updates.push_back(std::make_pair(addr, entry.nexthop));
+            } else {
+                registrations.push_back(std::make_pair(addr, entry.type == JournalEntry::kRegister));
+            }
+            ++records;
+        }
+        torn = torn || readers[i].torn();
+    }
+
+    // only the last record of each prefix matters
+    std::vector<std::pair<IPAddress, std::string_view> > adds;
+    std::vector<IPAddress> deletes;
+    netUpdates(updates, adds, deletes);
+    size_t routes_added = adds.size();
+    size_t routes_deleted = deletes.size();
+    applyUpdates(adds, deletes, false);
+
+    std::stable_sort(registrations.begin(), registrations.end(),
+                     [](const std::pair<IPAddress, bool>& a, const std::pair<IPAddress, bool>& b) {
+                         return addressBefore(a.first, b.first);
+                     });
+    size_t registered = 0;
+    for (size_t i = 0; i < registrations.size(); ++i) {
+        if (i + 1 < registrations.size() && !addressBefore(registrations[i].first, registrations[i + 1].first)) {
+            continue;
+        }
+        const IPAddress& addr = registrations[i].first;
+        if (!registrations[i].second) {
+            continue;
+        }
+        ++registered;
+        if (!callback) {
+            continue;
+        }
+        if (addr.version == IPVersion::IPv6) {
+            registerAddress(ipv6Key(addr), callback);
+        } else {
+            registerAddress(ipv4Key(addr), callback);
+        }
+    }
+
+    if (stats) {
+        stats->records = records;
+        stats->torn = torn;
+        stats->routes_added = routes_added;
+        stats->routes_deleted = routes_deleted;
+        stats->registrations = registered;
+        stats->seconds = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    return true;
+}
+
+RouteSnapshot RouteTracker::snapshot() const {
+    EpochGuard guard;
+    const SnapshotNode* root = __atomic_load_n(&published_snapshot_, __ATOMIC_ACQUIRE);
+    return RouteSnapshot(RouteSnapshot::retain(root));
+}
+
+// Makes routes_snapshot_ visible to snapshot(). A reader may be about to take
+// its own reference on the previous root, so that one is released only after
+// the epoch grace period.
+void RouteTracker::publishSnapshot() {
+    const SnapshotNode* previous = published_snapshot_;
+    __atomic_store_n(&published_snapshot_, RouteSnapshot::retain(routes_snapshot_.root_), __ATOMIC_RELEASE);
+    if (previous) {
+        reclaimer_.retire([previous]() { RouteSnapshot::release(previous); });
+    }
+}
+
+bool RouteTracker::ribInsert(const IPAddress& addr, uint32_t id, uint32_t* old_id) {
+    if (compact_rib_) {
+        *old_id = compact_rib_->insert(ipv4Key(addr), addr.prefix_length, id);
+        return true;
+    }
+
+    patricia_tree_t* tree =ip_tree_; 
+    
+    prefix_t* prefix;
+    {
+        struct in_addr sin;
+        memcpy(&sin, addr.bytes, sizeof(struct in_addr));
+        prefix = New_Prefix(AF_INET, &sin, addr.prefix_length);
+    }
+    
+    patricia_node_t* node =  patricia_lookup(tree, prefix);
+    Deref_Prefix(prefix);
+    if (!node) {
+        return false;
+    }
+    *old_id = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(node->user1));
+    node->user1 = reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+    return true;
+}
+
+// Returns the removed route's id (0 if there was none) and the route that
+// now covers the prefix, covering_length -1 when nothing does.
+uint32_t RouteTracker::ribRemove(const IPAddress& addr, uint32_t* covering_id, int* covering_length) {
+    *covering_id = 0;
+    *covering_length = -1;
+    if (compact_rib_) {
+        uint32_t id = compact_rib_->remove(ipv4Key(addr), addr.prefix_length);
+        if (id) {
+            compact_rib_->searchBest(ipv4Key(addr), addr.prefix_length, covering_id, covering_length);
+        }
+        return id;
+    }
+
+    patricia_tree_t* tree = ip_tree_;
+    
+    prefix_t* prefix;
+    //if (addr.version == IPVersion::IPv4) {
+        struct in_addr sin;
+        memcpy(&sin, addr.bytes, sizeof(struct in_addr));
+        prefix = New_Prefix(AF_INET, &sin, addr.prefix_length);
+    //}
+    
+    patricia_node_t* node = patricia_search_exact(tree, prefix);
+    
+    if (!node) {
+        Deref_Prefix(prefix);
+        return 0;
+    }
+    
+    uint32_t id = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(node->user1));
+    node->user1 = nullptr;
+    
+    patricia_remove(tree, node);
+
+    patricia_node_t* covering = patricia_search_best(tree, prefix);
+    Deref_Prefix(prefix);
+    if (covering && covering->user1) {
+        *covering_id = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(covering->user1));
+        *covering_length = covering->prefix->bitlen;
+    }
+    return id;
+}
+
+bool RouteTracker::fibLookup(uint32_t address, uint32_t* id, int* length) const {
+    if (fib_) {
+        return fib_->lookup(address, id, length);
+    }
+    if (poptrie_fib_) {
+        return poptrie_fib_->lookup(address, id, length);
+    }
+    return lc_fib_->lookup(address, id, length);
+}
+
+void RouteTracker::fibLookupBatch(const uint32_t* addresses, size_t count, uint32_t* ids, int* lengths) const {
+    if (fib_) {
+        fib_->lookupBatch(addresses, count, ids, lengths);
+    } else if (poptrie_fib_) {
+        poptrie_fib_->lookupBatch(addresses, count, ids, lengths);
+    } else {
+        lc_fib_->lookupBatch(addresses, count, ids, lengths);
+    }
+}
+
+void RouteTracker::fibInsert(const IPAddress& addr, uint32_t id) {
+    uint32_t prefix = ipv4Key(addr) & prefixMask(addr.prefix_length);
+    if (fib_) {
+        fib_->insert(prefix, addr.prefix_length, id);
+    } else if (poptrie_fib_) {
+        poptrie_fib_->insert(prefix, addr.prefix_length, id);
+    } else {
+        lc_fib_->insert(prefix, addr.prefix_length, id);
+    }
+}
+
+void RouteTracker::fibRemove(const IPAddress& addr, uint32_t covering_id, int covering_length) {
+    uint32_t prefix = ipv4Key(addr) & prefixMask(addr.prefix_length);
+    if (fib_) {
+        fib_->remove(prefix, addr.prefix_length, covering_id, covering_length);
+    } else if (poptrie_fib_) {
+        poptrie_fib_->remove(prefix, addr.prefix_length, covering_id, covering_length);
+    } else {
+        lc_fib_->remove(prefix, addr.prefix_length, covering_id, covering_length);
+    }
+}
+
+// Initial load of an empty compact table: the sorted IPv4 entries at the
+// front of parsed become the trie in one bottom-up pass instead of one
+// insert each. Returns how many entries of parsed it consumed.
+size_t RouteTracker::loadCompactRib(const std::vector<std::pair<IPAddress, std::string_view> >& parsed,
+                                    std::vector<IPAddress>& changed, std::vector<size_t>& accepted) {
+    static const size_t kParallelLoad = 65536;
+
+    std::vector<CompactTrie::Entry> entries;
+    std::vector<size_t> sources;
+    size_t changed_before = changed.size();
+    size_t consumed = 0;
+    for (; consumed < parsed.size() && parsed[consumed].first.version == IPVersion::IPv4; ++consumed) {
+        const IPAddress& addr = parsed[consumed].first;
+        uint32_t id = nexthops_->acquire(parsed[consumed].second);
+        if (id == 0) {
+            continue;
+        }
+        CompactTrie::Entry entry;
+        entry.prefix = ipv4Key(addr);
+        entry.length = addr.prefix_length;
+        entry.value = id;
+        if (!entries.empty() && entries.back().prefix == entry.prefix && entries.back().length == entry.length) {
+            // duplicate prefix: the last one wins
+            nexthops_->release(entries.back().value);
+            entries.back().value = id;
+            sources.back() = consumed;
+            changed.push_back(addr);
+            continue;
+        }
+        entries.push_back(entry);
+        sources.push_back(consumed);
+    }
+
+    if (!compact_rib_->assign(entries, entries.size() >= kParallelLoad ? 0 : 1)) {
+        // applyUpdates() sorted them, so this only happens should that order
+        // and the trie's ever disagree: nothing was loaded, and the caller
+        // inserts every route one at a time instead
+        for (size_t i = 0; i < entries.size(); ++i) {
+            nexthops_->release(entries[i].value);
+        }
+        changed.resize(changed_before);
+        return 0;
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const IPAddress& addr = parsed[sources[i]].first;
+        fibInsert(addr, entries[i].value);
+        routes_snapshot_.setRoute(entries[i].prefix, entries[i].length, nexthops_->shared(entries[i].value));
+        changed.push_back(addr);
+    }
+    accepted.insert(accepted.end(), sources.begin(), sources.end());
+    return consumed;
+}
 
-    // left subtree
-    if (node->l) freePatriciaNode(node->l);
+// Writers below publish new state before releasing what it replaced: lookups
+// run without rt_mutex_ and may still be resolving the old nexthop id.
+bool RouteTracker::insertRoute(const IPAddress& addr, std::string_view nexthop, bool publish) {
+    uint32_t id = nexthops_->acquire(nexthop);
+    if (id == 0) {
+        return false;
+    }
 
-    // right
-    if (node->r) freePatriciaNode(node->r);
+    if (addr.version == IPVersion::IPv6) {
+        // the 128-bit table is also what IPv6 lookups read, so there is no
+        // compiled copy or snapshot to update
+        uint32_t old_id = ipv6_rib_->insert(ipv6Key(addr), addr.prefix_length, id);
+        if (old_id) {
+            nexthops_->release(old_id);
+        }
+        if (publish) {
+            reclaimer_.reclaim();
+        }
+        return true;
+    }
 
-    // my data added 
-    if (node->data) {
-        delete static_cast<std::string*>(node->data);
-        node->data = nullptr;
+    uint32_t old_id;
+    if (!ribInsert(addr, id, &old_id)) {
+        nexthops_->release(id);
+        return false;
+    }
+    if (old_id == id) {
+        nexthops_->release(id);
+        return true;
     }
+    fibInsert(addr, id);
 
-    if (node->prefix) {
-        Deref_Prefix(node->prefix);
-        node->prefix = nullptr;
+    routes_snapshot_.setRoute(ipv4Key(addr), addr.prefix_length, nexthops_->shared(id));
+    if (publish) {
+        publishSnapshot();
     }
 
-    free(node);
+    if (old_id) {
+        nexthops_->release(old_id);
+    }
+    if (publish) {
+        reclaimer_.reclaim();
+    }
+    return true;
 }
 
+bool RouteTracker::removeRoute(const IPAddress& addr, bool publish) {
+    if (addr.version == IPVersion::IPv6) {
+        uint32_t id = ipv6_rib_->remove(ipv6Key(addr), addr.prefix_length);
+        if (!id) {
+            return false;
+        }
+        nexthops_->release(id);
+        if (publish) {
+            reclaimer_.reclaim();
+        }
+        return true;
+    }
+
+    uint32_t covering_id;
+    int covering_length;
+    uint32_t id = ribRemove(addr, &covering_id, &covering_length);
+    if (!id) {
+        return false;
+    }
 
-RouteTracker::RouteTracker() {
-    ip_tree_ = New_Patricia(32);
-  //  ip_tree_->free_user_data = free_route_data;
-}
+    // hand the withdrawn range back to whatever now covers the prefix
+    fibRemove(addr, covering_id, covering_length);
 
-RouteTracker::~RouteTracker() {
-    {
-        std::lock_guard<std::mutex> _lock(rt_mutex_);
-        for (std::unordered_map<std::string, TrackedAddress>::iterator it = tracked_addresses_.begin(); it != tracked_addresses_.end(); ++it) {
-            if (it->second.current_route) {
-                delete it->second.current_route;
-            }
-        }
-        tracked_addresses_.clear();
+    routes_snapshot_.clearRoute(ipv4Key(addr), addr.prefix_length);
+    if (publish) {
+        publishSnapshot();
     }
 
-    if (ip_tree_) {
-        freePatriciaNode(ip_tree_->head);
-        free(ip_tree_);
-        ip_tree_ = nullptr;
-    }    
-    //if (ip_tree_) {
-    //    Destroy_Patricia(ip_tree_, nullptr);
-    //}
+    // the string behind id stays readable until no reader can reach it
+    nexthops_->release(id);
+    if (publish) {
+        reclaimer_.reclaim();
+    }
+    
+    return true;
 }
 
-bool RouteTracker::addRoute(const std::string& prefix, const std::string& nexthop) {
-    if (prefix.empty() || nexthop.empty()) {
-        return false;
+// Re-resolves the tracked addresses that changed_network can affect and queues a
+// notification for each one whose route moved. Only addresses inside the prefix
+// are visited: on add, those currently routed via an equal or less specific
+// prefix; on delete, those routed via exactly the removed prefix.
+// Caller holds rt_mutex_.
+void RouteTracker::notifyAffectedAddresses(const IPAddress& changed_network, bool route_added,
+                                           std::vector<NotificationData>& notifications) {
+    if (changed_network.version == IPVersion::IPv6) {
+        notifyAffectedAddresses6(changed_network, route_added, notifications);
+        return;
     }
-    //std::cout << " addRoute: " << "pfx:" << prefix << "nh:" << nexthop << "\n";    
-    IPAddress addr;
-    if (!parseIP(prefix, addr)) {
-        return false;
+    int length = changed_network.prefix_length;
+    uint32_t mask = prefixMask(length);
+    uint32_t first = ipv4Key(changed_network) & mask;
+    uint32_t last = first | ~mask;
+
+    std::vector<TrackedTable::Entry*> inside;
+    tracked_addresses_.collect(first, last, inside);
+    for (size_t i = 0; i < inside.size(); ++i) {
+        if (route_added ? inside[i]->route_length > length : inside[i]->route_length != length) {
+            continue;
+        }
+        refreshTracked(*inside[i], notifications);
     }
-    
-        std::unique_lock<std::mutex> rlock(rt_mutex_);
-    {
-        insertRoute(addr, nexthop);
+}
+
+// notifyAffectedAddresses() for an IPv6 change, over the 128-bit tracked map.
+void RouteTracker::notifyAffectedAddresses6(const IPAddress& changed_network, bool route_added,
+                                            std::vector<NotificationData>& notifications) {
+    int length = changed_network.prefix_length;
+    IPv6Address first = ipv6Key(changed_network).masked(length);
+    IPv6Address last = first.lastInPrefix(length);
+
+    TrackedMap6::iterator it = tracked_addresses6_.lower_bound(first);
+    for (; it != tracked_addresses6_.end() && it->first <= last; ++it) {
+        if (route_added ? it->second.route_length > length : it->second.route_length != length) {
+            continue;
+        }
+        refreshTracked6(it->first, it->second, notifications);
     }
-    
-    //notifyAffectedAddresses(addr);
-    std::vector<NotificationData> notifications;
-    
-    {
-        //std::lock_guard<std::mutex> tlock(rt_mutex_);
-        
-        for (std::unordered_map<std::string, TrackedAddress>::iterator it = tracked_addresses_.begin(); it != tracked_addresses_.end(); ++it) {
-            std::string ip_str = it->first;
-            TrackedAddress& tracked = it->second;
-            
-            Route* new_route = longestPrefixMatch(ip_str);
-            
-            bool route_changed = false;
-            if ((new_route == nullptr && tracked.current_route != nullptr) ||
-                (new_route != nullptr && tracked.current_route == nullptr) ||
-                (new_route != nullptr && tracked.current_route != nullptr && 
-                 (new_route->prefix != tracked.current_route->prefix || new_route->nexthop != tracked.current_route->nexthop))) {
-                route_changed = true;
-            }
-            
-            if (route_changed) {
-                NotificationData data;
-                data.ip_address = ip_str;
-                data.old_nexthop = tracked.current_route ? tracked.current_route->nexthop : "";
-                data.new_nexthop = new_route ? new_route->nexthop : "";
-                data.callback = tracked.callback;
-                
-                if (tracked.current_route) {
-                    delete tracked.current_route;
-                }
-                tracked.current_route = new_route;
-                
-                notifications.push_back(data);
-            } else {
-                delete new_route;
-            }
+}
+
+// After a bulk update: every tracked address inside any changed prefix is
+// re-resolved once against the final state. Overlapping prefixes are merged
+// first, so an address is visited (and notified) at most once.
+// Caller holds rt_mutex_.
+void RouteTracker::notifyChangedNetworks(const std::vector<IPAddress>& changed,
+                                         std::vector<NotificationData>& notifications) {
+    std::vector<std::pair<uint32_t, uint32_t> > ranges;
+    std::vector<std::pair<IPv6Address, IPv6Address> > ranges6;
+    for (size_t i = 0; i < changed.size(); ++i) {
+        int length = changed[i].prefix_length;
+        if (changed[i].version == IPVersion::IPv6) {
+            IPv6Address first = ipv6Key(changed[i]).masked(length);
+            ranges6.push_back(std::make_pair(first, first.lastInPrefix(length)));
+        } else {
+            uint32_t first = ipv4Key(changed[i]) & prefixMask(length);
+            ranges.push_back(std::make_pair(first, first | ~prefixMask(length)));
         }
     }
-    rlock.unlock(); 
-    for (size_t i = 0; i < notifications.size(); ++i) {
-        try {
-            notifications[i].callback(notifications[i].ip_address, notifications[i].new_nexthop, notifications[i].old_nexthop);
-        } catch (...) {
+
+    mergeRanges(ranges);
+    std::vector<TrackedTable::Entry*> inside;
+    tracked_addresses_.collect(ranges, inside);
+    for (size_t i = 0; i < inside.size(); ++i) {
+        refreshTracked(*inside[i], notifications);
+    }
+    mergeRanges(ranges6);
+    for (size_t i = 0; i < ranges6.size(); ++i) {
+        TrackedMap6::iterator it = tracked_addresses6_.lower_bound(ranges6[i].first);
+        for (; it != tracked_addresses6_.end() && it->first <= ranges6[i].second; ++it) {
+            refreshTracked6(it->first, it->second, notifications);
         }
     }
+}
 
-    return true;
+// Re-resolves one tracked address and queues a notification if its nexthop
+// changed. Caller holds rt_mutex_.
+void RouteTracker::refreshTracked(TrackedTable::Entry& tracked, std::vector<NotificationData>& notifications) {
+    uint32_t id = 0;
+    int new_length = -1;
+    fibLookup(tracked.address, &id, &new_length);
+    if (!id) {
+        new_length = -1;
+    }
+    // the prefix is the address's first route_length bits
+    if (new_length == tracked.route_length && id == tracked.nexthop_id) {
+        return;
+    }
+
+    // a move to another prefix with the same (interned) nexthop is not worth
+    // a callback
+    if (id != tracked.nexthop_id) {
+        NotificationData data;
+        data.version = IPVersion::IPv4;
+        data.ip_address = tracked.address;
+        fillNotification(data, listenerCallback(tracked.listener), listenerSubscriber(tracked.listener),
+                         tracked.nexthop_id, id);
+        notifications.push_back(std::move(data));
+    }
+
+    if (id) {
+        nexthops_->retain(id);
+    }
+    if (tracked.nexthop_id) {
+        nexthops_->release(tracked.nexthop_id);
+    }
+    tracked.route_length = new_length;
+    tracked.nexthop_id = id;
 }
 
-bool RouteTracker::deleteRoute(const std::string& prefix) {
-    IPAddress addr;
-    if (!parseIP(prefix, addr)) {
-        return false;
+void RouteTracker::refreshTracked6(const IPv6Address& address, TrackedAddress6& tracked,
+                                   std::vector<NotificationData>& notifications) {
+    uint32_t id = 0;
+    int new_length = -1;
+    ipv6_rib_->lookup(address, &id, &new_length);
+    IPv6Address new_prefix = id ? address.masked(new_length) : IPv6Address();
+    if (new_length == tracked.route_length && new_prefix == tracked.route_prefix && id == tracked.nexthop_id) {
+        return;
     }
-    
-    //std::cout << " deleteRoute: " << "pfx:" << prefix << "\n";    
-    std::unique_lock<std::mutex> rlock(rt_mutex_);
-    bool deleted;
-    {
-        deleted = removeRoute(addr);
+
+    if (id != tracked.nexthop_id) {
+        NotificationData data;
+        data.version = IPVersion::IPv6;
+        data.ip6_address = address;
+        fillNotification(data, tracked.callback, tracked.subscriber, tracked.nexthop_id, id);
+        notifications.push_back(std::move(data));
     }
-    
-    if (deleted) {
-    //    notifyAffectedAddresses(addr);
-    std::vector<NotificationData> notifications;
-    
-    {
-        //std::lock_guard<std::mutex> tlock(rt_mutex_);
-        
-        for (std::unordered_map<std::string, TrackedAddress>::iterator it = tracked_addresses_.begin(); it != tracked_addresses_.end(); ++it) {
-            std::string ip_str = it->first;
-            TrackedAddress& tracked = it->second;
-            
-            Route* new_route = longestPrefixMatch(ip_str);
-            
-            bool route_changed = false;
-            if ((new_route == nullptr && tracked.current_route != nullptr) ||
-                (new_route != nullptr && tracked.current_route == nullptr) ||
-                (new_route != nullptr && tracked.current_route != nullptr && 
-                 (new_route->prefix != tracked.current_route->prefix || new_route->nexthop != tracked.current_route->nexthop))) {
-                route_changed = true;
-            }
-            
-            if (route_changed) {
-                NotificationData data;
-                data.ip_address = ip_str;
-                data.old_nexthop = tracked.current_route ? tracked.current_route->nexthop : "";
-                data.new_nexthop = new_route ? new_route->nexthop : "";
-                data.callback = tracked.callback;
-                
-                if (tracked.current_route) {
-                    delete tracked.current_route;
-                }
-                tracked.current_route = new_route;
-                
-                notifications.push_back(data);
-            } else {
-                delete new_route;
-            }
+
+    if (id) {
+        nexthops_->retain(id);
+    }
+    if (tracked.nexthop_id) {
+        nexthops_->release(tracked.nexthop_id);
+    }
+    tracked.route_prefix = new_prefix;
+    tracked.route_length = new_length;
+    tracked.nexthop_id = id;
+}
+
+// The nexthops of a change, as strings for a callback and as ids, each with
+// a reference of its own, for a subscriber. Caller holds rt_mutex_.
+void RouteTracker::fillNotification(NotificationData& data, RouteChangeCallback callback, uint32_t subscriber,
+                                    uint32_t old_id, uint32_t new_id) {
+    data.callback = callback;
+    data.subscriber = subscriber;
+    if (subscriber) {
+        data.old_id = old_id;
+        data.new_id = new_id;
+        if (old_id) {
+            nexthops_->retain(old_id);
+        }
+        if (new_id) {
+            nexthops_->retain(new_id);
         }
+    } else {
+        data.old_nexthop = old_id ? *nexthops_->get(old_id) : "";
+        data.new_nexthop = new_id ? *nexthops_->get(new_id) : "";
     }
-    rlock.unlock(); 
-    for (size_t i = 0; i < notifications.size(); ++i) {
-        try {
-            notifications[i].callback(notifications[i].ip_address, notifications[i].new_nexthop, notifications[i].old_nexthop);
-        } catch (...) {
+}
+
+void RouteTracker::releaseNotification(const NotificationData& data) {
+    if (data.old_id) {
+        nexthops_->release(data.old_id);
+    }
+    if (data.new_id) {
+        nexthops_->release(data.new_id);
+    }
+    for (size_t i = 0; i < data.changes.size(); ++i) {
+        if (data.changes[i].old_nexthop) {
+            nexthops_->release(data.changes[i].old_nexthop);
+        }
+        if (data.changes[i].new_nexthop) {
+            nexthops_->release(data.changes[i].new_nexthop);
         }
     }
+}
 
+// Runs queued callbacks; must be called after rt_mutex_ has been released.
+void RouteTracker::deliverNotifications(const std::vector<NotificationData>& notifications) {
+    for (size_t i = 0; i < notifications.size(); ++i) {
+        deliverNotification(notifications[i]);
     }
-    
-    return deleted;
 }
 
-// this is internal and protected by lock.
-Route* RouteTracker::longestPrefixMatch(const std::string& ip_address) const {
-    IPAddress addr;
-    if (!parseIPAddress(ip_address, addr)) {
-        return nullptr;
+void RouteTracker::deliverNotification(const NotificationData& data) {
+    if (data.batch_callback) {
+        try {
+            data.batch_callback(data.changes.data(), data.changes.size(), data.context);
+        } catch (...) {
+        }
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        releaseNotification(data);
+        return;
+    }
+    try {
+        data.callback(data.version == IPVersion::IPv6 ? formatIPv6(data.ip6_address) : formatIPv4(data.ip_address),
+                      data.new_nexthop, data.old_nexthop);
+    } catch (...) {
     }
-    
-    addr.prefix_length = 32;
-    
-    //std::lock_guard<std::mutex> rlock(rt_mutex_);
-    
-    return findLongestMatch(addr);
 }
 
-bool RouteTracker::registerAddress(const std::string& ip_address, RouteChangeCallback callback) {
-    if (ip_address.empty() || !callback) {
+bool RouteTracker::startNotifiers(unsigned threads, size_t max_queued) {
+    if (threads == 0 || max_queued == 0) {
         return false;
     }
-    
-    IPAddress addr;
-    if (!parseIPAddress(ip_address, addr)) {
+    std::lock_guard<std::mutex> rlock(rt_mutex_);
+    if (notifier_) {
         return false;
     }
-    
-    std::unique_lock<std::mutex> tlock(rt_mutex_);
-    Route* route = longestPrefixMatch(ip_address);
-  // invoke callback so remove locks before that
-                NotificationData data;
-                data.ip_address = ip_address;
-                data.new_nexthop = route ? route->nexthop : "";
-                data.old_nexthop = "";
-                data.callback = callback;
-    
-    
-    std::unordered_map<std::string, TrackedAddress>::iterator it = tracked_addresses_.find(ip_address);
-    if (it != tracked_addresses_.end() && it->second.current_route) {
-        delete it->second.current_route;
-    }
-    
-    tracked_addresses_[ip_address] = {callback, route};
-    
-#if 1
-  tlock.unlock();
- 
-       data.callback(data.ip_address, data.new_nexthop, data.old_nexthop);
-#endif
-
+    NotifierPool<NotificationData>* notifier = new NotifierPool<NotificationData>(
+        threads, max_queued, [this](NotificationData& data) { deliverNotification(data); });
+    __atomic_store_n(&notifier_, notifier, __ATOMIC_RELEASE);
     return true;
 }
 
-bool RouteTracker::unregisterAddress(const std::string& ip_address) {
-    std::unique_lock<std::mutex> tlock(rt_mutex_);
-     RouteChangeCallback local_callback; 
-    std::unordered_map<std::string, TrackedAddress>::iterator it = tracked_addresses_.find(ip_address);
-    if (it != tracked_addresses_.end()) {
-        local_callback = it->second.callback;
-        if (it->second.current_route) {
-            delete it->second.current_route;
-        }
-        tracked_addresses_.erase(it);
-#if 1
-  tlock.unlock();
-  // invoke callback so remove locks before that
-                NotificationData data;
-                data.ip_address = ip_address;
-                data.new_nexthop = "";
-                data.old_nexthop = "";
-                data.callback = local_callback;
- 
-       data.callback(data.ip_address, data.new_nexthop, data.old_nexthop);
-#endif
-        return true;
+void RouteTracker::setDebounceWindow(unsigned milliseconds) {
+    {
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        debounce_ms_ = milliseconds;
+        if (milliseconds && !debounce_thread_.joinable()) {
+            debounce_thread_ = std::thread(&RouteTracker::debounceLoop, this);
+        }
+    }
+    debounce_wake_.notify_all();
+    if (!milliseconds) {
+        closeWindows(true);
     }
-    return false;
 }
 
-std::vector<Route> RouteTracker::getAllRoutes() const {
-    std::lock_guard<std::mutex> rlock(rt_mutex_);
-    
-    std::vector<Route> routes;
-    
-    traversePatriciaTree(ip_tree_, routes);
-    
-return routes;
+void RouteTracker::debounceNotifications(std::vector<NotificationData>& notifications) {
+    if (debounce_ms_ == 0) {
+        return;
+    }
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(debounce_ms_);
+    for (size_t i = 0; i < notifications.size(); ++i) {
+        NotificationData& data = notifications[i];
+        NotificationKey key =
+            data.version == IPVersion::IPv4 ? notificationKey(data.ip_address) : NotificationKey(AF_INET6, data.ip6_address);
+        std::map<NotificationKey, DebouncedChange>::iterator it = debounced_.find(key);
+        if (it != debounced_.end()) {
+            // the window stays open until its deadline; the nexthop it
+            // started from stays the old one
+            NotificationData& open = it->second.data;
+            open.new_nexthop.swap(data.new_nexthop);
+            std::swap(open.new_id, data.new_id);
+            releaseNotification(data);
+            ++suppressed_;
+            continue;
+        }
+        DebouncedChange& change = debounced_[key];
+        change.data = std::move(data);
+        change.deadline = deadline;
+        // after a shorter window was set, this may be due before the others
+        if (debounce_deadlines_.empty() || deadline < debounce_deadlines_.begin()->first) {
+            debounce_wake_.notify_one();
+        }
+        debounce_deadlines_.insert(std::make_pair(deadline, key));
+    }
+    notifications.clear();
 }
 
-void RouteTracker::insertRoute(const IPAddress& addr, const std::string& nexthop) {
-    patricia_tree_t* tree =ip_tree_; 
-    
-    prefix_t* prefix;
-    {
-        struct in_addr sin;
-        memcpy(&sin, addr.bytes, sizeof(struct in_addr));
-        prefix = New_Prefix(AF_INET, &sin, addr.prefix_length);
+// Whichever closing finds nobody delivering delivers what every closing
+// appended meanwhile, in order, until none is left; so closings cannot
+// overtake each other and no lock is held while callbacks run.
+uint64_t RouteTracker::closeWindows(bool all) {
+    std::vector<NotificationData> notifications;
+    std::unique_lock<std::mutex> rlock(rt_mutex_);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!debounce_deadlines_.empty() && (all || debounce_deadlines_.begin()->first <= now)) {
+        std::map<NotificationKey, DebouncedChange>::iterator it =
+            debounced_.find(debounce_deadlines_.begin()->second);
+        // skip windows dropped by unregisterAddress(), and their
+        // successors, which have a later deadline of their own
+        bool current = it != debounced_.end() && it->second.deadline == debounce_deadlines_.begin()->first;
+        debounce_deadlines_.erase(debounce_deadlines_.begin());
+        if (!current) {
+            continue;
+        }
+        NotificationData& data = it->second.data;
+        if (data.old_nexthop != data.new_nexthop || data.old_id != data.new_id) {
+            notifications.push_back(std::move(data));
+        } else {
+            releaseNotification(data);
+            ++suppressed_;
+        }
+        debounced_.erase(it);
     }
-    
-    patricia_node_t* node =  patricia_lookup(tree, prefix);
-    
-    if (node->data) {
-        delete static_cast<std::string*>(node->data);
+    queueNotifications(notifications);
+    for (size_t i = 0; i < notifications.size(); ++i) {
+        closed_.push_back(std::move(notifications[i]));
     }
-    node->data = new std::string(nexthop);
-    
-    Deref_Prefix(prefix);
+    uint64_t closing = ++closings_;
+    if (delivering_closed_) {
+        return closing;
+    }
+    delivering_closed_ = true;
+    while (!closed_.empty()) {
+        notifications.clear();
+        notifications.swap(closed_);
+        rlock.unlock();
+        deliverNotifications(notifications);
+        rlock.lock();
+    }
+    delivering_closed_ = false;
+    delivered_closings_ = closings_;
+    closed_delivered_.notify_all();
+    return closing;
 }
 
-bool RouteTracker::removeRoute(const IPAddress& addr) {
-    patricia_tree_t* tree = ip_tree_;
-    
-    prefix_t* prefix;
-    //if (addr.version == IPVersion::IPv4) {
-        struct in_addr sin;
-        memcpy(&sin, addr.bytes, sizeof(struct in_addr));
-        prefix = New_Prefix(AF_INET, &sin, addr.prefix_length);
-    //}
-    
-    patricia_node_t* node = patricia_search_exact(tree, prefix);
-    Deref_Prefix(prefix);
-    
-    if (!node) {
-        return false;
-    }
-    
-    if (node->data) {
-        delete static_cast<std::string*>(node->data);
-        node->data = nullptr;
+// The thread behind setDebounceWindow(): sleeps until the first deadline
+// and closes that window, with every other window due by then.
+void RouteTracker::debounceLoop() {
+    std::unique_lock<std::mutex> rlock(rt_mutex_);
+    while (!debounce_stop_) {
+        if (debounce_deadlines_.empty()) {
+            debounce_wake_.wait(rlock);
+            continue;
+        }
+        // a copy: the entry may be gone by the time the wait checks it again
+        std::chrono::steady_clock::time_point deadline = debounce_deadlines_.begin()->first;
+        if (std::chrono::steady_clock::now() < deadline) {
+            debounce_wake_.wait_until(rlock, deadline);
+        } else {
+            rlock.unlock();
+            closeWindows(false);
+            rlock.lock();
+        }
     }
-    
-    patricia_remove(tree, node);
-    
-    return true;
 }
 
-Route* RouteTracker::findLongestMatch(const IPAddress& addr) const {
-    patricia_tree_t* tree = ip_tree_;
-    
-    prefix_t* prefix;
-    //if (addr.version == IPVersion::IPv4) {
-        struct in_addr sin;
-        memcpy(&sin, addr.bytes, sizeof(struct in_addr));
-        prefix = New_Prefix(AF_INET, &sin, addr.prefix_length);
-    //}
-    
-    patricia_node_t* node = patricia_search_best(tree, prefix);
-    Deref_Prefix(prefix);
-    
-    if (!node || !node->data) {
-        return nullptr;
+void RouteTracker::flushNotifications() {
+    uint64_t closing = closeWindows(true);
+    {
+        // another thread may be delivering this closing's windows
+        std::unique_lock<std::mutex> rlock(rt_mutex_);
+        closed_delivered_.wait(rlock, [this, closing]() { return delivered_closings_ >= closing; });
+    }
+    NotifierPool<NotificationData>* notifier = __atomic_load_n(&notifier_, __ATOMIC_ACQUIRE);
+    if (notifier) {
+        notifier->drain();
     }
-    
-    std::string prefix_str = prefix_toa(node->prefix);
-    std::string nexthop = *static_cast<std::string*>(node->data);
-    
-    return new Route(prefix_str, nexthop);
 }
-#if 0
-void RouteTracker::notifyAffectedAddresses(const IPAddress& /* changed_network */) {
-    std::vector<NotificationData> notifications;
-    
+
+NotifierStats RouteTracker::notifierStats() const {
+    NotifierStats stats;
+    memset(&stats, 0, sizeof(stats));
     {
-        std::lock_guard<std::mutex> tlock(rt_mutex_);
-        
-        for (std::unordered_map<std::string, TrackedAddress>::iterator it = tracked_addresses_.begin(); it != tracked_addresses_.end(); ++it) {
-            std::string ip_str = it->first;
-            TrackedAddress& tracked = it->second;
-            
-            Route* new_route = longestPrefixMatch(ip_str);
-            
-            bool route_changed = false;
-            if ((new_route == nullptr && tracked.current_route != nullptr) ||
-                (new_route != nullptr && tracked.current_route == nullptr) ||
-                (new_route != nullptr && tracked.current_route != nullptr && 
-                 (new_route->prefix != tracked.current_route->prefix || new_route->nexthop != tracked.current_route->nexthop))) {
-                route_changed = true;
-            }
-            
-            if (route_changed) {
-                NotificationData data;
-                data.ip_address = ip_str;
-                data.old_nexthop = tracked.current_route ? tracked.current_route->nexthop : "";
-                data.new_nexthop = new_route ? new_route->nexthop : "";
-                data.callback = tracked.callback;
-                
-                if (tracked.current_route) {
-                    delete tracked.current_route;
-                }
-                tracked.current_route = new_route;
-                
-                notifications.push_back(data);
-            } else {
-                delete new_route;
+        std::lock_guard<std::mutex> rlock(rt_mutex_);
+        stats.debouncing = debounced_.size();
+        stats.suppressed = suppressed_;
+    }
+    NotifierPool<NotificationData>* notifier = __atomic_load_n(&notifier_, __ATOMIC_ACQUIRE);
+    if (notifier) {
+        stats.threads = notifier->threads();
+        stats.queued = notifier->queued();
+        stats.max_queued = notifier->maxQueued();
+        stats.delivered = notifier->delivered();
+        stats.stalls = notifier->stalls();
+    }
+    return stats;
+}
+
+void RouteTracker::queueNotifications(std::vector<NotificationData>& notifications) {
+    // subscribers' changes become one batch entry per subscriber, at the
+    // position of its first change; the references move into the records
+    size_t kept = 0;
+    std::map<uint32_t, size_t> batches;
+    for (size_t i = 0; i < notifications.size(); ++i) {
+        NotificationData& data = notifications[i];
+        if (!data.subscriber) {
+            if (kept != i) {
+                notifications[kept] = std::move(data);
             }
+            ++kept;
+            continue;
+        }
+        RouteChange change;
+        change.version = data.version;
+        change.address = data.ip_address;
+        change.address6 = data.ip6_address;
+        change.old_nexthop = data.old_id;
+        change.new_nexthop = data.new_id;
+        std::pair<std::map<uint32_t, size_t>::iterator, bool> found =
+            batches.insert(std::make_pair(data.subscriber, kept));
+        if (found.second) {
+            // may overwrite data itself
+            NotificationData batch;
+            batch.subscriber = data.subscriber;
+            batch.batch_callback = subscribers_[data.subscriber - 1].callback;
+            batch.context = subscribers_[data.subscriber - 1].context;
+            notifications[kept++] = std::move(batch);
         }
+        notifications[found.first->second].changes.push_back(change);
     }
-    
+    notifications.resize(kept);
+
+    if (!notifier_) {
+        return;
+    }
+    // one address, one shard: its callbacks run in the order they are queued
+    // here, which rt_mutex_ makes the order of the updates; likewise for the
+    // batches of one subscriber
     for (size_t i = 0; i < notifications.size(); ++i) {
-        try {
-            notifications[i].callback(notifications[i].ip_address, notifications[i].new_nexthop, notifications[i].old_nexthop);
-        } catch (...) {
+        NotificationData& data = notifications[i];
+        uint64_t key = data.version == IPVersion::IPv6 ? data.ip6_address.hi ^ data.ip6_address.lo * 0x9E3779B97F4A7C15ull
+                                                       : data.ip_address;
+        if (data.batch_callback) {
+            key = (uint64_t(1) << 32) + data.subscriber;
         }
+        notifier_->push(key, std::move(data));
     }
+    notifications.clear();
 }
-#endif
-void RouteTracker::traversePatriciaTree(patricia_tree_t* tree, std::vector<Route>& routes) const {
-    if (!tree || !tree->head) return;
-    
-    patricia_node_t* node;
-    PATRICIA_WALK(tree->head, node) {
-        if (node->data) {
-            std::string prefix_str = prefix_toa(node->prefix);
-            std::string nexthop = *static_cast<std::string*>(node->data);
-            routes.push_back(Route(prefix_str, nexthop));
-        }
-    } PATRICIA_WALK_END;
+
+void RouteTracker::dropDebounced(const NotificationKey& key) {
+    if (debounced_.empty()) {
+        return;
+    }
+    std::map<NotificationKey, DebouncedChange>::iterator it = debounced_.find(key);
+    if (it != debounced_.end()) {
+        releaseNotification(it->second.data);
+        debounced_.erase(it);
+    }
+}
+
+void RouteTracker::waitForNotifiers() {
+    NotifierPool<NotificationData>* notifier = __atomic_load_n(&notifier_, __ATOMIC_ACQUIRE);
+    if (notifier) {
+        notifier->waitForRoom();
+    }
 }
 
-// Helpr for future compatibility for ipv6
-bool RouteTracker::parseIPAddress(const std::string& ip_str, IPAddress& result) const {
+// IPv6 when the text has a colon, IPv4 otherwise
+bool RouteTracker::parseIPAddress(std::string_view ip_str, IPAddress& result) const {
     if (ip_str.empty()) {
         return false;
     }
     
+    if (ip_str.find(':') != std::string_view::npos) {
+        return parseIPv6(ip_str, result);
+    }
     if (parseIPv4(ip_str, result)) {
         result.prefix_length = 32;
         return true;
@@ -422,50 +2170,52 @@ bool RouteTracker::parseIPAddress(const std::string& ip_str, IPAddress& result)
     return false;
 }
 
-bool RouteTracker::parseIPv4(const std::string& ip_str, IPAddress& result) const {
-    memset(result.bytes, 0, 16);
-    
-    if (inet_pton(AF_INET, ip_str.c_str(), result.bytes) == 1) {
-        return true;
+bool RouteTracker::parseIPv4(std::string_view ip_str, IPAddress& result) const {
+    uint32_t key;
+    if (!parseDottedQuad(ip_str, &key)) {
+        return false;
     }
-    return false;
+    memset(result.bytes, 0, 16);
+    ipv4FromKey(key, result);
+    return true;
 }
 
-bool RouteTracker::parseIP(const std::string& cidr, IPAddress& result) const {
-    if (cidr.empty()) {
+bool RouteTracker::parseIPv6(std::string_view ip_str, IPAddress& result) const {
+    IPv6Address key;
+    if (!parseIPv6Text(ip_str, &key)) {
         return false;
     }
-    
+    ipv6FromKey(key, result);
+    return true;
+}
+
+bool RouteTracker::parseIP(std::string_view cidr, IPAddress& result) const {
     size_t slash_pos = cidr.find('/');
-    if (slash_pos == std::string::npos) {
+    if (slash_pos == std::string_view::npos || slash_pos == 0) {
         return false;
     }
     
-    if (slash_pos == 0 || slash_pos == cidr.length() - 1) {
+    if (!parseIPAddress(cidr.substr(0, slash_pos), result)) {
         return false;
     }
     
-    std::string ip_part = cidr.substr(0, slash_pos);
-    std::string prefix_part = cidr.substr(slash_pos + 1);
-    
-    if (!parseIPAddress(ip_part, result)) {
+    // 0..32 in at most two digits for IPv4, 0..128 in three for IPv6
+    bool ipv6 = result.version == IPVersion::IPv6;
+    std::string_view length = cidr.substr(slash_pos + 1);
+    if (length.empty() || length.size() > (ipv6 ? 3u : 2u)) {
         return false;
     }
-    
-    try {
-        int prefix_len = std::stoi(prefix_part);
-        int max_len = 32;
-        
-        if (prefix_len < 0 || prefix_len > max_len) {
+    int prefix_len = 0;
+    for (size_t i = 0; i < length.size(); ++i) {
+        if (length[i] < '0' || length[i] > '9') {
             return false;
         }
-        
-        result.prefix_length = prefix_len;
-        return true;
-    } catch (...) {
+        prefix_len = prefix_len * 10 + (length[i] - '0');
+    }
+    if (prefix_len > (ipv6 ? 128 : 32)) {
         return false;
     }
-
+    
+    result.prefix_length = prefix_len;
+    return true;
 }
-
-
@@ -1,15 +1,37 @@
-//#define ENABLE_IPV6
+#ifndef _ROUTE_TRACKER_H
+#define _ROUTE_TRACKER_H
 
 #include <string>
+#include <string_view>
 #include <memory>
-#include <unordered_map>
+#include <map>
 #include <vector>
 #include <cstdint>
 #include <cstring>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <netinet/in.h>
+
+#include "epoch.h"
+#include "ipv6_trie.h"
+#include "tracked_table.h"
 
 struct _patricia_tree_t;
 typedef struct _patricia_tree_t patricia_tree_t;
+struct _patricia_node_t;
+typedef struct _patricia_node_t patricia_node_t;
+class Dir24Fib;
+class NexthopTable;
+class CompactTrie;
+class LcTrieFib;
+class PoptrieFib;
+class SnapshotFile;
+class UpdateJournal;
+template <typename Item> class NotifierPool;
+struct SnapshotNode;
 
 struct Route {
     std::string prefix;
@@ -18,62 +40,590 @@ struct Route {
     Route(const std::string& p, const std::string& nh) : prefix(p), nexthop(nh) {}
 };
 
+// Result of a binary lookup. prefix is in host byte order; prefix_length is -1
+// when nothing matched. nexthop refers to the route table's own copy: it stays
+// valid for as long as the calling thread holds an EpochGuard, even while
+// writers replace or delete the route. Compare nexthops by value: a nexthop
+// re-added while its old copy is being retired gets a second copy.
+struct RouteMatch {
+    uint32_t prefix;
+    int prefix_length;
+    std::string_view nexthop;
+
+    bool found() const { return prefix_length >= 0; }
+};
+
+// RouteMatch for an IPv6 lookup; same lifetime rules.
+struct RouteMatch6 {
+    IPv6Address prefix;
+    int prefix_length;
+    std::string_view nexthop;
+
+    bool found() const { return prefix_length >= 0; }
+};
+
+// One route that differs between two snapshots; an empty nexthop means the
+// route is absent on that side.
+struct RouteDelta {
+    uint32_t prefix;
+    int prefix_length;
+    std::string_view old_nexthop;
+    std::string_view new_nexthop;
+};
+
+// Immutable view of a route table, backed by a persistent (path-copying)
+// patricia trie. Copies share every node, so taking, keeping or cloning a
+// snapshot is O(1), and deriving a modified snapshot copies one root-to-leaf
+// path. Snapshots are safe to use from any thread without locking, and the
+// nexthop views they hand out live as long as the snapshot does.
+class RouteSnapshot {
+public:
+    RouteSnapshot() : root_(nullptr) {}
+    RouteSnapshot(const RouteSnapshot& other);
+    RouteSnapshot& operator=(const RouteSnapshot& other);
+    ~RouteSnapshot();
+
+    size_t size() const;
+    RouteMatch lookup(uint32_t address) const;
+    RouteMatch lookup(const in_addr& address) const;
+    // not found when ip_address does not parse
+    RouteMatch lookup(std::string_view ip_address) const;
+    // visits routes in address order (shorter prefix first on ties)
+    void forEach(const std::function<void(uint32_t prefix, int prefix_length, std::string_view nexthop)>& visit) const;
+    std::vector<Route> routes() const;
+
+    // what-if clones; the receiver is left untouched
+    RouteSnapshot withRoute(uint32_t prefix, int prefix_length, std::string_view nexthop) const;
+    RouteSnapshot withoutRoute(uint32_t prefix, int prefix_length) const;
+
+    // Appends the routes that differ between from and to in address order.
+    // Subtrees the two snapshots still share are skipped without a visit.
+    static void diff(const RouteSnapshot& from, const RouteSnapshot& to, std::vector<RouteDelta>& changes);
+
+private:
+    friend class RouteTracker;
+    explicit RouteSnapshot(const SnapshotNode* root) : root_(root) {}  // adopts a reference
+    // shares the caller's string instead of copying it
+    RouteSnapshot withRoute(uint32_t prefix, int prefix_length, const std::shared_ptr<const std::string>& nexthop) const;
+    // In-place forms of withRoute()/withoutRoute() for the tracker's working
+    // copy: nodes no other snapshot can reach are edited, shared ones are
+    // copied. Consecutive edits before a publish copy each path only once.
+    void setRoute(uint32_t prefix, int prefix_length, const std::shared_ptr<const std::string>& nexthop);
+    void clearRoute(uint32_t prefix, int prefix_length);
+    static const SnapshotNode* retain(const SnapshotNode* root);
+    static void release(const SnapshotNode* root);
+
+    const SnapshotNode* root_;
+};
+
+enum class IPVersion {
+    IPv4,
+    IPv6
+};
+
 struct IPAddress {
-    //IPVersion version;
-    unsigned char bytes[16]; // support ipv6 in future
+    IPVersion version;
+    unsigned char bytes[16]; // network byte order; IPv4 uses the first 4
     int prefix_length;
     
-    IPAddress() : prefix_length(0) {
+    IPAddress() : version(IPVersion::IPv4), prefix_length(0) {
         memset(bytes, 0, 16);
     }
 };
 
+// Route dump formats RouteTracker::loadRoutes() reads.
+enum class RouteFileFormat {
+    kText,          // "prefix nexthop" per line; blank lines and # comments skipped
+    kMrt            // MRT TABLE_DUMP_V2 (RFC 6396) RIB dump, first path of each prefix
+};
+
+struct RouteLoadStats {
+    size_t routes_parsed;       // routes read from the file
+    size_t routes_skipped;      // lines or RIB records that did not parse
+    size_t routes_added;
+    double parse_seconds;
+    double apply_seconds;
+
+    double routesPerSecond() const {
+        double seconds = parse_seconds + apply_seconds;
+        return seconds > 0 ? routes_parsed / seconds : 0;
+    }
+};
+
+struct JournalReplayStats {
+    size_t records;             // intact records read
+    bool torn;                  // whether a journal ended in a damaged record
+    size_t routes_added;        // net effect, after later records override
+    size_t routes_deleted;      // earlier ones for the same prefix
+    size_t registrations;       // addresses registered at the end
+    double seconds;
+
+    double recordsPerSecond() const { return seconds > 0 ? records / seconds : 0; }
+};
+
+struct NotifierStats {
+    unsigned threads;           // 0 when callbacks run inline
+    size_t queued;              // notifications waiting now
+    size_t max_queued;          // the most ever waiting at once
+    uint64_t delivered;
+    uint64_t stalls;            // updates that waited for the queue to drain
+    size_t debouncing;          // addresses with a debounce window open
+    uint64_t suppressed;        // changes folded into an open window, or
+                                // undone by the time it closed
+};
+
 typedef void (*RouteChangeCallback)(const std::string& ip_address,
                                      const std::string& new_nexthop,
                                      const std::string& old_nexthop);
 
+// One tracked address whose nexthop changed, as batch subscribers see it.
+// Nexthops are ids (0: unrouted) for RouteTracker::nexthopName(); the ids in
+// a batch stay valid until the callback returns.
+struct RouteChange {
+    IPVersion version;
+    uint32_t address;           // IPv4, host byte order
+    IPv6Address address6;       // IPv6
+    uint32_t old_nexthop;
+    uint32_t new_nexthop;
+};
+
+typedef void (*RouteChangeBatchCallback)(const RouteChange* changes, size_t count, void* context);
+
+// Names one registration for RouteTracker::unregister(); 0 is never a handle.
+typedef uint64_t AddressHandle;
+
 class RouteTracker {
 public:
-    RouteTracker();
+    // Node layout of the route table (the control-plane trie that lookups
+    // are compiled from). kCompactRib uses 16-byte index-linked nodes.
+    enum RibLayout {
+        kPatriciaRib,
+        kCompactRib
+    };
+    // Compiled table that lookups run against. kDir24Lookup answers in one or
+    // two memory accesses but reserves 64MB of address space; kLcTrieLookup
+    // is an LC-trie behind a 2^16 direct table, a few MB for a full table;
+    // kPoptrieLookup is a popcount-indexed multiway trie behind the same
+    // direct table, a few MB and at most three nodes per lookup.
+    enum LookupEngine {
+        kDir24Lookup,
+        kLcTrieLookup,
+        kPoptrieLookup
+    };
+
+    explicit RouteTracker(RibLayout layout = kPatriciaRib, LookupEngine engine = kDir24Lookup);
     ~RouteTracker();
     
     RouteTracker(const RouteTracker&) = delete;
     RouteTracker& operator=(const RouteTracker&) = delete;
     
-    bool addRoute(const std::string& prefix, const std::string& nexthop);
-    bool deleteRoute(const std::string& prefix);
-    bool registerAddress(const std::string& ip_address, RouteChangeCallback callback);
-    bool unregisterAddress(const std::string& ip_address);
+    // Text entry points take "a.b.c.d/len" or IPv6 "x:y::z/len" prefixes and
+    // addresses of either family. The binary overloads take IPv4 in host
+    // byte order (uint32_t) or network byte order (in_addr), IPv6 as
+    // IPv6Address or in6_addr, and do no parsing at all. IPv6 routes live in
+    // their own 128-bit table, so IPv4 operations never touch them.
+    bool addRoute(std::string_view prefix, std::string_view nexthop);
+    bool addRoute(uint32_t prefix, int prefix_length, std::string_view nexthop);
+    bool addRoute(const in_addr& prefix, int prefix_length, std::string_view nexthop);
+    bool addRoute(const IPv6Address& prefix, int prefix_length, std::string_view nexthop);
+    bool addRoute(const in6_addr& prefix, int prefix_length, std::string_view nexthop);
+    bool deleteRoute(std::string_view prefix);
+    bool deleteRoute(uint32_t prefix, int prefix_length);
+    bool deleteRoute(const in_addr& prefix, int prefix_length);
+    bool deleteRoute(const IPv6Address& prefix, int prefix_length);
+    bool deleteRoute(const in6_addr& prefix, int prefix_length);
+    bool registerAddress(std::string_view ip_address, RouteChangeCallback callback);
+    bool registerAddress(uint32_t ip_address, RouteChangeCallback callback);
+    bool registerAddress(const in_addr& ip_address, RouteChangeCallback callback);
+    bool registerAddress(const IPv6Address& ip_address, RouteChangeCallback callback);
+    bool registerAddress(const in6_addr& ip_address, RouteChangeCallback callback);
+    bool unregisterAddress(std::string_view ip_address);
+    bool unregisterAddress(uint32_t ip_address);
+    bool unregisterAddress(const in_addr& ip_address);
+    bool unregisterAddress(const IPv6Address& ip_address);
+    bool unregisterAddress(const in6_addr& ip_address);
+    // Bulk registration, for startup: the addresses are sorted and resolved
+    // in one batched lookup sweep under one lock hold, then each gets its
+    // registration callback (a subscriber gets one batch). Duplicates are
+    // registered once. handles, when not null, receives a handle per
+    // address, which unregister() takes instead of the address: no parsing
+    // and no search. A handle dies with its registration, however that ends.
+    // Returns count, or 0 without a callback or subscriber.
+    size_t registerAddresses(const uint32_t* addresses, size_t count, RouteChangeCallback callback,
+                             AddressHandle* handles = nullptr);
+    size_t registerAddresses(const IPv6Address* addresses, size_t count, RouteChangeCallback callback,
+                             AddressHandle* handles = nullptr);
+    size_t subscribeAddresses(const uint32_t* addresses, size_t count, uint32_t subscriber,
+                              AddressHandle* handles = nullptr);
+    size_t subscribeAddresses(const IPv6Address* addresses, size_t count, uint32_t subscriber,
+                              AddressHandle* handles = nullptr);
+    bool unregister(AddressHandle handle);
+    // Bulk forms for loading or withdrawing a table: one lock hold for the
+    // whole batch, one snapshot publication, and one notification pass
+    // against the final state, so a tracked address gets at most one
+    // callback per call, and none when its nexthop ends up the same.
+    // Entries that do not parse (or have an empty nexthop) are skipped;
+    // returns how many routes were added or deleted.
+    // With the compact layout, loading into an empty table builds the trie
+    // bottom-up from the sorted batch (in parallel for large batches).
+    size_t addRoutes(const std::vector<std::pair<std::string, std::string> >& routes);
+    size_t deleteRoutes(const std::vector<std::string>& prefixes);
+    // Between beginTransaction() and commit(), route updates made by the
+    // calling thread (single or bulk) are queued instead of applied, and
+    // return whether they were queued. commit() applies the net effect of the
+    // queue as one bulk update: lookups and snapshots see all of it or none
+    // of it, and each affected tracked address gets one old -> new callback,
+    // or none when its nexthop is unchanged, e.g. a withdrawn and re-announced
+    // prefix. Registrations and other threads' updates are not part of the
+    // transaction. beginTransaction() returns false while any thread has one
+    // open; commit() returns how many routes changed.
+    bool beginTransaction();
+    size_t commit();
+    void rollback();
+    // Asynchronous callbacks. By default callbacks run on the updating thread
+    // once it has released the lock; after startNotifiers() they are queued
+    // instead (lock-free, under the lock that orders the updates) and run on
+    // threads notifier threads. The callbacks of one address always run on
+    // the same thread, in the order of the updates that caused them.
+    // Backpressure: an update waits, before taking the lock, while
+    // max_queued notifications are waiting; callbacks that update the
+    // tracker never wait. Returns false when notifiers already run or an
+    // argument is 0. Callbacks may run until flushNotifications() returns or
+    // the tracker is destroyed, which delivers everything queued.
+    bool startNotifiers(unsigned threads, size_t max_queued = 65536);
+    // Batch subscribers. Addresses tracked with subscribeAddress() report to
+    // their subscriber's callback, which receives every change of one update,
+    // bulk call, commit or closing debounce window as one array of binary
+    // records, with the context given to subscribe(). Subscribing an address
+    // reports its current nexthop as a change from 0; unregistering it
+    // reports nothing. unsubscribe() unregisters the subscriber's addresses.
+    // Batches go through the notifier threads like any callback.
+    uint32_t subscribe(RouteChangeBatchCallback callback, void* context);
+    bool unsubscribe(uint32_t subscriber);
+    // false when subscriber is not subscribed
+    bool subscribeAddress(uint32_t ip_address, uint32_t subscriber);
+    bool subscribeAddress(const IPv6Address& ip_address, uint32_t subscriber);
+    // Batches queued before unsubscribe() may still arrive until
+    // flushNotifications() returns.
+    // Lock-free; valid during a batch callback for the ids in the batch.
+    std::string_view nexthopName(uint32_t id) const;
+    // Debouncing. A tracked address only hears about a change of nexthop,
+    // never about a move to another prefix with the same nexthop. With a
+    // window of milliseconds > 0, its first change opens a window of that
+    // length for the address; later changes are folded in, and when the
+    // window closes it gets one old -> new callback, or none when it is back
+    // on the nexthop it started from. Registration callbacks are never
+    // delayed, and unregistering drops the address's pending change. 0, the
+    // default, delivers at once and closes the open windows; from a callback,
+    // those are delivered after it returns.
+    void setDebounceWindow(unsigned milliseconds);
+    // Closes every debounce window and waits until every queued callback has
+    // run. Not to be called from a callback.
+    void flushNotifications();
+    NotifierStats notifierStats() const;
+    // Bulk-adds every route in a dump file, as addRoutes() would. The file is
+    // memory-mapped and parsed in place on threads worker threads (0 means one
+    // per core); nexthops are viewed in the mapping rather than copied until
+    // they are interned. Returns false when the file cannot be mapped.
+    bool loadRoutes(const std::string& path, RouteFileFormat format, RouteLoadStats* stats = nullptr,
+                    unsigned threads = 0);
+    // Writes every route, IPv4 and IPv6, to path in the binary format of
+    // snapshot_file.h; false when the file cannot be written. A checkpoint
+    // of the journal when one is open (see openJournal()).
+    bool saveSnapshot(const std::string& path) const;
+    // Warm restart from a saveSnapshot() file into a tracker without routes.
+    // IPv4 lookups are answered from the mapped file as soon as this returns
+    // while a background thread rebuilds the route tables from it; IPv6
+    // lookups, snapshot() and getAllRoutes() see the routes once the rebuild
+    // is done. Route updates and address registrations wait for the rebuild,
+    // as does waitForRestore().
+    // Returns false, changing nothing, when the tracker already has routes or
+    // the file is missing, damaged, or of another version or byte order.
+    bool loadSnapshot(const std::string& path);
+    void waitForRestore() const;
+    // Write-ahead journal for crash recovery (format in update_journal.h).
+    // While one is open, every route update and (un)registration is appended
+    // under the lock in the order it is applied; a background thread writes
+    // and fsyncs the appended records every sync_interval_ms (0: on every
+    // update), so updates never wait for the disk and a crash loses at most
+    // the last interval. An existing journal is appended to. With a journal
+    // open, saveSnapshot() is a checkpoint: the journal moves to path.old at
+    // the moment the routes are captured and is removed once the snapshot is
+    // written. Returns false when path cannot be opened or is not a journal.
+    bool openJournal(const std::string& path, unsigned sync_interval_ms = 10);
+    // Writes out and syncs the journal now; false when none is open or a
+    // write has failed.
+    bool syncJournal();
+    void closeJournal();
+    // Recovery, after loadSnapshot() of the last checkpoint if there is one:
+    // reads path.old (an unfinished checkpoint) and path up to any torn tail,
+    // reduces them to the last update per prefix and applies that as one bulk
+    // update. Addresses still registered at the end are registered again with
+    // callback, as callbacks are not journaled; a null callback skips them.
+    // Returns false when a journal is open on this tracker or neither file is
+    // a readable journal.
+    bool replayJournal(const std::string& path, RouteChangeCallback callback = nullptr,
+                       JournalReplayStats* stats = nullptr);
+    // IPv4 routes from a snapshot, then the IPv6 routes; neither takes nor
+    // stalls rt_mutex_
     std::vector<Route> getAllRoutes() const;
-    // exposing this lockless functioon for testing from single threaded environment
-    Route* longestPrefixMatch(const std::string& ip_address) const;
+    // O(1) and lock-free; later route updates do not affect the snapshot.
+    // Snapshots hold the IPv4 routes only.
+    RouteSnapshot snapshot() const;
+    // lockless; safe to call while other threads add or delete routes
+    Route* longestPrefixMatch(std::string_view ip_address) const;
+    // Lock-free lookup of an IPv4 address (host byte order). Hold an
+    // EpochGuard around the call to keep using the returned nexthop.
+    RouteMatch lookup(uint32_t address) const;
+    RouteMatch lookup(const in_addr& address) const;
+    // not found when ip_address is not a dotted quad
+    RouteMatch lookup(std::string_view ip_address) const;
+    // Lock-free IPv6 lookups, same EpochGuard rule. The 128-bit table is
+    // searched a 64-bit word at a time.
+    RouteMatch6 lookup(const IPv6Address& address) const;
+    RouteMatch6 lookup(const in6_addr& address) const;
+    // not found when ip_address is not an IPv6 address
+    RouteMatch6 lookup6(std::string_view ip_address) const;
+    // Lock-free lookup of count addresses, overlapping the table misses of
+    // the whole burst. Same EpochGuard rule as lookup().
+    void lookupBatch(const uint32_t* addresses, size_t count, RouteMatch* results) const;
+    void lookupBatch(const IPv6Address* addresses, size_t count, RouteMatch6* results) const;
 private:
-    bool parseIPAddress(const std::string& ip_str, IPAddress& result) const;
-    bool parseIPv4(const std::string& ip_str, IPAddress& result) const;
-    bool parseIP(const std::string& cidr, IPAddress& result) const;
+    bool parseIPAddress(std::string_view ip_str, IPAddress& result) const;
+    bool parseIPv4(std::string_view ip_str, IPAddress& result) const;
+    bool parseIPv6(std::string_view ip_str, IPAddress& result) const;
+    bool parseIP(std::string_view cidr, IPAddress& result) const;
     
-    void insertRoute(const IPAddress& addr, const std::string& nexthop);
-    bool removeRoute(const IPAddress& addr);
-    Route* findLongestMatch(const IPAddress& addr) const;
+    bool addRoute(const IPAddress& addr, std::string_view nexthop);
+    bool deleteRoute(const IPAddress& addr);
+    // publish false leaves the snapshot publication and reclamation to the
+    // caller, for bulk updates
+    bool insertRoute(const IPAddress& addr, std::string_view nexthop, bool publish = true);
+    bool removeRoute(const IPAddress& addr, bool publish = true);
+    size_t applyRoutes(std::vector<std::pair<IPAddress, std::string_view> >& parsed, bool journal = true);
+    size_t applyUpdates(std::vector<std::pair<IPAddress, std::string_view> >& adds, std::vector<IPAddress>& deletes,
+                        bool journal = true);
+    // queues the update when this thread has a transaction open; caller holds
+    // rt_mutex_
+    bool queueInTransaction(const IPAddress& addr, std::string_view nexthop);
+    // append to journal_ when one is open; caller holds rt_mutex_
+    void journalRoute(const IPAddress& addr, std::string_view nexthop) const;
+    void journalRegistration(const IPAddress& addr, bool registered) const;
+    void restoreRoutes(const SnapshotFile* image);
+    // Bulk-loads the leading IPv4 routes of parsed into an empty compact RIB;
+    // returns how many it consumed, 0 when the trie rejects their order, and
+    // appends the index of each one it applied to accepted.
+    size_t loadCompactRib(const std::vector<std::pair<IPAddress, std::string_view> >& parsed,
+                          std::vector<IPAddress>& changed, std::vector<size_t>& accepted);
+    // route table primitives over whichever layout is in use; ids are
+    // nexthop ids, 0 meaning no route
+    bool ribInsert(const IPAddress& addr, uint32_t id, uint32_t* old_id);
+    uint32_t ribRemove(const IPAddress& addr, uint32_t* covering_id, int* covering_length);
+    // compiled table primitives over whichever engine is in use
+    bool fibLookup(uint32_t address, uint32_t* id, int* length) const;
+    void fibLookupBatch(const uint32_t* addresses, size_t count, uint32_t* ids, int* lengths) const;
+    void fibInsert(const IPAddress& addr, uint32_t id);
+    void fibRemove(const IPAddress& addr, uint32_t covering_id, int covering_length);
     
-    void notifyAffectedAddresses(const IPAddress& changed_network);
-    void traversePatriciaTree(patricia_tree_t* tree, std::vector<Route>& routes) const;
+    struct NotificationData;
+    void notifyAffectedAddresses(const IPAddress& changed_network, bool route_added,
+                                 std::vector<NotificationData>& notifications);
+    void notifyAffectedAddresses6(const IPAddress& changed_network, bool route_added,
+                                  std::vector<NotificationData>& notifications);
+    void notifyChangedNetworks(const std::vector<IPAddress>& changed, std::vector<NotificationData>& notifications);
+    struct TrackedAddress6;
+    void refreshTracked(TrackedTable::Entry& tracked, std::vector<NotificationData>& notifications);
+    void refreshTracked6(const IPv6Address& address, TrackedAddress6& tracked,
+                         std::vector<NotificationData>& notifications);
+    void deliverNotifications(const std::vector<NotificationData>& notifications);
+    void deliverNotification(const NotificationData& data);
+    void fillNotification(NotificationData& data, RouteChangeCallback callback, uint32_t subscriber, uint32_t old_id,
+                          uint32_t new_id);
+    // Gathers the subscribers' notifications into one batch per subscriber;
+    // then, with notifiers running, hands everything to them and clears the
+    // vector. Caller holds rt_mutex_.
+    void queueNotifications(std::vector<NotificationData>& notifications);
+    // drops the nexthop references a subscriber's notification holds; caller
+    // holds rt_mutex_
+    void releaseNotification(const NotificationData& data);
+    // backpressure, before taking rt_mutex_ for an update
+    void waitForNotifiers();
+    // with a debounce window, moves notifications into debounced_ and clears
+    // the vector; caller holds rt_mutex_
+    void debounceNotifications(std::vector<NotificationData>& notifications);
+    // delivers the debounced changes whose window has closed, or all of them;
+    // returns the closing's number (see delivered_closings_)
+    uint64_t closeWindows(bool all);
+    void debounceLoop();
+    // registration bodies: exactly one of callback and subscriber is set
+    bool trackAddress(uint32_t ip_address, RouteChangeCallback callback, uint32_t subscriber);
+    bool trackAddress6(const IPv6Address& ip_address, RouteChangeCallback callback, uint32_t subscriber);
 
+    // exactly one of these holds the routes
     patricia_tree_t* ip_tree_;
+    std::unique_ptr<CompactTrie> compact_rib_;
+    // compiled copy of the route table answering host lookups without the lock. Its
+    // values are nexthop ids; each routed node holds a reference to its
+    // nexthop id (in node->user1 for the patricia layout).
+    // exactly one of these is set
+    std::unique_ptr<Dir24Fib> fib_;
+    std::unique_ptr<LcTrieFib> lc_fib_;
+    std::unique_ptr<PoptrieFib> poptrie_fib_;
+    std::unique_ptr<NexthopTable> nexthops_;
+    // the IPv6 routes, route table and lookup structure in one; values are
+    // nexthop ids holding a reference each
+    std::unique_ptr<Ipv6Trie> ipv6_rib_;
+    // persistent copy of the route table maintained by insertRoute/removeRoute;
+    // published_snapshot_ holds its own reference and is swapped in once the
+    // update is complete
+    RouteSnapshot routes_snapshot_;
+    const SnapshotNode* published_snapshot_;
+    void publishSnapshot();
+
+    // the file loadSnapshot() is rebuilding from, null otherwise; IPv4
+    // lookups read it while it is set, as the tables are incomplete
+    const SnapshotFile* restore_image_;
+    // restore_mutex_ guards restore_thread_ and restoring_; waiters block on
+    // restore_done_ rather than joining, so that a callback the rebuild runs
+    // can take the mutex to see that it is the rebuild
+    mutable std::mutex restore_mutex_;
+    mutable std::condition_variable restore_done_;
+    std::thread restore_thread_;
+    bool restoring_;
+
+    // null unless openJournal() succeeded; set and used under rt_mutex_
+    std::unique_ptr<UpdateJournal> journal_;
+
+    // the thread with a transaction open, and its queued updates in order
+    // (host bits cleared, empty nexthop for a delete); under rt_mutex_
+    std::thread::id transaction_owner_;
+    std::vector<std::pair<IPAddress, std::string> > transaction_;
+
+    // declared after everything its pending reclamations touch, so that it is
+    // destroyed (and runs them) first
+    EpochReclaimer reclaimer_;
     
-    struct TrackedAddress {
-        RouteChangeCallback callback;
-        Route* current_route;
+    struct TrackedAddress6 {
+        RouteChangeCallback callback;   // null for a subscriber's address
+        IPv6Address route_prefix;
+        int route_length;   // -1 when unrouted
+        uint32_t nexthop_id;    // holds a reference; 0 when unrouted
+        uint32_t subscriber;    // 0 unless subscribeAddress()
+        uint32_t handle;        // slot in handle_slots_ + 1; 0 when none was asked for
     };
     
+    // ip_address is formatted only when the callback runs, outside the lock.
+    // A subscriber's address carries nexthop ids instead of strings, each
+    // holding a reference, and is gathered with the other changes for the
+    // same subscriber into one batch entry, which has batch_callback set.
     struct NotificationData {
-        std::string ip_address;
+        NotificationData()
+            : version(IPVersion::IPv4), ip_address(0), ip6_address(), callback(nullptr), subscriber(0), old_id(0),
+              new_id(0), batch_callback(nullptr), context(nullptr) {}
+        IPVersion version;
+        uint32_t ip_address;
+        IPv6Address ip6_address;
         std::string old_nexthop;
         std::string new_nexthop;
         RouteChangeCallback callback;
+        uint32_t subscriber;
+        uint32_t old_id;
+        uint32_t new_id;
+        RouteChangeBatchCallback batch_callback;
+        void* context;
+        std::vector<RouteChange> changes;
+    };
+
+    // subscribe() ids are indexes + 1; unsubscribed entries have no callback
+    struct Subscriber {
+        RouteChangeBatchCallback callback;
+        void* context;
+    };
+    std::vector<Subscriber> subscribers_;
+    
+    // debouncing, under rt_mutex_. An open window per address: data holds
+    // the nexthop from before the window and the latest one. Windows close
+    // in deadline order; a deadline whose window was dropped or reopened is
+    // skipped.
+    typedef std::pair<int, IPv6Address> NotificationKey;   // family, address
+    struct DebouncedChange {
+        NotificationData data;
+        std::chrono::steady_clock::time_point deadline;
     };
+    // closes the address's window without a notification
+    void dropDebounced(const NotificationKey& key);
+    unsigned debounce_ms_;
+    std::map<NotificationKey, DebouncedChange> debounced_;
+    std::multimap<std::chrono::steady_clock::time_point, NotificationKey> debounce_deadlines_;
+    uint64_t suppressed_;
+    bool debounce_stop_;
+    std::condition_variable debounce_wake_;
+    std::thread debounce_thread_;
+    // closed windows waiting for delivery, in closing order. One closing at
+    // a time delivers them, without a lock, while later closings (also from
+    // its callbacks) only append. closings_ numbers the closings;
+    // delivered_closings_ is the last whose changes have all been delivered.
+    std::vector<NotificationData> closed_;
+    bool delivering_closed_;
+    uint64_t closings_;
+    uint64_t delivered_closings_;
+    std::condition_variable closed_delivered_;
     
-    std::unordered_map<std::string, TrackedAddress> tracked_addresses_;
+    // IPv4 tracked addresses, keyed by address (host byte order). Entries
+    // hold a reference to nexthop_id, a handle slot + 1 (0 when none was
+    // asked for) and a listener: a registered callback's index + 1, or
+    // kSubscriberListener | subscriber.
+    TrackedTable tracked_addresses_;
+    static const uint32_t kSubscriberListener = 0x80000000u;
+    // callbacks interned for listeners; never dropped, there are few
+    std::vector<RouteChangeCallback> callbacks_;
+    std::map<RouteChangeCallback, uint32_t> callback_listeners_;
+    // IPv6 tracked addresses, keyed by the full 128-bit address
+    typedef std::map<IPv6Address, TrackedAddress6> TrackedMap6;
+    TrackedMap6 tracked_addresses6_;
+
+    // registerAddresses() handles: each live one names its entry, by address
+    // for IPv4 and by map iterator (which survives other inserts and erases)
+    // for IPv6; free slots are reused with the next generation
+    struct HandleSlot {
+        uint32_t address;
+        TrackedMap6::iterator address6;
+        uint32_t generation;
+        bool ipv6;
+    };
+    std::vector<HandleSlot> handle_slots_;
+    std::vector<uint32_t> free_handle_slots_;
+
+    // registration helpers, under rt_mutex_
+    bool validSubscriber(uint32_t subscriber) const;   // 0 (none) is valid
+    uint32_t listener(RouteChangeCallback callback, uint32_t subscriber);
+    RouteChangeCallback listenerCallback(uint32_t listener) const {
+        return listener & kSubscriberListener ? nullptr : callbacks_[listener - 1];
+    }
+    static uint32_t listenerSubscriber(uint32_t listener) {
+        return listener & kSubscriberListener ? listener & ~kSubscriberListener : 0;
+    }
+    void trackResolved(TrackedTable::Entry& tracked, uint32_t id, int length,
+                       std::vector<NotificationData>& notifications);
+    void trackResolved6(TrackedMap6::iterator it, uint32_t id, int length, RouteChangeCallback callback,
+                        uint32_t subscriber, std::vector<NotificationData>& notifications);
+    size_t trackAddresses(const uint32_t* addresses, size_t count, RouteChangeCallback callback, uint32_t subscriber,
+                          AddressHandle* handles);
+    size_t trackAddresses6(const IPv6Address* addresses, size_t count, RouteChangeCallback callback,
+                           uint32_t subscriber, AddressHandle* handles);
+    AddressHandle addressHandle(TrackedTable::Entry& tracked);
+    AddressHandle addressHandle6(TrackedMap6::iterator it);
+    uint32_t newHandleSlot();
+    void freeHandleSlot(uint32_t slot);
+    // unlocks tlock before the callback
+    bool untrackAddress(TrackedTable::Entry* tracked, std::unique_lock<std::mutex>& tlock);
+    bool untrackAddress6(TrackedMap6::iterator it, std::unique_lock<std::mutex>& tlock);
     
     mutable std::mutex rt_mutex_;
+
+    // owned; null until startNotifiers(), which sets it once, so that
+    // updates can read it before taking the lock
+    NotifierPool<NotificationData>* notifier_;
 };
+
+#endif /* _ROUTE_TRACKER_H */
@@ -0,0 +1,223 @@
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include "snapshot_file.h"
+#include "compact_trie.h"
+#include "crc32c.h"
+
+static const char kMagic[8] = {'R', 'T', 'S', 'N', 'A', 'P', '\r', '\n'};
+static const uint32_t kByteOrder = 0x01020304;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // kByteOrder as the writer stored it
+    uint64_t file_bytes;
+    uint32_t header_checksum;   // of the header with this field zero
+    uint32_t body_checksum;     // of everything after the header
+    uint64_t nexthop_count;
+    uint64_t directory_offset;
+    uint64_t string_offset;
+    uint64_t string_bytes;
+    uint64_t route_count;
+    uint64_t route_offset;
+    uint64_t route6_count;
+    uint64_t route6_offset;
+    uint64_t trie_nodes;
+    uint64_t trie_offset;
+    uint32_t trie_root;
+    uint32_t reserved;
+};
+static_assert(sizeof(SnapshotHeader) % 8 == 0 && sizeof(SnapshotHeader) <= 256, "header size");
+static_assert(sizeof(SnapshotFile::Route) == 12 && sizeof(SnapshotFile::Route6) == 24, "packed route records");
+
+static uint32_t headerChecksum(const void* header, size_t size) {
+    unsigned char copy[256];
+    memcpy(copy, header, size);
+    memset(copy + offsetof(SnapshotHeader, header_checksum), 0, sizeof(uint32_t));
+    return crc32c(0, copy, size);
+}
+
+// ---- writing ----
+
+namespace {
+
+// Appends sections to the file, padding each to 8 bytes and checksumming
+// everything it writes.
+class SectionWriter {
+public:
+    explicit SectionWriter(FILE* out) : out_(out), offset_(sizeof(SnapshotHeader)), crc_(0), ok_(true) {}
+
+    uint64_t append(const void* data, size_t size) {
+        static const char kPadding[8] = {0};
+        uint64_t start = offset_;
+        put(data, size);
+        put(kPadding, (8 - size % 8) % 8);
+        return start;
+    }
+    uint64_t offset() const { return offset_; }
+    uint32_t checksum() const { return crc_; }
+    bool ok() const { return ok_; }
+
+private:
+    void put(const void* data, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        ok_ = ok_ && fwrite(data, 1, size, out_) == size;
+        crc_ = crc32c(crc_, data, size);
+        offset_ += size;
+    }
+
+    FILE* out_;
+    uint64_t offset_;
+    uint32_t crc_;
+    bool ok_;
+};
+
+}  // namespace
+
+bool SnapshotFile::write(const std::string& path, const std::vector<std::string_view>& nexthops,
+                         const std::vector<Route>& routes, const std::vector<Route6>& routes6) {
+    std::vector<uint32_t> directory;
+    std::string strings;
+    for (size_t i = 0; i < nexthops.size(); ++i) {
+        directory.push_back(static_cast<uint32_t>(strings.size()));
+        directory.push_back(static_cast<uint32_t>(nexthops[i].size()));
+        strings.append(nexthops[i].data(), nexthops[i].size());
+    }
+
+    std::vector<CompactTrie::Entry> entries(routes.size());
+    for (size_t i = 0; i < routes.size(); ++i) {
+        entries[i].prefix = routes[i].prefix;
+        entries[i].length = routes[i].length;
+        entries[i].value = routes[i].nexthop + 1;
+    }
+    CompactTrie trie;
+    if (!trie.assign(entries)) {
+        return false;
+    }
+
+    std::string temporary = path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    SectionWriter writer(out);
+    header.nexthop_count = nexthops.size();
+    header.directory_offset = writer.append(directory.data(), directory.size() * sizeof(uint32_t));
+    header.string_bytes = strings.size();
+    header.string_offset = writer.append(strings.data(), strings.size());
+    header.route_count = routes.size();
+    header.route_offset = writer.append(routes.data(), routes.size() * sizeof(Route));
+    header.route6_count = routes6.size();
+    header.route6_offset = writer.append(routes6.data(), routes6.size() * sizeof(Route6));
+    header.trie_nodes = trie.imageNodes();
+    header.trie_root = trie.imageRoot();
+    header.trie_offset = writer.append(trie.imageData(), trie.imageNodes() * CompactTrie::kImageNodeBytes);
+
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.byte_order = kByteOrder;
+    header.file_bytes = writer.offset();
+    header.body_checksum = writer.checksum();
+    header.header_checksum = headerChecksum(&header, sizeof(header));
+    ok = ok && writer.ok() && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    // the data is on disk before the rename can replace a good file with it
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return syncDirectoryOf(path);
+}
+
+// ---- reading ----
+
+SnapshotFile::SnapshotFile()
+    : directory_(nullptr), strings_(nullptr), nexthop_count_(0), routes_(nullptr), route_count_(0),
+      routes6_(nullptr), route6_count_(0), trie_(nullptr), trie_nodes_(0), trie_root_(0) {}
+
+// whether count records of size bytes at offset fit in a file of file_bytes
+static bool sectionFits(uint64_t offset, uint64_t count, size_t size, uint64_t file_bytes) {
+    return offset % 8 == 0 && offset <= file_bytes && count <= (file_bytes - offset) / size;
+}
+
+bool SnapshotFile::open(const std::string& path) {
+    // the checksum reads every page anyway
+    if (!file_.open(path, MADV_WILLNEED) || file_.size() < sizeof(SnapshotHeader)) {
+        return false;
+    }
+    SnapshotHeader header;
+    memcpy(&header, file_.data(), sizeof(header));
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+        header.byte_order != kByteOrder || header.file_bytes != file_.size() ||
+        header.header_checksum != headerChecksum(&header, sizeof(header))) {
+        return false;
+    }
+    if (!sectionFits(header.directory_offset, header.nexthop_count, 2 * sizeof(uint32_t), header.file_bytes) ||
+        !sectionFits(header.string_offset, header.string_bytes, 1, header.file_bytes) ||
+        !sectionFits(header.route_offset, header.route_count, sizeof(Route), header.file_bytes) ||
+        !sectionFits(header.route6_offset, header.route6_count, sizeof(Route6), header.file_bytes) ||
+        !sectionFits(header.trie_offset, header.trie_nodes, CompactTrie::kImageNodeBytes, header.file_bytes) ||
+        header.nexthop_count > std::numeric_limits<uint32_t>::max() ||
+        header.trie_nodes > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+    const char* base = file_.data();
+    if (crc32c(0, base + sizeof(SnapshotHeader), file_.size() - sizeof(SnapshotHeader)) != header.body_checksum) {
+        return false;
+    }
+
+    directory_ = reinterpret_cast<const uint32_t*>(base + header.directory_offset);
+    strings_ = base + header.string_offset;
+    nexthop_count_ = header.nexthop_count;
+    routes_ = reinterpret_cast<const Route*>(base + header.route_offset);
+    route_count_ = header.route_count;
+    routes6_ = reinterpret_cast<const Route6*>(base + header.route6_offset);
+    route6_count_ = header.route6_count;
+    trie_ = base + header.trie_offset;
+    trie_nodes_ = header.trie_nodes;
+    trie_root_ = header.trie_root;
+
+    // the writer's invariants, so that nothing read later needs a check
+    for (size_t i = 0; i < nexthop_count_; ++i) {
+        if (directory_[2 * i] > header.string_bytes || directory_[2 * i + 1] > header.string_bytes - directory_[2 * i]) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < route_count_; ++i) {
+        if (routes_[i].length > 32 || routes_[i].nexthop >= nexthop_count_) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < route6_count_; ++i) {
+        if (routes6_[i].length > 128 || routes6_[i].nexthop >= nexthop_count_) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view SnapshotFile::nexthop(uint32_t index) const {
+    if (index >= nexthop_count_) {
+        return std::string_view();
+    }
+    return std::string_view(strings_ + directory_[2 * index], directory_[2 * index + 1]);
+}
+
+bool SnapshotFile::lookup(uint32_t address, std::string_view* nexthop_text, int* length) const {
+    uint32_t value;
+    if (!CompactTrie::searchImage(trie_, trie_nodes_, trie_root_, address, &value, length) ||
+        value - 1 >= nexthop_count_) {
+        return false;
+    }
+    *nexthop_text = nexthop(value - 1);
+    return true;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file snapshot_file.h
+ * @brief Binary route table file that can be searched where it is mapped
+ *
+ * Layout, all integers in the writer's byte order (a file from a machine of
+ * the other byte order is rejected) and every section 8-byte aligned:
+ *
+ *   Header                 magic, version, section offsets and counts, and
+ *                          CRC-32C checksums of the header and of the rest
+ *   nexthop directory      {offset, length} into the string bytes, per nexthop
+ *   string bytes           the nexthop text, not NUL terminated
+ *   IPv4 routes            Route, sorted by (prefix, length)
+ *   IPv6 routes            Route6, in address order
+ *   IPv4 trie              CompactTrie image of the IPv4 routes; values are
+ *                          nexthop index + 1
+ *
+ * Sections refer to each other by offset and index only, so the file is
+ * position independent: a mapping of it answers IPv4 longest-prefix lookups
+ * through CompactTrie::searchImage() without building anything. open()
+ * verifies the checksums and the section bounds before anything is read.
+ */
+
+#ifndef _SNAPSHOT_FILE_H
+#define _SNAPSHOT_FILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped_file.h"
+
+class SnapshotFile {
+public:
+    static const uint32_t kVersion = 1;
+
+    struct Route {
+        uint32_t prefix;        // host byte order
+        uint32_t length;
+        uint32_t nexthop;       // index into the nexthops
+    };
+    struct Route6 {
+        uint64_t hi;            // IPv6Address words
+        uint64_t lo;
+        uint32_t length;
+        uint32_t nexthop;
+    };
+
+    // Writes path through a temporary file, synced and then renamed into
+    // place; true once the file and its directory entry are durable. routes
+    // must be sorted by (prefix, length) without duplicates and every
+    // nexthop index must be below nexthops.size().
+    static bool write(const std::string& path, const std::vector<std::string_view>& nexthops,
+                      const std::vector<Route>& routes, const std::vector<Route6>& routes6);
+
+    SnapshotFile();
+
+    // Maps and validates path; false when it is missing, truncated, corrupt,
+    // of another version or of the other byte order.
+    bool open(const std::string& path);
+
+    // Longest IPv4 route covering address (host byte order), searched in the
+    // mapping; nexthop views the file.
+    bool lookup(uint32_t address, std::string_view* nexthop, int* length) const;
+
+    size_t routes() const { return route_count_; }
+    const Route* routeData() const { return routes_; }
+    size_t routes6() const { return route6_count_; }
+    const Route6* route6Data() const { return routes6_; }
+    std::string_view nexthop(uint32_t index) const;
+
+private:
+    MappedFile file_;
+    const uint32_t* directory_;
+    const char* strings_;
+    size_t nexthop_count_;
+    const Route* routes_;
+    size_t route_count_;
+    const Route6* routes6_;
+    size_t route6_count_;
+    const void* trie_;
+    size_t trie_nodes_;
+    uint32_t trie_root_;
+};
+
+#endif /* _SNAPSHOT_FILE_H */
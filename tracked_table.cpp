@@ -0,0 +1,162 @@
+#include <algorithm>
+
+#include "tracked_table.h"
+
+static const size_t kMinSlots = 16;
+
+TrackedTable::TrackedTable() : slots_(kMinSlots), shift_(28), size_(0) {
+    static_assert(sizeof(Entry) == 20, "tracked entries stay packed");
+}
+
+TrackedTable::Entry* TrackedTable::find(uint32_t address) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = home(address);; i = (i + 1) & mask) {
+        Entry& entry = slots_[i];
+        if (!entry.listener) {
+            return nullptr;
+        }
+        if (entry.address == address) {
+            return &entry;
+        }
+    }
+}
+
+TrackedTable::Entry* TrackedTable::insert(uint32_t address, uint32_t listener, bool* inserted) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+        grow();
+    }
+    size_t mask = slots_.size() - 1;
+    size_t i = home(address);
+    for (; slots_[i].listener; i = (i + 1) & mask) {
+        if (slots_[i].address == address) {
+            slots_[i].listener = listener;
+            if (inserted) {
+                *inserted = false;
+            }
+            return &slots_[i];
+        }
+    }
+    Entry& entry = slots_[i];
+    entry.address = address;
+    entry.nexthop_id = 0;
+    entry.listener = listener;
+    entry.handle = 0;
+    entry.route_length = -1;
+    ++size_;
+    indexInsert(address);
+    if (inserted) {
+        *inserted = true;
+    }
+    return &entry;
+}
+
+// Backward shift: every later entry of the probe run whose home is not
+// between the hole and itself moves into the hole, which moves on.
+void TrackedTable::erase(Entry* entry) {
+    indexErase(entry->address);
+    size_t mask = slots_.size() - 1;
+    size_t hole = entry - slots_.data();
+    for (size_t i = (hole + 1) & mask; slots_[i].listener; i = (i + 1) & mask) {
+        if (((i - home(slots_[i].address)) & mask) >= ((i - hole) & mask)) {
+            slots_[hole] = slots_[i];
+            hole = i;
+        }
+    }
+    slots_[hole].listener = 0;
+    --size_;
+}
+
+void TrackedTable::clear() {
+    std::vector<Entry>(kMinSlots).swap(slots_);
+    shift_ = 28;
+    size_ = 0;
+    chunks_.clear();
+    chunk_starts_.clear();
+}
+
+void TrackedTable::grow() {
+    std::vector<Entry> old(slots_.size() * 2);
+    old.swap(slots_);
+    --shift_;
+    size_t mask = slots_.size() - 1;
+    for (size_t j = 0; j < old.size(); ++j) {
+        if (old[j].listener) {
+            size_t i = home(old[j].address);
+            while (slots_[i].listener) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = old[j];
+        }
+    }
+}
+
+size_t TrackedTable::memoryBytes() const {
+    size_t bytes = slots_.capacity() * sizeof(Entry) + chunk_starts_.capacity() * sizeof(uint32_t) +
+                   chunks_.capacity() * sizeof(std::vector<uint32_t>);
+    for (size_t c = 0; c < chunks_.size(); ++c) {
+        bytes += chunks_[c].capacity() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+size_t TrackedTable::chunkFor(uint32_t address) const {
+    size_t c = std::upper_bound(chunk_starts_.begin(), chunk_starts_.end(), address) - chunk_starts_.begin();
+    return c ? c - 1 : 0;
+}
+
+// A full chunk splits in two; the directory insert moves one word per
+// chunk, a few hundred for a few hundred thousand addresses.
+void TrackedTable::indexInsert(uint32_t address) {
+    if (chunks_.empty()) {
+        chunks_.push_back(std::vector<uint32_t>(1, address));
+        chunk_starts_.push_back(address);
+        return;
+    }
+    size_t c = chunkFor(address);
+    std::vector<uint32_t>& chunk = chunks_[c];
+    chunk.insert(std::lower_bound(chunk.begin(), chunk.end(), address), address);
+    chunk_starts_[c] = chunk.front();
+    if (chunk.size() > kChunkKeys) {
+        std::vector<uint32_t> upper(chunk.begin() + kChunkKeys / 2, chunk.end());
+        chunk.resize(kChunkKeys / 2);
+        chunk_starts_.insert(chunk_starts_.begin() + c + 1, upper.front());
+        chunks_.insert(chunks_.begin() + c + 1, std::vector<uint32_t>());
+        chunks_[c + 1].swap(upper);
+    }
+}
+
+// An emptied chunk goes; one under a quarter full merges with its
+// successor when both fit in one.
+void TrackedTable::indexErase(uint32_t address) {
+    size_t c = chunkFor(address);
+    std::vector<uint32_t>& chunk = chunks_[c];
+    chunk.erase(std::lower_bound(chunk.begin(), chunk.end(), address));
+    if (chunk.empty()) {
+        chunks_.erase(chunks_.begin() + c);
+        chunk_starts_.erase(chunk_starts_.begin() + c);
+        return;
+    }
+    chunk_starts_[c] = chunk.front();
+    if (chunk.size() < kChunkKeys / 4 && c + 1 < chunks_.size() &&
+        chunk.size() + chunks_[c + 1].size() <= kChunkKeys) {
+        chunk.insert(chunk.end(), chunks_[c + 1].begin(), chunks_[c + 1].end());
+        chunks_.erase(chunks_.begin() + c + 1);
+        chunk_starts_.erase(chunk_starts_.begin() + c + 1);
+    }
+}
+
+void TrackedTable::collect(const std::vector<std::pair<uint32_t, uint32_t> >& ranges, std::vector<Entry*>& out) {
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        collect(ranges[r].first, ranges[r].second, out);
+    }
+}
+
+void TrackedTable::collect(uint32_t first, uint32_t last, std::vector<Entry*>& out) {
+    for (size_t c = chunkFor(first); c < chunks_.size() && chunk_starts_[c] <= last; ++c) {
+        const std::vector<uint32_t>& chunk = chunks_[c];
+        for (std::vector<uint32_t>::const_iterator it = std::lower_bound(chunk.begin(), chunk.end(), first);
+             it != chunk.end() && *it <= last; ++it) {
+            out.push_back(find(*it));
+        }
+    }
+}
@@ -0,0 +1,99 @@
+/**
+ * @file tracked_table.h
+ * @brief Flat open-addressing table of tracked IPv4 addresses
+ *
+ * One array of fixed 20-byte entries keyed by the binary address: linear
+ * probing from a Fibonacci hash, no nodes and no pointers, so a lookup is
+ * usually one cache line. Erasing shifts the following entries of the probe
+ * run back instead of leaving a tombstone. The table grows by doubling at
+ * 3/4 full.
+ *
+ * The hash has no order, so the addresses are also kept sorted in a compact
+ * index for the route updates, which need the tracked addresses inside a
+ * prefix: sorted chunks of at most kChunkKeys addresses, 4 bytes each, found
+ * by binary search over the chunks' first addresses. A prefix costs one
+ * search plus a walk along contiguous memory, however few addresses it
+ * holds, and each address found is one probe away from its entry.
+ *
+ * Not thread safe; the owner serializes access. Entry pointers stay valid
+ * until the next insert or erase.
+ */
+
+#ifndef _TRACKED_TABLE_H
+#define _TRACKED_TABLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+class TrackedTable {
+public:
+    // The owner's state for one address. listener is never 0 in a live
+    // entry: 0 marks an empty slot.
+    struct Entry {
+        uint32_t address;       // host byte order
+        uint32_t nexthop_id;    // 0 when unrouted
+        uint32_t listener;      // who hears about changes, in the owner's encoding
+        uint32_t handle;        // the owner's handle, 0 for none
+        int32_t route_length;   // -1 when unrouted
+    };
+
+    TrackedTable();
+
+    TrackedTable(const TrackedTable&) = delete;
+    TrackedTable& operator=(const TrackedTable&) = delete;
+
+    Entry* find(uint32_t address);
+    // The entry for address, created unrouted when missing; listener (not 0)
+    // is set either way. *inserted tells which.
+    Entry* insert(uint32_t address, uint32_t listener, bool* inserted = nullptr);
+    void erase(Entry* entry);
+    void clear();
+
+    // Appends the entries inside any of ranges (sorted, disjoint, inclusive)
+    // to out, in address order.
+    void collect(const std::vector<std::pair<uint32_t, uint32_t> >& ranges, std::vector<Entry*>& out);
+    void collect(uint32_t first, uint32_t last, std::vector<Entry*>& out);
+
+    template <typename Visit>
+    void forEach(Visit visit) {
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            if (slots_[i].listener) {
+                visit(slots_[i]);
+            }
+        }
+    }
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            if (slots_[i].listener) {
+                visit(slots_[i]);
+            }
+        }
+    }
+
+    size_t size() const { return size_; }
+    // the slots and the sorted index
+    size_t memoryBytes() const;
+
+private:
+    static const size_t kChunkKeys = 512;
+
+    size_t home(uint32_t address) const { return (address * 0x9E3779B1u) >> shift_; }
+    void grow();
+    // the chunk that holds address, or would
+    size_t chunkFor(uint32_t address) const;
+    void indexInsert(uint32_t address);
+    void indexErase(uint32_t address);
+
+    std::vector<Entry> slots_;  // a power of two of them
+    unsigned shift_;            // 32 - log2(slots)
+    size_t size_;
+    // the sorted index: chunks in address order, none empty, and the first
+    // address of each
+    std::vector<std::vector<uint32_t> > chunks_;
+    std::vector<uint32_t> chunk_starts_;
+};
+
+#endif /* _TRACKED_TABLE_H */
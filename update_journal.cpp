@@ -0,0 +1,230 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "update_journal.h"
+#include "crc32c.h"
+
+static const char kMagic[8] = {'R', 'T', 'J', 'R', 'N', 'L', '\r', '\n'};
+static const uint32_t kVersion = 1;
+static const uint32_t kByteOrder = 0x01020304;
+static const size_t kHeaderBytes = 16;
+static const size_t kRecordHead = 28;
+// buffered bytes that wake the flusher before its interval is up
+static const size_t kFlushBytes = 1 << 20;
+
+static void putHeader(char* header) {
+    memcpy(header, kMagic, sizeof(kMagic));
+    memcpy(header + 8, &kVersion, 4);
+    memcpy(header + 12, &kByteOrder, 4);
+}
+
+static bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+UpdateJournal::UpdateJournal() : sync_interval_ms_(0), fd_(-1), failed_(false), stop_(false) {}
+
+UpdateJournal::~UpdateJournal() {
+    if (flusher_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        flusher_.join();
+    }
+    if (fd_ >= 0) {
+        sync();
+        close(fd_);
+    }
+}
+
+bool UpdateJournal::open(const std::string& path, unsigned sync_interval_ms) {
+    path_ = path;
+    sync_interval_ms_ = sync_interval_ms;
+    if (!openFile()) {
+        return false;
+    }
+    if (sync_interval_ms_ > 0) {
+        flusher_ = std::thread(&UpdateJournal::flushLoop, this);
+    }
+    return true;
+}
+
+bool UpdateJournal::openFile() {
+    JournalReader reader;
+    size_t valid = 0;
+    if (reader.open(path_)) {
+        JournalEntry entry;
+        while (reader.next(entry)) {
+        }
+        valid = reader.offset();
+    } else {
+        // only a missing or empty file may be started afresh
+        struct stat st;
+        if (stat(path_.c_str(), &st) == 0 && st.st_size > 0) {
+            return false;
+        }
+    }
+
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        return false;
+    }
+    if (valid == 0) {
+        char header[kHeaderBytes];
+        putHeader(header);
+        if (ftruncate(fd_, 0) != 0 || !writeAll(fd_, header, sizeof(header))) {
+            close(fd_);
+            fd_ = -1;
+            return false;
+        }
+    } else if (reader.torn() && ftruncate(fd_, valid) != 0) {
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+void UpdateJournal::append(const JournalEntry& entry) {
+    char head[kRecordHead];
+    uint32_t nexthop_bytes = static_cast<uint32_t>(entry.nexthop.size());
+    head[4] = static_cast<char>(entry.type);
+    head[5] = entry.family == AF_INET6 ? 6 : 4;
+    head[6] = static_cast<char>(entry.length);
+    head[7] = 0;
+    memcpy(head + 8, &nexthop_bytes, 4);
+    memcpy(head + 12, entry.address, 16);
+    uint32_t checksum = crc32c(crc32c(0, head + 4, kRecordHead - 4), entry.nexthop.data(), nexthop_bytes);
+    memcpy(head, &checksum, 4);
+
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.append(head, kRecordHead);
+        pending_.append(entry.nexthop.data(), nexthop_bytes);
+        wake = pending_.size() >= kFlushBytes;
+    }
+    if (sync_interval_ms_ == 0) {
+        std::lock_guard<std::mutex> io_lock(io_mutex_);
+        flush();
+    } else if (wake) {
+        wake_.notify_one();
+    }
+}
+
+void UpdateJournal::flush() {
+    std::string batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch.swap(pending_);
+    }
+    if (fd_ < 0 || batch.empty()) {
+        return;
+    }
+    if (!writeAll(fd_, batch.data(), batch.size()) || fdatasync(fd_) != 0) {
+        failed_ = true;
+    }
+}
+
+void UpdateJournal::flushLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        wake_.wait_for(lock, std::chrono::milliseconds(sync_interval_ms_));
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> io_lock(io_mutex_);
+            flush();
+        }
+        lock.lock();
+    }
+}
+
+bool UpdateJournal::sync() {
+    std::lock_guard<std::mutex> io_lock(io_mutex_);
+    flush();
+    return fd_ >= 0 && !failed_;
+}
+
+bool UpdateJournal::rotate(const std::string& old_path) {
+    std::lock_guard<std::mutex> io_lock(io_mutex_);
+    flush();
+    if (fd_ < 0 || failed_) {
+        return false;
+    }
+    close(fd_);
+    fd_ = -1;
+    if (rename(path_.c_str(), old_path.c_str()) != 0) {
+        failed_ = true;
+        return false;
+    }
+    // the rename and the new file must survive a crash before a checkpoint
+    // relies on them
+    if (!openFile() || fdatasync(fd_) != 0 || !syncDirectoryOf(path_)) {
+        failed_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool JournalReader::open(const std::string& path) {
+    if (!file_.open(path, MADV_SEQUENTIAL) || file_.size() < kHeaderBytes) {
+        return false;
+    }
+    char header[kHeaderBytes];
+    putHeader(header);
+    if (memcmp(file_.data(), header, kHeaderBytes) != 0) {
+        return false;
+    }
+    offset_ = kHeaderBytes;
+    return true;
+}
+
+bool JournalReader::next(JournalEntry& entry) {
+    if (offset_ < kHeaderBytes || offset_ == file_.size()) {
+        return false;
+    }
+    const char* head = file_.data() + offset_;
+    uint32_t checksum;
+    uint32_t nexthop_bytes;
+    if (file_.size() - offset_ < kRecordHead) {
+        torn_ = true;
+        return false;
+    }
+    memcpy(&checksum, head, 4);
+    memcpy(&nexthop_bytes, head + 8, 4);
+    if (file_.size() - offset_ - kRecordHead < nexthop_bytes ||
+        crc32c(0, head + 4, kRecordHead - 4 + nexthop_bytes) != checksum) {
+        torn_ = true;
+        return false;
+    }
+    uint8_t type = head[4];
+    uint8_t family = head[5];
+    uint8_t length = head[6];
+    if (type < JournalEntry::kAddRoute || type > JournalEntry::kUnregister || (family != 4 && family != 6) ||
+        length > (family == 6 ? 128 : 32)) {
+        torn_ = true;
+        return false;
+    }
+    entry.type = static_cast<JournalEntry::Type>(type);
+    entry.family = family == 6 ? AF_INET6 : AF_INET;
+    entry.length = length;
+    memcpy(entry.address, head + 12, 16);
+    entry.nexthop = std::string_view(head + kRecordHead, nexthop_bytes);
+    offset_ += kRecordHead + nexthop_bytes;
+    return true;
+}
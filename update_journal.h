@@ -0,0 +1,109 @@
+/**
+ * @file update_journal.h
+ * @brief Append-only journal of route updates and registrations
+ *
+ * File: a 16-byte header (magic, version, byte order) followed by records,
+ * each a fixed 28-byte head and the nexthop bytes:
+ *
+ *   checksum:4  CRC-32C of the rest of the record, nexthop included
+ *   type:1  family:1 (4 or 6)  length:1  reserved:1
+ *   nexthop_bytes:4
+ *   address:16  network byte order, IPv4 in the first 4 bytes
+ *
+ * UpdateJournal appends into a buffer; a background thread writes the buffer
+ * and fdatasync()s the file once per sync interval, so a crash loses at most
+ * the last interval and the writer never waits for the disk. JournalReader
+ * walks a journal in place through a mapping and stops at the first record
+ * that is incomplete or fails its checksum: the torn tail of a crash.
+ */
+
+#ifndef _UPDATE_JOURNAL_H
+#define _UPDATE_JOURNAL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "mapped_file.h"
+
+struct JournalEntry {
+    enum Type : uint8_t {
+        kAddRoute = 1,
+        kDeleteRoute = 2,
+        kRegister = 3,
+        kUnregister = 4
+    };
+
+    Type type;
+    int family;                 // AF_INET or AF_INET6
+    int length;                 // prefix length; 0 for registrations
+    unsigned char address[16];  // network byte order
+    std::string_view nexthop;   // kAddRoute only
+};
+
+class UpdateJournal {
+public:
+    UpdateJournal();
+    // writes out and syncs what is buffered
+    ~UpdateJournal();
+
+    UpdateJournal(const UpdateJournal&) = delete;
+    UpdateJournal& operator=(const UpdateJournal&) = delete;
+
+    // Appends to path, creating it (with its header) when it does not exist
+    // and cutting off a torn tail, so that new records follow intact ones.
+    // sync_interval_ms 0 writes and syncs on every append instead.
+    bool open(const std::string& path, unsigned sync_interval_ms);
+    void append(const JournalEntry& entry);
+    // Writes out and syncs everything appended so far; false when a write
+    // or sync has failed since open().
+    bool sync();
+    // Checkpoint: syncs, renames the journal to old_path and starts an empty
+    // one at the original path; true once both names are durable.
+    bool rotate(const std::string& old_path);
+
+    const std::string& path() const { return path_; }
+
+private:
+    bool openFile();
+    void flush();       // io_mutex_ held
+    void flushLoop();
+
+    std::string path_;
+    unsigned sync_interval_ms_;
+    int fd_;
+    bool failed_;
+
+    std::mutex mutex_;          // pending_, stop_
+    std::string pending_;
+    bool stop_;
+    std::condition_variable wake_;
+    std::mutex io_mutex_;       // the file: writes in append order
+    std::thread flusher_;
+};
+
+class JournalReader {
+public:
+    JournalReader() : offset_(0), torn_(false) {}
+
+    // Maps path and checks its header; a missing file is an error.
+    bool open(const std::string& path);
+    // The next intact record; false at the end of the journal or at a torn
+    // record. entry.nexthop views the mapping.
+    bool next(JournalEntry& entry);
+    // whether reading stopped at a damaged record rather than the end
+    bool torn() const { return torn_; }
+    // bytes of header and intact records read so far
+    size_t offset() const { return offset_; }
+
+private:
+    MappedFile file_;
+    size_t offset_;
+    bool torn_;
+};
+
+#endif /* _UPDATE_JOURNAL_H */